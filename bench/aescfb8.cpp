@@ -0,0 +1,132 @@
+/* 
+ * hCraft - A custom Minecraft server.
+ * Copyright (C) 2012	Jacob Zhitomirsky
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+
+/* 
+ * AES/CFB8 throughput benchmark.
+ * 
+ * Encrypts packet-sized buffers with the cipher used for player connections,
+ * once through a StringSource/StreamTransformationFilter/StringSink pipeline
+ * (the way packets used to be encrypted), and once in place with
+ * ProcessData (). Runs on a single thread, so the figures are per core.
+ * 
+ * Usage: aescfb8 [megabytes per run]
+ */
+
+#include <cryptopp/aes.h>
+#include <cryptopp/modes.h>
+#include <cryptopp/filters.h>
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+
+
+namespace {
+	
+	typedef CryptoPP::CFB_Mode<CryptoPP::AES>::Encryption cfb8_encryption;
+	
+	/* 
+	 * Encrypts @total bytes in pieces of @piece bytes through a filter
+	 * pipeline, copying data into and out of std::strings.
+	 */
+	static void
+	_run_pipeline (cfb8_encryption& enc, std::vector<unsigned char>& data,
+		size_t piece, size_t total)
+	{
+		for (size_t done = 0; done < total; done += piece)
+			{
+				std::string src ((const char *)data.data (), piece);
+				std::string tar;
+				CryptoPP::StringSource (src, true,
+					new CryptoPP::StreamTransformationFilter (enc,
+						new CryptoPP::StringSink (tar)));
+				std::memcpy (data.data (), tar.data (), tar.size ());
+			}
+	}
+	
+	/* 
+	 * Encrypts @total bytes in pieces of @piece bytes, in place.
+	 */
+	static void
+	_run_in_place (cfb8_encryption& enc, std::vector<unsigned char>& data,
+		size_t piece, size_t total)
+	{
+		for (size_t done = 0; done < total; done += piece)
+			enc.ProcessData (data.data (), data.data (), piece);
+	}
+	
+	static double
+	_measure (void (*run) (cfb8_encryption&, std::vector<unsigned char>&, size_t, size_t),
+		size_t piece, size_t total)
+	{
+		unsigned char key[16];
+		for (int i = 0; i < 16; ++i)
+			key[i] = (unsigned char)(i * 37 + 11);
+		cfb8_encryption enc (key, 16, key, 1);
+		
+		std::vector<unsigned char> data (piece);
+		for (size_t i = 0; i < piece; ++i)
+			data[i] = (unsigned char)i;
+		
+		auto start = std::chrono::steady_clock::now ();
+		run (enc, data, piece, total);
+		auto end = std::chrono::steady_clock::now ();
+		
+		double secs = std::chrono::duration<double> (end - start).count ();
+		if (secs <= 0.0)
+			return 0.0;
+		return (total / (1024.0 * 1024.0)) / secs;
+	}
+}
+
+
+int
+main (int argc, char *argv[])
+{
+	size_t megabytes = (argc > 1) ? std::atoi (argv[1]) : 16;
+	if (megabytes == 0)
+		megabytes = 16;
+	size_t total = megabytes * 1024 * 1024;
+	
+	// typical sizes: small entity updates, block changes, map chunks.
+	static const size_t sizes[] = { 16, 64, 256, 1024, 4096, 16384, 65536 };
+	
+	std::cout << "AES/CFB8, " << megabytes << "MB per run, single thread" << std::endl;
+	std::cout << std::setw (10) << "size" << std::setw (16) << "pipeline MB/s"
+		<< std::setw (16) << "in-place MB/s" << std::setw (10) << "speedup" << std::endl;
+	
+	for (size_t piece : sizes)
+		{
+			size_t run_total = total - (total % piece);
+			double pipe = _measure (_run_pipeline, piece, run_total);
+			double in_place = _measure (_run_in_place, piece, run_total);
+			
+			std::cout << std::setw (10) << piece
+				<< std::setw (16) << std::fixed << std::setprecision (1) << pipe
+				<< std::setw (16) << in_place
+				<< std::setw (9) << std::setprecision (2)
+				<< ((pipe > 0.0) ? (in_place / pipe) : 0.0) << "x" << std::endl;
+		}
+	
+	return 0;
+}
@@ -0,0 +1,150 @@
+/* 
+ * hCraft - A custom Minecraft server.
+ * Copyright (C) 2012	Jacob Zhitomirsky
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/* 
+ * Chunk compression benchmark.
+ * 
+ * Generates a square of chunks using one of the server's world generators,
+ * and compresses each of them the same way chunk data packets are built, once
+ * for every compression level supported by the deflate backend. Throughput is
+ * measured over the uncompressed data.
+ * 
+ * Usage: chunkcompress [generator] [radius] [seed]
+ */
+
+#include "logger.hpp"
+#include "server.hpp"
+#include "world.hpp"
+#include "chunk.hpp"
+#include "packet.hpp"
+#include "compression.hpp"
+#include "generation/worldgenerator.hpp"
+#include "providers/worldprovider.hpp"
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <chrono>
+#include <cstdlib>
+#include <sys/stat.h>
+
+
+namespace {
+	
+	struct chunk_data
+	{
+		unsigned char *data;
+		unsigned int size;
+	};
+}
+
+
+int
+main (int argc, char *argv[])
+{
+	using namespace hCraft;
+	
+	const char *gen_name = (argc > 1) ? argv[1] : "overhang";
+	int radius = (argc > 2) ? std::atoi (argv[2]) : 6;
+	long seed = (argc > 3) ? std::atol (argv[3]) : 1337;
+	
+	mkdir ("data", 0744);
+	mkdir ("data/bench", 0744);
+	
+	logger log;
+	server srv (log);
+	
+	world_generator *gen = world_generator::create (gen_name, seed);
+	if (!gen)
+		{
+			std::cerr << "error: unknown world generator \"" << gen_name << "\"" << std::endl;
+			return 1;
+		}
+	world_provider *prov = world_provider::create ("hw", "data/bench", "bench");
+	world *wr = new world (srv, "bench", log, gen, prov);
+	
+	// generate chunks
+	std::vector<chunk_data> chunks;
+	unsigned long long total_in = 0;
+	for (int cx = -radius; cx <= radius; ++cx)
+		for (int cz = -radius; cz <= radius; ++cz)
+			{
+				chunk *ch = wr->load_chunk (cx, cz);
+				
+				chunk_data cd;
+				unsigned short primary_bitmap, add_bitmap;
+				cd.data = packet::make_chunk_data (ch, cd.size, primary_bitmap,
+					add_bitmap);
+				chunks.push_back (cd);
+				total_in += cd.size;
+			}
+	
+	std::cout << "backend: " << compression::backend_name () << std::endl;
+	std::cout << "chunks:  " << chunks.size () << " (" << gen_name << ", "
+		<< (total_in / 1024) << " KB uncompressed)" << std::endl;
+	std::cout << std::endl;
+	std::cout << "level       MB/s     ratio    KB/chunk" << std::endl;
+	
+	// 16 subchunks with add arrays + the biome array
+	unsigned long buf_size = compression::bound (16 * 12288 + 256);
+	unsigned char *buf = new unsigned char [buf_size];
+	
+	for (int level = 0; level <= compression::max_level (); ++level)
+		{
+			// repeat the whole set until at least half a second has passed.
+			unsigned long long total_out = 0, bytes = 0;
+			auto start = std::chrono::steady_clock::now ();
+			double secs;
+			do
+				{
+					total_out = 0;
+					for (chunk_data& cd : chunks)
+						{
+							unsigned long out_size = buf_size;
+							if (!compression::compress (buf, out_size, cd.data, cd.size, level))
+								{
+									std::cerr << "error: compression failed at level " << level << std::endl;
+									return 1;
+								}
+							total_out += out_size;
+						}
+					bytes += total_in;
+					
+					secs = std::chrono::duration<double> (
+						std::chrono::steady_clock::now () - start).count ();
+				}
+			while (secs < 0.5);
+			
+			std::cout << std::setw (5) << level
+				<< std::fixed << std::setprecision (1)
+				<< std::setw (11) << (bytes / secs / (1024.0 * 1024.0))
+				<< std::setprecision (2)
+				<< std::setw (10) << ((double)total_in / total_out)
+				<< std::setprecision (1)
+				<< std::setw (12) << ((double)total_out / chunks.size () / 1024.0)
+				<< std::endl;
+		}
+	
+	delete[] buf;
+	for (chunk_data& cd : chunks)
+		delete[] cd.data;
+	delete wr;
+	
+	return 0;
+}
+
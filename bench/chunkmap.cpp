@@ -0,0 +1,182 @@
+/* 
+ * hCraft - A custom Minecraft server.
+ * Copyright (C) 2012	Jacob Zhitomirsky
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* 
+ * Chunk lookup contention benchmark.
+ * 
+ * Generates a square of chunks, and then has a growing number of threads
+ * read random blocks from it through world::get_id (), once spreading reads
+ * over random chunks and once reading runs of blocks from the same chunk.
+ * For comparison, the same lookups are also made through a single mutex
+ * guarded hash map, which is how worlds used to index their chunks.
+ * 
+ * Usage: chunkmap [threads] [radius]
+ */
+
+#include "logger.hpp"
+#include "server.hpp"
+#include "world.hpp"
+#include "chunk.hpp"
+#include "generation/worldgenerator.hpp"
+#include "providers/worldprovider.hpp"
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <unordered_map>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <random>
+#include <functional>
+#include <cstdlib>
+#include <sys/stat.h>
+
+
+namespace {
+	
+	using namespace hCraft;
+	
+	// the old way.
+	struct locked_map
+	{
+		std::unordered_map<unsigned long long, chunk *> chunks;
+		std::mutex lock;
+		
+		chunk*
+		find (int x, int z)
+		{
+			unsigned long long key = ((unsigned long long)((unsigned int)z) << 32)
+				| (unsigned long long)((unsigned int)x);
+			std::lock_guard<std::mutex> guard {this->lock};
+			auto itr = this->chunks.find (key);
+			return (itr == this->chunks.end ()) ? nullptr : itr->second;
+		}
+	};
+	
+	
+	/* 
+	 * Runs @{threads} threads, each reading blocks through @{read} for about
+	 * half a second, and returns the total amount of reads per second.
+	 * @{run} is the number of reads made within the same chunk in a row.
+	 */
+	double
+	run_readers (int threads, int radius, int run,
+		std::function<unsigned short (int, int, int)> read)
+	{
+		std::atomic<bool> go {false}, stop {false};
+		std::atomic<unsigned long long> total {0};
+		std::atomic<unsigned int> sink {0};
+		
+		std::vector<std::thread> ths;
+		for (int t = 0; t < threads; ++t)
+			ths.emplace_back (
+				[&, t] ()
+					{
+						std::mt19937 rnd (1337 + t);
+						std::uniform_int_distribution<int> cdist (-radius * 16, radius * 16 + 15);
+						std::uniform_int_distribution<int> ydist (0, 127);
+						
+						while (!go.load ())
+							std::this_thread::yield ();
+						
+						unsigned long long reads = 0;
+						unsigned int acc = 0;
+						while (!stop.load (std::memory_order_relaxed))
+							{
+								int bx = cdist (rnd), bz = cdist (rnd);
+								for (int i = 0; i < run; ++i)
+									acc += read ((bx & ~0xF) | (i & 0xF), ydist (rnd),
+										(bz & ~0xF) | ((i >> 4) & 0xF));
+								reads += run;
+							}
+						
+						total += reads;
+						sink += acc;
+					});
+		
+		auto start = std::chrono::steady_clock::now ();
+		go = true;
+		std::this_thread::sleep_for (std::chrono::milliseconds (500));
+		stop = true;
+		for (std::thread& th : ths)
+			th.join ();
+		
+		double secs = std::chrono::duration<double> (
+			std::chrono::steady_clock::now () - start).count ();
+		return total.load () / secs;
+	}
+}
+
+
+int
+main (int argc, char *argv[])
+{
+	using namespace hCraft;
+	
+	int max_threads = (argc > 1) ? std::atoi (argv[1]) : 8;
+	int radius = (argc > 2) ? std::atoi (argv[2]) : 12;
+	
+	mkdir ("data", 0744);
+	mkdir ("data/bench", 0744);
+	
+	logger log;
+	server srv (log);
+	
+	world_generator *gen = world_generator::create ("flatgrass", 1337);
+	world_provider *prov = world_provider::create ("hw2", "data/bench", "chunkmap");
+	world *wr = new world (srv, "chunkmap", log, gen, prov);
+	wr->set_memory_budget (0);
+	
+	locked_map old_map;
+	for (int cx = -radius; cx <= radius; ++cx)
+		for (int cz = -radius; cz <= radius; ++cz)
+			{
+				chunk *ch = wr->load_chunk (cx, cz);
+				old_map.chunks[((unsigned long long)((unsigned int)cz) << 32)
+					| (unsigned long long)((unsigned int)cx)] = ch;
+			}
+	
+	std::cout << "chunks: " << wr->get_resident_chunks () << std::endl;
+	std::cout << std::endl;
+	std::cout << "threads    random (Mreads/s)        runs of 256 (Mreads/s)" << std::endl;
+	std::cout << "           world    locked map      world    locked map" << std::endl;
+	
+	auto world_read = [wr] (int x, int y, int z) -> unsigned short
+		{ return wr->get_id (x, y, z); };
+	auto old_read = [&old_map] (int x, int y, int z) -> unsigned short
+		{
+			chunk *ch = old_map.find (x >> 4, z >> 4);
+			return ch ? ch->get_id (x & 0xF, y, z & 0xF) : 0;
+		};
+	
+	for (int threads = 1; threads <= max_threads; threads <<= 1)
+		{
+			std::cout << std::setw (7) << threads
+				<< std::fixed << std::setprecision (1)
+				<< std::setw (11) << (run_readers (threads, radius, 1, world_read) / 1e6)
+				<< std::setw (14) << (run_readers (threads, radius, 1, old_read) / 1e6)
+				<< std::setw (11) << (run_readers (threads, radius, 256, world_read) / 1e6)
+				<< std::setw (14) << (run_readers (threads, radius, 256, old_read) / 1e6)
+				<< std::endl;
+		}
+	
+	delete wr;
+	return 0;
+}
+
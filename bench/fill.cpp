@@ -0,0 +1,155 @@
+/* 
+ * hCraft - A custom Minecraft server.
+ * Copyright (C) 2012	Jacob Zhitomirsky
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* 
+ * Cuboid fill benchmark.
+ * 
+ * Generates a square of chunks 512x512 blocks in size, and fills a slab of
+ * it the way /cuboid does (through a dense edit stage), timing the fill and
+ * the commit separately. The same slab is then filled once more by setting
+ * blocks directly in the world and read back, and finally filled and
+ * counted through the chunks' bulk operations.
+ * 
+ * Usage: fill [height] [generator]
+ */
+
+#include "logger.hpp"
+#include "server.hpp"
+#include "world.hpp"
+#include "chunk.hpp"
+#include "editstage.hpp"
+#include "drawops.hpp"
+#include "generation/worldgenerator.hpp"
+#include "providers/worldprovider.hpp"
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <cstdlib>
+#include <sys/stat.h>
+
+
+namespace {
+	
+	double
+	secs_since (std::chrono::steady_clock::time_point start)
+	{
+		return std::chrono::duration<double> (
+			std::chrono::steady_clock::now () - start).count ();
+	}
+	
+	void
+	report (const char *what, double secs, unsigned long long blocks)
+	{
+		std::cout << std::left << std::setw (18) << what << std::right
+			<< std::fixed << std::setprecision (1)
+			<< std::setw (10) << (secs * 1000.0) << " ms"
+			<< std::setw (12) << (blocks / secs / 1e6) << " Mblocks/s" << std::endl;
+	}
+}
+
+
+int
+main (int argc, char *argv[])
+{
+	using namespace hCraft;
+	
+	const static int size = 512; // in blocks
+	
+	int height = (argc > 1) ? std::atoi (argv[1]) : 4;
+	const char *gen_name = (argc > 2) ? argv[2] : "flatgrass";
+	
+	mkdir ("data", 0744);
+	mkdir ("data/bench", 0744);
+	
+	logger log;
+	server srv (log);
+	
+	world_generator *gen = world_generator::create (gen_name, 1337);
+	if (!gen)
+		{
+			std::cerr << "error: unknown world generator \"" << gen_name << "\"" << std::endl;
+			return 1;
+		}
+	world_provider *prov = world_provider::create ("hw2", "data/bench", "fill");
+	world *wr = new world (srv, "fill", log, gen, prov);
+	wr->set_memory_budget (0);
+	wr->auto_lighting = false;
+	
+	auto start = std::chrono::steady_clock::now ();
+	wr->load_grid (chunk_pos (size / 32, size / 32), size / 16);
+	std::cout << "chunks: " << wr->get_resident_chunks () << " ("
+		<< std::fixed << std::setprecision (1) << secs_since (start) << " s to generate)"
+		<< std::endl << std::endl;
+	
+	int y0 = 64, y1 = 64 + height - 1;
+	unsigned long long blocks = (unsigned long long)size * size * height;
+	
+	// through an edit stage
+	{
+		dense_edit_stage es (wr);
+		draw_ops draw (es);
+		
+		start = std::chrono::steady_clock::now ();
+		draw.fill_cuboid (vector3 (0, y0, 0), vector3 (size - 1, y1, size - 1), blocki (1));
+		report ("stage fill", secs_since (start), blocks);
+		
+		start = std::chrono::steady_clock::now ();
+		es.commit (false);
+		report ("stage commit", secs_since (start), blocks);
+	}
+	
+	// directly
+	start = std::chrono::steady_clock::now ();
+	for (int y = y0; y <= y1; ++y)
+		for (int z = 0; z < size; ++z)
+			for (int x = 0; x < size; ++x)
+				wr->set_block (x, y, z, 4, 0);
+	report ("world set_block", secs_since (start), blocks);
+	
+	start = std::chrono::steady_clock::now ();
+	unsigned long long sum = 0;
+	for (int y = y0; y <= y1; ++y)
+		for (int z = 0; z < size; ++z)
+			for (int x = 0; x < size; ++x)
+				sum += wr->get_id (x, y, z);
+	report ("world get_id", secs_since (start), blocks);
+	
+	if (sum != blocks * 4)
+		std::cerr << "error: read back unexpected blocks" << std::endl;
+	
+	// in bulk, a chunk at a time
+	start = std::chrono::steady_clock::now ();
+	for (int cz = 0; cz < (size / 16); ++cz)
+		for (int cx = 0; cx < (size / 16); ++cx)
+			wr->load_chunk (cx, cz)->fill (0, y0, 0, 15, y1, 15, 5, 0);
+	report ("chunk fill", secs_since (start), blocks);
+	
+	start = std::chrono::steady_clock::now ();
+	unsigned long long count = 0;
+	for (int cz = 0; cz < (size / 16); ++cz)
+		for (int cx = 0; cx < (size / 16); ++cx)
+			count += wr->load_chunk (cx, cz)->count (0, y0, 0, 15, y1, 15, 5);
+	report ("chunk count", secs_since (start), blocks);
+	
+	if (count != blocks)
+		std::cerr << "error: counted unexpected blocks" << std::endl;
+	
+	delete wr;
+	return 0;
+}
+
@@ -0,0 +1,107 @@
+/* 
+ * hCraft - A custom Minecraft server.
+ * Copyright (C) 2012	Jacob Zhitomirsky
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* 
+ * Falling sand benchmark.
+ * 
+ * Generates a square of chunks 512x512 blocks in size, drops a number of
+ * layers of sand onto it from up high, and lets the world's physics workers
+ * settle them. Once a second it prints how many physics updates are
+ * scheduled and how many ticks behind the workers are running.
+ * 
+ * Usage: physics [layers] [threads]
+ */
+
+#include "logger.hpp"
+#include "server.hpp"
+#include "world.hpp"
+#include "physics/blocks/physics_block.hpp"
+#include "generation/worldgenerator.hpp"
+#include "providers/worldprovider.hpp"
+#include <iostream>
+#include <iomanip>
+#include <thread>
+#include <cstdlib>
+#include <sys/stat.h>
+
+
+int
+main (int argc, char *argv[])
+{
+	using namespace hCraft;
+	
+	const static int size = 512; // in blocks
+	const static int top = 120;
+	
+	int layers = (argc > 1) ? std::atoi (argv[1]) : 2;
+	int threads = (argc > 2) ? std::atoi (argv[2]) : 4;
+	
+	mkdir ("data", 0744);
+	mkdir ("data/bench", 0744);
+	
+	logger log;
+	server srv (log);
+	physics_block::init_blocks ();
+	
+	world_generator *gen = world_generator::create ("flatgrass", 1337);
+	world_provider *prov = world_provider::create ("hw2", "data/bench", "physics");
+	world *wr = new world (srv, "physics", log, gen, prov);
+	wr->set_memory_budget (0);
+	wr->auto_lighting = false;
+	
+	wr->load_grid (chunk_pos (size / 32, size / 32), size / 16);
+	wr->physics.set_thread_count (threads);
+	wr->start ();
+	
+	unsigned long long blocks = (unsigned long long)size * size * layers;
+	std::cout << "dropping " << blocks << " sand blocks, " << threads
+		<< " physics thread" << ((threads == 1) ? "" : "s") << std::endl;
+	
+	for (int y = top; y > top - layers; --y)
+		for (int z = 0; z < size; ++z)
+			for (int x = 0; x < size; ++x)
+				wr->queue_update (x, y, z, BT_SAND);
+	
+	unsigned int worst = 0;
+	int idle = 0, settled = 0;
+	for (int sec = 1; idle < 2; ++sec)
+		{
+			std::this_thread::sleep_for (std::chrono::seconds (1));
+			
+			size_t backlog = wr->physics.get_backlog ();
+			unsigned int late = wr->physics.get_lateness ();
+			if (late > worst)
+				worst = late;
+			idle = (backlog == 0) ? (idle + 1) : 0;
+			if (idle == 1)
+				settled = sec;
+			
+			std::cout << std::setw (4) << sec << " s"
+				<< std::setw (12) << backlog << " scheduled"
+				<< std::setw (8) << late << " ticks late" << std::endl;
+		}
+	
+	std::cout << std::endl << "settled within " << settled << " s, at most "
+		<< worst << " ticks late" << std::endl;
+	
+	wr->stop ();
+	wr->physics.set_thread_count (0);
+	delete wr;
+	return 0;
+}
+
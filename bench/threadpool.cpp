@@ -0,0 +1,369 @@
+/* 
+ * hCraft - A custom Minecraft server.
+ * Copyright (C) 2012	Jacob Zhitomirsky
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+
+/* 
+ * Thread pool benchmark.
+ * 
+ * Simulates a crowd of bots sending packets to the server: a few producer
+ * threads (standing in for the network workers) hand out packets round-robin
+ * to the bots, and every packet is handled by a pool thread, once through a
+ * single shared queue (the way packets used to be dispatched), and once
+ * through a strand per bot on the work-stealing pool. One of the bots is
+ * slow, its packets take a lot longer to handle than everybody else's.
+ * 
+ * For each pool, the benchmark reports the time taken, how often the queue
+ * locks were contended, the latency seen by the other bots, and how many
+ * packets were handled out of order.
+ * 
+ * Usage: threadpool [bots] [packets per bot] [pool threads]
+ */
+
+#include "threadpool.hpp"
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <queue>
+#include <chrono>
+#include <atomic>
+#include <memory>
+#include <cstdlib>
+
+
+namespace {
+	
+	typedef std::chrono::steady_clock bench_clock;
+	
+	/* 
+	 * The thread pool packets used to be handled by: a single queue protected
+	 * by a mutex, shared by all threads.
+	 */
+	class legacy_pool
+	{
+		struct task
+		{
+			std::function<void (void *)> callback;
+			void *context;
+		};
+		
+		std::vector<std::thread> workers;
+		std::queue<task> tasks;
+		std::mutex task_lock;
+		std::condition_variable cv;
+		std::atomic_bool terminating;
+		
+	public:
+		std::atomic_ullong lock_acquisitions;
+		std::atomic_ullong lock_contentions;
+		
+	private:
+		void
+		acquire ()
+		{
+			++ this->lock_acquisitions;
+			if (!this->task_lock.try_lock ())
+				{
+					++ this->lock_contentions;
+					this->task_lock.lock ();
+				}
+		}
+		
+		void
+		main_loop ()
+		{
+			for (;;)
+				{
+					task t;
+					{
+						this->acquire ();
+						std::unique_lock<std::mutex> guard {this->task_lock, std::adopt_lock};
+						this->cv.wait (guard, [this] { return !this->tasks.empty () || this->terminating; });
+						if (this->terminating && this->tasks.empty ())
+							return;
+						
+						t = std::move (this->tasks.front ());
+						this->tasks.pop ();
+					}
+					
+					t.callback (t.context);
+				}
+		}
+		
+	public:
+		legacy_pool ()
+		{
+			this->terminating = false;
+			this->lock_acquisitions = 0;
+			this->lock_contentions = 0;
+		}
+		
+		void
+		start (int thread_count)
+		{
+			for (int i = 0; i < thread_count; ++i)
+				this->workers.emplace_back (&legacy_pool::main_loop, this);
+		}
+		
+		void
+		stop ()
+		{
+			{
+				std::lock_guard<std::mutex> guard {this->task_lock};
+				this->terminating = true;
+				this->cv.notify_all ();
+			}
+			
+			for (std::thread& th : this->workers)
+				th.join ();
+			this->workers.clear ();
+		}
+		
+		void
+		enqueue (std::function<void (void *)>&& cb, void *context)
+		{
+			this->acquire ();
+			std::lock_guard<std::mutex> guard {this->task_lock, std::adopt_lock};
+			this->tasks.push (task {std::move (cb), context});
+			this->cv.notify_one ();
+		}
+	};
+	
+	
+	
+	struct bot
+	{
+		bool slow;
+		std::atomic_int last_seq;
+		std::atomic_int handled;
+		std::unique_ptr<hCraft::strand> st;
+	};
+	
+	struct bot_packet
+	{
+		bot *b;
+		int seq;
+		bench_clock::time_point sent;
+	};
+	
+	struct run_results
+	{
+		double secs;
+		unsigned long long lock_acquisitions;
+		unsigned long long lock_contentions;
+		double avg_latency_us;
+		double max_latency_us;
+		long long out_of_order;
+	};
+	
+	static std::atomic_llong _out_of_order;
+	static std::atomic_llong _latency_total;
+	static std::atomic_llong _latency_max;
+	static std::atomic_llong _latency_count;
+	static std::atomic_int _remaining;
+	
+	static void
+	_spin (int micros)
+	{
+		auto until = bench_clock::now () + std::chrono::microseconds (micros);
+		while (bench_clock::now () < until)
+			;
+	}
+	
+	static void
+	_handle_packet (void *ptr)
+	{
+		bot_packet *bp = static_cast<bot_packet *> (ptr);
+		bot *b = bp->b;
+		
+		long long lat = std::chrono::duration_cast<std::chrono::microseconds> (
+			bench_clock::now () - bp->sent).count ();
+		if (!b->slow)
+			{
+				_latency_total += lat;
+				++ _latency_count;
+				long long prev = _latency_max.load ();
+				while (lat > prev && !_latency_max.compare_exchange_weak (prev, lat))
+					;
+			}
+		
+		int prev = b->last_seq.exchange (bp->seq);
+		if (prev > bp->seq)
+			++ _out_of_order;
+		
+		_spin (b->slow ? 2000 : 5);
+		++ b->handled;
+		delete bp;
+		-- _remaining;
+	}
+	
+	/* 
+	 * Feeds packets from @producers threads to the specified dispatch function.
+	 */
+	template<typename F>
+	static void
+	_produce (std::vector<std::unique_ptr<bot> >& bots, int packets, int producers,
+		F dispatch)
+	{
+		std::vector<std::thread> threads;
+		for (int p = 0; p < producers; ++p)
+			threads.emplace_back ([&bots, packets, producers, p, &dispatch] {
+				for (int seq = 0; seq < packets; ++seq)
+					{
+						for (size_t i = p; i < bots.size (); i += producers)
+							{
+								bot_packet *bp = new bot_packet;
+								bp->b = bots[i].get ();
+								bp->seq = seq;
+								bp->sent = bench_clock::now ();
+								dispatch (bp);
+							}
+						
+						// packets trickle in, rather than arriving all at once.
+						if (seq % 8 == 7)
+							std::this_thread::sleep_for (std::chrono::microseconds (200));
+					}
+			});
+		
+		for (std::thread& th : threads)
+			th.join ();
+		while (_remaining.load () > 0)
+			std::this_thread::sleep_for (std::chrono::milliseconds (1));
+	}
+	
+	static void
+	_reset (std::vector<std::unique_ptr<bot> >& bots, int packets)
+	{
+		for (auto& b : bots)
+			{
+				b->last_seq = -1;
+				b->handled = 0;
+			}
+		
+		_out_of_order = 0;
+		_latency_total = 0;
+		_latency_max = 0;
+		_latency_count = 0;
+		_remaining = bots.size () * packets;
+	}
+	
+	static run_results
+	_results (bench_clock::time_point start)
+	{
+		run_results res;
+		res.secs = std::chrono::duration<double> (bench_clock::now () - start).count ();
+		res.out_of_order = _out_of_order.load ();
+		res.avg_latency_us = _latency_count.load ()
+			? ((double)_latency_total.load () / _latency_count.load ()) : 0.0;
+		res.max_latency_us = _latency_max.load ();
+		return res;
+	}
+	
+	static void
+	_print (const char *name, const run_results& res)
+	{
+		std::cout << std::left << std::setw (14) << name << std::right
+			<< std::fixed << std::setprecision (3)
+			<< std::setw (9) << res.secs
+			<< std::setw (14) << res.lock_acquisitions
+			<< std::setw (12) << res.lock_contentions
+			<< std::setw (9) << std::setprecision (2)
+			<< (res.lock_acquisitions ? (100.0 * res.lock_contentions / res.lock_acquisitions) : 0.0)
+			<< std::setw (12) << std::setprecision (1) << res.avg_latency_us
+			<< std::setw (12) << res.max_latency_us
+			<< std::setw (10) << res.out_of_order << std::endl;
+	}
+}
+
+
+int
+main (int argc, char *argv[])
+{
+	int bot_count = (argc > 1) ? std::atoi (argv[1]) : 200;
+	int packets = (argc > 2) ? std::atoi (argv[2]) : 200;
+	int threads = (argc > 3) ? std::atoi (argv[3]) : 6;
+	const int producers = 4;
+	if (bot_count <= 0 || packets <= 0 || threads <= 0)
+		{
+			std::cerr << "usage: threadpool [bots] [packets per bot] [pool threads]" << std::endl;
+			return 1;
+		}
+	
+	std::cout << bot_count << " bots, " << packets << " packets each, "
+		<< threads << " pool threads, " << producers << " producers" << std::endl;
+	std::cout << std::left << std::setw (14) << "pool" << std::right
+		<< std::setw (9) << "secs"
+		<< std::setw (14) << "lock acq."
+		<< std::setw (12) << "contended"
+		<< std::setw (9) << "%"
+		<< std::setw (12) << "avg lat us"
+		<< std::setw (12) << "max lat us"
+		<< std::setw (10) << "reorder" << std::endl;
+	
+	std::vector<std::unique_ptr<bot> > bots;
+	for (int i = 0; i < bot_count; ++i)
+		{
+			bot *b = new bot;
+			b->slow = (i == 0);
+			bots.emplace_back (b);
+		}
+	
+	// single shared queue
+	{
+		legacy_pool pool;
+		pool.start (threads);
+		_reset (bots, packets);
+		
+		auto start = bench_clock::now ();
+		_produce (bots, packets, producers, [&pool] (bot_packet *bp) {
+			pool.enqueue (_handle_packet, bp); });
+		run_results res = _results (start);
+		pool.stop ();
+		
+		res.lock_acquisitions = pool.lock_acquisitions.load ();
+		res.lock_contentions = pool.lock_contentions.load ();
+		_print ("shared queue", res);
+	}
+	
+	// work-stealing pool, one strand per bot
+	{
+		hCraft::thread_pool pool;
+		pool.start (threads);
+		for (auto& b : bots)
+			b->st.reset (new hCraft::strand (pool));
+		_reset (bots, packets);
+		
+		auto start = bench_clock::now ();
+		_produce (bots, packets, producers, [] (bot_packet *bp) {
+			bp->b->st->post (_handle_packet, bp); });
+		run_results res = _results (start);
+		
+		for (auto& b : bots)
+			while (!b->st->idle ())
+				std::this_thread::sleep_for (std::chrono::milliseconds (1));
+		pool.stop ();
+		
+		hCraft::thread_pool::stats st = pool.get_stats ();
+		res.lock_acquisitions = st.lock_acquisitions;
+		res.lock_contentions = st.lock_contentions;
+		_print ("strands", res);
+		std::cout << "  (" << st.tasks_run << " pool tasks, " << st.steals << " stolen)" << std::endl;
+	}
+	
+	return 0;
+}
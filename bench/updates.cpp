@@ -0,0 +1,123 @@
+/* 
+ * hCraft - A custom Minecraft server.
+ * Copyright (C) 2012	Jacob Zhitomirsky
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* 
+ * Block update throughput benchmark.
+ * 
+ * Generates a square of chunks 512x512 blocks in size, queues a slab of
+ * block updates over it, and lets the world's thread apply them, reporting
+ * the rate at which they were applied. The updates are applied on the world
+ * thread alone, and then again with the given number of pooled threads
+ * helping out.
+ * 
+ * Usage: updates [height] [threads]
+ */
+
+#include "logger.hpp"
+#include "server.hpp"
+#include "world.hpp"
+#include "threadpool.hpp"
+#include "generation/worldgenerator.hpp"
+#include "providers/worldprovider.hpp"
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <thread>
+#include <cstdlib>
+#include <sys/stat.h>
+
+
+namespace {
+	
+	double
+	secs_since (std::chrono::steady_clock::time_point start)
+	{
+		return std::chrono::duration<double> (
+			std::chrono::steady_clock::now () - start).count ();
+	}
+	
+	/* 
+	 * Queues a slab of updates and waits for the world to apply all of them.
+	 */
+	void
+	run (hCraft::world *wr, const char *what, int size, int y0, int y1,
+		unsigned short id)
+	{
+		unsigned long long before = wr->get_updates_applied ();
+		unsigned long long updates = (unsigned long long)size * size * (y1 - y0 + 1);
+		
+		auto start = std::chrono::steady_clock::now ();
+		for (int y = y0; y <= y1; ++y)
+			for (int z = 0; z < size; ++z)
+				for (int x = 0; x < size; ++x)
+					wr->queue_update (x, y, z, id, 0, 0, nullptr, nullptr, false);
+		
+		while ((wr->get_updates_applied () - before) < updates)
+			std::this_thread::sleep_for (std::chrono::milliseconds (1));
+		
+		double secs = secs_since (start);
+		std::cout << std::left << std::setw (18) << what << std::right
+			<< std::fixed << std::setprecision (1)
+			<< std::setw (10) << (secs * 1000.0) << " ms"
+			<< std::setw (12) << (updates / secs / 1e6) << " Mupdates/s" << std::endl;
+	}
+}
+
+
+int
+main (int argc, char *argv[])
+{
+	using namespace hCraft;
+	
+	const static int size = 512; // in blocks
+	
+	int height = (argc > 1) ? std::atoi (argv[1]) : 4;
+	int threads = (argc > 2) ? std::atoi (argv[2]) : 4;
+	
+	mkdir ("data", 0744);
+	mkdir ("data/bench", 0744);
+	
+	logger log;
+	server srv (log);
+	
+	world_generator *gen = world_generator::create ("flatgrass", 1337);
+	world_provider *prov = world_provider::create ("hw2", "data/bench", "updates");
+	world *wr = new world (srv, "updates", log, gen, prov);
+	wr->set_memory_budget (0);
+	wr->auto_lighting = false;
+	
+	auto start = std::chrono::steady_clock::now ();
+	wr->load_grid (chunk_pos (size / 32, size / 32), size / 16);
+	std::cout << "chunks: " << wr->get_resident_chunks () << " ("
+		<< std::fixed << std::setprecision (1) << secs_since (start) << " s to generate)"
+		<< std::endl << std::endl;
+	
+	int y0 = 64, y1 = 64 + height - 1;
+	wr->start ();
+	
+	run (wr, "world thread", size, y0, y1, 1);
+	
+	srv.get_thread_pool ().start (threads);
+	run (wr, "with pool", size, y0, y1, 4);
+	
+	wr->stop ();
+	srv.get_thread_pool ().stop ();
+	delete wr;
+	return 0;
+}
+
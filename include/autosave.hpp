@@ -0,0 +1,130 @@
+/* 
+ * hCraft - A custom Minecraft server.
+ * Copyright (C) 2012	Jacob Zhitomirsky
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _hCraft__AUTOSAVE_H_
+#define _hCraft__AUTOSAVE_H_
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <vector>
+#include <string>
+#include <ctime>
+
+
+namespace hCraft {
+	
+	// forward decs:
+	class server;
+	class world;
+	
+	
+	/* 
+	 * Periodically writes out the chunks that have been modified since they
+	 * were last saved, for all loaded worlds, from a thread of its own (see
+	 * world::save_dirty ()). A crash loses at most one interval's worth of
+	 * changes.
+	 */
+	class autosaver
+	{
+	public:
+		struct status
+		{
+			// the round currently in progress, if any.
+			bool running;
+			std::string world;
+			int chunks_done;
+			int chunks_total;
+			
+			// the last completed round.
+			int last_chunks;
+			unsigned long long last_bytes;
+			int last_ms;
+			std::time_t last_time; // zero if none yet
+		};
+		
+	private:
+		server &srv;
+		int interval; // in seconds
+		
+		std::thread th;
+		bool _running;
+		std::mutex lock;
+		std::condition_variable cv;
+		
+		// worlds left to save in the current round, and the one being saved.
+		std::vector<world *> queue;
+		world *current;
+		
+		status st;
+		
+	private:
+		/* 
+		 * The function ran by the autosave thread.
+		 */
+		void main_loop ();
+		
+		/* 
+		 * Saves all worlds once.
+		 */
+		void save_round ();
+		
+	public:
+		/* 
+		 * Constructs a new stopped autosaver.
+		 */
+		autosaver (server &srv);
+		
+		/* 
+		 * Class destructor.
+		 */
+		~autosaver ();
+		
+		
+		
+		/* 
+		 * Starts saving worlds every @{interval_secs} seconds. Does nothing if
+		 * the interval is zero.
+		 */
+		void start (int interval_secs);
+		
+		/* 
+		 * Stops the autosave thread. A world that is being saved is completed
+		 * first.
+		 */
+		void stop ();
+		
+		
+		
+		/* 
+		 * Removes the specified world from the current round, and blocks until
+		 * it is no longer being saved. Must be called with the server's world
+		 * lock held, before the world is destroyed.
+		 */
+		void release (world *w);
+		
+		/* 
+		 * Returns the progress of the current round and the timing of the
+		 * last one.
+		 */
+		status get_status ();
+	};
+}
+
+#endif
+
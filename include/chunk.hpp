@@ -22,6 +22,7 @@
 #include "blocks.hpp"
 #include <unordered_set>
 #include <mutex>
+#include <atomic>
 #include <functional>
 
 
@@ -62,26 +63,199 @@ namespace hCraft {
 	};
 	
 	
+	/* 
+	 * 4096 four-bit values (block or sky light levels) that take up no memory
+	 * for as long as they all hold the same value. The 2048 byte array is
+	 * allocated on the first write that breaks uniformity, and is published
+	 * atomically so that readers on other threads never see it half-built.
+	 */
+	class nibble_array
+	{
+		std::atomic<unsigned char *> data;
+		unsigned char fill;
+		
+	public:
+		nibble_array (unsigned char fill);
+		nibble_array (const nibble_array& other);
+		~nibble_array ();
+		
+		inline bool allocated () const
+			{ return this->data.load (std::memory_order_relaxed) != nullptr; }
+		
+		inline unsigned char
+		get (unsigned int index) const
+		{
+			const unsigned char *d = this->data.load (std::memory_order_acquire);
+			if (!d)
+				return this->fill;
+			return (index & 1) ? (d[index >> 1] >> 4) : (d[index >> 1] & 0xF);
+		}
+		
+		void set (unsigned int index, unsigned char val);
+		
+		/* 
+		 * Writes all 4096 values into @{out} (2048 bytes, two values per byte,
+		 * lower nibble first).
+		 */
+		void export_to (unsigned char *out) const;
+		
+		/* 
+		 * Replaces the contents of the array with the 2048 bytes pointed to by
+		 * @{in}. Uniform input does not allocate anything. Must not be called
+		 * while other threads may be reading the array.
+		 */
+		void import (const unsigned char *in);
+		
+		/* 
+		 * Overwrites all 4096 values with the 2048 bytes pointed to by @{in}.
+		 * Unlike import (), this is safe to call while other threads are
+		 * reading the array.
+		 */
+		void assign (const unsigned char *in);
+		
+		/* 
+		 * Releases the backing array if all values have become equal.
+		 */
+		void compact ();
+	};
+	
+	
+	/* 
+	 * The IDs and metadata values of a subchunk's blocks, stored as indices
+	 * into a palette of (id << 4) | meta entries. Indices are bit-packed into
+	 * 64-bit words, and take no space at all when the palette has a single
+	 * entry (e.g. a subchunk made entirely out of air or stone).
+	 * 
+	 * An index that is in use is never repointed at a different palette
+	 * entry; growing the index width produces a new block_palette instead.
+	 */
+	struct block_palette
+	{
+		unsigned int bits;  // bits per index: 0, 1, 2, 4, 8 or 16
+		unsigned int cap;   // palette entries available
+		unsigned int size;  // palette entries in use
+		unsigned short *entries;
+		unsigned long long *words;
+		
+	//----
+		
+		/* 
+		 * Allocates a palette (along with its index words, in the same memory
+		 * block) able to hold @{bits}-bit indices, with all indices set to 0.
+		 */
+		static block_palette* create (unsigned int bits);
+		static void destroy (block_palette *pal);
+		
+		/* 
+		 * Returns the smallest supported index width that can address @{count}
+		 * distinct palette entries.
+		 */
+		static unsigned int bits_for (unsigned int count);
+		
+		inline unsigned int
+		index_at (unsigned int index) const
+		{
+			if (this->bits == 0)
+				return 0;
+			unsigned int pos = index * this->bits;
+			return (this->words[pos >> 6] >> (pos & 63)) & ((1U << this->bits) - 1);
+		}
+		
+		inline unsigned short
+		get (unsigned int index) const
+			{ return this->entries[this->index_at (index)]; }
+		
+		inline void
+		put (unsigned int index, unsigned int val)
+		{
+			unsigned int pos = index * this->bits;
+			unsigned long long mask = ((1ULL << this->bits) - 1) << (pos & 63);
+			unsigned long long& w = this->words[pos >> 6];
+			w = (w & ~mask) | ((unsigned long long)val << (pos & 63));
+		}
+		
+		/* 
+		 * Sets the @{len} indices starting at @{start} to @{val}, a whole 64-bit
+		 * word at a time.
+		 */
+		void fill_run (unsigned int start, unsigned int len, unsigned int val);
+		
+		/* 
+		 * Returns the number of indices equal to @{val} among the @{len} indices
+		 * starting at @{start}.
+		 */
+		unsigned int count_run (unsigned int start, unsigned int len,
+			unsigned int val) const;
+		
+		/* 
+		 * Translates every index into a byte through @{table} (which must have
+		 * @{cap} entries), and writes the 4096 results into @{out}.
+		 */
+		void expand_bytes (const unsigned char *table, unsigned char *out) const;
+		
+		/* 
+		 * Same as expand_bytes (), but packs the results into 2048 bytes, two
+		 * four-bit values per byte.
+		 */
+		void expand_nibbles (const unsigned char *table, unsigned char *out) const;
+	};
+	
+	
 	/* 
 	 * Every chunk is made out of 16 subchunks, each being 16x16x16 in size.
+	 * 
+	 * Block IDs and metadata are kept in a block_palette, and lighting and
+	 * extra values are only allocated once they stop being uniform. The
+	 * world thread may modify a subchunk while other threads (chunk encoding,
+	 * I/O) read it: storage that has to be replaced is swapped atomically, and
+	 * the old copy is freed only after readers have had time to drop it.
 	 */
 	struct subchunk
 	{
-		unsigned char ids[4096];
-		unsigned char meta[2048];
-		unsigned char blight[2048];
-		unsigned char slight[2048];
-		unsigned char *add;
-		unsigned char extra[4096];
+		std::atomic<block_palette *> blocks;
+		nibble_array blight;
+		nibble_array slight;
+		std::atomic<unsigned char *> extra; // 4096 bytes, allocated on demand
 		int add_count;
 		int air_count;
 		
-		// an array of 4096 bits which keeps track of custom blocks (i.e. have an 
-		// ID value which is not recognized by vanilla Minecraft).
-		unsigned int custom[128];
+		// the palette index of the last value written (see palette_index ()).
+		unsigned int last_index;
 		
-	//----
-	
+	private:
+		/* 
+		 * Returns the palette index of the specified (id << 4) | meta value,
+		 * adding it to the palette first if necessary. Entries no longer
+		 * referenced by any block (other than the one at @{replacing}, which is
+		 * about to be overwritten) are reused before the index width is grown.
+		 */
+		unsigned int palette_index (unsigned short val, unsigned int replacing);
+		
+		/* 
+		 * Calls @{f} (start, len) for every run of consecutive block indices
+		 * that make up the specified box.
+		 */
+		template<typename F>
+		static void
+		for_each_run (int x1, int y1, int z1, int x2, int y2, int z2, F f)
+		{
+			for (int y = y1; y <= y2; ++y)
+				{
+					if (x1 == 0 && x2 == 15)
+						f ((y << 8) | (z1 << 4), (z2 - z1 + 1) << 4);
+					else
+						for (int z = z1; z <= z2; ++z)
+							f ((y << 8) | (z << 4) | x1, x2 - x1 + 1);
+				}
+		}
+		
+		/* 
+		 * Stores the given (id << 4) | meta value at @{index} and updates the
+		 * air/add counters.
+		 */
+		void put_value (unsigned int index, unsigned short val);
+		
+	public:
 		inline bool all_air () { return this->air_count == 4096; }
 		inline bool has_add () { return this->add_count > 0; }
 		
@@ -90,7 +264,12 @@ namespace hCraft {
 		/* 
 		 * Constructs a new empty subchunk, with all blocks set to air.
 		 */
-		subchunk (bool init = true);
+		subchunk ();
+		
+		/* 
+		 * Constructs a deep copy of the specified subchunk.
+		 */
+		subchunk (const subchunk& other);
 		
 		/* 
 		 * Class destructor.
@@ -120,6 +299,92 @@ namespace hCraft {
 		unsigned char get_extra (int x, int y, int z);
 		
 		block_data get_block (int x, int y, int z);
+		
+	//----
+		
+		/* 
+		 * Bulk conversion to the flat array layout used on the wire and on disk.
+		 * export_ids () passes every distinct block ID through @{map} once, and
+		 * writes the lower 8 bits of the result for each block (4096 bytes).
+		 */
+		template<typename F>
+		void
+		export_ids (unsigned char *out, F map) const
+		{
+			const block_palette *pal = this->blocks.load (std::memory_order_acquire);
+			unsigned char table[4096];
+			for (unsigned int i = 0; i < pal->cap; ++i)
+				table[i] = map (pal->entries[i] >> 4) & 0xFF;
+			pal->expand_bytes (table, out);
+		}
+		
+		void export_ids (unsigned char *out) const;
+		void export_add (unsigned char *out) const;   // 2048 bytes
+		void export_meta (unsigned char *out) const;  // 2048 bytes
+		void export_extra (unsigned char *out) const; // 4096 bytes
+		
+		/* 
+		 * Bulk operations on the box that spans from (@{x1}, @{y1}, @{z1}) to
+		 * (@{x2}, @{y2}, @{z2}), inclusive. These work on whole runs of packed
+		 * indices at a time, rather than on individual blocks.
+		 */
+		
+		/* 
+		 * Sets every block in the box to the specified block.
+		 */
+		void fill (int x1, int y1, int z1, int x2, int y2, int z2,
+			unsigned short id, unsigned char meta, unsigned char ex = 0);
+		
+		/* 
+		 * Changes every block in the box whose ID is @{from_id} (and whose
+		 * metadata value is @{from_meta}, unless it is -1) into the specified
+		 * block. Returns the number of blocks changed.
+		 */
+		int replace (int x1, int y1, int z1, int x2, int y2, int z2,
+			unsigned short from_id, int from_meta, unsigned short id,
+			unsigned char meta);
+		
+		/* 
+		 * Copies the box from @{src} (which must be a different subchunk) into
+		 * this one, with every block moved by (@{dx}, @{dy}, @{dz}). The moved
+		 * box must lie within the subchunk. Lighting is not copied.
+		 */
+		void copy (const subchunk& src, int x1, int y1, int z1, int x2, int y2,
+			int z2, int dx, int dy, int dz);
+		
+		/* 
+		 * Returns the number of blocks in the box whose ID is @{id} (and whose
+		 * metadata value is @{meta}, unless it is -1).
+		 */
+		int count (int x1, int y1, int z1, int x2, int y2, int z2,
+			unsigned short id, int meta = -1) const;
+		
+		/* 
+		 * Replaces the subchunk's contents with the given flat arrays. @{add}
+		 * and @{extra} may be null. Must be called before the subchunk is made
+		 * visible to other threads.
+		 */
+		void import (const unsigned char *ids, const unsigned char *add,
+			const unsigned char *meta, const unsigned char *blight,
+			const unsigned char *slight, const unsigned char *extra);
+		
+		/* 
+		 * Overwrites the subchunk's block and sky light values with the given
+		 * flat arrays (2048 bytes each).
+		 */
+		void assign_light (const unsigned char *blight, const unsigned char *slight);
+		
+		/* 
+		 * Drops unused palette entries (narrowing the indices if possible) and
+		 * releases light/extra arrays that have become uniform.
+		 */
+		void compact ();
+		
+		/* 
+		 * Returns the number of bytes held by the subchunk, including storage
+		 * allocated on demand.
+		 */
+		unsigned long long resident_size () const;
 	};
 	
 	
@@ -137,9 +402,22 @@ namespace hCraft {
 		std::unordered_set<entity *> entities;
 		std::mutex entity_lock;
 		
+		// incremented on every change made to the chunk's contents.
+		std::atomic<unsigned long long> version;
+		
+		// the world clock value at the time the chunk was last looked up
+		// (see world::evict_chunks ()).
+		std::atomic<unsigned int> last_access;
+		
+		// the version of the chunk's contents last written to disk.
+		unsigned long long saved_version;
+		
 	private:
 		int top_nonempty_subchunk ();
 		
+		inline void touch ()
+			{ this->version.fetch_add (1, std::memory_order_relaxed); }
+		
 	public:
 		bool modified;
 		bool generated;
@@ -154,10 +432,41 @@ namespace hCraft {
 		
 		inline unsigned char* get_biome_array () { return this->biomes; }
 		inline void set_biome (int x, int z, unsigned char val)
-			{ this->biomes[(z << 4) | x] = val; }
+			{ this->biomes[(z << 4) | x] = val; this->touch (); }
 		inline unsigned char get_biome (int x, int z)
 			{ return this->biomes[(z << 4) | x]; }
 		
+		/* 
+		 * Returns a number that identifies the current contents of the chunk.
+		 * The value changes whenever a block (or its lighting) is modified, and
+		 * is never shared by two different chunk objects, even if one of them
+		 * is destroyed.
+		 */
+		inline unsigned long long get_version () const
+			{ return this->version.load (std::memory_order_relaxed); }
+		
+		/* 
+		 * Checks whether the chunk has been modified since it was last saved.
+		 */
+		inline bool dirty () const
+			{ return this->modified || (this->get_version () != this->saved_version); }
+		
+		/* 
+		 * Records that the contents identified by @{ver} (see get_version ())
+		 * have been written to disk.
+		 */
+		inline void mark_saved (unsigned long long ver)
+			{ this->saved_version = ver; }
+		
+		inline unsigned int get_last_access () const
+			{ return this->last_access.load (std::memory_order_relaxed); }
+		inline void mark_access (unsigned int t)
+			{
+				// avoid dirtying the cache line on every lookup.
+				if (this->last_access.load (std::memory_order_relaxed) != t)
+					this->last_access.store (t, std::memory_order_relaxed);
+			}
+		
 		inline short get_height (int x, int z) { return this->heightmap[(z << 4) | x]; }
 		inline void set_height (int x, int z, short h) { this->heightmap[(z << 4) | x] = h; }
 		
@@ -177,7 +486,34 @@ namespace hCraft {
 		 * Creates (if does not already exist) and returns the sub-chunk located at
 		 * the given vertical position.
 		 */
-		subchunk* create_sub (int index, bool init = true);
+		subchunk* create_sub (int index);
+		
+		/* 
+		 * Overwrites the block and sky light values of the sub-chunk at the
+		 * given vertical position (creating it if necessary).
+		 */
+		void assign_light (int index, const unsigned char *blight,
+			const unsigned char *slight);
+		
+		/* 
+		 * Returns an estimate of the amount of memory (in bytes) held by the chunk
+		 * and its sub-chunks.
+		 */
+		unsigned long long resident_size ();
+		
+		/* 
+		 * Shrinks the storage of every sub-chunk to fit its current contents
+		 * (see subchunk::compact ()).
+		 */
+		void compact ();
+		
+		/* 
+		 * Returns a copy of the chunk's block data, biomes and heightmap, to be
+		 * saved in the background, and stores the version it was copied at in
+		 * @{ver}. The chunk stays dirty until mark_saved () is called with it,
+		 * once the copy has actually been written out.
+		 */
+		chunk* snapshot (unsigned long long& ver);
 		
 		
 		/* 
@@ -203,6 +539,19 @@ namespace hCraft {
 		
 		block_data get_block (int x, int y, int z);
 		
+		/* 
+		 * Bulk operations on the box that spans from (@{x1}, @{y1}, @{z1}) to
+		 * (@{x2}, @{y2}, @{z2}), inclusive, in chunk coordinates. See the
+		 * subchunk methods of the same names.
+		 */
+		void fill (int x1, int y1, int z1, int x2, int y2, int z2,
+			unsigned short id, unsigned char meta, unsigned char ex = 0);
+		int replace (int x1, int y1, int z1, int x2, int y2, int z2,
+			unsigned short from_id, int from_meta, unsigned short id,
+			unsigned char meta);
+		int count (int x1, int y1, int z1, int x2, int y2, int z2,
+			unsigned short id, int meta = -1);
+		
 	//----
 		
 		/* 
@@ -228,6 +577,11 @@ namespace hCraft {
 		 */
 		void remove_entity (entity *e);
 		
+		/* 
+		 * Checks whether there are any entities in the chunk.
+		 */
+		bool has_entities ();
+		
 		/* 
 		 * Calls the specified function on every entity in the chunk's entity list.
 		 */
@@ -0,0 +1,142 @@
+/* 
+ * hCraft - A custom Minecraft server.
+ * Copyright (C) 2012	Jacob Zhitomirsky
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _hCraft__CHUNKCACHE_H_
+#define _hCraft__CHUNKCACHE_H_
+
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <unordered_map>
+#include <list>
+#include <atomic>
+
+
+namespace hCraft {
+	
+	// forward decs:
+	class world;
+	class chunk;
+	struct packet;
+	
+	
+	/* 
+	 * A bounded LRU cache of compressed chunk data packets (0x33).
+	 * 
+	 * Building a chunk packet involves deflating around 10KB of data for every
+	 * non-empty subchunk, and the same chunks are usually sent to many players
+	 * (e.g. everyone around spawn). Instead of rebuilding it for each of them,
+	 * the finished packet is kept here and shared between all players, until
+	 * the chunk is modified (see chunk::get_version ()) or the entry is evicted
+	 * to make room for other chunks.
+	 */
+	class chunk_packet_cache
+	{
+		struct cache_key
+		{
+			world *w;
+			int cx, cz;
+			
+			bool
+			operator== (const cache_key& other) const
+				{ return (this->w == other.w) && (this->cx == other.cx) && (this->cz == other.cz); }
+		};
+		
+		struct cache_key_hash
+		{
+			std::size_t
+			operator() (const cache_key& key) const
+			{
+				return std::hash<void *> () (key.w)
+					^ ((std::size_t)key.cx * 73856093U) ^ ((std::size_t)key.cz * 19349663U);
+			}
+		};
+		
+		struct cache_entry
+		{
+			unsigned long long version;
+			std::shared_ptr<packet> pack;
+			bool building;
+			std::list<cache_key>::iterator lru_pos;
+		};
+		
+	private:
+		std::unordered_map<cache_key, cache_entry, cache_key_hash> entries;
+		std::list<cache_key> lru; // most recently used first
+		std::mutex lock;
+		std::condition_variable build_cv;
+		
+		unsigned long long capacity; // in bytes
+		unsigned long long used;
+		
+		std::atomic<unsigned long long> hits, misses;
+		
+	private:
+		/* 
+		 * Drops least recently used entries until the cache fits within its
+		 * capacity. The cache lock must be held.
+		 */
+		void shrink ();
+		
+		/* 
+		 * Removes the specified entry from the cache.
+		 * The cache lock must be held.
+		 */
+		void erase (std::unordered_map<cache_key, cache_entry, cache_key_hash>::iterator itr);
+		
+	public:
+		inline unsigned long long get_hits () const { return this->hits.load (); }
+		inline unsigned long long get_misses () const { return this->misses.load (); }
+		inline unsigned long long get_size () const { return this->used; }
+		
+	public:
+		/* 
+		 * Constructs a new cache that can hold up to @{capacity} bytes worth of
+		 * packets.
+		 */
+		chunk_packet_cache (unsigned long long capacity = 32ULL << 20);
+		
+		
+		
+		/* 
+		 * Changes the maximum amount of memory used by the cache.
+		 * A capacity of zero disables caching altogether.
+		 */
+		void set_capacity (unsigned long long capacity);
+		
+		/* 
+		 * Returns a packet containing the specified chunk, building it if a
+		 * packet for the chunk's current version is not available.
+		 * The returned packet must not be modified.
+		 */
+		std::shared_ptr<packet> get (world *w, int cx, int cz, chunk *ch);
+		
+		/* 
+		 * Removes all packets built from chunks of the given world.
+		 */
+		void purge (world *w);
+		
+		/* 
+		 * Removes all entries.
+		 */
+		void clear ();
+	};
+}
+
+#endif
+
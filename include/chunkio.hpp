@@ -0,0 +1,192 @@
+/* 
+ * hCraft - A custom Minecraft server.
+ * Copyright (C) 2012	Jacob Zhitomirsky
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _hCraft__CHUNKIO_H_
+#define _hCraft__CHUNKIO_H_
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <memory>
+#include <vector>
+#include <deque>
+#include <unordered_map>
+
+
+namespace hCraft {
+	
+	// forward decs:
+	class world;
+	class chunk;
+	
+	
+	/* 
+	 * Carries out the chunk reads and writes of a single world on a thread of
+	 * its own, so that the world's thread and the generator's workers never
+	 * have to wait on the world file themselves.
+	 * 
+	 * Reads are handled in batches, in the order their chunks appear in the
+	 * world file, with the provider lock taken once per batch. Writes are
+	 * always carried out before any read that was queued after them, and so a
+	 * chunk that gets evicted and requested again is read back as it was
+	 * written.
+	 * 
+	 * While the I/O thread isn't running (before the world is started and
+	 * after it has been stopped), requests are carried out on the calling
+	 * thread instead.
+	 */
+	class chunk_io
+	{
+	public:
+		typedef std::function<void (chunk *)> callback;
+		
+	private:
+		struct read_request
+		{
+			int cx, cz;
+			bool prefetch;
+			
+			// set if the chunk is to be handed over to the caller instead of being
+			// put into the world.
+			std::shared_ptr<std::promise<chunk *>> fetch;
+			std::vector<callback> cbs;
+			
+			long long pos;
+			std::vector<unsigned char> data;
+			chunk *ch;
+			
+			read_request (int cx, int cz, bool prefetch)
+				: cx (cx), cz (cz), prefetch (prefetch), pos (-1), ch (nullptr)
+				{ }
+		};
+		
+		struct write_request
+		{
+			int cx, cz;
+			chunk *ch;
+		};
+		
+	private:
+		world &w;
+		std::mutex &prov_lock;
+		
+		std::thread th;
+		bool _running;
+		std::mutex lock;
+		std::condition_variable cv;
+		
+		std::deque<write_request> writes;
+		std::deque<read_request> fetches;
+		std::unordered_map<unsigned long long, read_request> loads;
+		int urgent_loads; // loads that aren't prefetches
+		
+		// chunks that have been read in, but couldn't be put into the world yet
+		// because a chunk close to them was being generated (I/O thread only).
+		std::vector<read_request> stalled;
+		
+	private:
+		/* 
+		 * The function ran by the I/O thread.
+		 */
+		void main_loop ();
+		
+		/* 
+		 * Compresses the given chunks and writes them out, then retires them.
+		 * Chunks that fail to compress or to be written are left in @{batch}, all
+		 * others are removed from it.
+		 */
+		void do_writes (std::vector<write_request>& batch);
+		
+		/* 
+		 * Reads and decodes the chunks of the given requests, and hands them
+		 * over to whoever requested them.
+		 */
+		void do_reads (std::vector<read_request>& batch);
+		
+		/* 
+		 * Puts a chunk read in by a load request into the world. Returns false if
+		 * it has to be retried later on.
+		 */
+		bool finish_load (read_request& req);
+		
+		/* 
+		 * Decodes the data read for the specified request into a new chunk.
+		 */
+		void decode (read_request& req);
+		
+	public:
+		/* 
+		 * Constructs a new stopped I/O stage for the specified world.
+		 * @{prov_lock} is the lock that guards the world's provider.
+		 */
+		chunk_io (world &w, std::mutex &prov_lock);
+		
+		/* 
+		 * Class destructor.
+		 */
+		~chunk_io ();
+		
+		
+		
+		/* 
+		 * Starts the I/O thread.
+		 */
+		void start ();
+		
+		/* 
+		 * Stops the I/O thread. Pending writes and reads are completed first,
+		 * pending prefetches are dropped.
+		 */
+		void stop ();
+		
+		
+		
+		/* 
+		 * Reads the chunk located at the specified coordinates from the world file,
+		 * and hands it over to the caller without putting it into the world. The
+		 * returned future yields null if the chunk is not present on disk.
+		 */
+		std::future<chunk *> fetch (int cx, int cz);
+		
+		/* 
+		 * Reads the chunk located at the specified coordinates into the world, if
+		 * it isn't in memory already. @{cb} is then called from the I/O thread
+		 * with the chunk, or with null if the chunk isn't present on disk either.
+		 * If the I/O thread isn't running, the chunk is loaded (or generated)
+		 * right away through world::load_chunk () instead.
+		 */
+		void load (int cx, int cz, callback cb);
+		
+		/* 
+		 * Same as load (), but at a lower priority and without a callback.
+		 * Prefetches are dropped if the I/O thread isn't running.
+		 */
+		void prefetch (int cx, int cz);
+		
+		/* 
+		 * Takes ownership of the specified chunk, which must have already been
+		 * removed from the world, and writes it out.
+		 */
+		void save (int cx, int cz, chunk *ch);
+	};
+}
+
+#endif
+
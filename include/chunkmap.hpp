@@ -0,0 +1,204 @@
+/* 
+ * hCraft - A custom Minecraft server.
+ * Copyright (C) 2012	Jacob Zhitomirsky
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _hCraft__CHUNKMAP_H_
+#define _hCraft__CHUNKMAP_H_
+
+#include <atomic>
+#include <vector>
+
+
+namespace hCraft {
+	
+	// forward decs:
+	class chunk;
+	
+	
+	/* 
+	 * The index of the chunks a world holds in memory.
+	 * 
+	 * Chunks are grouped into regions of 32x32 chunks, each region holding a
+	 * dense array of chunk pointers, so neighbouring chunks share cache lines
+	 * and finding a chunk within a region is a plain array access. Regions are
+	 * found through a small open addressing table keyed by region
+	 * coordinates. Once created, a region stays in the map until it is
+	 * destroyed.
+	 * 
+	 * Lookups take no locks at all, while insertions and removals must be
+	 * serialized by the caller (the world's chunk lock). The region table is
+	 * rebuilt once it fills up; the old table is kept around until reclaim ()
+	 * has been called twice, since lookups might still be going through it.
+	 */
+	class chunk_map
+	{
+	public:
+		enum { REGION_SHIFT = 5, REGION_SIZE = 32 };
+		
+	private:
+		struct region
+		{
+			int rx, rz;
+			unsigned int count;
+			std::atomic<chunk *> chunks[REGION_SIZE * REGION_SIZE];
+		};
+		
+		struct table
+		{
+			unsigned int mask;
+			unsigned int used;
+			std::atomic<region *> *slots; // null if never used
+		};
+		
+	private:
+		std::atomic<table *> tab;
+		std::vector<region *> regions;
+		unsigned int count;
+		std::atomic<unsigned int> epoch;
+		
+		// tables replaced since the last call to reclaim (), and the ones
+		// replaced before that.
+		std::vector<table *> retired;
+		std::vector<table *> retired_old;
+		
+	private:
+		static inline unsigned int
+		hash_region (int rx, int rz)
+			{ return ((unsigned int)rx * 73856093U) ^ ((unsigned int)rz * 19349663U); }
+		
+		static inline unsigned int
+		region_index (int x, int z)
+			{ return ((unsigned int)(z & (REGION_SIZE - 1)) << REGION_SHIFT)
+				| (unsigned int)(x & (REGION_SIZE - 1)); }
+		
+		inline region*
+		find_region (int rx, int rz) const
+		{
+			const table *t = this->tab.load (std::memory_order_acquire);
+			unsigned int i = hash_region (rx, rz) & t->mask;
+			for (;;)
+				{
+					region *r = t->slots[i].load (std::memory_order_acquire);
+					if (!r || ((r->rx == rx) && (r->rz == rz)))
+						return r;
+					
+					i = (i + 1) & t->mask;
+				}
+		}
+		
+		static table* new_table (unsigned int size);
+		static void free_table (table *t);
+		
+		/* 
+		 * Returns the region with the given coordinates, creating it if it
+		 * doesn't exist yet.
+		 */
+		region* get_region (int rx, int rz);
+		
+	public:
+		/* 
+		 * Constructs a new empty chunk map.
+		 */
+		chunk_map ();
+		
+		/* 
+		 * Class destructor. Does not free the chunks themselves.
+		 */
+		~chunk_map ();
+		
+		
+		
+		/* 
+		 * Returns the chunk located at the specified coordinates, or null if
+		 * there is none. Safe to call at any time, from any thread.
+		 */
+		inline chunk*
+		find (int x, int z) const
+		{
+			const region *r = this->find_region (x >> REGION_SHIFT, z >> REGION_SHIFT);
+			if (!r)
+				return nullptr;
+			return r->chunks[region_index (x, z)].load (std::memory_order_acquire);
+		}
+		
+		/* 
+		 * Incremented every time a chunk is removed from the map or replaced,
+		 * so that cached lookups can tell whether they're still valid.
+		 */
+		inline unsigned int get_epoch () const
+			{ return this->epoch.load (std::memory_order_acquire); }
+		
+		/* 
+		 * Returns the number of chunks in the map.
+		 */
+		inline unsigned int size () const { return this->count; }
+		inline bool empty () const { return this->count == 0; }
+		
+		
+		
+		/* 
+		 * Inserts the specified chunk into the map, and returns the chunk that it
+		 * replaced, if any.
+		 */
+		chunk* insert (int x, int z, chunk *ch);
+		
+		/* 
+		 * Removes the chunk located at the specified coordinates from the map,
+		 * and returns it (null if there was none).
+		 */
+		chunk* erase (int x, int z);
+		
+		/* 
+		 * Removes all chunks and regions from the map. No lookups may be in
+		 * progress.
+		 */
+		void clear ();
+		
+		/* 
+		 * Calls @{f} with the coordinates of every chunk in the map, and the
+		 * chunk itself, a region at a time. The map must not be modified in the
+		 * meantime.
+		 */
+		template<typename F>
+		void
+		for_each (F f)
+		{
+			for (region *r : this->regions)
+				{
+					if (r->count == 0)
+						continue;
+					
+					int bx = r->rx * REGION_SIZE, bz = r->rz * REGION_SIZE;
+					for (int i = 0; i < (REGION_SIZE * REGION_SIZE); ++i)
+						{
+							chunk *ch = r->chunks[i].load (std::memory_order_relaxed);
+							if (ch)
+								f (bx | (i & (REGION_SIZE - 1)), bz | (i >> REGION_SHIFT), ch);
+						}
+				}
+		}
+		
+		/* 
+		 * Frees the tables replaced before the previous call to this function.
+		 * Meant to be called every few seconds.
+		 */
+		void reclaim ();
+	};
+}
+
+#endif
+
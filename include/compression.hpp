@@ -0,0 +1,80 @@
+/* 
+ * hCraft - A custom Minecraft server.
+ * Copyright (C) 2012	Jacob Zhitomirsky
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _hCraft__COMPRESSION_H_
+#define _hCraft__COMPRESSION_H_
+
+
+namespace hCraft {
+	
+	/* 
+	 * Things that get compressed, each having its own compression level.
+	 */
+	enum compression_target
+	{
+		CT_NETWORK,  // chunk data packets
+		CT_DISK,     // chunks saved by world providers
+	};
+	
+	
+	/* 
+	 * zlib-format deflate compression.
+	 * 
+	 * The implementation is picked at build time: zlib is used by default, and
+	 * libdeflate can be selected with `scons deflate=libdeflate'. A zlib-ng
+	 * build configured with --zlib-compat can replace zlib without any changes.
+	 */
+	namespace compression {
+		
+		/* 
+		 * Returns the name of the deflate implementation in use.
+		 */
+		const char* backend_name ();
+		
+		/* 
+		 * Returns the highest compression level supported by the backend.
+		 */
+		int max_level ();
+		
+		/* 
+		 * Returns the maximum size of a compressed stream produced from
+		 * @{src_len} bytes of input.
+		 */
+		unsigned long bound (unsigned long src_len);
+		
+		/* 
+		 * Compresses @{src_len} bytes from @{src} into @{dest}, which must be
+		 * able to hold at least bound (@{src_len}) bytes. On success, @{dest_len}
+		 * is set to the size of the compressed stream.
+		 */
+		bool compress (unsigned char *dest, unsigned long& dest_len,
+			const unsigned char *src, unsigned long src_len, int level);
+		
+		
+		
+		/* 
+		 * Gets or sets the compression level used for the specified target.
+		 * Levels are clamped into the range of [0, max_level ()].
+		 */
+		int get_level (compression_target target);
+		void set_level (compression_target target, int level);
+	}
+}
+
+#endif
+
@@ -72,6 +72,13 @@ namespace hCraft {
 		virtual blocki get (int x, int y, int z) = 0;
 		virtual void reset (int x, int y, int z) = 0;
 		
+		/* 
+		 * Stages the specified block at every position of the box between
+		 * (@{x1}, @{y1}, @{z1}) and (@{x2}, @{y2}, @{z2}), inclusive.
+		 */
+		virtual void fill (int x1, int y1, int z1, int x2, int y2, int z2,
+			unsigned short id, unsigned char meta = 0, unsigned char ex = 0);
+		
 		
 		/* 
 		 * Sends all modified blocks to the specified player(s).
@@ -170,6 +177,19 @@ namespace hCraft {
 		virtual blocki get (int x, int y, int z) override;
 		virtual void reset (int x, int y, int z) override;
 		
+		/* 
+		 * Stages the specified block at every position of the box between
+		 * (@{x1}, @{y1}, @{z1}) and (@{x2}, @{y2}, @{z2}), inclusive, filling
+		 * whole microchunk rows at a time.
+		 */
+		virtual void fill (int x1, int y1, int z1, int x2, int y2, int z2,
+			unsigned short id, unsigned char meta = 0, unsigned char ex = 0) override;
+		
+		/* 
+		 * Checks whether any blocks in the specified chunk are staged.
+		 */
+		bool has_changes_in (int cx, int cz);
+		
 		
 		/* 
 		 * Sends all modified blocks to the specified player(s).
@@ -36,7 +36,7 @@ namespace hCraft {
 			blocki bl_leaves;
 			int min_height;
 			
-			std::minstd_rand rnd;
+			long gen_seed;
 			
 		public:
 			generic_trees (int min_height = 4, blocki bl_trunk = {BT_TRUNK},
@@ -53,7 +53,7 @@ namespace hCraft {
 			blocki bl_leaves;
 			int min_height;
 			
-			std::minstd_rand rnd;
+			long gen_seed;
 			
 		public:
 			palm_trees (int min_height = 4, blocki bl_trunk = {BT_TRUNK, 3},
@@ -30,7 +30,6 @@ namespace hCraft {
 	 */
 	class flatgrass_world_generator: public world_generator
 	{
-		std::minstd_rand rnd;
 		long gen_seed;
 		
 	public:
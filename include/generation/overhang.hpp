@@ -34,7 +34,6 @@ namespace hCraft {
 	 */
 	class overhang_world_generator: public world_generator
 	{
-		std::minstd_rand rnd;
 		long gen_seed;
 		
 		noise::module::Perlin pn1, pn2, pn3, pn4, pn5, pn6;
@@ -20,8 +20,13 @@
 #define _hCraft__GENERATOR_H_
 
 #include <thread>
-#include <queue>
+#include <vector>
+#include <unordered_map>
+#include <functional>
+#include <memory>
 #include <mutex>
+#include <atomic>
+#include <condition_variable>
 
 
 namespace hCraft {
@@ -32,15 +37,6 @@ namespace hCraft {
 	class chunk;
 	
 	
-	struct gen_request
-	{
-		player *pl;
-		world *w;
-		int cx, cz; // chunk coordinates.
-		int flags;
-		int extra;
-	};
-	
 	struct gen_response
 	{
 		world *w;
@@ -68,25 +64,152 @@ namespace hCraft {
 	};
 	
 	/* 
-	 * A continuous loop that runs in its own thread that supplies players with
-	 * chunks once they have been generated.
+	 * Supplies players with chunks once they have been generated.
+	 * 
+	 * Every chunk that has been requested but not yet generated is represented
+	 * by a single job, no matter how many players asked for it: requests for a
+	 * chunk that is already queued merely add the player to the job's list of
+	 * waiters. Once the chunk is ready, it is delivered to all waiters at once.
+	 * 
+	 * Jobs are ordered by their distance from the players waiting on them
+	 * (closest first), and are spread between a pool of generator workers, each
+	 * having its own priority heap. A worker pops the closest job off its own
+	 * heap, and once that runs dry, steals the closest job of another worker.
+	 * Jobs for chunks that lie close together are placed in the same worker's
+	 * heap, to keep neighbouring chunks (which cannot be generated concurrently,
+	 * see world::load_chunk ()) from being handed to different workers.
 	 * 
 	 * Note that this class doesn't really do any "real" world generation, that
 	 * kind of stuff is handled elsewhere.
 	 */
 	class chunk_generator
 	{
-		std::thread *th;
+		struct gen_waiter
+		{
+			player *pl;
+			int flags;
+			int extra;
+			int priority;
+			std::function<void (chunk *)> cb; // used instead of a player
+		};
+		
+		enum gen_job_state
+		{
+			GJS_QUEUED,
+			GJS_RUNNING,
+			GJS_DONE,
+		};
+		
+		struct gen_job
+		{
+			world *w;
+			int cx, cz;
+			
+			gen_job_state state;
+			int priority; // lower is better
+			std::vector<gen_waiter> waiters;
+		};
+		
+		/* 
+		 * Jobs whose priority changes while they are queued are pushed into the
+		 * heap again, the old entries are discarded once they reach the top.
+		 */
+		struct gen_entry
+		{
+			std::shared_ptr<gen_job> job;
+			int priority;
+			unsigned long long seq;
+			
+			bool
+			operator< (const gen_entry& other) const
+			{
+				// std::push_heap () keeps the greatest element at the top.
+				if (this->priority != other.priority)
+					return this->priority > other.priority;
+				return this->seq > other.seq;
+			}
+		};
+		
+		struct gen_key
+		{
+			world *w;
+			int cx, cz;
+			
+			bool
+			operator== (const gen_key& other) const
+				{ return (this->w == other.w) && (this->cx == other.cx) && (this->cz == other.cz); }
+		};
+		
+		struct gen_key_hash
+		{
+			std::size_t
+			operator() (const gen_key& key) const
+			{
+				return std::hash<void *> () (key.w)
+					^ ((std::size_t)key.cx * 73856093U) ^ ((std::size_t)key.cz * 19349663U);
+			}
+		};
+		
+		struct gen_worker
+		{
+			std::thread th;
+			std::vector<gen_entry> heap;
+			std::mutex lock;
+		};
+		
+	private:
+		std::vector<std::unique_ptr<gen_worker>> workers;
 		bool _running;
 		
-		std::queue<gen_request> requests;
-		std::mutex request_mutex;
+		// every job that has not been completed yet.
+		std::unordered_map<gen_key, std::shared_ptr<gen_job>, gen_key_hash> jobs;
+		std::mutex jobs_lock;
+		unsigned long long next_seq;
+		
+		std::atomic_int pending; // number of queued jobs
+		std::mutex wait_lock;
+		std::condition_variable wait_cv;
 		
 	private:
 		/* 
 		 * Where everything happens.
 		 */
-		void main_loop ();
+		void main_loop (gen_worker *w);
+		
+		/* 
+		 * Takes the closest job off the given worker's heap, or steals one from
+		 * another worker if it is empty. The returned job is marked as running.
+		 * Returns null if no jobs are pending at all.
+		 */
+		std::shared_ptr<gen_job> next_job (gen_worker *w);
+		
+		/* 
+		 * Generates (or loads) the chunk specified by the job and delivers it to
+		 * all players waiting on it.
+		 */
+		void handle (std::shared_ptr<gen_job> job);
+		
+		/* 
+		 * Inserts an entry for the specified job into the heap of the worker
+		 * responsible for it. The job lock must be held.
+		 */
+		void push_job (std::shared_ptr<gen_job> job);
+		
+		/* 
+		 * Removes the given player from the job's list of waiters, and drops the
+		 * job altogether if nobody is left waiting on it. The job lock must be
+		 * held.
+		 */
+		void remove_waiter (std::shared_ptr<gen_job> job, player *pl);
+		
+		/* 
+		 * Returns the priority of the closest waiter in the given list.
+		 */
+		static int lowest_priority (const std::vector<gen_waiter>& waiters);
+		
+	public:
+		inline int worker_count () const { return this->workers.size (); }
+		inline int pending_count () const { return this->pending.load (); }
 		
 	public:
 		chunk_generator ();
@@ -95,12 +218,14 @@ namespace hCraft {
 		
 		
 		/* 
-		 * Starts the internal thread and begins accepting generation requests.
+		 * Starts @{worker_count} generator workers and begins accepting generation
+		 * requests. If @{worker_count} is zero, a worker will be started for
+		 * every available core.
 		 */
-		void start ();
+		void start (int worker_count = 0);
 		
 		/* 
-		 * Stops the generation thread and cleans up resources.
+		 * Stops all generator workers and cleans up resources.
 		 */
 		void stop ();
 		
@@ -109,8 +234,32 @@ namespace hCraft {
 		/* 
 		 * Requests the chunk located at the given coordinates to be generated.
 		 * The specified player is then informed when it's ready.
+		 * 
+		 * Requesting a chunk that the player is already waiting on updates the
+		 * request's priority according to the player's current position.
 		 */
 		void request (world *w, int cx, int cz, player *pl, int flags = 0, int extra = 0);
+		
+		/* 
+		 * Requests the chunk located at the given coordinates to be generated on
+		 * behalf of something other than a player. @{cb} is called from one of
+		 * the generator's workers once the chunk is ready. Returns false if the
+		 * generator is not running, in which case @{cb} is never called.
+		 */
+		bool request (world *w, int cx, int cz, std::function<void (chunk *)> cb,
+			int priority = 0);
+		
+		/* 
+		 * Withdraws the player's request for the specified chunk. The chunk is
+		 * not generated at all if no one else is waiting on it.
+		 */
+		void cancel (player *pl, world *w, int cx, int cz);
+		
+		/* 
+		 * Withdraws all requests made by the specified player.
+		 * Must be called before the player is destroyed.
+		 */
+		void cancel (player *pl);
 	};
 }
 
@@ -16,12 +16,17 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+
 #ifndef _hCraft__LIGHTING_H_
 #define _hCraft__LIGHTING_H_
 
-#include <queue>
+#include "position.hpp"
+#include <vector>
+#include <deque>
 #include <mutex>
 #include <bitset>
+#include <memory>
+#include <unordered_map>
 
 
 namespace hCraft {
@@ -30,6 +35,7 @@ namespace hCraft {
 	class world;
 	class logger;
 	class chunk;
+	class thread_pool;
 	
 	
 	/* 
@@ -50,19 +56,125 @@ namespace hCraft {
 	};
 	
 	
+	/* 
+	 * The sub-chunks of a chunk column whose light has changed.
+	 */
+	struct light_change
+	{
+		int cx;
+		int cz;
+		unsigned short sections; // bitmap
+	};
+	
+	
+	/* 
+	 * A set of block positions, stored as a bitmap per chunk. Bitmaps are
+	 * kept around for reuse when the set is cleared.
+	 */
+	class block_bitmap
+	{
+		typedef std::bitset<65536> chunk_bits;
+		
+		std::unordered_map<unsigned long long, std::unique_ptr<chunk_bits>> chunks;
+		std::vector<std::unique_ptr<chunk_bits>> spare;
+		
+	public:
+		/* 
+		 * Adds the specified position to the set. Returns false if it was
+		 * already in it.
+		 */
+		bool insert (int x, int y, int z);
+		
+		/* 
+		 * Removes all positions from the set.
+		 */
+		void clear ();
+	};
+	
+	
 	/* 
 	 * Handles block\sky lighting for a world or a chunk.
+	 * 
+	 * Block changes are relit in passes. A pass first darkens everything that
+	 * was lit through the changed blocks (breadth-first, outwards from them),
+	 * and then spreads light back in from the sources and lit blocks at the
+	 * edge of the darkened area, brightest first, using a bucket per light
+	 * level. Brightest-first means a block is given its final light level the
+	 * first time it is reached, so the work done is proportional to the
+	 * number of blocks whose lighting actually changes.
 	 */
 	class lighting_manager
 	{
+		// a queued block and its light level.
+		struct light_node
+		{
+			int x, y, z;
+			int level;
+		};
+		
+		// the state of sky or block light.
+		struct light_channel
+		{
+			bool sky;
+			
+			// blocks changed since the current pass started.
+			std::vector<light_update> pending;
+			block_bitmap pending_set;
+			
+			// the current pass.
+			bool active;
+			std::deque<light_node> darken;
+			std::vector<light_update> buckets[16];
+			int level; // highest bucket that might not be empty
+			block_bitmap seeded;
+			
+			// blocks whose light has been modified during the current pass, and
+			// the light they had before it.
+			std::vector<light_node> touched;
+			block_bitmap touched_set;
+		};
+		
 		logger &log;
 		world *wr;
-		std::queue<light_update> sl_updates;
-		std::queue<light_update> bl_updates;
+		light_channel sl;
+		light_channel bl;
 		std::mutex lock;
 		
-		bool sl_overloaded, bl_overloaded;
-		int limit;
+		// sub-chunks relit since the last call to take_changes ().
+		std::unordered_map<unsigned long long, unsigned short> changed;
+		
+		// chunks whose borders have to be checked (see queue_borders ()).
+		std::vector<chunk_pos> borders;
+		std::mutex border_lock;
+		
+	private:
+		void enqueue_nolock (light_channel& lc, int x, int y, int z);
+		
+		/* 
+		 * Starts a new pass over the blocks pending in the given channel.
+		 */
+		void start_pass (light_channel& lc);
+		
+		/* 
+		 * Continues the channel's current pass, doing no more than @{budget}
+		 * blocks' worth of work. Returns the amount of work done.
+		 */
+		int run_pass (light_channel& lc, int budget);
+		
+		void mark_changed (int x, int y, int z);
+		void touch (light_channel& lc, int x, int y, int z, int old);
+		void finish_pass (light_channel& lc);
+		void reset_block (light_channel& lc, chunk *ch, int x, int y, int z);
+		void darken_step (light_channel& lc, const light_node& n);
+		void brighten_step (light_channel& lc, const light_update& u, int level);
+		
+		void seed (light_channel& lc, int x, int y, int z, int level, bool dedup);
+		
+		bool light_supported (light_channel& lc, chunk *ch, int x, int y, int z,
+			int level, int from_x, int from_z);
+		void exchange_light (light_channel& lc, chunk *ach, int ax, int az,
+			chunk *bch, int bx, int bz, int y);
+		void exchange_borders (int cx, int cz);
 		
 	public:
 		inline world* get_world () const { return this->wr; }
@@ -74,25 +186,49 @@ namespace hCraft {
 		/* 
 		 * Constructs a new lighting manager on top of the given world.
 		 */
-		lighting_manager (logger &log, world *wr, int limit = 3495254);
+		lighting_manager (logger &log, world *wr);
 		
 		
 		/* 
 		 * Goes through all queued updates and handles them (No more than
-		 * @{max_updates} updates are handled).
+		 * @{max_updates} blocks are relit for each kind of light).
 		 * 
-		 * Returns the total amount of updates handled.
+		 * Returns the total amount of blocks relit.
 		 */
 		int update (int max_updates = 384);
 		
 		/* 
 		 * Relights a whole chunk (as much as possible).
 		 */
-		void relight_chunk (chunk *ch);
+		static void relight_chunk (chunk *ch);
+		
+		/* 
+		 * Relights the given chunks from scratch, spreading the work over
+		 * @{pool}. Each chunk is lit on its own; light is exchanged with the
+		 * chunks around it later on, by update ().
+		 * 
+		 * Not thread-safe, the caller must hold the manager's lock.
+		 */
+		void relight_chunks_nolock (thread_pool& pool,
+			const std::vector<chunk_pos>& chunks);
+		
+		/* 
+		 * Queues the borders of the specified chunk to be checked for light that
+		 * has to cross over to (or from) the chunks around it. Thread-safe, and
+		 * does not acquire the manager's lock.
+		 */
+		void queue_borders (int cx, int cz);
+		
+		/* 
+		 * Appends the sub-chunks whose light has been changed by update () since
+		 * the last call to @{out}. Chunks relit as a whole are not included.
+		 */
+		void take_changes (std::vector<light_change>& out);
 		
 		
 		/* 
-		 * Pushes a lighting update to the update queue.
+		 * Queues the block at the specified coordinates to be relit, after it has
+		 * been modified. A block is queued at most once per pass.
 		 */
 		void enqueue (int x, int y, int z);
 		
@@ -117,6 +117,23 @@ namespace hCraft {
 		 */
 		static int remaining (const unsigned char *data, unsigned int have);
 		
+		/* 
+		 * Determines the total length of the packet at the start of the specified
+		 * byte array. If the first @have bytes are not enough to tell, a lower
+		 * bound greater than @have is returned instead, and the function should be
+		 * called again once at least that many bytes are available. Returns -1 if
+		 * the packet is invalid.
+		 */
+		static int frame_length (const unsigned char *data, unsigned int have);
+		
+		/* 
+		 * Pooled storage for received packets. Buffers returned by
+		 * alloc_received () can hold at least @size bytes, and must be given
+		 * back with release_received ().
+		 */
+		static unsigned char* alloc_received (unsigned int size);
+		static void release_received (unsigned char *data);
+		
 		
 		
 	//---
@@ -185,7 +202,29 @@ namespace hCraft {
 		static packet* make_entity_properties (int eid,
 			const std::vector<entity_property>& props);
 		
-		static packet* make_chunk (int x, int z, chunk *ch);
+		/* 
+		 * Encodes the contents of the specified chunk into the uncompressed form
+		 * sent in chunk data packets (0x33). The returned array must be freed
+		 * with delete[].
+		 * 
+		 * If @{sections} does not contain all sub-chunks, only the existing
+		 * sub-chunks it selects are encoded (even if they are empty), and the
+		 * biome array is left out.
+		 */
+		static unsigned char* make_chunk_data (chunk *ch, unsigned int& out_size,
+			unsigned short& primary_bitmap, unsigned short& add_bitmap,
+			unsigned short sections = 0xFFFF);
+		
+		/* 
+		 * Builds a chunk data packet. If @{level} is negative, the compression
+		 * level currently set for network traffic is used.
+		 * 
+		 * A packet that carries only some of the chunk's @{sections} is not
+		 * ground-up continuous: the client replaces those sub-chunks (blocks
+		 * and light) and keeps the rest of the column as it is.
+		 */
+		static packet* make_chunk (int x, int z, chunk *ch, int level = -1,
+			unsigned short sections = 0xFFFF);
 		
 		static packet* make_empty_chunk (int x, int z);
 		
@@ -21,6 +21,7 @@
 
 #include <deque>
 #include <mutex>
+#include <atomic>
 #include <thread>
 #include <vector>
 #include <memory>
@@ -29,7 +30,6 @@
 #include <unordered_map>
 #include <random>
 #include "position.hpp"
-#include "tbb/concurrent_queue.h"
 
 
 namespace hCraft {
@@ -92,17 +92,75 @@ namespace hCraft {
 		physics_params params;
 		
 		int tick;
-		std::chrono::steady_clock::time_point nt; // next tick
+		unsigned long long due; // the tick at which the update fires
 		
 	//---
 		physics_update () { }
 		physics_update (world *w, int x, int y, int z, int extra, int tick,
-			std::chrono::steady_clock::time_point nt, physics_block_callback cb = nullptr);
+			unsigned long long due, physics_block_callback cb = nullptr);
 		physics_update (world *w, entity *e, bool persistent, int tick,
-			std::chrono::steady_clock::time_point nt);
+			unsigned long long due);
 	};
 	
 	
+	
+	/* 
+	 * A hierarchical timing wheel of physics updates, keyed by the tick they
+	 * are due at. Level 0 has a slot for each of the next 64 ticks, and every
+	 * level above it spans 64 times as many ticks as the one beneath it; its
+	 * slots are cascaded down a level as the wheel turns. Scheduling an update
+	 * and expiring it are both constant-time, however far ahead it is due.
+	 * 
+	 * Not thread-safe on its own - see physics_shard.
+	 */
+	class physics_wheel
+	{
+	public:
+		static constexpr int slot_bits = 6;
+		static constexpr int slots = 1 << slot_bits;
+		static constexpr int levels = 4;
+		
+	private:
+		std::vector<physics_update> wheel[levels][slots];
+		std::vector<physics_update> ready; // due, but not taken yet
+		unsigned long long now;
+		size_t count;
+		
+	private:
+		void place (const physics_update& u);
+		
+	public:
+		inline unsigned long long current_tick () const { return this->now; }
+		inline size_t size () const { return this->count; }
+		inline size_t ready_count () const { return this->ready.size (); }
+		
+	public:
+		physics_wheel ();
+		
+		/* 
+		 * Inserts the specified update into the slot of the tick it is due at.
+		 * Updates that are already due are made ready right away.
+		 */
+		void insert (const physics_update& u);
+		
+		/* 
+		 * Turns the wheel forward to tick @{t}, making every update due at or
+		 * before it ready.
+		 */
+		void advance (unsigned long long t);
+		
+		/* 
+		 * Moves up to @{max} ready updates into @{out}.
+		 * Returns the number of updates taken.
+		 */
+		size_t take (std::vector<physics_update>& out, size_t max);
+		
+		/* 
+		 * Moves every update in the wheel, due or not, into @{out}.
+		 */
+		void drain (std::vector<physics_update>& out);
+	};
+	
 //-----
 	/* 
 	 * These structures are used to store block memberships in chunks.
@@ -115,40 +173,131 @@ namespace hCraft {
 		ph_mem_subchunk ();
 	};
 	
-	struct ph_mem_chunk {
-		ph_mem_subchunk *subs[16];
+	/* 
+	 * The blocks of a physics region (a square of 4x4 chunks) that have
+	 * updates scheduled, and how many each, in a flat table of lazily
+	 * allocated sub-chunks.
+	 */
+	struct ph_mem_region {
+		enum { SHIFT = 2, SIZE = 4 }; // in chunks
 		
-		// constructor
-		ph_mem_chunk () {
-			for (int i = 0; i < 16; ++i)
-				subs[i] = nullptr;
-		}
+		ph_mem_subchunk *subs[SIZE * SIZE][16];
+		
+		// number of queued blocks in every chunk, and in the whole region.
+		unsigned int counts[SIZE * SIZE];
+		unsigned int total;
+		
+	//----
+		ph_mem_region ();
+		~ph_mem_region ();
+		
+		bool has (int x, int y, int z) const;
+		
+		/* 
+		 * Adds/removes a membership of the specified block. Both return true
+		 * if the block's chunk went from having none to having some, or the
+		 * other way around.
+		 */
+		bool add (int x, int y, int z);
+		bool remove (int x, int y, int z);
+	};
+	
+	/* 
+	 * Identifies a chunk or a physics region in a world.
+	 */
+	struct ph_key {
+		world *w;
+		int x, z;
+		
+		inline bool
+		operator== (const ph_key& other) const
+			{ return (this->w == other.w) && (this->x == other.x) && (this->z == other.z); }
+	};
+	
+	class ph_key_hash
+	{
+		std::hash<int> int_hash;
+		std::hash<world *> ptr_hash;
 		
-		// destructor
-		~ph_mem_chunk () {
-			for (int i = 0; i < 16; ++i)
-				delete subs[i];
+	public:
+		std::size_t
+		operator() (const ph_key& k) const
+		{
+			return ptr_hash (k.w) ^ int_hash (k.x) ^ (int_hash (k.z) << 5);
 		}
 	};
+	
+	/* 
+	 * A request to schedule an update on the shard that owns it.
+	 */
+	struct physics_message {
+		physics_update u;
+		bool once; // dropped if the block already has an update scheduled
+	};
+	
+	/* 
+	 * Everything a worker owns: the timing wheel holding the updates of its
+	 * regions, and the regions' block memberships. These are only ever touched
+	 * by the owning worker, without locks. Other threads hand it updates
+	 * through its inbox, and take due updates off its ready list when they
+	 * run out of their own.
+	 */
+	struct physics_shard {
+		// owner only:
+		physics_wheel wheel;
+		std::unordered_map<ph_key, ph_mem_region *, ph_key_hash> regions;
+		ph_mem_region *last_region; // most recently looked up
+		ph_key last_key;
+		
+		// number of updates in the wheel, as of the owner's last look.
+		std::atomic<size_t> wheel_size;
+		
+		// due updates, not yet processed.
+		std::vector<physics_update> ready;
+		std::mutex ready_lock;
+		
+		// updates scheduled by threads other than the owner.
+		std::vector<physics_message> inbox;
+		bool retired; // set once the shard's worker has been removed
+		std::mutex inbox_lock;
+		
+	//----
+		physics_shard ();
+		~physics_shard ();
+	};
 //-----
 	
 	class physics_manager;
 	
 	/* 
-	 * Every worker runs in its own separate thread.
+	 * Every worker runs in its own separate thread, and processes the updates
+	 * of the regions its shard owns as they fall due, stealing due updates
+	 * from the other shards when it runs out.
 	 */
 	class physics_worker
 	{
 		friend class physics_manager;
 		
+		// the worker running on the calling thread, if any.
+		static thread_local physics_worker *current;
+		
 	public:
 		bool paused;
 		unsigned long long ticks;
 		
 	private:
 		physics_manager &man;
+		unsigned int id; // index of the shard owned by the worker
+		unsigned int layout; // shard layout the shard's regions are placed for
 		std::minstd_rand rnd;
 		
+		// how many ticks late the last batch of updates was processed.
+		std::atomic<unsigned int> lateness;
+		
+		// scratch space for collect () and rehome ().
+		std::vector<physics_message> mail;
+		std::vector<physics_update> due;
+		
 		bool _running;
 		std::thread th;
 		
@@ -158,11 +307,28 @@ namespace hCraft {
 		 */
 		void main_loop ();
 		
+		/* 
+		 * Places the updates in the worker's inbox onto its wheel, and moves the
+		 * ones due by tick @{now} onto its ready list.
+		 */
+		void collect (unsigned long long now);
+		
+		/* 
+		 * Hands the updates of regions that the shard no longer owns (after the
+		 * number of workers has changed) over to their new owners.
+		 */
+		void rehome ();
+		
+		/* 
+		 * Processes a single due update during tick @{now}.
+		 */
+		void process (physics_update& u, unsigned long long now);
+		
 	public:
 		/* 
 		 * Constructs and starts the worker thread.
 		 */
-		physics_worker (physics_manager &man);
+		physics_worker (physics_manager &man, unsigned int id);
 		
 		/* 
 		 * Destructor - stops the worker thread.
@@ -174,33 +340,107 @@ namespace hCraft {
 	
 	/* 
 	 * Manages a collection of physics_worker instances. 
+	 * 
+	 * The world is partitioned into physics regions, each owned by a single
+	 * worker (the region's coordinates are hashed to pick one), so updates
+	 * within a region are scheduled and tracked without any locking, and
+	 * only updates crossing over to another worker's region are passed
+	 * through its inbox.
 	 */
 	class physics_manager
 	{
 		friend class physics_worker;
 		
+	public:
+		static constexpr unsigned int max_threads = 24;
+		static constexpr int tick_ms = 50; // length of a physics tick
+		
+	private:
 		std::vector<std::shared_ptr<physics_worker>> workers;
 		std::mutex lock;
 		
-		std::unordered_map<world *,
-			std::unordered_map<chunk_pos, ph_mem_chunk, chunk_pos_hash>>
-				block_mem;
-				
-	public:
-		tbb::concurrent_queue<physics_update> updates;
+		// one shard per worker (the first one is always in use, so updates
+		// can be scheduled even when there are no workers).
+		physics_shard shards[max_threads];
+		std::atomic<unsigned int> shard_count;
+		std::atomic<unsigned int> layout; // bumped when shard_count changes
+		
+		std::chrono::steady_clock::time_point epoch; // start of tick 0
+		
+		// the number of block updates in every chunk, counted from the moment
+		// they are scheduled until they have been processed, wherever they are
+		// in between (see has_blocks_in_chunk ()). Split by the chunk's hash.
+		static constexpr unsigned int chunk_count_sets = 16;
+		struct {
+			std::unordered_map<ph_key, int, ph_key_hash> counts;
+			std::mutex lock;
+		} chunk_counts[chunk_count_sets];
 				
 	protected:
-		bool block_exists_nolock (world *w, int x, int y, int z);
-		void add_block_nolock (world *w, int x, int y, int z);
+		/* 
+		 * Returns the index of the shard owning the specified update, out of
+		 * the first @{count} shards.
+		 */
+		static unsigned int owner_of (const physics_update& u, unsigned int count);
 		
-		bool block_exists (world *w, int x, int y, int z);
-		void add_block (world *w, int x, int y, int z);
-		void remove_block (world *w, int x, int y, int z);
+		/* 
+		 * Block membership in regions owned by @{shard}. Must be called by the
+		 * shard's owner.
+		 */
+		ph_mem_region* get_region (physics_shard& shard, world *w, int x, int z,
+			bool create);
+		bool block_exists (physics_shard& shard, world *w, int x, int y, int z);
+		void add_block (physics_shard& shard, world *w, int x, int y, int z);
+		void remove_block (physics_shard& shard, world *w, int x, int y, int z);
+		
+		/* 
+		 * Adds @{delta} to the number of updates counted in the chunk of the
+		 * specified update, if it's a block update.
+		 */
+		void count_update (const physics_update& u, int delta);
+		
+		/* 
+		 * Puts the specified update on @{shard}'s wheel and records its block.
+		 * Must be called by the shard's owner. Returns false if @{once} is set
+		 * and the block already has an update scheduled.
+		 */
+		bool place (physics_shard& shard, const physics_update& u, bool once);
+		
+		/* 
+		 * Schedules the specified update on the shard owning it: directly, if
+		 * called by the owner, otherwise through the shard's inbox.
+		 */
+		void dispatch (const physics_update& u, bool once);
+		
+		/* 
+		 * Schedules the specified update @{tick_delay} ticks from now.
+		 */
+		void schedule (physics_update& u, int tick_delay, bool once);
+		
+		/* 
+		 * Moves up to @{max} due updates from the shards of other workers into
+		 * @{out}, taking at most half of what is due on any single shard.
+		 */
+		size_t steal (unsigned int thief, std::vector<physics_update>& out,
+			size_t max);
+		
+		/* 
+		 * Returns the point in time at which tick @{t} starts.
+		 */
+		inline std::chrono::steady_clock::time_point
+		tick_time (unsigned long long t)
+			{ return this->epoch + std::chrono::milliseconds (tick_ms * t); }
 		
 	public:
+		physics_manager ();
 		~physics_manager ();
 		
 		
+		/* 
+		 * Returns the number of the current physics tick.
+		 */
+		unsigned long long current_tick ();
+		
 		/* 
 		 * Changes the number of worker threads to utilize.
 		 */
@@ -208,6 +448,24 @@ namespace hCraft {
 		inline int get_thread_count ()
 			{ return workers.size (); }
 		
+		/* 
+		 * Returns the total number of scheduled updates, due or not.
+		 */
+		size_t get_backlog ();
+		
+		/* 
+		 * Returns how many ticks behind schedule the workers are running (the
+		 * largest lateness of the updates they processed most recently).
+		 */
+		unsigned int get_lateness ();
+		
+		
+		/* 
+		 * Checks whether there are any queued block updates in the specified
+		 * chunk of world @{w}.
+		 */
+		bool has_blocks_in_chunk (world *w, int cx, int cz);
+		
 		
 		/* 
 		 * Queues an update to be processed by one of the workers:
@@ -31,6 +31,7 @@
 #include "cistring.hpp"
 #include "sqlops.hpp"
 #include "generator.hpp"
+#include "threadpool.hpp"
 
 #include <atomic>
 #include <queue>
@@ -138,6 +139,7 @@ namespace hCraft {
 		
 		struct event_base *evbase;
 		struct bufferevent *bufev;
+		struct event *flush_ev; // made active to start writing out queued packets
 		evutil_socket_t sock;
 		
 		int dbid;
@@ -158,6 +160,10 @@ namespace hCraft {
 		double total_walked, total_run;
 		double total_walked_old, total_run_old;
 		
+		// smoothed movement per position update, used to read ahead the chunks
+		// the player is heading towards.
+		double move_dx, move_dz;
+		
 		double last_ground_height;
 		bool fall_flag;
 		
@@ -178,26 +184,25 @@ namespace hCraft {
 		bool disconnecting;
 		
 		bool reading;
-		unsigned char rdbuf[384];
-		int total_read;
-		int read_rem;
 		std::atomic_int handlers_scheduled;
 		CryptoPP::CFB_Mode<CryptoPP::AES>::Decryption *decryptor;
+		size_t in_decrypted; // bytes at the front of the input already decrypted
 		
 		unsigned char vtoken[4];
 		unsigned char ssec[16]; // shared secret
 		
-		// Using a thread pool to execute packet handling methods gives rise to a
-		// problem: Packets that must be executed in a certain order (such as, for
-		// example - 0x66 [window click] packets) are NOT guaranteed to be handled
-		// in the same order they were received. To solve this, received packets
-		// are first put into this queue, and only after a conclusion is made that
-		// it is indeed safe to call the packet callbacks, the packets in the queue
-		// are executed one after the other all at once in a pooled thread.
-		std::deque<unsigned char *> exec_queue;
+		// Received packets are handled in the thread pool, but must be handled
+		// in the order they were received. They are posted to this strand,
+		// which runs them one after the other, while packets of other players
+		// are handled in parallel.
+		strand pkt_strand;
 		
 		bool writing;
-		std::queue<packet *> out_queue;
+		struct evbuffer *outbuf; // packets waiting to be moved into the bufferevent
+		int corked;
+		bool flush_pending;
+		bool kick_pending;
+		std::atomic<bool> kick_flushed; // kick packet moved into the bufferevent
 		std::mutex out_lock;
 		CryptoPP::CFB_Mode<CryptoPP::AES>::Encryption *encryptor;
 		
@@ -220,6 +225,11 @@ namespace hCraft {
 		std::queue<gen_response> response_chunks;
 		std::mutex response_chunks_lock;
 		bool need_new_chunks;
+		
+		// light refreshes sent during the current second (see
+		// take_light_refresh ()).
+		int light_refreshes;
+		std::chrono::steady_clock::time_point light_refresh_time;
 				
 		std::chrono::steady_clock::time_point last_tick;
 		std::chrono::steady_clock::time_point last_heart_regen;
@@ -245,7 +255,10 @@ namespace hCraft {
 		blocki sb_block;
 		std::mutex sb_lock;
 		
+		// modified by the player's own thread only, which takes the lock while
+		// doing so (see knows_chunk ()).
 		std::vector<known_chunk> known_chunks;
+		std::mutex known_chunks_lock;
 		
 		inventory inv;
 		
@@ -268,6 +281,19 @@ namespace hCraft {
 		static void handle_read (struct bufferevent *bufev, void *ctx);
 		static void handle_write (struct bufferevent *bufev, void *ctx);
 		static void handle_event (struct bufferevent *bufev, short events, void *ctx);
+		static void handle_flush (evutil_socket_t fd, short events, void *ctx);
+		
+		/* 
+		 * Wakes up the player's worker to write out queued packets, unless the
+		 * player is corked. The output lock must be held.
+		 */
+		void schedule_flush ();
+		
+		/* 
+		 * Decrypts newly arrived data in place, inside the bufferevent's input
+		 * buffer.
+		 */
+		void decrypt_input (struct evbuffer *buf);
 		
 		/* 
 		 * Packet handlers:
@@ -297,22 +323,15 @@ namespace hCraft {
 		static int handle_packet_fe (player *pl, packet_reader reader);
 		static int handle_packet_ff (player *pl, packet_reader reader);
 		
-		/* 
-		 * Examines the queue that holds packets pending to be handled by
-		 * appropriate callback methods in-order to conclude whether it is safe
-		 * to handle the packets. 
-		 */
-		bool test_packet_chain ();
-		
 		/* 
 		 * Executes the appropriate packet handler for the given byte array.
 		 */
 		int handle (const unsigned char *data);
 		
 		/* 
-		 * Executed in a thread pool task, spawned by handle ().
+		 * Executed in the player's packet strand, spawned by handle_read ().
 		 */
-		friend void handle_func (void *ctx);
+		friend void handle_func (player *pl, unsigned char *data);
 		
 		
 	//----
@@ -348,6 +367,12 @@ namespace hCraft {
 		
 		void update_home_chunk ();
 		
+		/* 
+		 * Has the world's I/O thread read in the chunks just past the edge of
+		 * the player's view, in the direction the player is moving in.
+		 */
+		void prefetch_ahead (chunk_pos cpos);
+		
 	//----
 		
 		/* 
@@ -385,14 +410,18 @@ namespace hCraft {
 		
 		inline bool is_reading () { return this->reading; }
 		inline bool is_writing () { return this->writing; }
-		inline bool is_handling_packets () { return (this->handlers_scheduled.load () > 0); }
+		inline bool is_handling_packets ()
+			{ return (this->handlers_scheduled.load () > 0) || !this->pkt_strand.idle (); }
 		inline bool is_disconnecting () { return this->disconnecting; }
 		inline std::chrono::time_point<std::chrono::system_clock> disconnection_time ()
 			{ return this->fail_time; }
 		
+		inline struct event_base* get_event_base () { return this->evbase; }
+		
 		inline world* get_world () { return this->curr_world; }
 		inline std::mutex& get_world_lock () { return this->world_lock; }
 		static constexpr int chunk_radius () { return 5; }
+		static constexpr int light_refresh_rate () { return 64; } // per second
 		
 		inline slot_item& held_item () { return this->inv.get (this->held_slot); }
 		inline slot_item cursor_item () { return this->cursor_slot; }
@@ -438,9 +467,33 @@ namespace hCraft {
 		
 		/* 
 		 * Inserts the specified packet into the player's queue of outgoing packets.
+		 * 
+		 * Packets are not written out immediately. Instead, the worker thread
+		 * that handles the player's connection is woken up, and it moves
+		 * everything that has been queued until then into the socket at once.
 		 */
 		void send (packet *pack);
 		
+		/* 
+		 * Same as send (packet *), but for packets that are shared between
+		 * several players (e.g. cached chunks). The packet must not be modified
+		 * afterwards.
+		 */
+		void send (std::shared_ptr<packet> pack);
+		
+		/* 
+		 * While the player is corked, sent packets are only queued, and are
+		 * written out together once uncork () is called. Calls may be nested.
+		 */
+		void cork ();
+		void uncork ();
+		
+		/* 
+		 * Returns the amount of bytes queued for sending, but not yet written
+		 * out to the socket.
+		 */
+		int get_send_queue_size ();
+		
 		/* 
 		 * Resends the block located at the given block coordinates.
 		 */
@@ -470,6 +523,20 @@ namespace hCraft {
 		 */
 		bool can_see_chunk (int x, int z);
 		
+		/* 
+		 * Checks whether the player has been sent the specified chunk and has
+		 * not unloaded it since. Safe to call from other threads.
+		 */
+		bool knows_chunk (world *w, int x, int z);
+		
+		/* 
+		 * Called by the player's world before it sends the player a chunk whose
+		 * light has changed. Returns false if the player has already been sent
+		 * as many light refreshes as it is allowed to in the current second,
+		 * in which case the refresh should be retried later.
+		 */
+		bool take_light_refresh ();
+		
 		/* 
 		 * Used by the chunk_generator class to inform the player that a chunk
 		 * has been generated.
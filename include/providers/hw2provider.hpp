@@ -0,0 +1,306 @@
+/* 
+ * hCraft - A custom Minecraft server.
+ * Copyright (C) 2012	Jacob Zhitomirsky
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _hCraft__HW2PROVIDER_H_
+#define _hCraft__HW2PROVIDER_H_
+
+#include "worldprovider.hpp"
+#include "hwprovider.hpp"
+#include <fstream>
+#include <vector>
+#include <utility>
+#include <string>
+
+
+namespace hCraft {
+	
+	/* 
+	 * An entry in an HWv2 world's chunk index. Each chunk is stored in a single
+	 * contiguous run of sectors.
+	 */
+	struct hw2_entry
+	{
+		int x, z;
+		unsigned int offset; // in sectors, zero if the slot is unused
+		unsigned int size;   // in bytes
+		unsigned int crc;    // CRC-32 of the chunk's compressed data
+	};
+	
+	
+	/* 
+	 * Keeps track of which sectors of a world file are in use, so that space
+	 * freed by rewritten chunks can be handed out again.
+	 */
+	class hw2_space_map
+	{
+		std::vector<unsigned long long> bits;
+		unsigned int sectors; // number of sectors in the file
+		unsigned int hint;    // no free sectors below this one
+		unsigned int used;
+		
+	public:
+		hw2_space_map ();
+		
+		void clear ();
+		
+		/* 
+		 * The number of sectors the file spans, and how many of them are in use.
+		 */
+		inline unsigned int size () const { return this->sectors; }
+		inline unsigned int in_use () const { return this->used; }
+		
+		/* 
+		 * Extends the map to span at least @{sectors} sectors, the new ones
+		 * being free.
+		 */
+		void extend (unsigned int sectors);
+		
+		/* 
+		 * Marks @{count} sectors starting at @{off} as used\free.
+		 */
+		void mark (unsigned int off, unsigned int count);
+		void release (unsigned int off, unsigned int count);
+		
+		/* 
+		 * Finds the first run of @{count} free sectors, extending the file if
+		 * there is none, marks it as used and returns its offset.
+		 */
+		unsigned int allocate (unsigned int count);
+	};
+	
+	
+	
+	class hw2_provider_naming: public world_provider_naming
+	{
+	public:
+		virtual const char* provider_name ()
+			{ return "hw2"; }
+		
+		
+		/* 
+		 * Returns true if the format is stored within a separate directory
+		 * (like Anvil).
+		 */
+		virtual bool is_directory_format ()
+			{ return false; }
+		
+		/* 
+		 * Adds required prefixes, suffixes, etc... to the specified world name so
+		 * that the importer's claims_name () function returns true when passed to
+		 * it.
+		 */
+		virtual std::string make_name (const char *world_name);
+		
+		/* 
+		 * Checks whether the specified path name meets the format required by this
+		 * exporter (could be a name prefix, suffix, extension, etc...).
+		 */
+		virtual bool claims_name (const char *path);
+	};
+	
+	
+	/* 
+	 * World exporter for the HWv2 format (.hw2 files).
+	 * 
+	 * Unlike HWv1, chunks are written out whole into contiguous runs of 512-byte
+	 * sectors, and every chunk carries a CRC-32 of its data. Rewritten chunks
+	 * are written to a fresh run before the old one is released, and freed
+	 * sectors are reused. All chunks are listed in one flat hash table, which
+	 * is read in its entirety when the provider is created.
+	 * 
+	 * Chunk data itself is encoded just like in HWv1 (see hw_encode_chunk ()).
+	 */
+	class hw2_provider: public world_provider
+	{
+		std::string out_path;
+		std::fstream strm;
+		hw_mapping *map; // used for all reads
+		
+		world_information inf;
+		unsigned int index_offset; // in sectors
+		std::vector<hw2_entry> index; // the size is always a power of two
+		hw2_space_map space;
+		
+	private:
+		void read_file ();
+		
+		void write_header ();
+		void write_entry (unsigned int slot);
+		void grow_index ();
+		unsigned int find_slot (int x, int z);
+		const unsigned char* chunk_data (int x, int z, unsigned int& len);
+		
+	public:
+		/* 
+		 * Constructs a new world provider for the HWv2 format.
+		 * Throws std::runtime_error if the world file exists, but is corrupt.
+		 */
+		hw2_provider (const char *path, const char *world_name);
+		
+		/* 
+		 * Class destructor.
+		 */
+		~hw2_provider ();
+		
+		
+		
+		/* 
+		 * Returns the name of this world provider.
+		 */
+		virtual const char* name ()
+			{ return "hw2"; }
+		
+		
+		
+		/* 
+		 * Opens the underlying file stream for reading\writing.
+		 * By using open () and close (), multiple chunks can be read\written
+		 * without reopening the world file everytime.
+		 */
+		virtual void open (world &wr);
+		
+		/* 
+		 * Closes the underlying file stream.
+		 */
+		virtual void close ();
+		
+		
+		
+		/* 
+		 * Saves only the specified chunk.
+		 */
+		virtual void save (world& wr, chunk *ch, int x, int z);
+		
+		/* 
+		 * Serializes and compresses the specified chunk into @{out}, in the form
+		 * expected by save_encoded (). Safe to call from several threads at once.
+		 */
+		virtual void encode_chunk (chunk *ch, std::vector<unsigned char>& out);
+		
+		/* 
+		 * Writes out chunk data previously produced by encode_chunk ().
+		 */
+		virtual void save_encoded (world& wr, const std::vector<unsigned char>& data,
+			int x, int z);
+		
+		/* 
+		 * Saves the specified world without writing out any chunks.
+		 * NOTE: If a world file already exists at the destination path, an empty
+		 *       template will NOT be written out.
+		 */
+		virtual void save_empty (world &wr);
+		
+		/* 
+		 * Updates world information for a given world. 
+		 */
+		virtual void save_info (world &w, const world_information &info);
+		
+		
+		
+		/* 
+		 * Opens the file located at path @{path} and performs a check to see if it
+		 * is of the same format created by this exporter.
+		 */
+		virtual bool claims (const char *path);
+		
+		/* 
+		 * Attempts to load the chunk located at the specified coordinates into
+		 * @{ch}. Returns true on success, and false if the chunk is not present
+		 * within the world file. Does not require the file to be open ()ed.
+		 * Throws std::runtime_error if the chunk's checksum does not match.
+		 */
+		virtual bool load (world &wr, chunk *ch, int x, int z);
+		
+		/* 
+		 * Reads the chunk located at the specified coordinates into @{out},
+		 * without decoding it, so that it can be handed to decode_chunk ()
+		 * afterwards. Returns false if the chunk is not present within the
+		 * world file.
+		 */
+		virtual bool load_encoded (world &wr, int x, int z,
+			std::vector<unsigned char>& out)
+			{ return this->load_raw (x, z, out); }
+		
+		/* 
+		 * Fills @{ch} with chunk data read by load_encoded (). Safe to call from
+		 * several threads at once.
+		 */
+		virtual void decode_chunk (chunk *ch, const std::vector<unsigned char>& data)
+			{ hw_decode_chunk (ch, data.data (), data.size ()); }
+		
+		/* 
+		 * Returns the position within the world file at which the data of the
+		 * specified chunk begins, or -1 if the chunk is not present.
+		 */
+		virtual long long locate (int x, int z);
+		
+		/* 
+		 * Loads world information into the specified structure.
+		 */
+		virtual const world_information& info ()
+			{ return this->inf; }
+		
+		
+		
+		/* 
+		 * Creates an empty world file that holds the specified information, if
+		 * one does not already exist.
+		 */
+		void save_empty (const world_information& info);
+		
+		/* 
+		 * Like open (), but fails instead of creating the world file if it does
+		 * not exist.
+		 */
+		bool open_file ();
+		
+		/* 
+		 * Reads the chunk located at the specified coordinates into @{out},
+		 * still compressed. Returns false if the chunk is not present within the
+		 * world file. Throws std::runtime_error if its checksum does not match.
+		 */
+		bool load_raw (int x, int z, std::vector<unsigned char>& out);
+		
+		/* 
+		 * Writes out compressed chunk data, in the form produced by
+		 * hw_encode_chunk (). The world file must already exist.
+		 */
+		void save_raw (const unsigned char *data, unsigned int len, int x, int z);
+		
+		/* 
+		 * Fills @{out} with the coordinates of every chunk stored in the world
+		 * file.
+		 */
+		void list_chunks (std::vector<std::pair<int, int>>& out);
+		
+		/* 
+		 * Returns the size of the world file, and how many bytes of it are not
+		 * used by anything.
+		 */
+		unsigned long long file_size () const;
+		unsigned long long free_space () const;
+		
+		/* 
+		 * Rewrites the world file with no free space in it, with chunks laid
+		 * out region by region. The world must not be in use by a server.
+		 */
+		void compact ();
+	};
+}
+
+#endif
@@ -21,11 +21,18 @@
 
 #include "worldprovider.hpp"
 #include <fstream>
+#include <vector>
+#include <utility>
 
 
 namespace hCraft {
 	
 //----
+	/* 
+	 * The tables below are read from the world file lazily, the first time
+	 * they are needed (see `loaded').
+	 */
+	
 	struct hw_chunk
 	{
 		int offset;
@@ -33,12 +40,14 @@ namespace hCraft {
 		int z;
 		unsigned int sector_table[256];
 		int size;
+		bool loaded;
 		
 		hw_chunk (int x, int z)
 		{
 			this->x = x;
 			this->z = z;
 			this->size = 0;
+			this->loaded = false;
 			for (int i = 0; i < 256; ++i)
 				sector_table[i] = 0;
 		}
@@ -49,11 +58,13 @@ namespace hCraft {
 		int offset;
 		int x, z;
 		hw_chunk* chunks[1024];
+		bool loaded;
 		
 		hw_region (int x, int z)
 		{
 			this->x = x;
 			this->z = z;
+			this->loaded = false;
 			for (int i = 0; i < 1024; ++i)
 				this->chunks[i] = nullptr;
 		}
@@ -70,11 +81,13 @@ namespace hCraft {
 		int offset;
 		int x, z;
 		hw_region* regions[1024];
+		bool loaded;
 		
 		hw_block (int x, int z)
 		{
 			this->x = x;
 			this->z = z;
+			this->loaded = false;
 			for (int i = 0; i < 1024; ++i)
 				this->regions[i] = nullptr;
 		}
@@ -91,11 +104,13 @@ namespace hCraft {
 		int offset;
 		int x, z;
 		hw_block* blocks[64];
+		bool loaded;
 		
 		hw_superblock (int x, int z)
 		{
 			this->x = x;
 			this->z = z;
+			this->loaded = false;
 			for (int i = 0; i < 64; ++i)
 				this->blocks[i] = nullptr;
 		}
@@ -108,6 +123,55 @@ namespace hCraft {
 	};
 //----
 	
+	/* 
+	 * A read-only view of a world file, mapped into memory. The mapping is
+	 * extended as the file grows.
+	 */
+	class hw_mapping
+	{
+		std::string path;
+		int fd;
+		unsigned char *data;
+		unsigned long long size;
+		
+	private:
+		bool remap ();
+		
+	public:
+		hw_mapping (const std::string& path);
+		~hw_mapping ();
+		
+		hw_mapping (const hw_mapping&) = delete;
+		
+		/* 
+		 * Returns a pointer to @{len} bytes of the file starting at offset @{off},
+		 * or null if the file is not that large. The pointer remains valid until
+		 * the next call to get ().
+		 */
+		const unsigned char* get (unsigned long long off, unsigned int len);
+		
+		/* 
+		 * Unmaps the file.
+		 */
+		void close ();
+	};
+	
+	
+	
+	/* 
+	 * Serializes and compresses the specified chunk into @{out}. Both .hw
+	 * formats store chunks in this form. Safe to call from several threads at
+	 * once.
+	 */
+	void hw_encode_chunk (chunk *ch, std::vector<unsigned char>& out);
+	
+	/* 
+	 * Inflates @{len} bytes of chunk data produced by hw_encode_chunk () into
+	 * @{ch}. Throws std::runtime_error if the data is corrupt.
+	 */
+	void hw_decode_chunk (chunk *ch, const unsigned char *data, unsigned int len);
+	
+	
 	class hw_provider_naming: public world_provider_naming
 	{
 	public:
@@ -145,6 +209,7 @@ namespace hCraft {
 		std::string out_path;
 		hw_superblock *sblocks[4096];
 		std::fstream strm;
+		hw_mapping *map; // used for all reads
 		
 		world_information inf;
 		
@@ -188,6 +253,18 @@ namespace hCraft {
 		 */
 		virtual void save (world& wr, chunk *ch, int x, int z);
 		
+		/* 
+		 * Serializes and compresses the specified chunk into @{out}, in the form
+		 * expected by save_encoded (). Safe to call from several threads at once.
+		 */
+		virtual void encode_chunk (chunk *ch, std::vector<unsigned char>& out);
+		
+		/* 
+		 * Writes out chunk data previously produced by encode_chunk ().
+		 */
+		virtual void save_encoded (world& wr, const std::vector<unsigned char>& data,
+			int x, int z);
+		
 		/* 
 		 * Saves the specified world without writing out any chunks.
 		 * NOTE: If a world file already exists at the destination path, an empty
@@ -211,15 +288,53 @@ namespace hCraft {
 		/* 
 		 * Attempts to load the chunk located at the specified coordinates into
 		 * @{ch}. Returns true on success, and false if the chunk is not present
-		 * within the world file.
+		 * within the world file. Does not require the file to be open ()ed.
 		 */
 		virtual bool load (world &wr, chunk *ch, int x, int z);
 		
+		/* 
+		 * Reads the chunk located at the specified coordinates into @{out},
+		 * without decoding it, so that it can be handed to decode_chunk ()
+		 * afterwards. Returns false if the chunk is not present within the
+		 * world file.
+		 */
+		virtual bool load_encoded (world &wr, int x, int z,
+			std::vector<unsigned char>& out)
+			{ return this->load_raw (x, z, out); }
+		
+		/* 
+		 * Fills @{ch} with chunk data read by load_encoded (). Safe to call from
+		 * several threads at once.
+		 */
+		virtual void decode_chunk (chunk *ch, const std::vector<unsigned char>& data)
+			{ hw_decode_chunk (ch, data.data (), data.size ()); }
+		
+		/* 
+		 * Returns the position within the world file at which the data of the
+		 * specified chunk begins, or -1 if the chunk is not present.
+		 */
+		virtual long long locate (int x, int z);
+		
 		/* 
 		 * Loads world information into the specified structure.
 		 */
 		virtual const world_information& info ()
 			{ return this->inf; }
+		
+		
+		
+		/* 
+		 * Reads the chunk located at the specified coordinates into @{out},
+		 * still compressed, in the form produced by hw_encode_chunk ().
+		 * Returns false if the chunk is not present within the world file.
+		 */
+		bool load_raw (int x, int z, std::vector<unsigned char>& out);
+		
+		/* 
+		 * Fills @{out} with the coordinates of every chunk stored in the world
+		 * file. This reads in all of the file's tables.
+		 */
+		void list_chunks (std::vector<std::pair<int, int>>& out);
 	};
 }
 
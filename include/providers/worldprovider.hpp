@@ -110,6 +110,20 @@ namespace hCraft {
 		 */
 		virtual void save (world& wr, chunk *ch, int x, int z) = 0;
 		
+		/* 
+		 * Serializes and compresses the specified chunk into @{out}, in the form
+		 * expected by save_encoded (). Does not touch the world file, and so
+		 * unlike the rest of the provider's member functions, may be called from
+		 * several threads at once.
+		 */
+		virtual void encode_chunk (chunk *ch, std::vector<unsigned char>& out) = 0;
+		
+		/* 
+		 * Writes out chunk data previously produced by encode_chunk ().
+		 */
+		virtual void save_encoded (world& wr, const std::vector<unsigned char>& data,
+			int x, int z) = 0;
+		
 		/* 
 		 * Saves the specified world without writing out any chunks.
 		 * NOTE: If a world file already exists at the destination path, an empty
@@ -133,10 +147,33 @@ namespace hCraft {
 		/* 
 		 * Attempts to load the chunk located at the specified coordinates into
 		 * @{ch}. Returns true on success, and false if the chunk is not present
-		 * within the world file.
+		 * within the world file. Does not require the file to be open ()ed.
 		 */
 		virtual bool load (world &wr, chunk *ch, int x, int z) = 0;
 		
+		/* 
+		 * Reads the chunk located at the specified coordinates into @{out},
+		 * without decoding it, so that it can be handed to decode_chunk ()
+		 * afterwards. Returns false if the chunk is not present within the
+		 * world file.
+		 */
+		virtual bool load_encoded (world &wr, int x, int z,
+			std::vector<unsigned char>& out) = 0;
+		
+		/* 
+		 * Fills @{ch} with chunk data read by load_encoded (). Does not touch the
+		 * world file, and so may be called from several threads at once.
+		 */
+		virtual void decode_chunk (chunk *ch,
+			const std::vector<unsigned char>& data) = 0;
+		
+		/* 
+		 * Returns the position within the world file at which the data of the
+		 * specified chunk begins, or -1 if the chunk is not present (or the
+		 * format can't tell). Used to read chunks in file order.
+		 */
+		virtual long long locate (int x, int z) { return -1; }
+		
 		/* 
 		 * Returns a structure that contains essential information about the
 		 * underlying world.
@@ -32,6 +32,8 @@
 #include "sql.hpp"
 #include "authentication.hpp"
 #include "generator.hpp"
+#include "chunkcache.hpp"
+#include "autosave.hpp"
 
 #include <unordered_map>
 #include <vector>
@@ -74,6 +76,14 @@ namespace hCraft {
 		
 		char ip[16];
 		int  port;
+		
+		int  gen_threads; // 0 = one per core
+		int  chunk_cache_mb; // 0 = disabled
+		int  world_mem_mb; // per world, 0 = unlimited
+		int  autosave_interval; // in seconds, 0 = disabled
+		int  net_comp_level;
+		int  disk_comp_level;
+		bool adaptive_comp;
 	};
 	
 	
@@ -119,15 +129,22 @@ namespace hCraft {
 		 * are attached. Every server worker handles I/O for all events that are
 		 * registered with it in a separate thread of execution, equally dividing
 		 * the server's load.
+		 * 
+		 * Workers block in their event loop until there is something to do.
+		 * Other threads wake them up through events made active with
+		 * event_active () (see player::send ()).
 		 */
 		struct worker
 		{
+			server *srv;
 			struct event_base *evbase;
-			std::atomic_int event_count;
+			struct event *keepalive;
+			struct evconnlistener *listener;
+			std::atomic_int conn_count;
 			std::thread th;
 			
 			// constructor.
-			worker (struct event_base *base, std::thread&& th);
+			worker (server *srv, struct event_base *base, std::thread&& th);
 			
 			// move constructor.
 			worker (worker&& w);
@@ -151,8 +168,7 @@ namespace hCraft {
 		int worker_count;
 		bool workers_ready;
 		bool workers_stop;
-		
-		struct evconnlistener *listener;
+		std::atomic_uint next_worker;
 		
 		playerlist *players;
 		std::unordered_set<player *> connecting;
@@ -182,6 +198,8 @@ namespace hCraft {
 		physics_manager global_physics; // initially shared between all worlds
 		authenticator auth;
 		chunk_generator cgen;
+		chunk_packet_cache chunk_cache;
+		autosaver autosave;
 		
 	private:
 		// <init, destroy> functions:
@@ -262,10 +280,17 @@ namespace hCraft {
 		void work ();
 		
 		/* 
-		 * Returns the worker that has the least amount of events associated with
-		 * it.
+		 * Picks the worker that should handle a new connection. The worker that
+		 * accepted the connection is preferred, unless it handles noticeably more
+		 * connections than the least busy worker.
+		 */
+		worker& pick_worker (worker& local);
+		
+		/* 
+		 * Informs the worker that owns the given event base that one of its
+		 * connections has been closed.
 		 */
-		worker& get_min_worker ();
+		void release_worker (struct event_base *evbase);
 		
 		/* 
 		 * Wraps the accepted connection around a player object and associates it
@@ -287,6 +312,13 @@ namespace hCraft {
 		 */
 		static void handle_muted (scheduler_task& task);
 		
+		/* 
+		 * Lowers the compression level of chunk packets while chunks can't be
+		 * generated or sent fast enough, and raises it back once things calm
+		 * down.
+		 */
+		static void adjust_compression (scheduler_task& task);
+		
 	public:
 		inline bool is_running () { return this->running; }
 		inline bool is_shutting_down () { return this->shutting_down; }
@@ -366,6 +398,12 @@ namespace hCraft {
 		 */
 		world* find_world (const char *name);
 		
+		/* 
+		 * Calls the given function on every loaded world, with the world lock
+		 * held.
+		 */
+		void all_worlds (std::function<void (world *)> f);
+		
 		
 		
 		/* 
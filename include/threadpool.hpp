@@ -16,25 +16,36 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+
 #ifndef _hCraft__THREAD_POOL_H_
 #define _hCraft__THREAD_POOL_H_
 
 #include <thread>
 #include <mutex>
 #include <vector>
+#include <deque>
+#include <memory>
+#include <atomic>
 #include <functional>
-#include <queue>
 #include <condition_variable>
 
 
 namespace hCraft {
 	
+	class strand;
+	
+	
 	/* 
 	 * A pool of threads that can be used to asynchronously execute tasks.
+	 * 
+	 * Every pooled thread has a queue of its own. Tasks scheduled from within
+	 * the pool are put in the scheduling thread's queue, and tasks scheduled
+	 * from outside are spread across the queues in turn. Threads that run out
+	 * of work steal tasks from the other queues before going to sleep.
 	 */
 	class thread_pool
 	{
-		friend struct worker_thread;
+		friend class strand;
 		
 		struct task
 		{
@@ -52,35 +63,61 @@ namespace hCraft {
 		struct worker_thread
 		{
 			thread_pool *pool;
+			int index;
 			std::thread th;
+			std::deque<task> tasks;
+			std::mutex lock;
+		};
+		
+	public:
+		struct stats
+		{
+			unsigned long long tasks_run;
+			unsigned long long steals;
 			
-			worker_thread (const worker_thread&) = delete;
-			worker_thread (thread_pool *pool, std::thread&& th)
-				: pool (pool), th (std::move (th))
-				{ }
-			worker_thread (worker_thread&& other)
-				: pool (other.pool), th (std::move (other.th))
-				{ }
+			// how many times the queue locks were acquired, and how many of
+			// those had to wait for another thread to release them.
+			unsigned long long lock_acquisitions;
+			unsigned long long lock_contentions;
 		};
 		
 	private:
-		std::vector<worker_thread> workers;
-		std::queue<task> tasks;
-		std::mutex task_lock;
+		std::vector<std::unique_ptr<worker_thread> > workers;
+		std::atomic_uint next_worker;
+		std::atomic_int pending;  // tasks waiting in queues
+		std::atomic_int sleepers; // threads waiting for tasks
+		std::mutex idle_lock;
 		std::condition_variable cv;
-		bool terminating;
+		std::atomic_bool terminating;
+		
+		std::atomic_ullong tasks_run;
+		std::atomic_ullong steals;
+		std::atomic_ullong lock_acquisitions;
+		std::atomic_ullong lock_contentions;
+		
+		static thread_local worker_thread *this_worker;
 		
 	private:
 		/* 
 		 * The function ran by worker threads.
 		 */
-		void main_loop ();
+		void main_loop (worker_thread *w);
 		
 		/* 
 		 * Returns the next available task. If none are currently available, the
-		 * function blocks until one is.
+		 * function blocks until one is. Returns false if the pool is stopping.
+		 */
+		bool get_task (worker_thread *w, task& t);
+		
+		/* 
+		 * Removes the task at the front of the specified thread's queue.
+		 */
+		bool try_pop (worker_thread *w, task& t);
+		
+		/* 
+		 * Locks the specified queue lock, keeping track of contention.
 		 */
-		task get_task ();
+		void acquire (std::mutex& lock);
 		
 	public:
 		thread_pool ();
@@ -105,6 +142,62 @@ namespace hCraft {
 		 * Schedules the specified task to be ran by a pooled thread.
 		 */
 		void enqueue (std::function<void (void *)>&& cb, void *context = nullptr);
+		
+		/* 
+		 * Calls @{f} (i) for every i in [0, @{count}), on the calling thread and
+		 * on up to @{count} - 1 pooled threads, and returns once all calls
+		 * have completed.
+		 */
+		void run_parallel (size_t count, const std::function<void (size_t)>& f);
+		
+		/* 
+		 * Returns the number of threads in the pool (zero if it hasn't been
+		 * started).
+		 */
+		inline int thread_count () const { return this->workers.size (); }
+		
+		/* 
+		 * Returns counters describing the pool's activity since it was created.
+		 */
+		stats get_stats () const;
+	};
+	
+	
+	
+	/* 
+	 * Runs the tasks posted to it one at a time, in the order they were posted,
+	 * on a thread pool. Tasks of different strands run in parallel.
+	 * 
+	 * A strand only ever occupies one pooled thread, and gives it back after
+	 * running a batch of tasks, so a strand with a lot of work (or slow tasks)
+	 * can not hold up others.
+	 */
+	class strand
+	{
+		thread_pool& pool;
+		std::deque<thread_pool::task> tasks;
+		std::mutex lock;
+		bool scheduled;
+		
+	private:
+		static void run (void *ptr);
+		
+	public:
+		strand (thread_pool& pool);
+		strand (const strand&) = delete;
+		
+		
+		
+		/* 
+		 * Schedules the specified task to be ran after all previously posted
+		 * tasks have finished.
+		 */
+		void post (std::function<void (void *)>&& cb, void *context = nullptr);
+		
+		/* 
+		 * Checks whether there are no tasks pending or running.
+		 */
+		bool idle ();
 	};
 }
 
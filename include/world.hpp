@@ -27,10 +27,15 @@
 #include "physics/blocks/physics_block.hpp"
 #include "physics/physics.hpp"
 #include "editstage.hpp"
+#include "chunkio.hpp"
+#include "chunkmap.hpp"
 
 #include <unordered_set>
 #include <unordered_map>
 #include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include <vector>
 #include <deque>
 #include <memory>
 #include <thread>
@@ -46,6 +51,7 @@ namespace hCraft {
 	class player;
 	class playerlist;
 	class world_transaction;
+	class thread_pool;
 	
 	
 	/* 
@@ -97,6 +103,7 @@ namespace hCraft {
 		server &srv;
 		logger &log;
 		char name[33]; // 32 chars max
+		unsigned long long uid; // never reused, unlike the world's address
 		playerlist *players;
 		
 		std::unique_ptr<std::thread> th;
@@ -104,12 +111,49 @@ namespace hCraft {
 		
 		std::deque<block_update> updates;
 		world_physics_state ph_state;
+		
+		// block updates to chunks that are being read in or generated, held back
+		// until their chunk is ready (world thread only), and the chunks that
+		// have become ready since the last tick.
+		std::unordered_map<unsigned long long, std::vector<block_update>> held_updates;
+		std::vector<std::pair<unsigned long long, bool>> ready_chunks;
+		std::mutex ready_lock;
 		unsigned long long ticks;
 		
-		std::unordered_map<unsigned long long, chunk *> chunks;
+		// block updates applied so far, and how many were applied during the
+		// last full second.
+		std::atomic<unsigned long long> updates_applied;
+		std::atomic<unsigned int> update_rate;
+		
+		// relit sub-chunks not yet sent to players (used by the world's thread
+		// only).
+		std::vector<light_change> light_changes;
+		
+		// refreshes that did not fit within a player's rate limit, per player
+		// (used by the world's thread only).
+		std::unordered_map<player *, std::vector<light_change>> light_deferred;
+		
+		// lookups are lock-free, modifications take the chunk lock.
+		chunk_map chunks;
 		std::mutex chunk_lock;
 		
-		struct { int x, z; chunk *ch; } last_chunk;
+		// chunks removed from the map, and when (see retire_chunk ()).
+		std::vector<std::pair<unsigned int, chunk *>> retired;
+		std::mutex retire_lock;
+		
+		// chunk residency (see evict_chunks ()).
+		std::atomic<unsigned int> res_clock; // seconds since the world was started
+		std::atomic<unsigned long long> mem_budget; // in bytes, 0 = unlimited
+		std::atomic<unsigned long long> mem_used;
+		std::atomic<int> saves_running; // save_dirty () calls in progress
+		
+		// chunks that are currently being generated (see load_chunk ()).
+		std::vector<chunk_pos> gen_active;
+		std::mutex gen_lock;
+		std::condition_variable gen_cv;
+		
+		// world providers are not thread-safe.
+		std::mutex prov_lock;
 		
 		std::unordered_set<entity *> entities;
 		std::mutex entity_lock;
@@ -131,8 +175,11 @@ namespace hCraft {
 		std::mutex estage_lock;
 		std::mutex update_lock;
 		
+		chunk_io io;
+		
 	public:
 		inline const char* get_name () { return this->name; }
+		inline logger& get_logger () { return this->log; }
 		inline playerlist& get_players () { return *this->players; }
 		
 		inline world_generator* get_generator () { return this->gen; }
@@ -152,6 +199,29 @@ namespace hCraft {
 		inline world_physics_state physics_state () const { return this->ph_state; }
 		inline std::mutex& get_update_lock () { return this->update_lock; }
 		
+		/* 
+		 * The amount of memory (in bytes) resident chunks may take up before the
+		 * least recently used ones start getting written out and freed.
+		 * Zero means no limit.
+		 */
+		inline unsigned long long get_memory_budget () const
+			{ return this->mem_budget.load (std::memory_order_relaxed); }
+		inline void set_memory_budget (unsigned long long bytes)
+			{ this->mem_budget.store (bytes, std::memory_order_relaxed); }
+		
+		// as of the last eviction pass.
+		inline unsigned long long get_resident_memory () const
+			{ return this->mem_used.load (std::memory_order_relaxed); }
+		
+		/* 
+		 * Block update throughput: the total number of updates applied, and the
+		 * number of updates applied during the last full second.
+		 */
+		inline unsigned long long get_updates_applied () const
+			{ return this->updates_applied.load (std::memory_order_relaxed); }
+		inline unsigned int get_update_rate () const
+			{ return this->update_rate.load (std::memory_order_relaxed); }
+		
 	private:
 		/* 
 		 * The function ran by the world's thread.
@@ -159,6 +229,62 @@ namespace hCraft {
 		void worker ();
 		
 		chunk* get_chunk_nolock (int x, int z);
+		void link_chunk_nolock (int x, int z, chunk *ch);
+		
+		/* 
+		 * Holds back the specified block update if its chunk isn't in memory
+		 * yet, and has the chunk read in or generated in the background.
+		 * Returns true if the update was held back.
+		 */
+		bool hold_update (const block_update& u);
+		
+		/* 
+		 * Requeues the updates held back for chunks that have become ready.
+		 */
+		void release_held_updates ();
+		void chunk_ready (unsigned long long key, bool load_here);
+		
+		/* 
+		 * Applies a tick's worth of block updates in two phases: blocks are set
+		 * (in parallel, for large batches), and players, lighting and physics
+		 * are then notified on the world's thread in the order the updates were
+		 * queued. Changed blocks are staged in @{pl_tr} to be sent to players.
+		 */
+		void apply_updates (std::vector<block_update>& batch,
+			dense_edit_stage& pl_tr);
+		
+		/* 
+		 * Resends the sub-chunks whose light has changed to the players that have
+		 * been sent their column. Every chunk column is encoded once, and the
+		 * packet is shared between all of those players. Refreshes that do not
+		 * fit within a player's rate limit are kept for the next call, for that
+		 * player only.
+		 */
+		void send_light_refreshes ();
+		
+		/* 
+		 * Writes out and frees the least recently used chunks that are neither
+		 * visible to players nor pinned by entities, physics, edit stages or
+		 * nearby generation, until the world fits its memory budget again.
+		 */
+		void evict_chunks ();
+		bool chunk_pinned (int cx, int cz, chunk *ch,
+			const std::vector<chunk_pos>& watchers);
+		
+		/* 
+		 * Frees retired chunks that no lookup can be using anymore.
+		 */
+		void free_retired ();
+		
+		/* 
+		 * Generating a chunk may modify the chunks around it as well (trees that
+		 * cross chunk borders, etc...), and so no two chunks that are less than
+		 * three chunks apart may be generated at the same time. These block
+		 * until the chunk at the given coordinates can be safely generated, and
+		 * mark it as done.
+		 */
+		void reserve_generation (int cx, int cz);
+		void release_generation (int cx, int cz);
 		
 		std::unordered_set<entity *>::iterator
 		despawn_entity_nolock (std::unordered_set<entity *>::iterator itr);
@@ -208,6 +334,18 @@ namespace hCraft {
 		 */
 		void save_meta ();
 		
+		/* 
+		 * Saves chunks that have been modified since they were last saved,
+		 * without holding the chunk lock while they are compressed or written.
+		 * Compression is spread over the given thread pool.
+		 * 
+		 * @{progress} is called with the number of chunks saved so far and the
+		 * total number of chunks to save after every batch. Returns the number of
+		 * chunks saved and adds the amount of bytes written to @{bytes}.
+		 */
+		int save_dirty (thread_pool& pool, unsigned long long& bytes,
+			std::function<void (int, int)> progress = nullptr);
+		
 		
 		
 		/* 
@@ -229,11 +367,39 @@ namespace hCraft {
 		 */
 		void put_chunk (int x, int z, chunk *ch);
 		
+		/* 
+		 * Returns the chunk at the given coordinates, reading it in from disk if
+		 * it isn't in memory, or inserting an empty, ungenerated chunk if it isn't
+		 * on disk either. Used to write into the chunks around one that is being
+		 * generated, by the thread generating it.
+		 */
+		chunk* load_neighbour (int x, int z);
+		
+		/* 
+		 * Inserts a chunk that has been read in by the I/O thread into the world,
+		 * unless one is already present. Returns the chunk that ends up in the
+		 * world, or null if the chunk can't be inserted yet because a chunk close
+		 * to it is being generated.
+		 */
+		chunk* adopt_chunk (int x, int z, chunk *ch);
+		
+		/* 
+		 * Frees the specified chunk, which must have already been removed from
+		 * the world, once any lookup that might have found it just before that
+		 * is done with it.
+		 */
+		void retire_chunk (chunk *ch);
+		
 		/* 
 		 * Searches the chunk world for a chunk located at the specified coordinates.
 		 */
 		chunk* get_chunk (int x, int z);
 		
+		/* 
+		 * Returns the number of chunks currently held in memory.
+		 */
+		int get_resident_chunks ();
+		
 		/* 
 		 * Returns the chunk located at the given block coordinates.
 		 */
@@ -243,6 +409,8 @@ namespace hCraft {
 		 * Same as get_chunk (), but if the chunk does not exist, it will be either
 		 * loaded from a file (if such a file exists), or completely generated from
 		 * scratch.
+		 * 
+		 * Safe to call from multiple threads at once.
 		 */
 		chunk* load_chunk (int x, int z);
 		chunk* load_chunk_at (int bx, int bz);
@@ -321,6 +489,12 @@ namespace hCraft {
 		void queue_lighting_nolock (int x, int y, int z)
 			{ this->lm.enqueue_nolock (x, y, z); }
 		
+		/* 
+		 * Relights the specified chunks as a whole, in parallel on the server's
+		 * thread pool. The lighting manager's lock must be held by the caller.
+		 */
+		void relight_chunks_nolock (const std::vector<chunk_pos>& chunks);
+		
 		void queue_physics (int x, int y, int z, int extra = 0,
 			void *ptr = nullptr, int tick_delay = 20, physics_params *params = nullptr,
 			physics_block_callback cb = nullptr);
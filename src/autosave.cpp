@@ -0,0 +1,228 @@
+/* 
+ * hCraft - A custom Minecraft server.
+ * Copyright (C) 2012	Jacob Zhitomirsky
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "autosave.hpp"
+#include "server.hpp"
+#include "world.hpp"
+#include "logger.hpp"
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <stdexcept>
+
+
+namespace hCraft {
+	
+	/* 
+	 * Constructs a new stopped autosaver.
+	 */
+	autosaver::autosaver (server &srv)
+		: srv (srv)
+	{
+		this->interval = 0;
+		this->_running = false;
+		this->current = nullptr;
+		
+		this->st.running = false;
+		this->st.chunks_done = 0;
+		this->st.chunks_total = 0;
+		this->st.last_chunks = 0;
+		this->st.last_bytes = 0;
+		this->st.last_ms = 0;
+		this->st.last_time = 0;
+	}
+	
+	/* 
+	 * Class destructor.
+	 */
+	autosaver::~autosaver ()
+	{
+		this->stop ();
+	}
+	
+	
+	
+	/* 
+	 * Starts saving worlds every @{interval_secs} seconds. Does nothing if
+	 * the interval is zero.
+	 */
+	void
+	autosaver::start (int interval_secs)
+	{
+		if (this->_running || interval_secs <= 0)
+			return;
+		
+		this->interval = interval_secs;
+		this->_running = true;
+		this->th = std::thread (
+			std::bind (std::mem_fn (&hCraft::autosaver::main_loop), this));
+	}
+	
+	/* 
+	 * Stops the autosave thread. A world that is being saved is completed
+	 * first.
+	 */
+	void
+	autosaver::stop ()
+	{
+		{
+			std::lock_guard<std::mutex> guard {this->lock};
+			if (!this->_running)
+				return;
+			this->_running = false;
+			this->queue.clear ();
+		}
+		this->cv.notify_all ();
+		
+		if (this->th.joinable ())
+			this->th.join ();
+	}
+	
+	
+	
+	/* 
+	 * The function ran by the autosave thread.
+	 */
+	void
+	autosaver::main_loop ()
+	{
+		std::unique_lock<std::mutex> guard {this->lock};
+		while (this->_running)
+			{
+				this->cv.wait_for (guard, std::chrono::seconds (this->interval),
+					[this] { return !this->_running; });
+				if (!this->_running)
+					break;
+				
+				guard.unlock ();
+				this->save_round ();
+				guard.lock ();
+			}
+	}
+	
+	/* 
+	 * Saves all worlds once.
+	 */
+	void
+	autosaver::save_round ()
+	{
+		auto start = std::chrono::steady_clock::now ();
+		
+		// the server's world lock is taken before ours (see release ()).
+		this->srv.all_worlds (
+			[this] (world *w)
+				{
+					std::lock_guard<std::mutex> guard {this->lock};
+					this->queue.push_back (w);
+				});
+		{
+			std::lock_guard<std::mutex> guard {this->lock};
+			this->st.running = true;
+		}
+		
+		int chunks = 0;
+		unsigned long long bytes = 0;
+		for (;;)
+			{
+				world *w;
+				{
+					std::lock_guard<std::mutex> guard {this->lock};
+					if (this->queue.empty () || !this->_running)
+						break;
+					
+					w = this->queue.front ();
+					this->queue.erase (this->queue.begin ());
+					this->current = w;
+					
+					this->st.world = w->get_name ();
+					this->st.chunks_done = 0;
+					this->st.chunks_total = 0;
+				}
+				
+				try
+					{
+						chunks += w->save_dirty (this->srv.get_thread_pool (), bytes,
+							[this] (int done, int total)
+								{
+									std::lock_guard<std::mutex> guard {this->lock};
+									this->st.chunks_done = done;
+									this->st.chunks_total = total;
+								});
+						w->save_meta ();
+					}
+				catch (const std::exception& ex)
+					{
+						this->srv.get_logger () (LT_ERROR) << "Autosave of world \""
+							<< w->get_name () << "\" failed: " << ex.what () << std::endl;
+					}
+				
+				{
+					std::lock_guard<std::mutex> guard {this->lock};
+					this->current = nullptr;
+				}
+				this->cv.notify_all ();
+			}
+		
+		int ms = std::chrono::duration_cast<std::chrono::milliseconds> (
+			std::chrono::steady_clock::now () - start).count ();
+		{
+			std::lock_guard<std::mutex> guard {this->lock};
+			this->queue.clear ();
+			this->st.running = false;
+			this->st.world.clear ();
+			this->st.chunks_done = 0;
+			this->st.chunks_total = 0;
+			this->st.last_chunks = chunks;
+			this->st.last_bytes = bytes;
+			this->st.last_ms = ms;
+			this->st.last_time = std::time (nullptr);
+		}
+		
+		if (chunks > 0)
+			this->srv.get_logger () () << "Autosaved " << chunks << " chunk(s) ("
+				<< (bytes >> 10) << "KB) in " << ms << "ms." << std::endl;
+	}
+	
+	
+	
+	/* 
+	 * Removes the specified world from the current round, and blocks until
+	 * it is no longer being saved. Must be called with the server's world
+	 * lock held, before the world is destroyed.
+	 */
+	void
+	autosaver::release (world *w)
+	{
+		std::unique_lock<std::mutex> guard {this->lock};
+		this->queue.erase (std::remove (this->queue.begin (), this->queue.end (), w),
+			this->queue.end ());
+		this->cv.wait (guard, [this, w] { return this->current != w; });
+	}
+	
+	/* 
+	 * Returns the progress of the current round and the timing of the
+	 * last one.
+	 */
+	autosaver::status
+	autosaver::get_status ()
+	{
+		std::lock_guard<std::mutex> guard {this->lock};
+		return this->st;
+	}
+}
+
@@ -19,6 +19,10 @@
 #include "chunk.hpp"
 #include "world.hpp"
 #include <cstring>
+#include <algorithm>
+#include <deque>
+#include <vector>
+#include <chrono>
 
 #include <iostream> // DEBUG
 
@@ -26,286 +30,1052 @@
 namespace hCraft {
 	
 	/* 
-	 * Constructs a new empty subchunk, with all blocks set to air.
+	 * Storage that is replaced while other threads may still be reading it
+	 * (palettes that have been grown, light arrays that have become uniform)
+	 * is kept around for a while before being freed.
+	 */
+	struct retired_block
+	{
+		void *ptr;
+		void (*release) (void *);
+		std::chrono::steady_clock::time_point when;
+	};
+	
+	static std::mutex retire_lock;
+	static std::deque<retired_block> retired_blocks;
+	
+	static void
+	retire (void *ptr, void (*release) (void *))
+	{
+		auto now = std::chrono::steady_clock::now ();
+		std::vector<retired_block> expired;
+		
+		{
+			std::lock_guard<std::mutex> guard {retire_lock};
+			retired_blocks.push_back ({ptr, release, now});
+			
+			// blocks are retired in order, so the expired ones are at the front.
+			while (!retired_blocks.empty () &&
+				(now - retired_blocks.front ().when) >= std::chrono::seconds (2))
+				{
+					expired.push_back (retired_blocks.front ());
+					retired_blocks.pop_front ();
+				}
+		}
+		
+		for (retired_block& b : expired)
+			b.release (b.ptr);
+	}
+	
+	static void
+	release_bytes (void *ptr)
+		{ delete[] (unsigned char *)ptr; }
+	
+	static void
+	release_palette (void *ptr)
+		{ block_palette::destroy ((block_palette *)ptr); }
+	
+	
+	
+//----
+	
+	nibble_array::nibble_array (unsigned char fill)
+		: data (nullptr)
+	{
+		this->fill = fill & 0xF;
+	}
+	
+	nibble_array::nibble_array (const nibble_array& other)
+		: data (nullptr)
+	{
+		this->fill = other.fill;
+		
+		const unsigned char *d = other.data.load (std::memory_order_acquire);
+		if (d)
+			{
+				unsigned char *copy = new unsigned char[2048];
+				std::memcpy (copy, d, 2048);
+				this->data.store (copy, std::memory_order_relaxed);
+			}
+	}
+	
+	nibble_array::~nibble_array ()
+	{
+		delete[] this->data.load (std::memory_order_relaxed);
+	}
+	
+	
+	
+	void
+	nibble_array::set (unsigned int index, unsigned char val)
+	{
+		unsigned char *d = this->data.load (std::memory_order_relaxed);
+		bool publish = false;
+		if (!d)
+			{
+				if (val == this->fill)
+					return;
+				
+				d = new unsigned char[2048];
+				std::memset (d, this->fill | (this->fill << 4), 2048);
+				publish = true;
+			}
+		
+		unsigned int half = index >> 1;
+		if (index & 1)
+			{ d[half] &= 0x0F; d[half] |= (val << 4); }
+		else
+			{ d[half] &= 0xF0; d[half] |= (val & 0xF); }
+		
+		if (publish)
+			this->data.store (d, std::memory_order_release);
+	}
+	
+	/* 
+	 * Writes all 4096 values into @{out} (2048 bytes, two values per byte,
+	 * lower nibble first).
+	 */
+	void
+	nibble_array::export_to (unsigned char *out) const
+	{
+		const unsigned char *d = this->data.load (std::memory_order_acquire);
+		if (d)
+			std::memcpy (out, d, 2048);
+		else
+			std::memset (out, this->fill | (this->fill << 4), 2048);
+	}
+	
+	
+	static bool
+	_uniform_nibbles (const unsigned char *in)
+	{
+		unsigned char b = in[0];
+		if ((b >> 4) != (b & 0xF))
+			return false;
+		for (int i = 1; i < 2048; ++i)
+			if (in[i] != b)
+				return false;
+		return true;
+	}
+	
+	/* 
+	 * Replaces the contents of the array with the 2048 bytes pointed to by
+	 * @{in}. Uniform input does not allocate anything. Must not be called
+	 * while other threads may be reading the array.
+	 */
+	void
+	nibble_array::import (const unsigned char *in)
+	{
+		unsigned char *d = this->data.load (std::memory_order_relaxed);
+		if (!d && _uniform_nibbles (in))
+			{
+				this->fill = in[0] & 0xF;
+				return;
+			}
+		
+		if (!d)
+			{
+				d = new unsigned char[2048];
+				this->data.store (d, std::memory_order_relaxed);
+			}
+		std::memcpy (d, in, 2048);
+	}
+	
+	/* 
+	 * Overwrites all 4096 values with the 2048 bytes pointed to by @{in}.
+	 * Unlike import (), this is safe to call while other threads are
+	 * reading the array.
 	 */
-	subchunk::subchunk (bool init)
+	void
+	nibble_array::assign (const unsigned char *in)
 	{
-		if (init)
+		unsigned char *d = this->data.load (std::memory_order_relaxed);
+		if (!d)
 			{
-				std::memset (this->ids, 0x00, 4096);
-				std::memset (this->meta, 0x00, 2048);
-				std::memset (this->blight, 0x00, 2048);
-				std::memset (this->slight, 0xFF, 2048);
-				this->add = nullptr;
-				std::memset (this->extra, 0x00, 4096);
+				unsigned char b = this->fill | (this->fill << 4);
+				if (in[0] == b && _uniform_nibbles (in))
+					return;
+				
+				d = new unsigned char[2048];
+				std::memcpy (d, in, 2048);
+				this->data.store (d, std::memory_order_release);
+				return;
+			}
+		
+		std::memcpy (d, in, 2048);
+	}
+	
+	/* 
+	 * Releases the backing array if all values have become equal.
+	 */
+	void
+	nibble_array::compact ()
+	{
+		unsigned char *d = this->data.load (std::memory_order_relaxed);
+		if (!d || !_uniform_nibbles (d))
+			return;
+		
+		// readers that find no array read the fill value instead.
+		this->fill = d[0] & 0xF;
+		this->data.store (nullptr, std::memory_order_release);
+		retire (d, release_bytes);
+	}
+	
+	
+	
+//----
+	
+	static inline unsigned int
+	_palette_cap (unsigned int bits)
+		{ return bits ? std::min (1U << bits, 4096U) : 1; }
+	
+	static inline unsigned int
+	_palette_words (unsigned int bits)
+		{ return (4096 * bits) / 64; }
+	
+	static inline unsigned long long
+	_palette_bytes (unsigned int bits)
+	{
+		return sizeof (block_palette) + _palette_words (bits) * 8
+			+ _palette_cap (bits) * 2;
+	}
+	
+	/* 
+	 * Allocates a palette (along with its index words, in the same memory
+	 * block) able to hold @{bits}-bit indices, with all indices set to 0.
+	 */
+	block_palette*
+	block_palette::create (unsigned int bits)
+	{
+		unsigned char *mem = new unsigned char[_palette_bytes (bits)];
+		block_palette *pal = reinterpret_cast<block_palette *> (mem);
+		pal->bits = bits;
+		pal->cap = _palette_cap (bits);
+		pal->size = 0;
 		
-				this->add_count = 0;
-				this->air_count = 4096;
+		// the words come first to keep them 8-byte aligned.
+		pal->words = reinterpret_cast<unsigned long long *> (mem + sizeof (block_palette));
+		pal->entries = reinterpret_cast<unsigned short *> (pal->words + _palette_words (bits));
+		std::memset (pal->words, 0, _palette_words (bits) * 8);
+		std::memset (pal->entries, 0, pal->cap * 2);
+		return pal;
+	}
+	
+	void
+	block_palette::destroy (block_palette *pal)
+	{
+		delete[] reinterpret_cast<unsigned char *> (pal);
+	}
+	
+	/* 
+	 * Returns the smallest supported index width that can address @{count}
+	 * distinct palette entries.
+	 */
+	unsigned int
+	block_palette::bits_for (unsigned int count)
+	{
+		if (count <= 1) return 0;
+		if (count <= 2) return 1;
+		if (count <= 4) return 2;
+		if (count <= 16) return 4;
+		if (count <= 256) return 8;
+		return 16;
+	}
+	
+	
+	
+	/* 
+	 * Sets the @{len} indices starting at @{start} to @{val}, a whole 64-bit
+	 * word at a time.
+	 */
+	void
+	block_palette::fill_run (unsigned int start, unsigned int len, unsigned int val)
+	{
+		if (this->bits == 0)
+			return;
+		
+		// @{val} repeated in every lane of a word.
+		unsigned long long pattern = val * (~0ULL / ((1ULL << this->bits) - 1));
+		
+		unsigned int pos = start * this->bits, end = (start + len) * this->bits;
+		while (pos < end)
+			{
+				unsigned int off = pos & 63;
+				unsigned int n = std::min (64 - off, end - pos);
+				unsigned long long mask = (n == 64) ? ~0ULL : (((1ULL << n) - 1) << off);
 				
-				for (int i = 0; i < 128; ++i)
-					this->custom[i] = 0;
+				unsigned long long& w = this->words[pos >> 6];
+				w = (w & ~mask) | (pattern & mask);
+				pos += n;
 			}
 	}
 	
+	/* 
+	 * Returns the number of indices equal to @{val} among the @{len} indices
+	 * starting at @{start}.
+	 */
+	unsigned int
+	block_palette::count_run (unsigned int start, unsigned int len,
+		unsigned int val) const
+	{
+		if (this->bits == 0)
+			return (val == 0) ? len : 0;
+		
+		unsigned int bits = this->bits;
+		unsigned long long lanes = ~0ULL / ((1ULL << bits) - 1); // lowest bit of every lane
+		unsigned long long pattern = val * lanes;
+		
+		unsigned int count = 0;
+		unsigned int pos = start * bits, end = (start + len) * bits;
+		while (pos < end)
+			{
+				unsigned int off = pos & 63;
+				unsigned int n = std::min (64 - off, end - pos);
+				unsigned long long mask = (n == 64) ? ~0ULL : (((1ULL << n) - 1) << off);
+				
+				// lanes that hold @{val} become zero; fold every lane onto its lowest
+				// bit and count the ones that are left.
+				unsigned long long x = this->words[pos >> 6] ^ pattern;
+				for (unsigned int s = 1; s < bits; s <<= 1)
+					x |= x >> s;
+				count += (n / bits) - __builtin_popcountll (x & lanes & mask);
+				pos += n;
+			}
+		
+		return count;
+	}
+	
+	
+	/* 
+	 * Translates every index into a byte through @{table} (which must have
+	 * @{cap} entries), and writes the 4096 results into @{out}.
+	 */
+	void
+	block_palette::expand_bytes (const unsigned char *table, unsigned char *out) const
+	{
+		if (this->bits == 0)
+			{
+				std::memset (out, table[0], 4096);
+				return;
+			}
+		
+		unsigned int bits = this->bits;
+		unsigned int per_word = 64 / bits;
+		unsigned long long mask = (1ULL << bits) - 1;
+		unsigned int words = _palette_words (bits);
+		for (unsigned int w = 0; w < words; ++w)
+			{
+				unsigned long long word = this->words[w];
+				for (unsigned int k = 0; k < per_word; ++k)
+					{
+						*out++ = table[word & mask];
+						word >>= bits;
+					}
+			}
+	}
+	
+	/* 
+	 * Same as expand_bytes (), but packs the results into 2048 bytes, two
+	 * four-bit values per byte.
+	 */
+	void
+	block_palette::expand_nibbles (const unsigned char *table, unsigned char *out) const
+	{
+		if (this->bits == 0)
+			{
+				std::memset (out, (table[0] & 0xF) | (table[0] << 4), 2048);
+				return;
+			}
+		
+		unsigned int bits = this->bits;
+		unsigned int per_word = 64 / bits;
+		unsigned long long mask = (1ULL << bits) - 1;
+		unsigned int words = _palette_words (bits);
+		for (unsigned int w = 0; w < words; ++w)
+			{
+				unsigned long long word = this->words[w];
+				for (unsigned int k = 0; k < per_word; k += 2)
+					{
+						unsigned char lo = table[word & mask];
+						word >>= bits;
+						unsigned char hi = table[word & mask];
+						word >>= bits;
+						*out++ = (lo & 0xF) | (hi << 4);
+					}
+			}
+	}
+	
+	
+	
+//----
+	
+	/* 
+	 * Constructs a new empty subchunk, with all blocks set to air.
+	 */
+	subchunk::subchunk ()
+		: blocks (block_palette::create (0)), blight (0), slight (15),
+			extra (nullptr)
+	{
+		this->blocks.load (std::memory_order_relaxed)->size = 1; // air
+		this->add_count = 0;
+		this->air_count = 4096;
+		this->last_index = 0;
+	}
+	
+	/* 
+	 * Constructs a deep copy of the specified subchunk.
+	 */
+	subchunk::subchunk (const subchunk& other)
+		: blight (other.blight), slight (other.slight), extra (nullptr)
+	{
+		const block_palette *pal = other.blocks.load (std::memory_order_acquire);
+		block_palette *copy = block_palette::create (pal->bits);
+		copy->size = pal->size;
+		std::memcpy (copy->entries, pal->entries, pal->cap * 2);
+		std::memcpy (copy->words, pal->words, _palette_words (pal->bits) * 8);
+		this->blocks.store (copy, std::memory_order_relaxed);
+		
+		const unsigned char *ex = other.extra.load (std::memory_order_acquire);
+		if (ex)
+			{
+				unsigned char *ex_copy = new unsigned char[4096];
+				std::memcpy (ex_copy, ex, 4096);
+				this->extra.store (ex_copy, std::memory_order_relaxed);
+			}
+		
+		this->add_count = other.add_count;
+		this->air_count = other.air_count;
+		this->last_index = 0;
+	}
+	
 	/* 
 	 * Class destructor.
 	 */
 	subchunk::~subchunk ()
 	{
-		if (this->add)
-			delete[] this->add;
+		block_palette::destroy (this->blocks.load (std::memory_order_relaxed));
+		delete[] this->extra.load (std::memory_order_relaxed);
 	}
 	
 	
 	
 //----
 	
-	void
-	subchunk::set_id (int x, int y, int z, unsigned short id)
+	/* 
+	 * Returns the palette index of the specified (id << 4) | meta value,
+	 * adding it to the palette first if necessary. Entries no longer
+	 * referenced by any block (other than the one at @{replacing}, which is
+	 * about to be overwritten, if less than 4096) are reused before the index
+	 * width is grown.
+	 */
+	unsigned int
+	subchunk::palette_index (unsigned short val, unsigned int replacing)
 	{
-		unsigned int index = (y << 8) | (z << 4) | x; 
-		unsigned int half = index >> 1;
+		block_palette *pal = this->blocks.load (std::memory_order_relaxed);
+		if (this->last_index < pal->size && pal->entries[this->last_index] == val)
+			return this->last_index;
 		
-		unsigned short lo = id & 0xFF; // the lower 8 bits of the ID.
-		unsigned short hi = id >> 8;   // the upper 4 bits of the ID (the "add").
-		unsigned short prev_lo = this->ids[index];
-		unsigned short prev_hi =
-			(this->add_count > 0)
-				? ((index & 1) ? (this->add[half] >> 4) : (this->add[half] & 0xF))
-				: 0;
-		unsigned short prev_id = (prev_hi << 8) | prev_lo;
+		for (unsigned int i = 0; i < pal->size; ++i)
+			if (pal->entries[i] == val)
+				return (this->last_index = i);
 		
-		this->ids[index] = lo;
-		if (hi != 0 && this->add_count == 0)
+		if (pal->size < pal->cap)
 			{
-				this->add = new unsigned char[2048];
-				std::memset (this->add, 0x00, 2048);
+				pal->entries[pal->size] = val;
+				return (this->last_index = pal->size++);
 			}
 		
-		if (this->add)
+		if (pal->bits > 0)
 			{
-				if (index & 1)
-					{ this->add[half] &= 0x0F; this->add[half] |= (hi << 4); }
-				else
-					{ this->add[half] &= 0xF0; this->add[half] |= hi; }
+				// the palette is full, but some entries might not be in use anymore.
+				unsigned short refs[4096];
+				std::memset (refs, 0, pal->cap * 2);
+				for (unsigned int i = 0; i < 4096; ++i)
+					++ refs[pal->index_at (i)];
+				if (replacing < 4096)
+					-- refs[pal->index_at (replacing)];
+				for (unsigned int i = 0; i < pal->size; ++i)
+					if (refs[i] == 0)
+						{
+							pal->entries[i] = val;
+							return (this->last_index = i);
+						}
 			}
 		
+		// widen the indices.
+		block_palette *np = block_palette::create (pal->bits ? (pal->bits * 2) : 1);
+		std::memcpy (np->entries, pal->entries, pal->size * 2);
+		np->size = pal->size;
+		if (pal->bits > 0)
+			for (unsigned int i = 0; i < 4096; ++i)
+				np->put (i, pal->index_at (i));
+		np->entries[np->size] = val;
+		this->last_index = np->size++;
+		
+		this->blocks.store (np, std::memory_order_release);
+		retire (pal, release_palette);
+		return this->last_index;
+	}
+	
+	/* 
+	 * Stores the given (id << 4) | meta value at @{index} and updates the
+	 * air/add counters.
+	 */
+	void
+	subchunk::put_value (unsigned int index, unsigned short val)
+	{
+		block_palette *pal = this->blocks.load (std::memory_order_relaxed);
+		unsigned short prev = pal->get (index);
+		if (prev == val)
+			return;
+		
+		unsigned int pi = this->palette_index (val, index);
+		pal = this->blocks.load (std::memory_order_relaxed); // might have grown
+		pal->put (index, pi);
+		
+		unsigned short prev_id = prev >> 4, id = val >> 4;
 		if (prev_id && !id)
 			++ this->air_count;
 		else if (!prev_id && id)
 			-- this->air_count;
 		
-		if (prev_hi && !hi)
+		if ((prev_id >> 8) && !(id >> 8))
 			-- this->add_count;
-		else if (!prev_hi && hi)
+		else if (!(prev_id >> 8) && (id >> 8))
 			++ this->add_count;
+	}
+	
+	
+	
+	void
+	subchunk::set_id (int x, int y, int z, unsigned short id)
+	{
+		unsigned int index = (y << 8) | (z << 4) | x;
+		unsigned short prev = this->blocks.load (std::memory_order_relaxed)->get (index);
 		
-		// custom block stuff
-		if (block_info::is_vanilla_id (id))
-			{
-				this->custom[index >> 5] &= ~(1 << (index & 0x1F));
-			}
-		else
-			{
-				this->custom[index >> 5] |=  (1 << (index & 0x1F));
-			}
-		
-		this->extra[index] = 0; // TODO: modify?
+		this->put_value (index, (id << 4) | (prev & 0xF));
+		this->set_extra (x, y, z, 0); // TODO: modify?
 	}
 	
 	unsigned short
 	subchunk::get_id (int x, int y, int z)
 	{
 		unsigned int index = (y << 8) | (z << 4) | x;
-		
-		unsigned short id = this->ids[index];
-		if (this->add_count > 0)
-			{
-				unsigned int half = index >> 1;
-				id |=
-					((index & 1) ? (this->add[half] >> 4) : (this->add[half] & 0xF))
-					<< 8;
-			}
-		
-		return id;
+		return this->blocks.load (std::memory_order_acquire)->get (index) >> 4;
 	}
 	
 	
 	void
 	subchunk::set_extra (int x, int y, int z, unsigned char e)
 	{
-		this->extra[(y << 8) | (z << 4) | x] = e;
+		unsigned int index = (y << 8) | (z << 4) | x;
+		unsigned char *ex = this->extra.load (std::memory_order_relaxed);
+		if (!ex)
+			{
+				if (e == 0)
+					return;
+				
+				ex = new unsigned char[4096];
+				std::memset (ex, 0, 4096);
+				ex[index] = e;
+				this->extra.store (ex, std::memory_order_release);
+				return;
+			}
+		
+		ex[index] = e;
 	}
 	
 	unsigned char
 	subchunk::get_extra (int x, int y, int z)
 	{
-		return this->extra[(y << 8) | (z << 4) | x];
+		const unsigned char *ex = this->extra.load (std::memory_order_acquire);
+		return ex ? ex[(y << 8) | (z << 4) | x] : 0;
 	}
 	
 	
 	void
 	subchunk::set_meta (int x, int y, int z, unsigned char val)
 	{
-		unsigned int index = (y << 8) | (z << 4) | x; 
-		unsigned int half = index >> 1;
+		unsigned int index = (y << 8) | (z << 4) | x;
+		unsigned short prev = this->blocks.load (std::memory_order_relaxed)->get (index);
 		
-		if (index & 1)
-			{ this->meta[half] &= 0x0F; this->meta[half] |= (val << 4); }
-		else
-			{ this->meta[half] &= 0xF0; this->meta[half] |= val; }
+		this->put_value (index, (prev & 0xFFF0) | (val & 0xF));
 	}
 	
 	unsigned char
 	subchunk::get_meta (int x, int y, int z)
 	{
-		unsigned int index = (y << 8) | (z << 4) | x; 
-		unsigned int half = index >> 1;
-		
-		return (index & 1)
-			? (this->meta[half] >> 4)
-			: (this->meta[half] & 0xF);
+		unsigned int index = (y << 8) | (z << 4) | x;
+		return this->blocks.load (std::memory_order_acquire)->get (index) & 0xF;
 	}
 	
 	
 	void
 	subchunk::set_block_light (int x, int y, int z, unsigned char val)
 	{
-		unsigned int index = (y << 8) | (z << 4) | x; 
-		unsigned int half = index >> 1;
-		
-		if (index & 1)
-			{ this->blight[half] &= 0x0F; this->blight[half] |= (val << 4); }
-		else
-			{ this->blight[half] &= 0xF0; this->blight[half] |= val; }
+		this->blight.set ((y << 8) | (z << 4) | x, val);
 	}
 	
 	unsigned char
 	subchunk::get_block_light (int x, int y, int z)
 	{
-		unsigned int index = (y << 8) | (z << 4) | x; 
-		unsigned int half = index >> 1;
-		
-		return (index & 1)
-			? (this->blight[half] >> 4)
-			: (this->blight[half] & 0xF);
+		return this->blight.get ((y << 8) | (z << 4) | x);
 	}
 	
 	
 	void
 	subchunk::set_sky_light (int x, int y, int z, unsigned char val)
 	{
-		unsigned int index = (y << 8) | (z << 4) | x; 
-		unsigned int half = index >> 1;
-		
-		if (index & 1)
-			{ this->slight[half] &= 0x0F; this->slight[half] |= (val << 4); }
-		else
-			{ this->slight[half] &= 0xF0; this->slight[half] |= val; }
+		this->slight.set ((y << 8) | (z << 4) | x, val);
 	}
 	
 	unsigned char
 	subchunk::get_sky_light (int x, int y, int z)
 	{
-		unsigned int index = (y << 8) | (z << 4) | x; 
-		unsigned int half = index >> 1;
-		
-		return (index & 1)
-			? (this->slight[half] >> 4)
-			: (this->slight[half] & 0xF);
+		return this->slight.get ((y << 8) | (z << 4) | x);
 	}
 	
 	
 	void
 	subchunk::set_block (int x, int y, int z, unsigned short id, unsigned char meta, unsigned char ex)
 	{
-		unsigned int index = (y << 8) | (z << 4) | x; 
-		unsigned int half = index >> 1;
+		unsigned int index = (y << 8) | (z << 4) | x;
 		
-		if (index & 1)
-			{ this->meta[half] &= 0x0F; this->meta[half] |= (meta << 4); }
+		this->put_value (index, (id << 4) | (meta & 0xF));
+		this->set_extra (x, y, z, ex);
+	}
+	
+	
+	block_data
+	subchunk::get_block (int x, int y, int z)
+	{
+		block_data data {};
+		unsigned int index = (y << 8) | (z << 4) | x;
+		
+		unsigned short val = this->blocks.load (std::memory_order_acquire)->get (index);
+		data.id = val >> 4;
+		data.meta = val & 0xF;
+		data.bl = this->blight.get (index);
+		data.sl = this->slight.get (index);
+		
+		const unsigned char *ex = this->extra.load (std::memory_order_acquire);
+		data.ex = ex ? ex[index] : 0;
+		
+		return data;
+	}
+	
+	
+	
+//----
+	
+	/* 
+	 * Sets every block in the box to the specified block.
+	 */
+	void
+	subchunk::fill (int x1, int y1, int z1, int x2, int y2, int z2,
+		unsigned short id, unsigned char meta, unsigned char ex)
+	{
+		unsigned short val = (id << 4) | (meta & 0xF);
+		int volume = (x2 - x1 + 1) * (y2 - y1 + 1) * (z2 - z1 + 1);
+		
+		block_palette *pal = this->blocks.load (std::memory_order_relaxed);
+		if (volume == 4096)
+			{
+				// the old palette is simply replaced with a single-entry one.
+				block_palette *np = block_palette::create (0);
+				np->entries[0] = val;
+				np->size = 1;
+				this->last_index = 0;
+				this->blocks.store (np, std::memory_order_release);
+				retire (pal, release_palette);
+				
+				this->air_count = (id == 0) ? 4096 : 0;
+				this->add_count = (id >> 8) ? 4096 : 0;
+			}
 		else
-			{ this->meta[half] &= 0xF0; this->meta[half] |= meta; }
-		
-		unsigned short lo = id & 0xFF; // the lower 8 bits of the ID.
-		unsigned short hi = id >> 8;   // the upper 4 bits of the ID (the "add").
-		unsigned short prev_lo = this->ids[index];
-		unsigned short prev_hi =
-			(this->add_count > 0)
-				? ((index & 1) ? (this->add[half] >> 4) : (this->add[half] & 0xF))
-				: 0;
-		unsigned short prev_id = (prev_hi << 8) | prev_lo;
-
-		this->ids[index] = lo;
-		if (hi != 0 && this->add_count == 0)
 			{
-				this->add = new unsigned char[2048];
-				std::memset (this->add, 0x00, 2048);
+				// tally the air/add blocks that are about to be overwritten.
+				int prev_air = 0, prev_add = 0;
+				for (unsigned int i = 0; i < pal->size; ++i)
+					{
+						unsigned short prev_id = pal->entries[i] >> 4;
+						if (prev_id != 0 && !(prev_id >> 8))
+							continue;
+						
+						int n = 0;
+						for_each_run (x1, y1, z1, x2, y2, z2,
+							[&] (unsigned int start, unsigned int len)
+								{ n += pal->count_run (start, len, i); });
+						if (prev_id == 0)
+							prev_air += n;
+						else
+							prev_add += n;
+					}
+				
+				unsigned int pi = this->palette_index (val, (y1 << 8) | (z1 << 4) | x1);
+				pal = this->blocks.load (std::memory_order_relaxed); // might have grown
+				for_each_run (x1, y1, z1, x2, y2, z2,
+					[pal, pi] (unsigned int start, unsigned int len)
+						{ pal->fill_run (start, len, pi); });
+				
+				this->air_count += ((id == 0) ? volume : 0) - prev_air;
+				this->add_count += ((id >> 8) ? volume : 0) - prev_add;
 			}
 		
-		if (add)
+		unsigned char *exs = this->extra.load (std::memory_order_relaxed);
+		if (!exs)
 			{
-				if (index & 1)
-					{ this->add[half] &= 0x0F; this->add[half] |= (hi << 4); }
-				else
-					{ this->add[half] &= 0xF0; this->add[half] |= hi; }
+				if (ex == 0)
+					return;
+				
+				exs = new unsigned char[4096];
+				std::memset (exs, 0, 4096);
+				for_each_run (x1, y1, z1, x2, y2, z2,
+					[exs, ex] (unsigned int start, unsigned int len)
+						{ std::memset (exs + start, ex, len); });
+				this->extra.store (exs, std::memory_order_release);
 			}
-
-		if (prev_id && !id)
-			++ this->air_count;
-		else if (!prev_id && id)
-			-- this->air_count;
-
-		if (prev_hi && !hi)
-			-- this->add_count;
-		else if (!prev_hi && hi)
-			++ this->add_count;
+		else
+			for_each_run (x1, y1, z1, x2, y2, z2,
+				[exs, ex] (unsigned int start, unsigned int len)
+					{ std::memset (exs + start, ex, len); });
+	}
+	
+	/* 
+	 * Changes every block in the box whose ID is @{from_id} (and whose
+	 * metadata value is @{from_meta}, unless it is -1) into the specified
+	 * block. Returns the number of blocks changed.
+	 */
+	int
+	subchunk::replace (int x1, int y1, int z1, int x2, int y2, int z2,
+		unsigned short from_id, int from_meta, unsigned short id,
+		unsigned char meta)
+	{
+		unsigned short val = (id << 4) | (meta & 0xF);
+		if (this->count (x1, y1, z1, x2, y2, z2, from_id, from_meta) == 0)
+			return 0;
 		
-		// custom block stuff
-		if (block_info::is_vanilla_id (id))
+		unsigned int pi = this->palette_index (val, 4096);
+		block_palette *pal = this->blocks.load (std::memory_order_relaxed);
+		
+		bool match[4096];
+		for (unsigned int i = 0; i < pal->cap; ++i)
 			{
-				this->custom[index >> 5] &= ~(1 << (index & 0x1F));
+				unsigned short e = pal->entries[i];
+				match[i] = (i < pal->size) && (i != pi) && ((e >> 4) == from_id)
+					&& (from_meta == -1 || (e & 0xF) == from_meta);
 			}
-		else
+		
+		int changed = 0;
+		for_each_run (x1, y1, z1, x2, y2, z2,
+			[&] (unsigned int start, unsigned int len)
+				{
+					for (unsigned int i = start; i < start + len; ++i)
+						if (match[pal->index_at (i)])
+							{
+								pal->put (i, pi);
+								++ changed;
+							}
+				});
+		
+		if (from_id == 0 && id != 0)
+			this->air_count -= changed;
+		else if (from_id != 0 && id == 0)
+			this->air_count += changed;
+		if ((from_id >> 8) && !(id >> 8))
+			this->add_count -= changed;
+		else if (!(from_id >> 8) && (id >> 8))
+			this->add_count += changed;
+		
+		return changed;
+	}
+	
+	/* 
+	 * Copies the box from @{src} (which must be a different subchunk) into
+	 * this one, with every block moved by (@{dx}, @{dy}, @{dz}). The moved
+	 * box must lie within the subchunk. Lighting is not copied.
+	 */
+	void
+	subchunk::copy (const subchunk& src, int x1, int y1, int z1, int x2, int y2,
+		int z2, int dx, int dy, int dz)
+	{
+		const block_palette *spal = src.blocks.load (std::memory_order_acquire);
+		const unsigned char *sex = src.extra.load (std::memory_order_acquire);
+		
+		// source palette entries are looked up in this subchunk's palette only
+		// once each.
+		int remap[4096];
+		std::fill (remap, remap + spal->cap, -1);
+		
+		int shift = dy * 256 + dz * 16 + dx;
+		for_each_run (x1, y1, z1, x2, y2, z2,
+			[&] (unsigned int start, unsigned int len)
+				{
+					for (unsigned int i = start; i < start + len; ++i)
+						{
+							unsigned int si = spal->index_at (i);
+							unsigned int di = i + shift;
+							
+							block_palette *pal = this->blocks.load (std::memory_order_relaxed);
+							unsigned short prev = pal->get (di);
+							unsigned short val = spal->entries[si];
+							if (prev != val)
+								{
+									if (remap[si] == -1 || pal->entries[remap[si]] != val)
+										{
+											remap[si] = this->palette_index (val, di);
+											pal = this->blocks.load (std::memory_order_relaxed);
+										}
+									pal->put (di, remap[si]);
+									
+									unsigned short prev_id = prev >> 4, id = val >> 4;
+									if (prev_id && !id)
+										++ this->air_count;
+									else if (!prev_id && id)
+										-- this->air_count;
+									if ((prev_id >> 8) && !(id >> 8))
+										-- this->add_count;
+									else if (!(prev_id >> 8) && (id >> 8))
+										++ this->add_count;
+								}
+							
+							if (sex || this->extra.load (std::memory_order_relaxed))
+								this->set_extra (di & 0xF, di >> 8, (di >> 4) & 0xF,
+									sex ? sex[i] : 0);
+						}
+				});
+	}
+	
+	/* 
+	 * Returns the number of blocks in the box whose ID is @{id} (and whose
+	 * metadata value is @{meta}, unless it is -1).
+	 */
+	int
+	subchunk::count (int x1, int y1, int z1, int x2, int y2, int z2,
+		unsigned short id, int meta) const
+	{
+		const block_palette *pal = this->blocks.load (std::memory_order_acquire);
+		
+		int n = 0;
+		for (unsigned int i = 0; i < pal->size; ++i)
 			{
-				this->custom[index >> 5] |=  (1 << (index & 0x1F));
+				unsigned short e = pal->entries[i];
+				if ((e >> 4) != id || (meta != -1 && (e & 0xF) != meta))
+					continue;
+				
+				for_each_run (x1, y1, z1, x2, y2, z2,
+					[&] (unsigned int start, unsigned int len)
+						{ n += pal->count_run (start, len, i); });
 			}
 		
-		this->extra[index] = ex;
+		return n;
 	}
 	
 	
-	block_data
-	subchunk::get_block (int x, int y, int z)
+	
+	void
+	subchunk::export_ids (unsigned char *out) const
 	{
-		block_data data {};
-		unsigned int index = (y << 8) | (z << 4) | x;
-		unsigned int half = index >> 1;
+		this->export_ids (out, [] (unsigned short id) { return id; });
+	}
+	
+	void
+	subchunk::export_add (unsigned char *out) const
+	{
+		const block_palette *pal = this->blocks.load (std::memory_order_acquire);
+		unsigned char table[4096];
+		for (unsigned int i = 0; i < pal->cap; ++i)
+			table[i] = pal->entries[i] >> 12;
+		pal->expand_nibbles (table, out);
+	}
+	
+	void
+	subchunk::export_meta (unsigned char *out) const
+	{
+		const block_palette *pal = this->blocks.load (std::memory_order_acquire);
+		unsigned char table[4096];
+		for (unsigned int i = 0; i < pal->cap; ++i)
+			table[i] = pal->entries[i] & 0xF;
+		pal->expand_nibbles (table, out);
+	}
+	
+	void
+	subchunk::export_extra (unsigned char *out) const
+	{
+		const unsigned char *ex = this->extra.load (std::memory_order_acquire);
+		if (ex)
+			std::memcpy (out, ex, 4096);
+		else
+			std::memset (out, 0, 4096);
+	}
+	
+	
+	/* 
+	 * Replaces the subchunk's contents with the given flat arrays. @{add}
+	 * and @{extra} may be null. Must be called before the subchunk is made
+	 * visible to other threads.
+	 */
+	void
+	subchunk::import (const unsigned char *ids, const unsigned char *add,
+		const unsigned char *meta, const unsigned char *blight,
+		const unsigned char *slight, const unsigned char *extra)
+	{
+		// gather the distinct values into a 65536-bit set. since the palette is
+		// built in ascending order, a value's index is its rank within the set.
+		unsigned short vals[4096];
+		unsigned long long present[1024];
+		std::memset (present, 0, sizeof present);
+		
+		int air = 0, adds = 0;
+		for (unsigned int i = 0; i < 4096; ++i)
+			{
+				unsigned int half = i >> 1;
+				unsigned short id = ids[i];
+				if (add)
+					id |= ((i & 1) ? (add[half] >> 4) : (add[half] & 0xF)) << 8;
+				unsigned short m = (i & 1) ? (meta[half] >> 4) : (meta[half] & 0xF);
+				
+				unsigned short v = (id << 4) | m;
+				vals[i] = v;
+				present[v >> 6] |= 1ULL << (v & 63);
+				
+				if (id == 0)
+					++ air;
+				if (id >> 8)
+					++ adds;
+			}
 		
-		data.id = this->ids[index];
-		if (this->add_count > 0)
+		unsigned short rank[1024];
+		unsigned int count = 0;
+		for (int w = 0; w < 1024; ++w)
 			{
-				data.id |=
-					((index & 1) ? (this->add[half] >> 4) : (this->add[half] & 0xF))
-					<< 8;
+				rank[w] = count;
+				count += __builtin_popcountll (present[w]);
 			}
 		
-		data.ex = this->extra[index];
+		block_palette *pal = block_palette::create (block_palette::bits_for (count));
+		for (int w = 0; w < 1024; ++w)
+			for (unsigned long long word = present[w]; word; word &= word - 1)
+				pal->entries[pal->size++] = (w << 6) | __builtin_ctzll (word);
 		
-		if (index & 1)
+		if (pal->bits > 0)
+			for (unsigned int i = 0; i < 4096; ++i)
+				{
+					unsigned short v = vals[i];
+					pal->put (i, rank[v >> 6] + __builtin_popcountll (
+						present[v >> 6] & ((1ULL << (v & 63)) - 1)));
+				}
+		
+		block_palette *old = this->blocks.exchange (pal);
+		retire (old, release_palette);
+		this->air_count = air;
+		this->add_count = adds;
+		this->last_index = 0;
+		
+		this->blight.import (blight);
+		this->slight.import (slight);
+		
+		if (extra)
 			{
-				data.meta = this->meta[half] >> 4;
-				data.bl = this->blight[half] >> 4;
-				data.sl = this->slight[half] >> 4;
+				bool zero = true;
+				for (int i = 0; i < 4096 && zero; ++i)
+					zero = (extra[i] == 0);
+				
+				unsigned char *ex = this->extra.load (std::memory_order_relaxed);
+				if (!zero && !ex)
+					{
+						ex = new unsigned char[4096];
+						this->extra.store (ex, std::memory_order_relaxed);
+					}
+				if (ex)
+					std::memcpy (ex, extra, 4096);
 			}
-		else
+	}
+	
+	/* 
+	 * Overwrites the subchunk's block and sky light values with the given
+	 * flat arrays (2048 bytes each).
+	 */
+	void
+	subchunk::assign_light (const unsigned char *blight, const unsigned char *slight)
+	{
+		this->blight.assign (blight);
+		this->slight.assign (slight);
+	}
+	
+	/* 
+	 * Drops unused palette entries (narrowing the indices if possible) and
+	 * releases light/extra arrays that have become uniform.
+	 */
+	void
+	subchunk::compact ()
+	{
+		block_palette *pal = this->blocks.load (std::memory_order_relaxed);
+		if (pal->bits > 0)
 			{
-				data.meta = this->meta[half] & 0xF;
-				data.bl = this->blight[half] & 0xF;
-				data.sl = this->slight[half] & 0xF;
+				unsigned short refs[4096];
+				std::memset (refs, 0, pal->cap * 2);
+				for (unsigned int i = 0; i < 4096; ++i)
+					++ refs[pal->index_at (i)];
+				
+				unsigned int used = 0;
+				for (unsigned int i = 0; i < pal->size; ++i)
+					if (refs[i])
+						++ used;
+				
+				unsigned int bits = block_palette::bits_for (used);
+				if (bits < pal->bits)
+					{
+						block_palette *np = block_palette::create (bits);
+						unsigned short remap[4096];
+						for (unsigned int i = 0; i < pal->size; ++i)
+							if (refs[i])
+								{
+									remap[i] = np->size;
+									np->entries[np->size++] = pal->entries[i];
+								}
+						if (bits > 0)
+							for (unsigned int i = 0; i < 4096; ++i)
+								np->put (i, remap[pal->index_at (i)]);
+						
+						this->last_index = 0;
+						this->blocks.store (np, std::memory_order_release);
+						retire (pal, release_palette);
+					}
 			}
 		
-		return data;
+		this->blight.compact ();
+		this->slight.compact ();
+		
+		unsigned char *ex = this->extra.load (std::memory_order_relaxed);
+		if (ex)
+			{
+				for (int i = 0; i < 4096; ++i)
+					if (ex[i] != 0)
+						return;
+				
+				this->extra.store (nullptr, std::memory_order_release);
+				retire (ex, release_bytes);
+			}
+	}
+	
+	/* 
+	 * Returns the number of bytes held by the subchunk, including storage
+	 * allocated on demand.
+	 */
+	unsigned long long
+	subchunk::resident_size () const
+	{
+		unsigned long long size = sizeof (subchunk);
+		size += _palette_bytes (this->blocks.load (std::memory_order_relaxed)->bits);
+		if (this->blight.allocated ())
+			size += 2048;
+		if (this->slight.allocated ())
+			size += 2048;
+		if (this->extra.load (std::memory_order_relaxed))
+			size += 4096;
+		
+		return size;
 	}
 	
 	
@@ -329,7 +1099,15 @@ namespace hCraft {
 		this->modified = true;
 		this->generated = false;
 		
+		// every chunk gets a range of 2^32 versions of its own, so that cached
+		// data built from a destroyed chunk can never be mistaken for data built
+		// from the chunk that replaced it.
+		static std::atomic<unsigned long long> next_epoch {1};
+		this->version = next_epoch.fetch_add (1, std::memory_order_relaxed) << 32;
+		
 		this->north = this->south = this->east = this->west = nullptr;
+		this->last_access = 0;
+		this->saved_version = 0;
 	}
 	
 	/* 
@@ -351,12 +1129,85 @@ namespace hCraft {
 	 * the given vertical position.
 	 */
 	subchunk*
-	chunk::create_sub (int index, bool init)
+	chunk::create_sub (int index)
 	{
 		subchunk *sub = this->get_sub (index);
 		if (sub) return sub;
 		
-		return (this->subs[index] = new subchunk (init));
+		return (this->subs[index] = new subchunk ());
+	}
+	
+	/* 
+	 * Overwrites the block and sky light values of the sub-chunk at the
+	 * given vertical position (creating it if necessary).
+	 */
+	void
+	chunk::assign_light (int index, const unsigned char *blight,
+		const unsigned char *slight)
+	{
+		this->create_sub (index)->assign_light (blight, slight);
+		this->modified = true;
+		this->touch ();
+	}
+	
+	/* 
+	 * Returns an estimate of the amount of memory (in bytes) held by the chunk
+	 * and its sub-chunks.
+	 */
+	unsigned long long
+	chunk::resident_size ()
+	{
+		unsigned long long size = sizeof (chunk);
+		for (int i = 0; i < 16; ++i)
+			{
+				subchunk *sub = this->subs[i];
+				if (sub)
+					size += sub->resident_size ();
+			}
+		
+		return size;
+	}
+	
+	/* 
+	 * Shrinks the storage of every sub-chunk to fit its current contents
+	 * (see subchunk::compact ()).
+	 */
+	void
+	chunk::compact ()
+	{
+		for (int i = 0; i < 16; ++i)
+			{
+				subchunk *sub = this->subs[i];
+				if (sub)
+					sub->compact ();
+			}
+	}
+	
+	/* 
+	 * Returns a copy of the chunk's block data, biomes and heightmap, to be
+	 * saved in the background, and stores the version it was copied at in
+	 * @{ver}. The chunk stays dirty until mark_saved () is called with it,
+	 * once the copy has actually been written out.
+	 */
+	chunk*
+	chunk::snapshot (unsigned long long& ver)
+	{
+		// read the version before anything is copied: a change that races with
+		// the copy bumps the version past it.
+		ver = this->get_version ();
+		
+		chunk *copy = new chunk ();
+		for (int i = 0; i < 16; ++i)
+			{
+				subchunk *sub = this->subs[i];
+				if (sub)
+					copy->subs[i] = new subchunk (*sub);
+			}
+		
+		std::memcpy (copy->biomes, this->biomes, sizeof this->biomes);
+		std::memcpy (copy->heightmap, this->heightmap, sizeof this->heightmap);
+		copy->generated = this->generated;
+		return copy;
 	}
 	
 	
@@ -378,6 +1229,7 @@ namespace hCraft {
 		
 		this->modified = true;
 		sub->set_id (x, y & 0xF, z, id);
+		this->touch ();
 	}
 	
 	unsigned short
@@ -437,6 +1289,7 @@ namespace hCraft {
 		//if (sub->get_meta (x, y & 0xF, z) != val)
 			this->modified = true;
 		sub->set_meta (x, y & 0xF, z, val);
+		this->touch ();
 	}
 	
 	unsigned char
@@ -467,6 +1320,7 @@ namespace hCraft {
 		//if (sub->get_block_light (x, y & 0xF, z) != val)
 			this->modified = true;
 		sub->set_block_light (x, y & 0xF, z, val);
+		this->touch ();
 	}
 	
 	unsigned char
@@ -497,6 +1351,7 @@ namespace hCraft {
 		//if (sub->get_sky_light (x, y & 0xF, z) != val)
 			this->modified = true;
 		sub->set_sky_light (x, y & 0xF, z, val);
+		this->touch ();
 	}
 	
 	unsigned char
@@ -526,6 +1381,7 @@ namespace hCraft {
 		
 		this->modified = true;
 		sub->set_block (x, y & 0xF, z, id, meta, ex);
+		this->touch ();
 	}
 	
 	
@@ -542,6 +1398,88 @@ namespace hCraft {
 		return sub->get_block (x, y & 0xF, z);
 	}
 	
+	
+	/* 
+	 * Bulk operations on the box that spans from (@{x1}, @{y1}, @{z1}) to
+	 * (@{x2}, @{y2}, @{z2}), inclusive, in chunk coordinates. See the
+	 * subchunk methods of the same names.
+	 */
+	
+	void
+	chunk::fill (int x1, int y1, int z1, int x2, int y2, int z2,
+		unsigned short id, unsigned char meta, unsigned char ex)
+	{
+		for (int sy = (y1 >> 4); sy <= (y2 >> 4); ++sy)
+			{
+				subchunk *sub = this->subs[sy];
+				if (!sub)
+					{
+						if (id == 0 && ex == 0)
+							continue;
+						sub = this->subs[sy] = new subchunk ();
+					}
+				
+				int ly1 = (sy == (y1 >> 4)) ? (y1 & 0xF) : 0;
+				int ly2 = (sy == (y2 >> 4)) ? (y2 & 0xF) : 15;
+				sub->fill (x1, ly1, z1, x2, ly2, z2, id, meta, ex);
+			}
+		
+		this->modified = true;
+		this->touch ();
+	}
+	
+	int
+	chunk::replace (int x1, int y1, int z1, int x2, int y2, int z2,
+		unsigned short from_id, int from_meta, unsigned short id,
+		unsigned char meta)
+	{
+		int changed = 0;
+		for (int sy = (y1 >> 4); sy <= (y2 >> 4); ++sy)
+			{
+				int ly1 = (sy == (y1 >> 4)) ? (y1 & 0xF) : 0;
+				int ly2 = (sy == (y2 >> 4)) ? (y2 & 0xF) : 15;
+				
+				subchunk *sub = this->subs[sy];
+				if (!sub)
+					{
+						// a missing sub-chunk is all air.
+						if (from_id != 0 || (from_meta != -1 && from_meta != 0) || id == 0)
+							continue;
+						sub = this->subs[sy] = new subchunk ();
+					}
+				
+				changed += sub->replace (x1, ly1, z1, x2, ly2, z2, from_id, from_meta,
+					id, meta);
+			}
+		
+		if (changed > 0)
+			{
+				this->modified = true;
+				this->touch ();
+			}
+		return changed;
+	}
+	
+	int
+	chunk::count (int x1, int y1, int z1, int x2, int y2, int z2,
+		unsigned short id, int meta)
+	{
+		int n = 0;
+		for (int sy = (y1 >> 4); sy <= (y2 >> 4); ++sy)
+			{
+				int ly1 = (sy == (y1 >> 4)) ? (y1 & 0xF) : 0;
+				int ly2 = (sy == (y2 >> 4)) ? (y2 & 0xF) : 15;
+				
+				subchunk *sub = this->subs[sy];
+				if (sub)
+					n += sub->count (x1, ly1, z1, x2, ly2, z2, id, meta);
+				else if (id == 0 && (meta == -1 || meta == 0))
+					n += (x2 - x1 + 1) * (ly2 - ly1 + 1) * (z2 - z1 + 1);
+			}
+		
+		return n;
+	}
+	
 	 
 	
 //----
@@ -621,6 +1559,16 @@ namespace hCraft {
 		this->entities.erase (e);
 	}
 	
+	/* 
+	 * Checks whether there are any entities in the chunk.
+	 */
+	bool
+	chunk::has_entities ()
+	{
+		std::lock_guard<std::mutex> guard {this->entity_lock};
+		return !this->entities.empty ();
+	}
+	
 	/* 
 	 * Calls the specified function on every entity in the chunk's entity list.
 	 */
@@ -677,15 +1625,7 @@ namespace hCraft {
 					}
 				
 				if (!ch)
-					{
-						ch = this->wr.get_chunk (cx, cz);
-						if (!ch)
-							{
-								// place empty chunk
-								ch = new chunk ();
-								this->wr.put_chunk (cx, cz, ch);
-							}
-					}
+					ch = this->wr.load_neighbour (cx, cz);
 
 				this->last.ch = ch;
 				this->last.x = cx;
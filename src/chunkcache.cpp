@@ -0,0 +1,208 @@
+/* 
+ * hCraft - A custom Minecraft server.
+ * Copyright (C) 2012	Jacob Zhitomirsky
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "chunkcache.hpp"
+#include "packet.hpp"
+#include "chunk.hpp"
+
+
+namespace hCraft {
+	
+	/* 
+	 * Constructs a new cache that can hold up to @{capacity} bytes worth of
+	 * packets.
+	 */
+	chunk_packet_cache::chunk_packet_cache (unsigned long long capacity)
+	{
+		this->capacity = capacity;
+		this->used = 0;
+		this->hits = 0;
+		this->misses = 0;
+	}
+	
+	
+	
+	/* 
+	 * Removes the specified entry from the cache.
+	 * The cache lock must be held.
+	 */
+	void
+	chunk_packet_cache::erase (
+		std::unordered_map<cache_key, cache_entry, cache_key_hash>::iterator itr)
+	{
+		cache_entry& ent = itr->second;
+		if (ent.pack)
+			this->used -= ent.pack->size;
+		this->lru.erase (ent.lru_pos);
+		this->entries.erase (itr);
+	}
+	
+	/* 
+	 * Drops least recently used entries until the cache fits within its
+	 * capacity. The cache lock must be held.
+	 */
+	void
+	chunk_packet_cache::shrink ()
+	{
+		auto litr = this->lru.end ();
+		while (this->used > this->capacity && litr != this->lru.begin ())
+			{
+				-- litr;
+				auto itr = this->entries.find (*litr);
+				if (itr->second.building)
+					continue; // still needed by whoever is building it
+				
+				// step past the entry first, erasing it invalidates the iterator.
+				++ litr;
+				this->erase (itr);
+			}
+	}
+	
+	
+	
+	/* 
+	 * Changes the maximum amount of memory used by the cache.
+	 * A capacity of zero disables caching altogether.
+	 */
+	void
+	chunk_packet_cache::set_capacity (unsigned long long capacity)
+	{
+		std::lock_guard<std::mutex> guard {this->lock};
+		this->capacity = capacity;
+		this->shrink ();
+	}
+	
+	
+	
+	/* 
+	 * Returns a packet containing the specified chunk, building it if a
+	 * packet for the chunk's current version is not available.
+	 * The returned packet must not be modified.
+	 */
+	std::shared_ptr<packet>
+	chunk_packet_cache::get (world *w, int cx, int cz, chunk *ch)
+	{
+		unsigned long long version = ch->get_version ();
+		cache_key key {w, cx, cz};
+		bool store = true;
+		
+		{
+			std::unique_lock<std::mutex> guard {this->lock};
+			if (this->capacity == 0)
+				store = false;
+			
+			while (store)
+				{
+					auto itr = this->entries.find (key);
+					if (itr == this->entries.end ())
+						break;
+					
+					cache_entry& ent = itr->second;
+					if (ent.version == version)
+						{
+							if (ent.building)
+								{
+									// someone else is already building this exact packet.
+									this->build_cv.wait (guard);
+									continue;
+								}
+							
+							++ this->hits;
+							this->lru.splice (this->lru.begin (), this->lru, ent.lru_pos);
+							return ent.pack;
+						}
+					
+					// the chunk has been modified since.
+					if (ent.building)
+						store = false;
+					else
+						this->erase (itr);
+					break;
+				}
+			
+			if (store)
+				{
+					// reserve a slot, so that concurrent requests for the same chunk
+					// wait for us instead of building the packet all over again.
+					this->lru.push_front (key);
+					this->entries[key] = {version, std::shared_ptr<packet> (), true,
+						this->lru.begin ()};
+				}
+		}
+		
+		++ this->misses;
+		std::shared_ptr<packet> pack (packet::make_chunk (cx, cz, ch));
+		if (!store)
+			return pack;
+		
+		{
+			std::lock_guard<std::mutex> guard {this->lock};
+			
+			auto itr = this->entries.find (key);
+			if (itr != this->entries.end () && itr->second.building
+				&& itr->second.version == version)
+				{
+					if (pack)
+						{
+							itr->second.pack = pack;
+							itr->second.building = false;
+							this->used += pack->size;
+							this->shrink ();
+						}
+					else
+						this->erase (itr);
+				}
+		}
+		
+		this->build_cv.notify_all ();
+		return pack;
+	}
+	
+	
+	
+	/* 
+	 * Removes all packets built from chunks of the given world.
+	 */
+	void
+	chunk_packet_cache::purge (world *w)
+	{
+		std::lock_guard<std::mutex> guard {this->lock};
+		for (auto itr = this->entries.begin (); itr != this->entries.end (); )
+			{
+				auto next = itr;
+				++ next;
+				if (itr->first.w == w)
+					this->erase (itr);
+				itr = next;
+			}
+	}
+	
+	/* 
+	 * Removes all entries.
+	 */
+	void
+	chunk_packet_cache::clear ()
+	{
+		std::lock_guard<std::mutex> guard {this->lock};
+		this->entries.clear ();
+		this->lru.clear ();
+		this->used = 0;
+	}
+}
+
@@ -0,0 +1,587 @@
+/* 
+ * hCraft - A custom Minecraft server.
+ * Copyright (C) 2012	Jacob Zhitomirsky
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "chunkio.hpp"
+#include "world.hpp"
+#include "chunk.hpp"
+#include "providers/worldprovider.hpp"
+#include "logger.hpp"
+#include <algorithm>
+#include <chrono>
+#include <exception>
+#include <stdexcept>
+
+
+namespace hCraft {
+	
+	static unsigned long long
+	chunk_key (int x, int z)
+		{ return ((unsigned long long)((unsigned int)z) << 32)
+			| (unsigned long long)((unsigned int)x); }
+	
+	
+	
+	/* 
+	 * Constructs a new stopped I/O stage for the specified world.
+	 * @{prov_lock} is the lock that guards the world's provider.
+	 */
+	chunk_io::chunk_io (world &w, std::mutex &prov_lock)
+		: w (w), prov_lock (prov_lock)
+	{
+		this->_running = false;
+		this->urgent_loads = 0;
+	}
+	
+	/* 
+	 * Class destructor.
+	 */
+	chunk_io::~chunk_io ()
+	{
+		this->stop ();
+	}
+	
+	
+	
+	/* 
+	 * Starts the I/O thread.
+	 */
+	void
+	chunk_io::start ()
+	{
+		if (this->_running)
+			return;
+		
+		this->_running = true;
+		this->th = std::thread (
+			std::bind (std::mem_fn (&hCraft::chunk_io::main_loop), this));
+	}
+	
+	/* 
+	 * Stops the I/O thread. Pending writes and reads are completed first,
+	 * pending prefetches are dropped.
+	 */
+	void
+	chunk_io::stop ()
+	{
+		{
+			std::lock_guard<std::mutex> guard {this->lock};
+			if (!this->_running)
+				return;
+			this->_running = false;
+		}
+		
+		this->cv.notify_all ();
+		if (this->th.joinable ())
+			this->th.join ();
+	}
+	
+	
+	
+	/* 
+	 * The function ran by the I/O thread.
+	 */
+	void
+	chunk_io::main_loop ()
+	{
+		const static size_t max_reads = 64; // per batch
+		
+		for (;;)
+			{
+				std::vector<write_request> wbatch;
+				std::vector<read_request> rbatch;
+				
+				{
+					std::unique_lock<std::mutex> guard {this->lock};
+					auto has_work = [this] () -> bool
+						{
+							return !this->_running || !this->writes.empty () ||
+								!this->fetches.empty () || !this->loads.empty ();
+						};
+					
+					// stalled chunks are retried every few milliseconds.
+					if (this->stalled.empty ())
+						this->cv.wait (guard, has_work);
+					else
+						this->cv.wait_for (guard, std::chrono::milliseconds (10), has_work);
+					
+					if (!this->_running && this->writes.empty () &&
+						this->fetches.empty () && (this->urgent_loads == 0))
+						break;
+					
+					wbatch.assign (this->writes.begin (), this->writes.end ());
+					this->writes.clear ();
+					
+					while (!this->fetches.empty () && (rbatch.size () < max_reads))
+						{
+							rbatch.push_back (std::move (this->fetches.front ()));
+							this->fetches.pop_front ();
+						}
+					
+					// loads that someone is waiting on come before prefetches, which
+					// are dropped once stopped.
+					for (int pass = 0; pass < (this->_running ? 2 : 1); ++pass)
+						for (auto itr = this->loads.begin ();
+							(itr != this->loads.end ()) && (rbatch.size () < max_reads); )
+							{
+								if (itr->second.prefetch != (pass == 1))
+									{ ++ itr; continue; }
+								
+								if (!itr->second.prefetch)
+									-- this->urgent_loads;
+								rbatch.push_back (std::move (itr->second));
+								itr = this->loads.erase (itr);
+							}
+				}
+				
+				if (!wbatch.empty ())
+					{
+						this->do_writes (wbatch);
+						for (write_request& wr : wbatch)
+							{
+								// keep it in memory, it will be saved again later on.
+								read_request req (wr.cx, wr.cz, false);
+								req.ch = wr.ch;
+								if (!this->finish_load (req))
+									this->stalled.push_back (std::move (req));
+							}
+					}
+				
+				if (!rbatch.empty ())
+					this->do_reads (rbatch);
+				
+				if (!this->stalled.empty ())
+					{
+						std::vector<read_request> retry;
+						retry.swap (this->stalled);
+						for (read_request& req : retry)
+							if (!this->finish_load (req))
+								this->stalled.push_back (std::move (req));
+					}
+			}
+		
+		{
+			std::lock_guard<std::mutex> guard {this->lock};
+			this->loads.clear ();
+		}
+		
+		// chunks that never made it into the world: the world is no longer
+		// running, so there's no one left to hand them to.
+		std::vector<write_request> unsaved;
+		for (read_request& req : this->stalled)
+			{
+				if (req.ch->dirty ())
+					unsaved.push_back ({req.cx, req.cz, req.ch});
+				else
+					delete req.ch;
+			}
+		this->stalled.clear ();
+		
+		if (!unsaved.empty ())
+			{
+				this->do_writes (unsaved);
+				for (write_request& wr : unsaved)
+					delete wr.ch;
+			}
+	}
+	
+	
+	
+	/* 
+	 * Compresses the given chunks and writes them out, then retires them.
+	 * Chunks that fail to compress or to be written are left in @{batch}, all
+	 * others are removed from it.
+	 */
+	void
+	chunk_io::do_writes (std::vector<write_request>& batch)
+	{
+		world_provider *prov = this->w.get_provider ();
+		if (!prov)
+			{
+				for (write_request& wr : batch)
+					this->w.retire_chunk (wr.ch);
+				batch.clear ();
+				return;
+			}
+		
+		std::vector<std::vector<unsigned char>> data (batch.size ());
+		for (size_t i = 0; i < batch.size (); ++i)
+			{
+				try
+					{
+						prov->encode_chunk (batch[i].ch, data[i]);
+					}
+				catch (const std::exception&)
+					{
+						data[i].clear ();
+					}
+			}
+		
+		std::vector<bool> written (batch.size (), false);
+		{
+			std::lock_guard<std::mutex> prov_guard {this->prov_lock};
+			try
+				{
+					prov->open (this->w);
+					for (size_t i = 0; i < batch.size (); ++i)
+						if (!data[i].empty ())
+							{
+								prov->save_encoded (this->w, data[i], batch[i].cx, batch[i].cz);
+								written[i] = true;
+							}
+					prov->close ();
+				}
+			catch (const std::exception& ex)
+				{
+					// chunks that have not been written stay in memory.
+					prov->close ();
+					this->w.get_logger () (LT_ERROR) << "Could not save chunks of world \""
+						<< this->w.get_name () << "\": " << ex.what () << std::endl;
+				}
+		}
+		
+		std::vector<write_request> failed;
+		for (size_t i = 0; i < batch.size (); ++i)
+			{
+				if (!written[i])
+					failed.push_back (batch[i]);
+				else
+					this->w.retire_chunk (batch[i].ch);
+			}
+		batch.swap (failed);
+	}
+	
+	
+	
+	/* 
+	 * Reads and decodes the chunks of the given requests, and hands them
+	 * over to whoever requested them.
+	 */
+	void
+	chunk_io::do_reads (std::vector<read_request>& batch)
+	{
+		std::vector<read_request *> todo;
+		
+		{
+			std::lock_guard<std::mutex> guard {this->lock};
+			for (read_request& req : batch)
+				{
+					// a chunk that is still waiting to be written out is read in the
+					// next round, once it has been.
+					unsigned long long key = chunk_key (req.cx, req.cz);
+					bool writing = false;
+					for (const write_request& wr : this->writes)
+						if (chunk_key (wr.cx, wr.cz) == key)
+							{ writing = true; break; }
+					if (writing)
+						{
+							if (req.fetch)
+								this->fetches.push_front (std::move (req));
+							else
+								{
+									auto itr = this->loads.find (key);
+									if (itr == this->loads.end ())
+										{
+											if (!req.prefetch)
+												++ this->urgent_loads;
+											this->loads.emplace (key, std::move (req));
+										}
+									else
+										{
+											if (itr->second.prefetch && !req.prefetch)
+												{
+													itr->second.prefetch = false;
+													++ this->urgent_loads;
+												}
+											for (callback& cb : req.cbs)
+												itr->second.cbs.push_back (std::move (cb));
+										}
+								}
+							continue;
+						}
+					
+					todo.push_back (&req);
+				}
+		}
+		
+		// no need to read in chunks that are already in memory.
+		for (auto itr = todo.begin (); itr != todo.end (); )
+			{
+				read_request& req = **itr;
+				if (!req.fetch)
+					{
+						chunk *ch = this->w.get_chunk (req.cx, req.cz);
+						if (ch && ch->generated)
+							{
+								for (callback& cb : req.cbs)
+									cb (ch);
+								itr = todo.erase (itr);
+								continue;
+							}
+					}
+				
+				++ itr;
+			}
+		if (todo.empty ())
+			return;
+		
+		world_provider *prov = this->w.get_provider ();
+		if (prov)
+			{
+				std::lock_guard<std::mutex> prov_guard {this->prov_lock};
+				for (read_request *req : todo)
+					req->pos = prov->locate (req->cx, req->cz);
+				
+				// chunks whose position is unknown (-1) go last.
+				std::sort (todo.begin (), todo.end (),
+					[] (const read_request *a, const read_request *b) -> bool
+						{ return (unsigned long long)a->pos < (unsigned long long)b->pos; });
+				
+				for (read_request *req : todo)
+					{
+						bool found;
+						try
+							{
+								found = prov->load_encoded (this->w, req->cx, req->cz, req->data);
+							}
+						catch (const std::exception& ex)
+							{
+								// a damaged chunk is treated as a missing one (and generated
+								// anew) rather than taking the server down.
+								this->w.get_logger () (LT_ERROR) << "Could not read chunk ["
+									<< req->cx << ", " << req->cz << "] of world \""
+									<< this->w.get_name () << "\": " << ex.what () << std::endl;
+								found = false;
+							}
+						
+						if (!found)
+							req->data.clear ();
+					}
+			}
+		
+		for (read_request *req : todo)
+			{
+				if (req->fetch)
+					{
+						try
+							{
+								this->decode (*req);
+								req->fetch->set_value (req->ch);
+							}
+						catch (const std::exception&)
+							{
+								req->fetch->set_exception (std::current_exception ());
+							}
+						continue;
+					}
+				
+				try
+					{
+						this->decode (*req);
+					}
+				catch (const std::exception&)
+					{
+						req->ch = nullptr;
+					}
+				
+				if (!req->ch)
+					{
+						for (callback& cb : req->cbs)
+							cb (nullptr);
+						continue;
+					}
+				
+				if (!this->finish_load (*req))
+					this->stalled.push_back (std::move (*req));
+			}
+	}
+	
+	/* 
+	 * Decodes the data read for the specified request into a new chunk.
+	 */
+	void
+	chunk_io::decode (read_request& req)
+	{
+		req.ch = nullptr;
+		if (req.data.empty ())
+			return;
+		
+		chunk *ch = new chunk ();
+		try
+			{
+				this->w.get_provider ()->decode_chunk (ch, req.data);
+			}
+		catch (const std::exception&)
+			{
+				delete ch;
+				throw;
+			}
+		
+		std::vector<unsigned char> ().swap (req.data);
+		if (!ch->generated)
+			{
+				delete ch;
+				return;
+			}
+		
+		// identical to what's on disk.
+		ch->modified = false;
+		ch->mark_saved (ch->get_version ());
+		ch->recalc_heightmap ();
+		req.ch = ch;
+	}
+	
+	/* 
+	 * Puts a chunk read in by a load request into the world. Returns false if
+	 * it has to be retried later on.
+	 */
+	bool
+	chunk_io::finish_load (read_request& req)
+	{
+		chunk *ch = this->w.adopt_chunk (req.cx, req.cz, req.ch);
+		if (!ch)
+			return false;
+		
+		if (ch != req.ch)
+			delete req.ch;
+		req.ch = nullptr;
+		
+		for (callback& cb : req.cbs)
+			cb (ch);
+		return true;
+	}
+	
+	
+	
+	/* 
+	 * Reads the chunk located at the specified coordinates from the world file,
+	 * and hands it over to the caller without putting it into the world. The
+	 * returned future yields null if the chunk is not present on disk.
+	 */
+	std::future<chunk *>
+	chunk_io::fetch (int cx, int cz)
+	{
+		read_request req (cx, cz, false);
+		req.fetch.reset (new std::promise<chunk *> ());
+		std::future<chunk *> res = req.fetch->get_future ();
+		
+		{
+			std::lock_guard<std::mutex> guard {this->lock};
+			if (this->_running)
+				{
+					this->fetches.push_back (std::move (req));
+					this->cv.notify_one ();
+					return res;
+				}
+		}
+		
+		std::vector<read_request> batch;
+		batch.push_back (std::move (req));
+		this->do_reads (batch);
+		return res;
+	}
+	
+	/* 
+	 * Reads the chunk located at the specified coordinates into the world, if
+	 * it isn't in memory already. @{cb} is then called from the I/O thread
+	 * with the chunk, or with null if the chunk isn't present on disk either.
+	 * If the I/O thread isn't running, the chunk is loaded (or generated)
+	 * right away through world::load_chunk () instead.
+	 */
+	void
+	chunk_io::load (int cx, int cz, callback cb)
+	{
+		{
+			std::lock_guard<std::mutex> guard {this->lock};
+			if (this->_running)
+				{
+					unsigned long long key = chunk_key (cx, cz);
+					auto itr = this->loads.find (key);
+					if (itr == this->loads.end ())
+						{
+							itr = this->loads.emplace (key,
+								read_request (cx, cz, false)).first;
+							++ this->urgent_loads;
+						}
+					else if (itr->second.prefetch)
+						{
+							itr->second.prefetch = false;
+							++ this->urgent_loads;
+						}
+					
+					if (cb)
+						itr->second.cbs.push_back (std::move (cb));
+					this->cv.notify_one ();
+					return;
+				}
+		}
+		
+		chunk *ch = this->w.load_chunk (cx, cz);
+		if (cb)
+			cb (ch);
+	}
+	
+	/* 
+	 * Same as load (), but at a lower priority and without a callback.
+	 * Prefetches are dropped if the I/O thread isn't running.
+	 */
+	void
+	chunk_io::prefetch (int cx, int cz)
+	{
+		std::lock_guard<std::mutex> guard {this->lock};
+		if (!this->_running)
+			return;
+		
+		unsigned long long key = chunk_key (cx, cz);
+		if (this->loads.find (key) != this->loads.end ())
+			return;
+		
+		this->loads.emplace (key, read_request (cx, cz, true));
+		this->cv.notify_one ();
+	}
+	
+	/* 
+	 * Takes ownership of the specified chunk, which must have already been
+	 * removed from the world, and writes it out.
+	 */
+	void
+	chunk_io::save (int cx, int cz, chunk *ch)
+	{
+		{
+			std::lock_guard<std::mutex> guard {this->lock};
+			if (this->_running)
+				{
+					this->writes.push_back ({cx, cz, ch});
+					this->cv.notify_one ();
+					return;
+				}
+		}
+		
+		std::vector<write_request> batch;
+		batch.push_back ({cx, cz, ch});
+		this->do_writes (batch);
+		
+		// failed to compress, keep it in memory if possible.
+		for (write_request& wr : batch)
+			{
+				chunk *res = this->w.adopt_chunk (wr.cx, wr.cz, wr.ch);
+				if (res != wr.ch)
+					delete wr.ch;
+			}
+	}
+}
+
@@ -0,0 +1,208 @@
+/* 
+ * hCraft - A custom Minecraft server.
+ * Copyright (C) 2012	Jacob Zhitomirsky
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "chunkmap.hpp"
+
+
+namespace hCraft {
+	
+	/* 
+	 * Constructs a new empty chunk map.
+	 */
+	chunk_map::chunk_map ()
+	{
+		this->count = 0;
+		this->epoch = 0;
+		this->tab.store (new_table (16), std::memory_order_relaxed);
+	}
+	
+	/* 
+	 * Class destructor. Does not free the chunks themselves.
+	 */
+	chunk_map::~chunk_map ()
+	{
+		free_table (this->tab.load (std::memory_order_relaxed));
+		for (table *t : this->retired)
+			free_table (t);
+		for (table *t : this->retired_old)
+			free_table (t);
+		for (region *r : this->regions)
+			delete r;
+	}
+	
+	
+	
+	chunk_map::table*
+	chunk_map::new_table (unsigned int size)
+	{
+		table *t = new table ();
+		t->mask = size - 1;
+		t->used = 0;
+		t->slots = new std::atomic<region *> [size];
+		for (unsigned int i = 0; i < size; ++i)
+			t->slots[i].store (nullptr, std::memory_order_relaxed);
+		
+		return t;
+	}
+	
+	void
+	chunk_map::free_table (table *t)
+	{
+		delete[] t->slots;
+		delete t;
+	}
+	
+	
+	
+	/* 
+	 * Returns the region with the given coordinates, creating it if it
+	 * doesn't exist yet.
+	 */
+	chunk_map::region*
+	chunk_map::get_region (int rx, int rz)
+	{
+		region *r = this->find_region (rx, rz);
+		if (r)
+			return r;
+		
+		r = new region ();
+		r->rx = rx;
+		r->rz = rz;
+		r->count = 0;
+		for (int i = 0; i < (REGION_SIZE * REGION_SIZE); ++i)
+			r->chunks[i].store (nullptr, std::memory_order_relaxed);
+		this->regions.push_back (r);
+		
+		table *t = this->tab.load (std::memory_order_relaxed);
+		if (((t->used + 1) * 4) > ((t->mask + 1) * 3))
+			{
+				// regions are never removed, so the new table simply gets twice as
+				// many slots.
+				table *nt = new_table ((t->mask + 1) * 2);
+				for (unsigned int i = 0; i <= t->mask; ++i)
+					{
+						region *o = t->slots[i].load (std::memory_order_relaxed);
+						if (!o)
+							continue;
+						
+						unsigned int j = hash_region (o->rx, o->rz) & nt->mask;
+						while (nt->slots[j].load (std::memory_order_relaxed))
+							j = (j + 1) & nt->mask;
+						nt->slots[j].store (o, std::memory_order_relaxed);
+						++ nt->used;
+					}
+				
+				// the new table's contents become visible along with the table itself.
+				this->tab.store (nt, std::memory_order_release);
+				this->retired.push_back (t);
+				t = nt;
+			}
+		
+		unsigned int i = hash_region (rx, rz) & t->mask;
+		while (t->slots[i].load (std::memory_order_relaxed))
+			i = (i + 1) & t->mask;
+		t->slots[i].store (r, std::memory_order_release);
+		++ t->used;
+		
+		return r;
+	}
+	
+	
+	
+	/* 
+	 * Inserts the specified chunk into the map, and returns the chunk that it
+	 * replaced, if any.
+	 */
+	chunk*
+	chunk_map::insert (int x, int z, chunk *ch)
+	{
+		region *r = this->get_region (x >> REGION_SHIFT, z >> REGION_SHIFT);
+		std::atomic<chunk *>& slot = r->chunks[region_index (x, z)];
+		
+		chunk *prev = slot.load (std::memory_order_relaxed);
+		slot.store (ch, std::memory_order_release);
+		if (prev)
+			{
+				this->epoch.fetch_add (1, std::memory_order_release);
+				return prev;
+			}
+		
+		++ r->count;
+		++ this->count;
+		return nullptr;
+	}
+	
+	/* 
+	 * Removes the chunk located at the specified coordinates from the map,
+	 * and returns it (null if there was none).
+	 */
+	chunk*
+	chunk_map::erase (int x, int z)
+	{
+		region *r = this->find_region (x >> REGION_SHIFT, z >> REGION_SHIFT);
+		if (!r)
+			return nullptr;
+		
+		std::atomic<chunk *>& slot = r->chunks[region_index (x, z)];
+		chunk *prev = slot.load (std::memory_order_relaxed);
+		if (!prev)
+			return nullptr;
+		
+		slot.store (nullptr, std::memory_order_release);
+		-- r->count;
+		-- this->count;
+		this->epoch.fetch_add (1, std::memory_order_release);
+		return prev;
+	}
+	
+	/* 
+	 * Removes all chunks and regions from the map. No lookups may be in
+	 * progress.
+	 */
+	void
+	chunk_map::clear ()
+	{
+		table *t = this->tab.load (std::memory_order_relaxed);
+		for (unsigned int i = 0; i <= t->mask; ++i)
+			t->slots[i].store (nullptr, std::memory_order_relaxed);
+		t->used = 0;
+		
+		for (region *r : this->regions)
+			delete r;
+		this->regions.clear ();
+		
+		this->count = 0;
+		this->epoch.fetch_add (1, std::memory_order_release);
+	}
+	
+	
+	
+	/* 
+	 * Frees the tables replaced before the previous call to this function.
+	 * Meant to be called every few seconds.
+	 */
+	void
+	chunk_map::reclaim ()
+	{
+		for (table *t : this->retired_old)
+			free_table (t);
+		this->retired_old.swap (this->retired);
+		this->retired.clear ();
+	}
+}
+
@@ -19,6 +19,7 @@
 #include "commands/drawc.hpp"
 #include "player.hpp"
 #include "world.hpp"
+#include "selection/cuboid_selection.hpp"
 #include "stringutils.hpp"
 #include "utils.hpp"
 #include <sstream>
@@ -240,6 +241,41 @@ namespace hCraft {
 						if (min_p.y > 255) min_p.y = 255;
 						if (max_p.y < 0) max_p.y = 0;
 						if (max_p.y > 255) max_p.y = 255;
+						
+						// plain cuboid fills are staged in bulk. blocks that already hold
+						// the target block are counted a chunk at a time instead of being
+						// looked up one by one.
+						if (dynamic_cast<cuboid_selection *> (sel) && !do_hollow && !is_rand
+							&& (bd_in.id == 0xFFFF) && wr->in_bounds (min_p.x, min_p.y, min_p.z)
+							&& wr->in_bounds (max_p.x, max_p.y, max_p.z))
+							{
+								int volume = (max_p.x - min_p.x + 1) * (max_p.y - min_p.y + 1)
+									* (max_p.z - min_p.z + 1);
+								int same = 0;
+								for (int cz = (min_p.z >> 4); cz <= (max_p.z >> 4); ++cz)
+									for (int cx = (min_p.x >> 4); cx <= (max_p.x >> 4); ++cx)
+										{
+											chunk *ch = wr->load_chunk (cx, cz);
+											same += ch->count (
+												(cx == (min_p.x >> 4)) ? (min_p.x & 0xF) : 0, min_p.y,
+												(cz == (min_p.z >> 4)) ? (min_p.z & 0xF) : 0,
+												(cx == (max_p.x >> 4)) ? (max_p.x & 0xF) : 15, max_p.y,
+												(cz == (max_p.z >> 4)) ? (max_p.z & 0xF) : 15,
+												bd_out.id, bd_out.meta);
+										}
+								
+								if (volume > same)
+									{
+										es.fill (min_p.x, min_p.y, min_p.z, max_p.x, max_p.y, max_p.z,
+											bd_out.id, bd_out.meta);
+										block_counter += volume - same;
+										++ selection_counter;
+									}
+								
+								es.commit (do_physics);
+								continue;
+							}
+						
 						for (int y = max_p.y; y >= min_p.y; --y)
 							for (int x = min_p.x; x <= max_p.x; ++x)
 								for (int z = min_p.z; z <= max_p.z; ++z)
@@ -101,6 +101,22 @@ namespace hCraft {
 		
 		
 		
+		static void
+		handle_stats (player *pl, command_reader& reader)
+		{
+			world *wr = pl->get_world ();
+			physics_manager& man = (wr->physics.get_thread_count () == 0)
+				? pl->get_server ().global_physics : wr->physics;
+			
+			unsigned int late = man.get_lateness ();
+			std::ostringstream ss;
+			ss << "§7Scheduled updates§f: §b" << man.get_backlog ()
+				 << "§7, lateness§f: §b" << late << " §7tick" << ((late == 1) ? "" : "s");
+			pl->message (ss.str ());
+		}
+		
+		
+		
 		/* 
 		 * /physics -
 		 * 
@@ -129,6 +145,7 @@ namespace hCraft {
 						{ "off", handle_off },
 						{ "pause", handle_pause },
 						{ "threads", handle_threads },
+						{ "stats", handle_stats },
 					};
 			
 			auto itr = funs.find (opt.c_str ());
@@ -105,7 +105,7 @@ namespace hCraft {
 				}
 			
 			// world provider
-			std::string provider_name ("hw");
+			std::string provider_name ("hw2");
 			auto opt_prov = reader.opt ("provider");
 			if (opt_prov->found ())
 				{
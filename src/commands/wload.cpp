@@ -91,8 +91,17 @@ namespace hCraft {
 					return;
 				}
 			
-			world_provider *prov = world_provider::create (prov_name.c_str (),
-				"data/worlds", world_name.c_str ());
+			world_provider *prov;
+			try
+				{
+					prov = world_provider::create (prov_name.c_str (),
+						"data/worlds", world_name.c_str ());
+				}
+			catch (const std::exception& ex)
+				{
+					pl->message ("§c * ERROR§f: §e" + std::string (ex.what ()) + "§f.");
+					return;
+				}
 			if (!prov)
 				{
 					pl->message ("§c * ERROR§f: §eInvalid provider§f.");
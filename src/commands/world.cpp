@@ -47,7 +47,20 @@ namespace hCraft {
 			
 			if (reader.no_args ())
 				{
-					pl->message ("§eYou are currently in§f: §b" + std::string (pl->get_world ()->get_name ()));
+					world *cw = pl->get_world ();
+					pl->message ("§eYou are currently in§f: §b" + std::string (cw->get_name ()));
+					
+					std::ostringstream ss;
+					ss << "§eResident chunks§f: §b" << cw->get_resident_chunks ()
+						 << " §7(§b" << (cw->get_resident_memory () >> 20) << "MB";
+					if (cw->get_memory_budget () > 0)
+						ss << " §7/ §b" << (cw->get_memory_budget () >> 20) << "MB";
+					ss << "§7)";
+					pl->message (ss.str ());
+					
+					std::ostringstream uss;
+					uss << "§eBlock updates§f: §b" << cw->get_update_rate () << "§7/s";
+					pl->message (uss.str ());
 					return;
 				}
 			else if (reader.arg_count () > 1)
@@ -0,0 +1,162 @@
+/* 
+ * hCraft - A custom Minecraft server.
+ * Copyright (C) 2012	Jacob Zhitomirsky
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "compression.hpp"
+#include <atomic>
+
+#ifdef HCRAFT_LIBDEFLATE
+#	include <libdeflate.h>
+#else
+#	include <zlib.h>
+#endif
+
+
+namespace hCraft {
+	
+	namespace compression {
+		
+		static std::atomic_int levels[] = {
+			ATOMIC_VAR_INIT (6), // CT_NETWORK
+			ATOMIC_VAR_INIT (9), // CT_DISK
+		};
+		
+		
+		
+#ifdef HCRAFT_LIBDEFLATE
+		
+		namespace {
+			
+			/* 
+			 * libdeflate compressors are relatively expensive to create, so every
+			 * thread keeps one for each level it uses.
+			 */
+			struct compressor_set
+			{
+				libdeflate_compressor *comps[13];
+				
+				compressor_set ()
+				{
+					for (int i = 0; i < 13; ++i)
+						this->comps[i] = nullptr;
+				}
+				
+				~compressor_set ()
+				{
+					for (int i = 0; i < 13; ++i)
+						if (this->comps[i])
+							libdeflate_free_compressor (this->comps[i]);
+				}
+				
+				libdeflate_compressor*
+				get (int level)
+				{
+					if (!this->comps[level])
+						this->comps[level] = libdeflate_alloc_compressor (level);
+					return this->comps[level];
+				}
+			};
+		}
+		
+		const char*
+		backend_name ()
+			{ return "libdeflate"; }
+		
+		int
+		max_level ()
+			{ return 12; }
+		
+		unsigned long
+		bound (unsigned long src_len)
+			{ return libdeflate_zlib_compress_bound (nullptr, src_len); }
+		
+		bool
+		compress (unsigned char *dest, unsigned long& dest_len,
+			const unsigned char *src, unsigned long src_len, int level)
+		{
+			static thread_local compressor_set comps;
+			
+			if (level < 0) level = 0;
+			else if (level > 12) level = 12;
+			
+			libdeflate_compressor *c = comps.get (level);
+			if (!c)
+				return false;
+			
+			std::size_t n = libdeflate_zlib_compress (c, src, src_len, dest, dest_len);
+			if (n == 0)
+				return false;
+			
+			dest_len = n;
+			return true;
+		}
+		
+#else
+		
+		const char*
+		backend_name ()
+			{ return "zlib"; }
+		
+		int
+		max_level ()
+			{ return 9; }
+		
+		unsigned long
+		bound (unsigned long src_len)
+			{ return compressBound (src_len); }
+		
+		bool
+		compress (unsigned char *dest, unsigned long& dest_len,
+			const unsigned char *src, unsigned long src_len, int level)
+		{
+			if (level < 0) level = 0;
+			else if (level > 9) level = 9;
+			
+			uLongf out_len = dest_len;
+			if (compress2 (dest, &out_len, src, src_len, level) != Z_OK)
+				return false;
+			
+			dest_len = out_len;
+			return true;
+		}
+		
+#endif
+		
+		
+		
+		/* 
+		 * Gets or sets the compression level used for the specified target.
+		 * Levels are clamped into the range of [0, max_level ()].
+		 */
+		
+		int
+		get_level (compression_target target)
+		{
+			return levels[target].load (std::memory_order_relaxed);
+		}
+		
+		void
+		set_level (compression_target target, int level)
+		{
+			if (level < 0) level = 0;
+			else if (level > max_level ()) level = max_level ();
+			levels[target].store (level, std::memory_order_relaxed);
+		}
+	}
+}
+
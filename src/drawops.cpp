@@ -522,13 +522,7 @@ namespace hCraft {
 		int ey = utils::max ((int)pt1.y, (int)pt2.y);
 		int ez = utils::max ((int)pt1.z, (int)pt2.z);
 		
-		for (int x = sx; x <= ex; ++x)
-			for (int y = sy; y <= ey; ++y)
-				for (int z = sz; z <= ez; ++z)
-					{
-						this->es.set (x, y, z, material.id, material.meta);
-					}
-		
+		this->es.fill (sx, sy, sz, ex, ey, ez, material.id, material.meta);
 		return ((ex - sx + 1) * (ey - sy + 1) * (ez - sz + 1));
 	}
 	
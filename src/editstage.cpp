@@ -23,12 +23,44 @@
 #include "physics/blocks/physics_block.hpp"
 #include <cstring>
 #include <mutex>
+#include <vector>
+#include <algorithm>
 
 #include <iostream> // DEBUG
 
 
 namespace hCraft {
 	
+	/* 
+	 * Returns iterators to the chunks of an edit stage, ordered by the region
+	 * they are in and then by their position within it, so that committing
+	 * them walks the world's chunk storage in order.
+	 */
+	template<typename T>
+	static std::vector<typename T::iterator>
+	region_order (T& chunks)
+	{
+		std::vector<typename T::iterator> order;
+		order.reserve (chunks.size ());
+		for (auto itr = chunks.begin (); itr != chunks.end (); ++itr)
+			order.push_back (itr);
+		
+		std::sort (order.begin (), order.end (),
+			[] (const typename T::iterator& a, const typename T::iterator& b) -> bool
+				{
+					const chunk_pos& p = a->first, & q = b->first;
+					int prz = p.z >> chunk_map::REGION_SHIFT, qrz = q.z >> chunk_map::REGION_SHIFT;
+					if (prz != qrz) return prz < qrz;
+					int prx = p.x >> chunk_map::REGION_SHIFT, qrx = q.x >> chunk_map::REGION_SHIFT;
+					if (prx != qrx) return prx < qrx;
+					if (p.z != q.z) return p.z < q.z;
+					return p.x < q.x;
+				});
+		return order;
+	}
+	
+	
+	
 	void
 	edit_stage::set_world (world *w, bool reset)
 	{
@@ -38,6 +70,21 @@ namespace hCraft {
 	}
 	
 	
+	/* 
+	 * Stages the specified block at every position of the box between
+	 * (@{x1}, @{y1}, @{z1}) and (@{x2}, @{y2}, @{z2}), inclusive.
+	 */
+	void
+	edit_stage::fill (int x1, int y1, int z1, int x2, int y2, int z2,
+		unsigned short id, unsigned char meta, unsigned char ex)
+	{
+		for (int y = y1; y <= y2; ++y)
+			for (int z = z1; z <= z2; ++z)
+				for (int x = x1; x <= x2; ++x)
+					this->set (x, y, z, id, meta, ex);
+	}
+	
+	
 	void
 	edit_stage::preview_to (player *pl, bool update_sbs)
 	{
@@ -194,12 +241,112 @@ namespace hCraft {
 		return {id, (unsigned char)(val & 0xF), ex};
 	}
 	
+	/* 
+	 * Checks whether every block of the given staged sub-chunk is set to the
+	 * same value (an actual block, not ES_NONE or ES_REM).
+	 */
+	static bool
+	uniform_sub (des_subchunk *sub, unsigned short& val, unsigned char& ex)
+	{
+		for (int mi = 0; mi < 8; ++mi)
+			if (!sub->micro[mi])
+				return false;
+		
+		val = sub->micro[0]->data[0];
+		ex = sub->micro[0]->ex[0];
+		if ((val >> 4) == ES_NONE || (val >> 4) == ES_REM)
+			return false;
+		
+		for (int mi = 0; mi < 8; ++mi)
+			{
+				des_microchunk *micro = sub->micro[mi];
+				for (int i = 0; i < 512; ++i)
+					if (micro->data[i] != val || micro->ex[i] != ex)
+						return false;
+			}
+		
+		return true;
+	}
+	
+	
 	void
 	dense_edit_stage::reset (int x, int y, int z)
 	{
 		this->set (x, y, z, ES_NONE, 0xF);
 	}
 	
+	/* 
+	 * Stages the specified block at every position of the box between
+	 * (@{x1}, @{y1}, @{z1}) and (@{x2}, @{y2}, @{z2}), inclusive, filling
+	 * whole microchunk rows at a time.
+	 */
+	void
+	dense_edit_stage::fill (int x1, int y1, int z1, int x2, int y2, int z2,
+		unsigned short id, unsigned char meta, unsigned char ex)
+	{
+		if (y1 < 0) y1 = 0;
+		if (y2 > 255) y2 = 255;
+		unsigned short val = (id << 4) | (meta & 0xF);
+		
+		for (int cz = (z1 >> 4); cz <= (z2 >> 4); ++cz)
+			for (int cx = (x1 >> 4); cx <= (x2 >> 4); ++cx)
+				{
+					des_chunk &ch = this->chunks[{cx, cz}];
+					
+					// the part of the box that lies within this chunk.
+					int bx1 = (cx == (x1 >> 4)) ? (x1 & 0xF) : 0;
+					int bx2 = (cx == (x2 >> 4)) ? (x2 & 0xF) : 15;
+					int bz1 = (cz == (z1 >> 4)) ? (z1 & 0xF) : 0;
+					int bz2 = (cz == (z2 >> 4)) ? (z2 & 0xF) : 15;
+					
+					for (int y = y1; y <= y2; ++y)
+						{
+							des_subchunk *sub = ch.subs[y >> 4];
+							if (!sub)
+								sub = ch.subs[y >> 4] = new des_subchunk ();
+							
+							int by = y & 0xF;
+							for (int bz = bz1; bz <= bz2; ++bz)
+								for (int mx = (bx1 >> 3); mx <= (bx2 >> 3); ++mx)
+									{
+										int m_index = ((by >> 3) << 2) | ((bz >> 3) << 1) | mx;
+										des_microchunk *micro = sub->micro[m_index];
+										if (!micro)
+											micro = sub->micro[m_index] = new des_microchunk ();
+										
+										// the run of the row that lies within this microchunk.
+										int rx1 = (mx == (bx1 >> 3)) ? (bx1 & 0x7) : 0;
+										int rx2 = (mx == (bx2 >> 3)) ? (bx2 & 0x7) : 7;
+										int b_index = ((by & 0x7) << 6) | ((bz & 0x7) << 3) | rx1;
+										int len = rx2 - rx1 + 1;
+										
+										unsigned short *row = micro->data + b_index;
+										int staged = 0;
+										for (int i = 0; i < len; ++i)
+											if ((row[i] >> 4) != ES_NONE)
+												++ staged;
+										if (id == ES_NONE)
+											ch.mod_count -= staged;
+										else
+											ch.mod_count += len - staged;
+										
+										std::fill (row, row + len, val);
+										std::memset (micro->ex + b_index, ex, len);
+									}
+						}
+				}
+	}
+	
+	/* 
+	 * Checks whether any blocks in the specified chunk are staged.
+	 */
+	bool
+	dense_edit_stage::has_changes_in (int cx, int cz)
+	{
+		auto itr = this->chunks.find ({cx, cz});
+		return (itr != this->chunks.end ()) && (itr->second.mod_count > 0);
+	}
+	
 	
 	
 	void
@@ -341,10 +488,22 @@ namespace hCraft {
 						affected_players.push_back (pl);
 				});
 		
-		std::lock_guard<std::mutex> u_guard ((this->w->update_lock));
-		std::lock_guard<std::mutex> es_guard ((this->w->estage_lock));
+		auto order = region_order (this->chunks);
+		
+		// chunks that have to be read in or generated are taken care of before
+		// the world's thread gets held up on the update lock.
+		for (auto itr : order)
+			this->w->load_chunk (itr->first.x, itr->first.z);
+		
+		std::unique_lock<std::mutex> u_guard ((this->w->update_lock));
+		std::unique_lock<std::mutex> es_guard ((this->w->estage_lock));
 		std::lock_guard<std::mutex> lm_guard ((this->w->lm.get_lock ()));
-		for (auto itr = this->chunks.begin (); itr != this->chunks.end (); ++itr)
+		
+		// chunks that are resent as a whole are relit as a whole too, in
+		// parallel, once all of them have been modified.
+		std::vector<chunk_pos> relit;
+		
+		for (auto itr : order)
 			{
 				int cx = itr->first.x;
 				int cz = itr->first.z;
@@ -355,7 +514,8 @@ namespace hCraft {
 				des_chunk &ch = itr->second;
 				
 				std::vector<block_change_record> records;
-				bool add_records = (ch.mod_count < chunk_cap);
+				bool whole_chunk = (ch.mod_count >= chunk_cap);
+				bool add_records = !whole_chunk;
 				
 				std::bitset<256> column_changed;
 				
@@ -371,6 +531,15 @@ namespace hCraft {
 						if (!sub)
 							continue;
 						
+						// a sub-chunk that is staged in its entirety with a single block
+						// is written out to the world's chunk in one go.
+						unsigned short bulk_val;
+						unsigned char bulk_ex;
+						bool bulk = uniform_sub (sub, bulk_val, bulk_ex);
+						if (bulk)
+							wch->fill (0, yy, 0, 15, yy + 15, 15, bulk_val >> 4, bulk_val & 0xF,
+								bulk_ex);
+						
 						for (int mi = 0; mi < 8; ++mi)
 							{
 								des_microchunk *micro = sub->micro[mi];
@@ -429,12 +598,14 @@ namespace hCraft {
 														if (wz < bound_min.z) bound_min.z = wz;
 														if (wz > bound_max.z) bound_max.z = wz;
 										
-														wch->set_block (rx, wy, rz, id, meta, ex);
+														if (!bulk)
+															wch->set_block (rx, wy, rz, id, meta, ex);
 														
 														//if (this->w->auto_lighting)
 														// NOTE: we already acquired the lighting manager's lock,
 														//       so this is perfectly safe.
-														this->w->queue_lighting_nolock (wx, wy, wz);
+														if (!whole_chunk)
+															this->w->queue_lighting_nolock (wx, wy, wz);
 														
 														if (physics)
 															{
@@ -455,14 +626,8 @@ namespace hCraft {
 								wch->recalc_heightmap (x, z);
 						}
 
-				if (ch.mod_count >= chunk_cap)
-					{
-						for (player *pl : affected_players)
-							{
-								if ((pl->get_world () == this->w) &&pl->can_see_chunk (cx, cz))
-									pl->send (packet::make_chunk (cx, cz, wch));
-							}
-					}
+				if (whole_chunk)
+					relit.emplace_back (cx, cz);
 				else if (ch.mod_count > 200)
 					{
 						packet *mbcp = packet::make_multi_block_change (cx, cz, records);
@@ -502,6 +667,29 @@ namespace hCraft {
 					}
 			}
 		
+		// the world's thread can not modify blocks while the lighting lock is
+		// held, so the update lock can be let go of before relighting (so that
+		// pooled threads blocked on it can help out).
+		es_guard.unlock ();
+		u_guard.unlock ();
+		
+		if (!relit.empty ())
+			{
+				this->w->relight_chunks_nolock (relit);
+				for (const chunk_pos& pos : relit)
+					{
+						chunk *wch = this->w->get_chunk (pos.x, pos.z);
+						if (!wch)
+							continue;
+						
+						for (player *pl : affected_players)
+							{
+								if ((pl->get_world () == this->w) && pl->can_see_chunk (pos.x, pos.z))
+									pl->send (packet::make_chunk (pos.x, pos.z, wch));
+							}
+					}
+			}
+		
 		// update player selections
 		for (player *pl : affected_players)
 			{
@@ -776,10 +964,17 @@ namespace hCraft {
 		unsigned char ex;
 		std::vector<sb_correction> corrections;
 		
-		std::lock_guard<std::mutex> u_guard ((this->w->update_lock));
-		std::lock_guard<std::mutex> es_guard ((this->w->estage_lock));
+		auto order = region_order (this->chunks);
+		
+		// chunks that have to be read in or generated are taken care of before
+		// the world's thread gets held up on the update lock.
+		for (auto itr : order)
+			this->w->load_chunk (itr->first.x, itr->first.z);
+		
+		std::unique_lock<std::mutex> u_guard ((this->w->update_lock));
+		std::unique_lock<std::mutex> es_guard ((this->w->estage_lock));
 		std::lock_guard<std::mutex> lm_guard ((this->w->lm.get_lock ()));
-		for (auto itr = this->chunks.begin (); itr != this->chunks.end (); ++itr)
+		for (auto itr : order)
 			{
 				int cx = itr->first.x;
 				int cz = itr->first.z;
@@ -30,6 +30,7 @@ namespace hCraft {
 			this->min_height = min_height; 
 			if (this->min_height < 1)
 				this->min_height = 1;
+			this->gen_seed = 0;
 		}
 		
 		
@@ -37,13 +38,15 @@ namespace hCraft {
 		void
 		generic_trees::seed (long s)
 		{
-			this->rnd.seed (s);
+			this->gen_seed = s;
 		}
 		
 		void
 		generic_trees::generate (world &wr, int x, int y, int z)
 		{
-			auto& rnd = this->rnd;
+			// seeded by position, so that trees can be planted from several
+			// generator threads at once.
+			std::minstd_rand rnd (this->gen_seed + x * 1917 + y * 113 + z * 3947);
 			std::uniform_int_distribution<> dis1 (0, 2), dis2 (0, 20);
 			
 			chunk_link_map map (wr, wr.get_chunk_at (x, z), x >> 4, z >> 4);
@@ -82,6 +85,7 @@ namespace hCraft {
 			this->min_height = min_height; 
 			if (this->min_height < 1)
 				this->min_height = 1;
+			this->gen_seed = 0;
 		}
 		
 		
@@ -89,13 +93,13 @@ namespace hCraft {
 		void
 		palm_trees::seed (long s)
 		{
-			this->rnd.seed (s);
+			this->gen_seed = s;
 		}
 		
 		void
 		palm_trees::generate (world &wr, int x, int y, int z)
 		{
-			auto& rnd = this->rnd;
+			std::minstd_rand rnd (this->gen_seed + x * 1917 + y * 113 + z * 3947);
 			std::uniform_int_distribution<> dis1 (0, 2), dis2 (0, 20);
 			
 			chunk_link_map map (wr, wr.get_chunk_at (x, z), x >> 4, z >> 4);
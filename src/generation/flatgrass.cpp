@@ -41,7 +41,7 @@ namespace hCraft {
 		int x, y, z;
 		unsigned int xz_hash = std::hash<long> () (((long)cz << 32) | cx) & 0xFFFFFFFF;
 		
-		this->rnd.seed (this->gen_seed + xz_hash);
+		std::minstd_rand rnd (this->gen_seed + xz_hash);
 		std::uniform_int_distribution<> dist (1, 20);
 		
 		int height = 64;
@@ -55,7 +55,7 @@ namespace hCraft {
 						out->set_id (x, y, z, BT_DIRT);
 					out->set_id (x, y, z, BT_GRASS);
 					
-					//if (dist (this->rnd) > 15)
+					//if (dist (rnd) > 15)
 					//	out->set_id_and_meta (x, y + 1, z, BT_TALL_GRASS, 1);
 					
 					out->set_biome (x, z, BI_FOREST);
@@ -220,7 +220,7 @@ namespace hCraft {
 			} state =	ST_AIR;
 		
 		unsigned int xz_hash = std::hash<long> () (((long)cz << 32) | cx) & 0xFFFFFFFF;
-		this->rnd.seed (this->gen_seed + xz_hash);
+		std::minstd_rand rnd (this->gen_seed + xz_hash);
 		std::uniform_int_distribution<> dis (1, 180);
 		
 		bool biomes[256];
@@ -21,6 +21,8 @@
 #include "chunk.hpp"
 #include "player.hpp"
 #include <functional>
+#include <algorithm>
+#include <limits>
 #include <chrono>
 
 #include <iostream> // DEBUG
@@ -30,8 +32,9 @@ namespace hCraft {
 	
 	chunk_generator::chunk_generator ()
 	{
-		this->th = nullptr;
 		this->_running = false;
+		this->pending = 0;
+		this->next_seq = 0;
 	}
 	
 	chunk_generator::~chunk_generator ()
@@ -42,21 +45,37 @@ namespace hCraft {
 	
 	
 	/* 
-	 * Starts the internal thread and begins accepting generation requests.
+	 * Starts @{worker_count} generator workers and begins accepting generation
+	 * requests. If @{worker_count} is zero, a worker will be started for
+	 * every available core.
 	 */
 	void
-	chunk_generator::start ()
+	chunk_generator::start (int worker_count)
 	{
 		if (this->_running)
 			return;
 		
+		if (worker_count <= 0)
+			{
+				worker_count = std::thread::hardware_concurrency ();
+				if (worker_count <= 0)
+					worker_count = 2;
+			}
+		
 		this->_running = true;
-		this->th = new std::thread (
-			std::bind (std::mem_fn (&hCraft::chunk_generator::main_loop), this));
+		for (int i = 0; i < worker_count; ++i)
+			this->workers.emplace_back (new gen_worker ());
+		
+		// the worker list must not change once the threads start stealing
+		// from each other.
+		for (auto& w : this->workers)
+			w->th = std::thread (
+				std::bind (std::mem_fn (&hCraft::chunk_generator::main_loop), this,
+					w.get ()));
 	}
 	
 	/* 
-	 * Stops the generation thread and cleans up resources.
+	 * Stops all generator workers and cleans up resources.
 	 */
 	void
 	chunk_generator::stop ()
@@ -64,73 +83,225 @@ namespace hCraft {
 		if (!this->_running)
 			return;
 		
-		this->_running = false;
+		{
+			std::lock_guard<std::mutex> guard {this->wait_lock};
+			this->_running = false;
+		}
+		this->wait_cv.notify_all ();
+		
+		for (auto& w : this->workers)
+			if (w->th.joinable ())
+				w->th.join ();
+		this->workers.clear ();
+		
+		{
+			std::lock_guard<std::mutex> guard {this->jobs_lock};
+			this->jobs.clear ();
+			this->pending = 0;
+		}
 	}
 	
 	
 	
 	/* 
-	 * Where everything happens.
+	 * Inserts an entry for the specified job into the heap of the worker
+	 * responsible for it. The job lock must be held.
 	 */
 	void
-	chunk_generator::main_loop ()
+	chunk_generator::push_job (std::shared_ptr<gen_job> job)
 	{
-		bool should_rest = false;
-		int counter = 0;
-		int req_counter = 0;
+		// jobs are grouped into 4x4 chunk cells, so that neighbouring chunks
+		// usually end up in the same worker's heap.
+		unsigned int cell = ((unsigned int)(job->cx >> 2) * 73856093U)
+			^ ((unsigned int)(job->cz >> 2) * 19349663U);
+		gen_worker *wk = this->workers[cell % this->workers.size ()].get ();
 		
-		while (this->_running)
+		std::lock_guard<std::mutex> guard {wk->lock};
+		wk->heap.push_back ({job, job->priority, this->next_seq ++});
+		std::push_heap (wk->heap.begin (), wk->heap.end ());
+	}
+	
+	
+	/* 
+	 * Returns the priority of the closest waiter in the given list.
+	 */
+	int
+	chunk_generator::lowest_priority (const std::vector<gen_waiter>& waiters)
+	{
+		int prio = std::numeric_limits<int>::max ();
+		for (auto& wt : waiters)
+			if (wt.priority < prio)
+				prio = wt.priority;
+		return prio;
+	}
+	
+	/* 
+	 * Removes the given player from the job's list of waiters, and drops the
+	 * job altogether if nobody is left waiting on it. The job lock must be
+	 * held.
+	 */
+	void
+	chunk_generator::remove_waiter (std::shared_ptr<gen_job> job, player *pl)
+	{
+		auto& waiters = job->waiters;
+		for (auto itr = waiters.begin (); itr != waiters.end (); ++itr)
+			if (itr->pl == pl)
+				{ waiters.erase (itr); break; }
+		
+		// jobs that are already being worked on are cleaned up by the worker.
+		if (job->state != GJS_QUEUED)
+			return;
+		
+		if (waiters.empty ())
 			{
-				if (should_rest)
-					std::this_thread::sleep_for (std::chrono::milliseconds (4));
-				else if (counter % 250 == 0)
-					std::this_thread::sleep_for (std::chrono::milliseconds (20));
-				should_rest = false;
-				++ counter;
-				
-				if (!this->requests.empty ())
+				job->state = GJS_DONE;
+				this->jobs.erase ({job->w, job->cx, job->cz});
+				-- this->pending;
+				return;
+			}
+		
+		int prio = lowest_priority (waiters);
+		if (prio != job->priority)
+			{
+				job->priority = prio;
+				this->push_job (job);
+			}
+	}
+	
+	
+	
+	/* 
+	 * Takes the closest job off the given worker's heap, or steals one from
+	 * another worker if it is empty. The returned job is marked as running.
+	 * Returns null if no jobs are pending at all.
+	 */
+	std::shared_ptr<chunk_generator::gen_job>
+	chunk_generator::next_job (gen_worker *w)
+	{
+		int count = this->workers.size ();
+		int self = 0;
+		while (this->workers[self].get () != w)
+			++ self;
+		
+		// own heap first, then steal from the others.
+		for (int i = 0; (i < count) && (this->pending.load () > 0); ++i)
+			{
+				gen_worker *victim = this->workers[(self + i) % count].get ();
+				for (;;)
 					{
-						gen_request req;
-						
-						// pop off queue
+						gen_entry ent;
 						{
-							std::lock_guard<std::mutex> guard {this->request_mutex};
-							if (this->requests.empty ())
-								continue;
-							
-							req = this->requests.front ();
-							this->requests.pop ();
-							++ req_counter;
+							std::lock_guard<std::mutex> guard {victim->lock};
+							if (victim->heap.empty ())
+								break;
+							std::pop_heap (victim->heap.begin (), victim->heap.end ());
+							ent = std::move (victim->heap.back ());
+							victim->heap.pop_back ();
 						}
 						
-						player *pl = req.pl;
-						world *w = req.w;
-						int flags = req.flags;
-						
-						if (!(flags & GFL_NOABORT) && (pl->get_world () != w || !pl->can_see_chunk (req.cx, req.cz)))
-							{
-								if (!(flags & GFL_NODELIVER))
-									pl->deliver_chunk (w, req.cx, req.cz, nullptr, GFL_ABORTED, req.extra);
-								continue;
-							}
-						
-						if ((flags & GFL_NODELIVER) && (w->get_chunk (req.cx, req.cz) != nullptr))
-							continue;
+						std::lock_guard<std::mutex> guard {this->jobs_lock};
+						if (ent.job->state != GJS_QUEUED || ent.priority != ent.job->priority)
+							continue; // outdated entry
 						
-						// generate chunk
-						chunk *ch = w->load_chunk (req.cx, req.cz);
-						if (!ch) continue; // shouldn't happen :X
-						
-						// deliver
-						// TODO: If the player disconnects at the right moment... this might
-						//       cause some problems, since the player pointer will remain
-						//       dangling...
-						if (!(flags & GFL_NODELIVER))
-							pl->deliver_chunk (w, req.cx, req.cz, ch, GFL_NONE, req.extra);
+						ent.job->state = GJS_RUNNING;
+						-- this->pending;
+						return ent.job;
+					}
+			}
+		
+		return std::shared_ptr<gen_job> ();
+	}
+	
+	
+	
+	/* 
+	 * Where everything happens.
+	 */
+	void
+	chunk_generator::main_loop (gen_worker *w)
+	{
+		while (this->_running)
+			{
+				std::shared_ptr<gen_job> job = this->next_job (w);
+				if (!job)
+					{
+						std::unique_lock<std::mutex> guard {this->wait_lock};
+						this->wait_cv.wait_for (guard, std::chrono::milliseconds (250),
+							[this] { return !this->_running || (this->pending.load () > 0); });
+						continue;
 					}
 				
-				should_rest = true;
+				this->handle (job);
+			}
+	}
+	
+	/* 
+	 * Generates (or loads) the chunk specified by the job and delivers it to
+	 * all players waiting on it.
+	 */
+	void
+	chunk_generator::handle (std::shared_ptr<gen_job> job)
+	{
+		world *w = job->w;
+		int cx = job->cx, cz = job->cz;
+		bool deliver = false;
+		
+		// drop players that no longer need the chunk.
+		{
+			std::lock_guard<std::mutex> guard {this->jobs_lock};
+			auto& waiters = job->waiters;
+			for (auto itr = waiters.begin (); itr != waiters.end (); )
+				{
+					player *pl = itr->pl;
+					if (!pl)
+						{ ++ itr; continue; }
+					
+					if (!(itr->flags & GFL_NOABORT) && (pl->get_world () != w || !pl->can_see_chunk (cx, cz)))
+						{
+							if (!(itr->flags & GFL_NODELIVER))
+								pl->deliver_chunk (w, cx, cz, nullptr, GFL_ABORTED, itr->extra);
+							itr = waiters.erase (itr);
+							continue;
+						}
+					
+					if (!(itr->flags & GFL_NODELIVER))
+						deliver = true;
+					++ itr;
+				}
+			
+			if (waiters.empty ())
+				{
+					job->state = GJS_DONE;
+					this->jobs.erase ({w, cx, cz});
+					return;
+				}
+		}
+		
+		if (deliver)
+			{
+				// generate all chunks around it first, to ensure that the world
+				// generator doesn't produce any glitched structures (such as trees
+				// cut in half) in the chunk we're about to send.
+				for (int xx = (cx - 1); xx <= (cx + 1); ++xx)
+					for (int zz = (cz - 1); zz <= (cz + 1); ++zz)
+						if (!(xx == cx && zz == cz))
+							w->load_chunk (xx, zz);
 			}
+		
+		// generate chunk
+		chunk *ch = w->load_chunk (cx, cz);
+		
+		// deliver
+		std::lock_guard<std::mutex> guard {this->jobs_lock};
+		for (auto& wt : job->waiters)
+			{
+				if (wt.cb)
+					wt.cb (ch);
+				else if (!(wt.flags & GFL_NODELIVER))
+					wt.pl->deliver_chunk (w, cx, cz, ch, ch ? GFL_NONE : GFL_ABORTED, wt.extra);
+			}
+		job->state = GJS_DONE;
+		this->jobs.erase ({w, cx, cz});
 	}
 	
 	
@@ -138,12 +309,159 @@ namespace hCraft {
 	/* 
 	 * Requests the chunk located at the given coordinates to be generated.
 	 * The specified player is then informed when it's ready.
+	 * 
+	 * Requesting a chunk that the player is already waiting on updates the
+	 * request's priority according to the player's current position.
 	 */
 	void
 	chunk_generator::request (world *w, int cx, int cz, player *pl, int flags, int extra)
 	{
-		std::lock_guard<std::mutex> guard {this->request_mutex};
-		this->requests.push ({pl, w, cx, cz, flags, extra});
+		if (this->workers.empty ())
+			return;
+		
+		// closest chunks first.
+		chunk_pos cpos = pl->pos;
+		int dx = cx - cpos.x, dz = cz - cpos.z;
+		int prio = dx*dx + dz*dz;
+		
+		{
+			std::lock_guard<std::mutex> guard {this->jobs_lock};
+			
+			auto itr = this->jobs.find ({w, cx, cz});
+			if (itr != this->jobs.end ())
+				{
+					// coalesce with the existing job
+					std::shared_ptr<gen_job> job = itr->second;
+					
+					bool found = false;
+					for (auto& wt : job->waiters)
+						if (wt.pl == pl)
+							{
+								if (!(flags & GFL_NODELIVER))
+									wt.flags &= ~GFL_NODELIVER;
+								wt.flags |= (flags & GFL_NOABORT);
+								wt.extra = extra;
+								wt.priority = prio;
+								found = true;
+								break;
+							}
+					if (!found)
+						job->waiters.push_back ({pl, flags, extra, prio});
+					
+					if (job->state == GJS_QUEUED)
+						{
+							int job_prio = lowest_priority (job->waiters);
+							if (job_prio != job->priority)
+								{
+									job->priority = job_prio;
+									this->push_job (job);
+								}
+						}
+					return;
+				}
+			
+			std::shared_ptr<gen_job> job (new gen_job ());
+			job->w = w;
+			job->cx = cx;
+			job->cz = cz;
+			job->state = GJS_QUEUED;
+			job->priority = prio;
+			job->waiters.push_back ({pl, flags, extra, prio});
+			
+			this->jobs[{w, cx, cz}] = job;
+			this->push_job (job);
+			++ this->pending;
+		}
+		
+		// synchronize with workers that are about to go to sleep
+		{ std::lock_guard<std::mutex> guard {this->wait_lock}; }
+		this->wait_cv.notify_one ();
+	}
+	
+	
+	
+	/* 
+	 * Requests the chunk located at the given coordinates to be generated on
+	 * behalf of something other than a player. @{cb} is called from one of
+	 * the generator's workers once the chunk is ready. Returns false if the
+	 * generator is not running, in which case @{cb} is never called.
+	 */
+	bool
+	chunk_generator::request (world *w, int cx, int cz,
+		std::function<void (chunk *)> cb, int priority)
+	{
+		if (this->workers.empty ())
+			return false;
+		
+		{
+			std::lock_guard<std::mutex> guard {this->jobs_lock};
+			
+			auto itr = this->jobs.find ({w, cx, cz});
+			if (itr != this->jobs.end ())
+				{
+					std::shared_ptr<gen_job> job = itr->second;
+					job->waiters.push_back ({nullptr, GFL_NOABORT, 0, priority, cb});
+					if ((job->state == GJS_QUEUED) && (priority < job->priority))
+						{
+							job->priority = priority;
+							this->push_job (job);
+						}
+					return true;
+				}
+			
+			std::shared_ptr<gen_job> job (new gen_job ());
+			job->w = w;
+			job->cx = cx;
+			job->cz = cz;
+			job->state = GJS_QUEUED;
+			job->priority = priority;
+			job->waiters.push_back ({nullptr, GFL_NOABORT, 0, priority, cb});
+			
+			this->jobs[{w, cx, cz}] = job;
+			this->push_job (job);
+			++ this->pending;
+		}
+		
+		{ std::lock_guard<std::mutex> guard {this->wait_lock}; }
+		this->wait_cv.notify_one ();
+		return true;
+	}
+	
+	
+	
+	/* 
+	 * Withdraws the player's request for the specified chunk. The chunk is
+	 * not generated at all if no one else is waiting on it.
+	 */
+	void
+	chunk_generator::cancel (player *pl, world *w, int cx, int cz)
+	{
+		std::lock_guard<std::mutex> guard {this->jobs_lock};
+		
+		auto itr = this->jobs.find ({w, cx, cz});
+		if (itr == this->jobs.end ())
+			return;
+		
+		std::shared_ptr<gen_job> job = itr->second;
+		this->remove_waiter (job, pl);
+	}
+	
+	/* 
+	 * Withdraws all requests made by the specified player.
+	 * Must be called before the player is destroyed.
+	 */
+	void
+	chunk_generator::cancel (player *pl)
+	{
+		std::lock_guard<std::mutex> guard {this->jobs_lock};
+		
+		std::vector<std::shared_ptr<gen_job>> affected;
+		for (auto& p : this->jobs)
+			for (auto& wt : p.second->waiters)
+				if (wt.pl == pl)
+					{ affected.push_back (p.second); break; }
+		
+		for (auto job : affected)
+			this->remove_waiter (job, pl);
 	}
 }
-
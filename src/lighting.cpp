@@ -20,30 +20,95 @@
 #include "logger.hpp"
 #include "blocks.hpp"
 #include "world.hpp"
+#include "threadpool.hpp"
 
 #include <utility>
-#include <bitset>
-#include <vector>
-
-#include <iostream> // DEBUG
+#include <algorithm>
+#include <cstring>
 
 
 namespace hCraft {
 	
+	/* 
+	 * Adds the specified position to the set. Returns false if it was
+	 * already in it.
+	 */
+	bool
+	block_bitmap::insert (int x, int y, int z)
+	{
+		unsigned long long key = ((unsigned long long)(unsigned int)(x >> 4) << 32)
+			| (unsigned int)(z >> 4);
+		
+		auto itr = this->chunks.find (key);
+		chunk_bits *bits;
+		if (itr == this->chunks.end ())
+			{
+				std::unique_ptr<chunk_bits> fresh;
+				if (this->spare.empty ())
+					fresh.reset (new chunk_bits ());
+				else
+					{
+						fresh = std::move (this->spare.back ());
+						this->spare.pop_back ();
+						fresh->reset ();
+					}
+				
+				bits = fresh.get ();
+				this->chunks.emplace (key, std::move (fresh));
+			}
+		else
+			bits = itr->second.get ();
+		
+		int index = (y << 8) | ((z & 15) << 4) | (x & 15);
+		if (bits->test (index))
+			return false;
+		bits->set (index);
+		return true;
+	}
+	
+	/* 
+	 * Removes all positions from the set.
+	 */
+	void
+	block_bitmap::clear ()
+	{
+		for (auto& p : this->chunks)
+			this->spare.push_back (std::move (p.second));
+		this->chunks.clear ();
+	}
+	
+	
+	
+//----
+	
 	/* 
 	 * Constructs a new lighting manager on top of the given world.
 	 */
-	lighting_manager::lighting_manager (logger &log, world *wr, int limit)
+	lighting_manager::lighting_manager (logger &log, world *wr)
 		: log (log)
 	{
 		this->wr = wr;
-		this->sl_overloaded = false;
-		this->bl_overloaded = false;
-		this->limit = limit;
+		
+		this->sl.sky = true;
+		this->bl.sky = false;
+		for (light_channel *lc : {&this->sl, &this->bl})
+			{
+				lc->active = false;
+				lc->level = 0;
+			}
 	}
 	
 	
 	
+	void
+	lighting_manager::enqueue_nolock (light_channel& lc, int x, int y, int z)
+	{
+		if (y < 0 || y > 255)
+			return;
+		if (lc.pending_set.insert (x, y, z))
+			lc.pending.emplace_back (x, y, z);
+	}
+	
 	void
 	lighting_manager::enqueue_nolock (int x, int y, int z)
 	{
@@ -54,31 +119,13 @@ namespace hCraft {
 	void
 	lighting_manager::enqueue_sl_nolock (int x, int y, int z)
 	{
-		if (this->sl_overloaded)
-			return;
-		
-		this->sl_updates.emplace (x, y, z);
-		if ((int)this->sl_updates.size () >= this->limit)
-			{
-				this->sl_overloaded = true;
-				this->log (LT_WARNING) << "World \"" << this->wr->get_name () <<
-					"\": Too many (S)lighting updates! (>= " << this->limit << ")" << std::endl;
-			}
+		this->enqueue_nolock (this->sl, x, y, z);
 	}
 	
 	void
 	lighting_manager::enqueue_bl_nolock (int x, int y, int z)
 	{
-		if (this->bl_overloaded)
-			return;
-		
-		this->bl_updates.emplace (x, y, z);
-		if ((int)this->bl_updates.size () >= this->limit)
-			{
-				this->bl_overloaded = true;
-				this->log (LT_WARNING) << "World \"" << this->wr->get_name () <<
-					"\": Too many (B)lighting updates! (>= " << this->limit << ")" << std::endl;
-			}
+		this->enqueue_nolock (this->bl, x, y, z);
 	}
 	
 	/* 
@@ -93,320 +140,708 @@ namespace hCraft {
 	
 	
 	
+//----
+	
+	static const int neighbour_offsets[6][3] = {
+		{ 1, 0, 0 }, { -1, 0, 0 },
+		{ 0, 1, 0 }, { 0, -1, 0 },
+		{ 0, 0, 1 }, { 0, 0, -1 },
+	};
+	
+	// indices of the upwards and downwards offsets in neighbour_offsets.
+	static const int neighbour_up = 2;
+	static const int neighbour_down = 3;
+	
+	
 	static inline int
-	_max (int a, int b)
-		{ return (a < b) ? b : a; }
+	get_light (bool sky, chunk *ch, int bx, int y, int bz)
+	{
+		return sky ? ch->get_sky_light (bx, y, bz)
+							 : ch->get_block_light (bx, y, bz);
+	}
 	
+	static inline void
+	set_light (bool sky, chunk *ch, int bx, int y, int bz, int val)
+	{
+		if (sky)
+			ch->set_sky_light (bx, y, bz, val);
+		else
+			ch->set_block_light (bx, y, bz, val);
+	}
+	
+	/* 
+	 * Returns the amount of light the specified block gets regardless of its
+	 * surroundings. Sky light enters the world through its top-most layer.
+	 */
 	static inline int
-	_min (int a, int b)
-		{ return (a > b) ? b : a; }
+	light_source (bool sky, int y, block_info *inf)
+	{
+		if (!sky)
+			return inf->luminance;
+		
+		if (y < 255 || inf->opacity >= 15)
+			return 0;
+		return 15 - inf->opacity;
+	}
 	
+	/* 
+	 * Returns the light level a block of the given type receives from a
+	 * neighbour lit at @{level}, or -1 if the block does not let light in.
+	 * Full sky light falling straight down is only dimmed by the blocks it
+	 * passes through.
+	 */
 	static inline int
-	_abs (int x)
-		{ return (x < 0) ? (-x) : x; }
+	light_through (bool sky, block_info *inf, int level, bool down = false)
+	{
+		if (!sky)
+			return inf->opaque ? -1 : (level - 1);
+		
+		if (inf->opacity >= 15)
+			return -1;
+		if (down && level == 15)
+			return 15 - inf->opacity;
+		return level - 1 - inf->opacity;
+	}
 	
 	
 	
-	using fn_enqueue = void (*)(void *, int, int, int);
+	/* 
+	 * Queues the specified block, lit at @{level}, to spread its light to its
+	 * neighbours. If @{dedup} is true, the block is queued only if it has not
+	 * already been seeded during the current pass.
+	 */
+	void
+	lighting_manager::seed (light_channel& lc, int x, int y, int z, int level,
+		bool dedup)
+	{
+		if (level <= 1)
+			return; // nothing to spread
+		if (dedup && !lc.seeded.insert (x, y, z))
+			return;
+		
+		lc.buckets[level].emplace_back (x, y, z);
+		if (level > lc.level)
+			lc.level = level;
+	}
 	
+	/* 
+	 * Records that the light of the sub-chunk containing the specified block
+	 * has changed.
+	 */
+	void
+	lighting_manager::mark_changed (int x, int y, int z)
+	{
+		unsigned long long key = ((unsigned long long)(unsigned int)(x >> 4) << 32)
+			| (unsigned int)(z >> 4);
+		this->changed[key] |= 1 << (y >> 4);
+	}
 	
-	static char
-	calc_chunk_sky_light (chunk *ch, int x, int y, int z, fn_enqueue enq, void *p)
+	/* 
+	 * Remembers the light the specified block had before the current pass
+	 * first modified it.
+	 */
+	void
+	lighting_manager::touch (light_channel& lc, int x, int y, int z, int old)
 	{
-		block_data this_block = ch->get_block (x, y, z);
-		block_info *this_info = block_info::from_id (this_block.id);
-		char nl;
-		
-		if (this_info->opacity == 15)
+		if (lc.touched_set.insert (x, y, z))
+			lc.touched.push_back ({ x, y, z, old });
+	}
+	
+	/* 
+	 * Ends the channel's current pass. Only sub-chunks with blocks that did
+	 * not end up back at their old light level are marked as changed.
+	 */
+	void
+	lighting_manager::finish_pass (light_channel& lc)
+	{
+		lc.active = false;
+		for (const light_node& n : lc.touched)
 			{
-				nl = 0;
+				chunk *ch = this->wr->get_chunk (n.x >> 4, n.z >> 4);
+				if (ch && get_light (lc.sky, ch, n.x & 15, n.y, n.z & 15) != n.level)
+					this->mark_changed (n.x, n.y, n.z);
 			}
-		else if ((y + 1) >= ch->get_height (x, z))
+		
+		lc.touched.clear ();
+		lc.touched_set.clear ();
+	}
+	
+	/* 
+	 * Darkens the specified block and sets it back to the light it gets on
+	 * its own.
+	 */
+	void
+	lighting_manager::reset_block (light_channel& lc, chunk *ch, int x, int y,
+		int z)
+	{
+		int bx = x & 15, bz = z & 15;
+		block_info *inf = block_info::from_id (ch->get_id (bx, y, bz));
+		int src = light_source (lc.sky, y, inf);
+		
+		int old = get_light (lc.sky, ch, bx, y, bz);
+		if (old > 0 || src > 0)
+			this->touch (lc, x, y, z, old);
+		if (old > 0)
 			{
-				nl = 15 - this_info->opacity;
+				set_light (lc.sky, ch, bx, y, bz, 0);
+				lc.darken.push_back ({ x, y, z, old });
 			}
-		else
+		if (src > 0)
 			{
-				char sle = (x < 15) ? ch->get_sky_light (x + 1, y, z)
-														 : (ch->east ? ch->east->get_sky_light (0, y, z) : 0);
-				char slw = (x >  0) ? ch->get_sky_light (x - 1, y, z)
-														 : (ch->west ? ch->west->get_sky_light (15, y, z) : 0);
-				char slu = (y < 255) ? ch->get_sky_light (x, y + 1, z) : 15;
-				char sld = (y >   0) ? ch->get_sky_light (x, y - 1, z) : 0;
-				char sls = (z < 15) ? ch->get_sky_light (x, y, z + 1)
-														 : (ch->south ? ch->south->get_sky_light (x, y, 0) : 0);
-				char sln = (z >  0) ? ch->get_sky_light (x, y, z - 1)
-														 : (ch->north ? ch->north->get_sky_light (x, y, 15) : 0);
-				
-				char brightest = _max (sle, _max (slw, _max (slu, _max (sld, _max (sls, _max (sln, 0))))));
-				nl = brightest - this_info->opacity - 1;
-				if (nl < 0) nl = 0;
+				set_light (lc.sky, ch, bx, y, bz, src);
+				this->seed (lc, x, y, z, src, false);
 			}
+	}
+	
+	/* 
+	 * Starts a new pass over the blocks pending in the given channel.
+	 */
+	void
+	lighting_manager::start_pass (light_channel& lc)
+	{
+		std::vector<light_update> pending;
+		pending.swap (lc.pending);
+		lc.pending_set.clear ();
+		lc.seeded.clear ();
+		lc.level = 0;
+		lc.active = true;
 		
-		if (this_block.sl != nl)
+		for (const light_update& u : pending)
 			{
-				ch->set_sky_light (x, y, z, nl);
+				chunk *ch = this->wr->get_chunk (u.x >> 4, u.z >> 4);
+				if (!ch)
+					continue;
+				
+				this->reset_block (lc, ch, u.x, u.y, u.z);
 				
-				if (x < 15)  enq (p, x + 1, y, z);
-				if (x >  0)  enq (p, x - 1, y, z);
-				if (y < 255) enq (p, x, y + 1, z);
-				if (y >   0) enq (p, x, y - 1, z);
-				if (z < 15)  enq (p, x, y, z + 1);
-				if (z >  0)  enq (p, x, y, z - 1);
+				// the block might have become transparent, pull light back in from
+				// its neighbours.
+				for (int i = 0; i < 6; ++i)
+					{
+						int nx = u.x + neighbour_offsets[i][0];
+						int ny = u.y + neighbour_offsets[i][1];
+						int nz = u.z + neighbour_offsets[i][2];
+						if (ny < 0 || ny > 255)
+							continue;
+						
+						chunk *nch = ((nx >> 4) == (u.x >> 4) && (nz >> 4) == (u.z >> 4))
+							? ch : this->wr->get_chunk (nx >> 4, nz >> 4);
+						if (!nch)
+							continue;
+						
+						this->seed (lc, nx, ny, nz,
+							get_light (lc.sky, nch, nx & 15, ny, nz & 15), true);
+					}
 			}
-		
-		return nl;
 	}
 	
-	static char
-	calc_sky_light (lighting_manager &lm, int x, int y, int z, fn_enqueue enq, void *p)
+	
+	
+	/* 
+	 * Removes light that was spread by the block at @{n}, which used to be
+	 * lit at level @{n.level}.
+	 */
+	void
+	lighting_manager::darken_step (light_channel& lc, const light_node& n)
 	{
-		world *wr = lm.get_world ();
-		
-		int cx = x >> 4;
-		int cz = z >> 4;
-		int bx = x & 15;
-		int bz = z & 15;
-		chunk *ch = wr->get_chunk (cx, cz);
-		if (!ch) return 0;
-		
-		block_data this_block = ch->get_block (bx, y, bz);
-		block_info *this_info = block_info::from_id (this_block.id);
-		char nl;
-		
-		if (this_info->opacity == 15)
+		for (int i = 0; i < 6; ++i)
 			{
-				nl = 0;
-			}
-		else if ((y + 1) >= ch->get_height (bx, bz))
-			{
-				nl = 15 - this_info->opacity;
+				int nx = n.x + neighbour_offsets[i][0];
+				int ny = n.y + neighbour_offsets[i][1];
+				int nz = n.z + neighbour_offsets[i][2];
+				if (ny < 0 || ny > 255)
+					continue;
+				
+				chunk *ch = this->wr->get_chunk (nx >> 4, nz >> 4);
+				if (!ch)
+					continue;
+				
+				int bx = nx & 15, bz = nz & 15;
+				int nl = get_light (lc.sky, ch, bx, ny, bz);
+				if (nl == 0)
+					continue;
+				
+				// full sky light falls straight down without getting any dimmer.
+				bool lit_by = (nl < n.level) ||
+					(lc.sky && (i == neighbour_down) && (n.level == 15) && (nl == 15));
+				if (lit_by)
+					this->reset_block (lc, ch, nx, ny, nz);
+				else
+					{
+						// lit independently, spread its light back into the darkened
+						// area.
+						this->seed (lc, nx, ny, nz, nl, true);
+					}
 			}
-		else
+	}
+	
+	/* 
+	 * Spreads the light of the block at @{u} (lit at @{level}) to its
+	 * neighbours.
+	 */
+	void
+	lighting_manager::brighten_step (light_channel& lc, const light_update& u,
+		int level)
+	{
+		for (int i = 0; i < 6; ++i)
 			{
-				char sle = (bx < 15) ? ch->get_sky_light (bx + 1, y, bz)
-														 : (ch->east ? ch->east->get_sky_light (0, y, bz) : 0);
-				char slw = (bx >  0) ? ch->get_sky_light (bx - 1, y, bz)
-														 : (ch->west ? ch->west->get_sky_light (15, y, bz) : 0);
-				char slu = (y < 255) ? ch->get_sky_light (bx, y + 1, bz) : 15;
-				char sld = (y >   0) ? ch->get_sky_light (bx, y - 1, bz) : 0;
-				char sls = (bz < 15) ? ch->get_sky_light (bx, y, bz + 1)
-														 : (ch->south ? ch->south->get_sky_light (bx, y, 0) : 0);
-				char sln = (bz >  0) ? ch->get_sky_light (bx, y, bz - 1)
-														 : (ch->north ? ch->north->get_sky_light (bx, y, 15) : 0);
+				int nx = u.x + neighbour_offsets[i][0];
+				int ny = u.y + neighbour_offsets[i][1];
+				int nz = u.z + neighbour_offsets[i][2];
+				if (ny < 0 || ny > 255)
+					continue;
 				
-				char brightest = _max (sle, _max (slw, _max (slu, _max (sld, _max (sls, _max (sln, 0))))));
-				nl = brightest;
-				nl -= this_info->opacity + 1;
-				if (nl < 0) nl = 0;
+				chunk *ch = this->wr->get_chunk (nx >> 4, nz >> 4);
+				if (!ch)
+					continue;
+				
+				int bx = nx & 15, bz = nz & 15;
+				block_info *inf = block_info::from_id (ch->get_id (bx, ny, bz));
+				int cand = light_through (lc.sky, inf, level, i == neighbour_down);
+				int cur = get_light (lc.sky, ch, bx, ny, bz);
+				if (cand > cur)
+					{
+						this->touch (lc, nx, ny, nz, cur);
+						set_light (lc.sky, ch, bx, ny, bz, cand);
+						this->seed (lc, nx, ny, nz, cand, false);
+					}
 			}
-		
-		if (this_block.sl != nl)
+	}
+	
+	/* 
+	 * Continues the channel's current pass, doing no more than @{budget}
+	 * blocks' worth of work. Returns the amount of work done.
+	 */
+	int
+	lighting_manager::run_pass (light_channel& lc, int budget)
+	{
+		int done = 0;
+		while (done < budget)
 			{
-				ch->set_sky_light (bx, y, bz, nl);
+				// darken everything first, so that light is only ever spread into
+				// its final place.
+				if (!lc.darken.empty ())
+					{
+						light_node n = lc.darken.front ();
+						lc.darken.pop_front ();
+						this->darken_step (lc, n);
+						++ done;
+						continue;
+					}
+				
+				while (lc.level > 0 && lc.buckets[lc.level].empty ())
+					-- lc.level;
+				if (lc.level == 0)
+					{
+						this->finish_pass (lc);
+						break;
+					}
+				
+				int level = lc.level;
+				light_update u = lc.buckets[level].back ();
+				lc.buckets[level].pop_back ();
+				++ done;
 				
-				enq (p, x + 1, y, z);
-				enq (p, x - 1, y, z);
-				if (y < 255) enq (p, x, y + 1, z);
-				if (y >   0) enq (p, x, y - 1, z);
-				enq (p, x, y, z + 1);
-				enq (p, x, y, z - 1);
+				chunk *ch = this->wr->get_chunk (u.x >> 4, u.z >> 4);
+				if (!ch || get_light (lc.sky, ch, u.x & 15, u.y, u.z & 15) != level)
+					continue; // stale
+				
+				this->brighten_step (lc, u, level);
 			}
 		
-		return nl;
+		return done;
 	}
 	
 	
-	static char
-	get_neighbour_bl (chunk *ch, int bx, int by, int bz)
-	{
-		if (by > 255) return 0;
-		if (by <   0) return 0;
-		
-		if (bx > 15)
-			{ bx = 0; ch = ch->east; if (!ch) return 0; }
-		if (bx <  0)
-			{ bx = 15; ch = ch->west; if (!ch) return 0; }
-		if (bz > 15)
-			{ bz = 0; ch = ch->south; if (!ch) return 0; }
-		if (bz <  0)
-			{ bz = 15; ch = ch->north; if (!ch) return 0; }
-		
-		block_data bd = ch->get_block (bx, by, bz);
-		block_info *binf = block_info::from_id (bd.id);
-		if (binf->opaque && (binf->luminance == 0))
-			return 0;
-		return bd.bl;
-	}
 	
-	 
-	static char
-	calc_block_light (lighting_manager& lm, int x, int y, int z, fn_enqueue enq, void *p)
+	/* 
+	 * Goes through all queued updates and handles them (No more than
+	 * @{max_updates} blocks are relit for each kind of light).
+	 * 
+	 * Returns the total amount of blocks relit.
+	 */
+	int
+	lighting_manager::update (int max_updates)
 	{
-		world *wr = lm.get_world ();
-		
-		int cx = x >> 4;
-		int cz = z >> 4;
-		int bx = x & 15;
-		int bz = z & 15;
-		chunk *ch = wr->get_chunk (cx, cz);
-		if (!ch) return 0;
-		
-		block_data this_block = ch->get_block (bx, y, bz);
-		block_info *this_info = block_info::from_id (this_block.id);
-		char nl;
-		
-		if (this_info->opaque)
-			{
-				nl = this_info->luminance;
-			}
-		else
-			{
-				char ble = get_neighbour_bl (ch, bx + 1, y, bz);
-				char blw = get_neighbour_bl (ch, bx - 1, y, bz);
-				char blu = get_neighbour_bl (ch, bx, y + 1, bz);
-				char bld = get_neighbour_bl (ch, bx, y - 1, bz);
-				char bls = get_neighbour_bl (ch, bx, y, bz + 1);
-				char bln = get_neighbour_bl (ch, bx, y, bz - 1);
+		std::lock_guard<std::mutex> guard {this->lock};
 		
-				char brightest = _max (ble, _max (blw, _max (blu, _max (bld, _max (bls, _max (bln, 0))))));
-				nl = brightest - 1 + this_info->luminance;
-				if (nl <  0) nl = 0;
-				else if (nl > 15) nl = 15;
-			}
+		std::vector<chunk_pos> borders;
+		{
+			std::lock_guard<std::mutex> border_guard {this->border_lock};
+			borders.swap (this->borders);
+		}
+		for (const chunk_pos& pos : borders)
+			this->exchange_borders (pos.x, pos.z);
 		
-		if (this_block.bl != nl)
+		int total = 0;
+		for (light_channel *lc : {&this->sl, &this->bl})
 			{
-				ch->set_block_light (bx, y, bz, nl);
-				
-				enq (p, x + 1, y, z);
-				enq (p, x - 1, y, z);
-				if (y < 255) enq (p, x, y + 1, z);
-				if (y >   0) enq (p, x, y - 1, z);
-				enq (p, x, y, z + 1);
-				enq (p, x, y, z - 1);
+				int budget = max_updates;
+				while (budget > 0)
+					{
+						if (!lc->active)
+							{
+								// blocks modified during a pass are relit in the next one.
+								if (lc->pending.empty ())
+									break;
+								
+								int count = (int)lc->pending.size ();
+								this->start_pass (*lc);
+								budget -= count;
+								total += count;
+								continue;
+							}
+						
+						int done = this->run_pass (*lc, budget);
+						budget -= done;
+						total += done;
+					}
 			}
 		
-		return nl;
+		return total;
 	}
 	
 	
 	
-	static void
-	chunk_enqueue_sl (void *param, int x, int y, int z)
-	{
-		std::queue<light_update> *q = static_cast<std::queue<light_update> *> (param);
-		q->emplace (x, y, z);
-	}
+//----
 	
+	/* 
+	 * Spreads light through a chunk's flat light array (indexed by
+	 * (y << 8) | (z << 4) | x), starting with the blocks queued in @{buckets}.
+	 * @{props} holds the opacity of every block for sky light, and its
+	 * luminance (with the top bit set for opaque blocks) for block light.
+	 */
 	static void
-	chunk_enqueue_bl (void *param, int x, int y, int z)
+	spread_in_chunk (bool sky, unsigned char *light, const unsigned char *props,
+		std::vector<unsigned short> *buckets, int top)
 	{
-		
+		for (int level = top; level > 1; --level)
+			while (!buckets[level].empty ())
+				{
+					int index = buckets[level].back ();
+					buckets[level].pop_back ();
+					if (light[index] != level)
+						continue; // stale
+					
+					int x = index & 15, z = (index >> 4) & 15, y = index >> 8;
+					for (int i = 0; i < 6; ++i)
+						{
+							int nx = x + neighbour_offsets[i][0];
+							int ny = y + neighbour_offsets[i][1];
+							int nz = z + neighbour_offsets[i][2];
+							if (nx < 0 || nx > 15 || nz < 0 || nz > 15 || ny < 0 || ny > 255)
+								continue;
+							
+							int n = (ny << 8) | (nz << 4) | nx;
+							int cand;
+							if (!sky)
+								cand = (props[n] & 0x80) ? -1 : (level - 1);
+							else if (props[n] >= 15)
+								cand = -1;
+							else if (i == neighbour_down && level == 15)
+								cand = 15 - props[n];
+							else
+								cand = level - 1 - props[n];
+							
+							if (cand > light[n])
+								{
+									light[n] = cand;
+									buckets[cand].push_back (n);
+								}
+						}
+				}
 	}
+	
 	/* 
 	 * Relights a whole chunk (as much as possible).
 	 */
 	void
 	lighting_manager::relight_chunk (chunk *ch)
 	{
-		std::queue<light_update> updates;
+		// block properties and light values, indexed by (y << 8) | (z << 4) | x.
+		std::vector<unsigned char> opacity (65536), props (65536);
+		std::vector<unsigned char> sl (65536), bl (65536);
+		
+		for (int sy = 0; sy < 16; ++sy)
+			{
+				subchunk *sub = ch->get_sub (sy);
+				if (!sub)
+					continue; // all air
+				
+				// palette entries are looked up once per sub-chunk, rather than once
+				// per block.
+				sub->export_ids (&opacity[sy << 12],
+					[] (unsigned short id) -> unsigned char
+						{ return block_info::from_id (id)->opacity; });
+				sub->export_ids (&props[sy << 12],
+					[] (unsigned short id) -> unsigned char
+						{
+							block_info *inf = block_info::from_id (id);
+							return inf->luminance | (inf->opaque ? 0x80 : 0);
+						});
+			}
+		
+		/* 
+		 * Sky light: scan all columns at once, a layer at a time, from the top
+		 * down. Full sky light is only dimmed by opacity, anything weaker
+		 * loses an extra level per block.
+		 */
+		unsigned char level[256];
+		short tops[256] = { 0 }; // one above the highest non-transparent block
+		std::memset (level, 15, 256);
+		for (int y = 255; y >= 0; --y)
+			{
+				const unsigned char *row = &opacity[y << 8];
+				for (int i = 0; i < 256; ++i)
+					{
+						int loss = row[i] + ((level[i] == 15) ? 0 : 1);
+						level[i] = (loss >= level[i]) ? 0 : (level[i] - loss);
+					}
+				std::memcpy (&sl[y << 8], level, 256);
+				
+				for (int i = 0; i < 256; ++i)
+					if (row[i] && !tops[i])
+						tops[i] = y + 1;
+			}
 		
+		/* 
+		 * Spread the sky light sideways. Above the highest non-transparent block
+		 * in its own and neighbouring columns, a block is as bright as it can
+		 * get, and so are all of its neighbours.
+		 */
+		std::vector<unsigned short> buckets[16];
+		int top = 0;
 		for (int x = 0; x < 16; ++x)
 			for (int z = 0; z < 16; ++z)
 				{
-					// the top-most layer is always lit.
-					ch->set_sky_light (x, 255, z, 15);
-					
-					bool at_air = false;
-					unsigned short id;
+					int h = tops[(z << 4) | x];
+					if (x > 0  && tops[(z << 4) | (x - 1)] > h) h = tops[(z << 4) | (x - 1)];
+					if (x < 15 && tops[(z << 4) | (x + 1)] > h) h = tops[(z << 4) | (x + 1)];
+					if (z > 0  && tops[((z - 1) << 4) | x] > h) h = tops[((z - 1) << 4) | x];
+					if (z < 15 && tops[((z + 1) << 4) | x] > h) h = tops[((z + 1) << 4) | x];
 					
-					char curr_opacity = 15;
-					for (int y = 254; y >= 0; --y)
+					for (int y = 0; y < h; ++y)
 						{
-							if (curr_opacity > 0)
-								curr_opacity -= block_info::from_id (ch->get_id (x, y, z))->opacity;
-							
-							// TODO: accept all transparent blocks
-							id = ch->get_id (x, y,z);
-							if (id != BT_AIR)
-								at_air = false;
-							else if (!at_air)
+							int index = (y << 8) | (z << 4) | x;
+							int l = sl[index];
+							if (l > 1)
 								{
-									at_air = true;
-									updates.emplace (x, y, z);
+									buckets[l].push_back (index);
+									if (l > top)
+										top = l;
 								}
-							
-							ch->set_sky_light (x, y, z, (curr_opacity > 0) ? curr_opacity : 0);
 						}
 				}
+		spread_in_chunk (true, sl.data (), opacity.data (), buckets, top);
 		
+		/* 
+		 * Block light, spread from luminous blocks.
+		 */
+		top = 0;
+		for (int i = 0; i < 65536; ++i)
+			{
+				int l = props[i] & 0xF;
+				bl[i] = l;
+				if (l > 1)
+					{
+						buckets[l].push_back (i);
+						if (l > top)
+							top = l;
+					}
+			}
+		spread_in_chunk (false, bl.data (), props.data (), buckets, top);
 		
-		while (!updates.empty ())
+		/* 
+		 * Write the light values back, a sub-chunk at a time.
+		 */
+		unsigned char bl_nibbles[2048], sl_nibbles[2048];
+		for (int sy = 0; sy < 16; ++sy)
 			{
-				light_update u = updates.front ();
-				updates.pop ();
-				calc_chunk_sky_light (ch, u.x, u.y, u.z, chunk_enqueue_sl, &updates);
+				const unsigned char *bls = &bl[sy << 12];
+				const unsigned char *sls = &sl[sy << 12];
+				bool lit = false;
+				for (int i = 0; i < 2048; ++i)
+					{
+						bl_nibbles[i] = bls[i << 1] | (bls[(i << 1) | 1] << 4);
+						sl_nibbles[i] = sls[i << 1] | (sls[(i << 1) | 1] << 4);
+						lit |= (bl_nibbles[i] != 0x00) || (sl_nibbles[i] != 0xFF);
+					}
+				
+				// sub-chunks that do not exist are dark and fully exposed to the sky.
+				if (!lit && !ch->get_sub (sy))
+					continue;
+				ch->assign_light (sy, bl_nibbles, sl_nibbles);
 			}
-	} 
+	}
 	
+	/* 
+	 * Relights the given chunks from scratch, spreading the work over
+	 * @{pool}. Each chunk is lit on its own; light is exchanged with the
+	 * chunks around it later on, by update ().
+	 * 
+	 * Not thread-safe, the caller must hold the manager's lock.
+	 */
+	void
+	lighting_manager::relight_chunks_nolock (thread_pool& pool,
+		const std::vector<chunk_pos>& chunks)
+	{
+		std::vector<chunk *> found;
+		for (const chunk_pos& pos : chunks)
+			{
+				chunk *ch = this->wr->get_chunk (pos.x, pos.z);
+				if (ch)
+					found.push_back (ch);
+			}
+		
+		pool.run_parallel (found.size (),
+			[&found] (size_t i)
+				{
+					lighting_manager::relight_chunk (found[i]);
+				});
+		
+		std::lock_guard<std::mutex> guard {this->border_lock};
+		this->borders.insert (this->borders.end (), chunks.begin (), chunks.end ());
+	}
+	
+	/* 
+	 * Queues the borders of the specified chunk to be checked for light that
+	 * has to cross over to (or from) the chunks around it. Thread-safe, and
+	 * does not acquire the manager's lock.
+	 */
+	void
+	lighting_manager::queue_borders (int cx, int cz)
+	{
+		std::lock_guard<std::mutex> guard {this->border_lock};
+		this->borders.emplace_back (cx, cz);
+	}
 	
 	
-	static void
-	lm_enqueue_sl (void *param, int x, int y, int z)
+	
+	/* 
+	 * Appends the sub-chunks whose light has been changed by update () since
+	 * the last call to @{out}. Chunks relit as a whole are not included.
+	 */
+	void
+	lighting_manager::take_changes (std::vector<light_change>& out)
 	{
-		lighting_manager *lm = static_cast<lighting_manager *> (param);
-		lm->enqueue_sl_nolock (x, y, z);
+		std::lock_guard<std::mutex> guard {this->lock};
+		for (auto& p : this->changed)
+			out.push_back ({ (int)(p.first >> 32), (int)(p.first & 0xFFFFFFFFU),
+				p.second });
+		this->changed.clear ();
 	}
 	
-	static void
-	lm_enqueue_bl (void *param, int x, int y, int z)
+	
+	
+	static int
+	top_sub (chunk *ch)
 	{
-		lighting_manager *lm = static_cast<lighting_manager *> (param);
-		lm->enqueue_bl_nolock (x, y, z);
+		for (int sy = 15; sy >= 0; --sy)
+			if (ch->get_sub (sy))
+				return sy;
+		return -1;
 	}
 	
 	/* 
-	 * Goes through all queued updates and handles them (No more than
-	 * @{max_updates} updates are handled).
-	 * 
-	 * Returns the total amount of updates handled.
+	 * Checks whether the specified block would be lit at @{level} even
+	 * without the block at (@{from_x}, @{from_z}) next to it: by its own
+	 * emission, by the sky above it, or by any of its other neighbours.
 	 */
-	int
-	lighting_manager::update (int max_updates)
+	bool
+	lighting_manager::light_supported (light_channel& lc, chunk *ch, int x,
+		int y, int z, int level, int from_x, int from_z)
 	{
-		std::lock_guard<std::mutex> guard {this->lock};
+		block_info *inf = block_info::from_id (ch->get_id (x & 15, y, z & 15));
+		if (light_source (lc.sky, y, inf) >= level)
+			return true;
 		
-		//std::cout << "A" << std::flush;
-		int updated = 0;
-		
-		// sky light updates
-		while (!this->sl_updates.empty () && (updated++ < max_updates))
+		for (int i = 0; i < 6; ++i)
 			{
-				light_update u = this->sl_updates.front ();
-				this->sl_updates.pop ();
+				int nx = x + neighbour_offsets[i][0];
+				int ny = y + neighbour_offsets[i][1];
+				int nz = z + neighbour_offsets[i][2];
+				if (ny < 0 || ny > 255 || (nx == from_x && nz == from_z && ny == y))
+					continue;
+				
+				chunk *nch = ch;
+				if ((nx >> 4) != (x >> 4) || (nz >> 4) != (z >> 4))
+					{
+						nch = this->wr->get_chunk (nx >> 4, nz >> 4);
+						if (!nch)
+							continue;
+					}
 				
-				calc_sky_light (*this, u.x, u.y, u.z, lm_enqueue_sl, this);
+				// light coming from the block above travels downwards.
+				int nl = get_light (lc.sky, nch, nx & 15, ny, nz & 15);
+				if (light_through (lc.sky, inf, nl, i == neighbour_up) >= level)
+					return true;
 			}
-		if (this->sl_updates.empty ())
-			this->sl_overloaded = false;
 		
-		//std::cout << "B" << std::flush;
+		return false;
+	}
+	
+	/* 
+	 * Compares the blocks on the two sides of a chunk border, and queues the
+	 * ones whose light is off.
+	 */
+	void
+	lighting_manager::exchange_light (light_channel& lc, chunk *ach, int ax,
+		int az, chunk *bch, int bx, int bz, int y)
+	{
+		int la = get_light (lc.sky, ach, ax & 15, y, az & 15);
+		int lb = get_light (lc.sky, bch, bx & 15, y, bz & 15);
+		block_info *ainf = block_info::from_id (ach->get_id (ax & 15, y, az & 15));
+		block_info *binf = block_info::from_id (bch->get_id (bx & 15, y, bz & 15));
+		
+		// B is queued if A lights it up further, or if its light is explained
+		// by nothing but A (it might have come from A before A was relit).
+		int lb_from_a = light_through (lc.sky, binf, la);
+		if (lb_from_a > lb || ((lb > 0) && (lb > lb_from_a)
+			&& !this->light_supported (lc, bch, bx, y, bz, lb, ax, az)))
+			this->enqueue_nolock (lc, bx, y, bz);
+		
+		if (light_through (lc.sky, ainf, lb) > la)
+			this->enqueue_nolock (lc, ax, y, az);
+	}
+	
+	/* 
+	 * Queues blocks along the borders of the specified (relit) chunk to be
+	 * relit, wherever light has to cross over to or from its neighbours.
+	 */
+	void
+	lighting_manager::exchange_borders (int cx, int cz)
+	{
+		chunk *ch = this->wr->get_chunk (cx, cz);
+		if (!ch)
+			return;
 		
-		// block light updates
-		updated = 0;
-		while (!this->bl_updates.empty () && (updated++ < max_updates))
+		for (int d = 0; d < 4; ++d)
 			{
-				light_update u = this->bl_updates.front ();
-				this->bl_updates.pop ();
+				int dx = neighbour_offsets[(d < 2) ? d : (d + 2)][0];
+				int dz = neighbour_offsets[(d < 2) ? d : (d + 2)][2];
+				chunk *nch = this->wr->get_chunk (cx + dx, cz + dz);
+				if (!nch)
+					continue;
+				
+				// block light can rise up to 14 blocks above the highest sub-chunk.
+				int h = (std::max (top_sub (ch), top_sub (nch)) + 2) << 4;
+				if (h > 256)
+					h = 256;
 				
-				calc_block_light (*this, u.x, u.y, u.z, lm_enqueue_bl, this);
+				for (int i = 0; i < 16; ++i)
+					{
+						// world coordinates of the blocks on either side.
+						int ax = (cx << 4) + ((dx == 0) ? i : ((dx > 0) ? 15 : 0));
+						int az = (cz << 4) + ((dz == 0) ? i : ((dz > 0) ? 15 : 0));
+						int bx = ax + dx, bz = az + dz;
+						
+						for (int y = 0; y < h; ++y)
+							{
+								this->exchange_light (this->sl, ch, ax, az, nch, bx, bz, y);
+								this->exchange_light (this->bl, ch, ax, az, nch, bx, bz, y);
+							}
+					}
 			}
-		if (this->bl_updates.empty ())
-			this->bl_overloaded = false;
-		
-		//std::cout << "C" << std::flush;
-		return updated;
 	}
 }
 
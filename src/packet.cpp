@@ -22,11 +22,13 @@
 #include "utils.hpp"
 #include "nbt.hpp"
 #include "player.hpp"
+#include "compression.hpp"
 #include <cstring>
 #include <zlib.h>
 #include <cmath>
 #include <sstream>
 #include <string>
+#include <mutex>
 
 #include <cryptopp/queue.h>
 #include <iostream> // DEBUG
@@ -426,153 +428,249 @@ namespace hCraft {
 	}
 	
 	/* 
-	 * Checks the specified byte array and determines how many more bytes should
-	 * be read in-order to complete reading the packet. Note that this function
-	 * might be called numerous times, since packets often contain variable-
-	 * length data (such as strings, slot data, etc...). Aside from checking the
-	 * remaining amount of bytes left, the function can also be used to check
-	 * whether the first byte of the array (the packet's opcode) is associated
-	 * with any valid packet (it returns -1 to indicate that it is not).
+	 * Layout of packets sent by clients, indexed by opcode:
+	 */
+	static const char* _rem_table[] =
+		{
+		/* 
+		 * o = opcode
+		 * ? = boolean
+		 * b = byte
+		 * s = short
+		 * i = int
+		 * l = long
+		 * f = float
+		 * d = double
+		 * z = string
+		 * q = slot
+		 * a = array
+		 */
+		
+			"oi"         , ""           , "obzzi"      , "oz"         , // 0x03
+			""           , ""           , ""           , "oii?"       , // 0x07
+			""           , ""           , "o?"         , "odddd?"     , // 0x0B
+			"off?"       , "oddddff?"   , "obibib"     , "oibibqbbb"  , // 0x0F
+			
+			"os"         , ""           , "oib"        , "oibi"       , // 0x13
+			""           , ""           , ""           , ""           , // 0x17
+			""           , ""           , ""           , ""           , // 0x1B
+			""           , ""           , ""           , ""           , // 0x1F
+			
+			""           , ""           , ""           , ""           , // 0x23
+			""           , ""           , ""           , ""           , // 0x27
+			""           , ""           , ""           , ""           , // 0x2B
+			""           , ""           , ""           , ""           , // 0x2F
+			
+			""           , ""           , ""           , ""           , // 0x33
+			""           , ""           , ""           , ""           , // 0x37
+			""           , ""           , ""           , ""           , // 0x3B
+			""           , ""           , ""           , ""           , // 0x3F
+			
+			""           , ""           , ""           , ""           , // 0x43
+			""           , ""           , ""           , ""           , // 0x47
+			""           , ""           , ""           , ""           , // 0x4B
+			""           , ""           , ""           , ""           , // 0x4F
+			
+			""           , ""           , ""           , ""           , // 0x53
+			""           , ""           , ""           , ""           , // 0x57
+			""           , ""           , ""           , ""           , // 0x5B
+			""           , ""           , ""           , ""           , // 0x5F
+			
+			""           , ""           , ""           , ""           , // 0x63
+			""           , "ob"         , "obsbsbq"    , ""           , // 0x67
+			""           , ""           , "obs?"       , "osq"        , // 0x6B
+			"obb"        , ""           , ""           , ""           , // 0x6F
+			
+			""           , ""           , ""           , ""           , // 0x73
+			""           , ""           , ""           , ""           , // 0x77
+			""           , ""           , ""           , ""           , // 0x7B
+			""           , ""           , ""           , ""           , // 0x7F
+			
+			""           , ""           , "oisizzzz"   , ""           , // 0x83
+			""           , ""           , ""           , ""           , // 0x87
+			""           , ""           , ""           , ""           , // 0x8B
+			""           , ""           , ""           , ""           , // 0x8F
+			
+			""           , ""           , ""           , ""           , // 0x93
+			""           , ""           , ""           , ""           , // 0x97
+			""           , ""           , ""           , ""           , // 0x9B
+			""           , ""           , ""           , ""           , // 0x9F
+			
+			""           , ""           , ""           , ""           , // 0xA3
+			""           , ""           , ""           , ""           , // 0xA7
+			""           , ""           , ""           , ""           , // 0xAB
+			""           , ""           , ""           , ""           , // 0xAF
+			
+			""           , ""           , ""           , ""           , // 0xB3
+			""           , ""           , ""           , ""           , // 0xB7
+			""           , ""           , ""           , ""           , // 0xBB
+			""           , ""           , ""           , ""           , // 0xBF
+			
+			""           , ""           , ""           , ""           , // 0xC3
+			""           , ""           , ""           , ""           , // 0xC7
+			""           , ""           , "obff"       , "oz"         , // 0xCB
+			"ozbbb?"     , "ob"         , ""           , ""           , // 0xCF
+			
+			""           , ""           , ""           , ""           , // 0xD3
+			""           , ""           , ""           , ""           , // 0xD7
+			""           , ""           , ""           , ""           , // 0xDB
+			""           , ""           , ""           , ""           , // 0xDF
+			
+			""           , ""           , ""           , ""           , // 0xE3
+			""           , ""           , ""           , ""           , // 0xE7
+			""           , ""           , ""           , ""           , // 0xEB
+			""           , ""           , ""           , ""           , // 0xEF
+			
+			""           , ""           , ""           , ""           , // 0xF3
+			""           , ""           , ""           , ""           , // 0xF7
+			""           , ""           , "oza"        , ""           , // 0xFB
+			"oaa"        , ""           , "ob"         , "oz"         , // 0xFF
+		};
+	
+	
+	namespace {
+		
+		enum frame_op_kind: unsigned char
+		{
+			FO_END,
+			FO_FIXED,  // a run of fixed-size fields
+			FO_STRING, // 16-bit length followed by as many UCS-2 characters
+			FO_ARRAY,  // 16-bit length followed by as many bytes
+			FO_SLOT,   // slot data
+		};
+		
+		struct frame_op
+		{
+			frame_op_kind kind;
+			unsigned short len;
+		};
+		
+		struct frame_layout
+		{
+			bool valid;
+			bool variable;
+			unsigned short fixed_size;
+			frame_op ops[8];
+		};
+		
+		/* 
+		 * The layout strings in _rem_table compiled into a list of operations per
+		 * opcode, with consecutive fixed-size fields merged together, so that
+		 * framing a packet does not have to interpret the strings every time.
+		 */
+		struct frame_table
+		{
+			frame_layout layouts[256];
+			
+			frame_table ()
+			{
+				for (int i = 0; i < 256; ++i)
+					{
+						frame_layout& fl = this->layouts[i];
+						fl.valid = fl.variable = false;
+						fl.fixed_size = 0;
+						fl.ops[0].kind = FO_END;
+						
+						const char *str = _rem_table[i];
+						if (!str[0] || str[0] == ' ')
+							continue;
+						fl.valid = true;
+						
+						int op = 0;
+						unsigned short run = 0;
+						for (; *str; ++str)
+							{
+								frame_op_kind kind;
+								switch (*str)
+									{
+										case 'o': case 'b': case '?': run += 1; continue;
+										case 's': run += 2; continue;
+										case 'f': case 'i': run += 4; continue;
+										case 'd': case 'l': run += 8; continue;
+										
+										case 'z': kind = FO_STRING; break;
+										case 'a': kind = FO_ARRAY; break;
+										case 'q': kind = FO_SLOT; break;
+										default: continue;
+									}
+								
+								if (run > 0)
+									{
+										fl.ops[op].kind = FO_FIXED;
+										fl.ops[op ++].len = run;
+										run = 0;
+									}
+								fl.ops[op].kind = kind;
+								fl.ops[op ++].len = 0;
+								fl.variable = true;
+							}
+						
+						if (run > 0)
+							{
+								fl.ops[op].kind = FO_FIXED;
+								fl.ops[op ++].len = run;
+							}
+						fl.ops[op].kind = FO_END;
+						
+						if (!fl.variable)
+							fl.fixed_size = run;
+					}
+			}
+		};
+	}
+	
+	static const frame_table&
+	_get_frame_table ()
+	{
+		static const frame_table table;
+		return table;
+	}
+	
+	/* 
+	 * Determines the total length of the packet at the start of the specified
+	 * byte array. If the first @have bytes are not enough to tell, a lower
+	 * bound greater than @have is returned instead, and the function should be
+	 * called again once at least that many bytes are available. Returns -1 if
+	 * the packet is invalid.
 	 */
 	int
-	packet::remaining (const unsigned char *data, unsigned int have)
+	packet::frame_length (const unsigned char *data, unsigned int have)
 	{
-		static const char* rem_table[] =
-			{
-			/* 
-			 * o = opcode
-			 * ? = boolean
-			 * b = byte
-			 * s = short
-			 * i = int
-			 * l = long
-			 * f = float
-			 * d = double
-			 * z = string
-			 * q = slot
-			 * a = array
-			 */
-			
-				"oi"         , ""           , "obzzi"      , "oz"         , // 0x03
-				""           , ""           , ""           , "oii?"       , // 0x07
-				""           , ""           , "o?"         , "odddd?"     , // 0x0B
-				"off?"       , "oddddff?"   , "obibib"     , "oibibqbbb"  , // 0x0F
-				
-				"os"         , ""           , "oib"        , "oibi"       , // 0x13
-				""           , ""           , ""           , ""           , // 0x17
-				""           , ""           , ""           , ""           , // 0x1B
-				""           , ""           , ""           , ""           , // 0x1F
-				
-				""           , ""           , ""           , ""           , // 0x23
-				""           , ""           , ""           , ""           , // 0x27
-				""           , ""           , ""           , ""           , // 0x2B
-				""           , ""           , ""           , ""           , // 0x2F
-				
-				""           , ""           , ""           , ""           , // 0x33
-				""           , ""           , ""           , ""           , // 0x37
-				""           , ""           , ""           , ""           , // 0x3B
-				""           , ""           , ""           , ""           , // 0x3F
-				
-				""           , ""           , ""           , ""           , // 0x43
-				""           , ""           , ""           , ""           , // 0x47
-				""           , ""           , ""           , ""           , // 0x4B
-				""           , ""           , ""           , ""           , // 0x4F
-				
-				""           , ""           , ""           , ""           , // 0x53
-				""           , ""           , ""           , ""           , // 0x57
-				""           , ""           , ""           , ""           , // 0x5B
-				""           , ""           , ""           , ""           , // 0x5F
-				
-				""           , ""           , ""           , ""           , // 0x63
-				""           , "ob"         , "obsbsbq"    , ""           , // 0x67
-				""           , ""           , "obs?"       , "osq"        , // 0x6B
-				"obb"        , ""           , ""           , ""           , // 0x6F
-				
-				""           , ""           , ""           , ""           , // 0x73
-				""           , ""           , ""           , ""           , // 0x77
-				""           , ""           , ""           , ""           , // 0x7B
-				""           , ""           , ""           , ""           , // 0x7F
-				
-				""           , ""           , "oisizzzz"   , ""           , // 0x83
-				""           , ""           , ""           , ""           , // 0x87
-				""           , ""           , ""           , ""           , // 0x8B
-				""           , ""           , ""           , ""           , // 0x8F
-				
-				""           , ""           , ""           , ""           , // 0x93
-				""           , ""           , ""           , ""           , // 0x97
-				""           , ""           , ""           , ""           , // 0x9B
-				""           , ""           , ""           , ""           , // 0x9F
-				
-				""           , ""           , ""           , ""           , // 0xA3
-				""           , ""           , ""           , ""           , // 0xA7
-				""           , ""           , ""           , ""           , // 0xAB
-				""           , ""           , ""           , ""           , // 0xAF
-				
-				""           , ""           , ""           , ""           , // 0xB3
-				""           , ""           , ""           , ""           , // 0xB7
-				""           , ""           , ""           , ""           , // 0xBB
-				""           , ""           , ""           , ""           , // 0xBF
-				
-				""           , ""           , ""           , ""           , // 0xC3
-				""           , ""           , ""           , ""           , // 0xC7
-				""           , ""           , "obff"       , "oz"         , // 0xCB
-				"ozbbb?"     , "ob"         , ""           , ""           , // 0xCF
-				
-				""           , ""           , ""           , ""           , // 0xD3
-				""           , ""           , ""           , ""           , // 0xD7
-				""           , ""           , ""           , ""           , // 0xDB
-				""           , ""           , ""           , ""           , // 0xDF
-				
-				""           , ""           , ""           , ""           , // 0xE3
-				""           , ""           , ""           , ""           , // 0xE7
-				""           , ""           , ""           , ""           , // 0xEB
-				""           , ""           , ""           , ""           , // 0xEF
-				
-				""           , ""           , ""           , ""           , // 0xF3
-				""           , ""           , ""           , ""           , // 0xF7
-				""           , ""           , "oza"        , ""           , // 0xFB
-				"oaa"        , ""           , "ob"         , "oz"         , // 0xFF
-			};
-		
-		const char *str = rem_table[(*data) & 0xFF];
-		if (!str[0] || str[0] == ' ')
+		if (have == 0)
+			return 1;
+		
+		const frame_layout& fl = _get_frame_table ().layouts[data[0]];
+		if (!fl.valid)
 			return -1;
+		if (!fl.variable)
+			return fl.fixed_size;
 		
 		short tmp;
-		
-		int c;
 		unsigned int need = 0;
-		while ((c = (int)(*str++)))
+		for (const frame_op *op = fl.ops; op->kind != FO_END; ++op)
 			{
-				switch (c)
+				switch (op->kind)
 					{
-						case 'o': case 'b': case '?': ++ need; break;
-						case 's': need += 2; break;
-						case 'f': case 'i': need += 4; break;
-						case 'd': case 'l': need += 8; break;
-						
-						// string
-						case 'z':
-							need += 2;
-							if (have < need)
-								goto done;
-							need += _read_short (data + need - 2) * 2;
+						case FO_FIXED:
+							need += op->len;
 							break;
 						
-						// array (prefixed with 16-bit integer describing length)
-						case 'a':
+						case FO_STRING:
+						case FO_ARRAY:
 							need += 2;
 							if (have < need)
-								goto done;
-							need += _read_short (data + need - 2);
+								return need;
+							tmp = (short)_read_short (data + need - 2);
+							if (tmp < 0)
+								return -1;
+							need += (op->kind == FO_STRING) ? (tmp * 2) : tmp;
 							break;
 						
-						// slot data
-						case 'q':
+						case FO_SLOT:
 							need += 2;
 							if (have < need)
-								goto done;
-							tmp = _read_short (data + need - 2); // id
+								return need;
+							tmp = (short)_read_short (data + need - 2); // id
 							
 							if (tmp == -1)
 								break; // done
@@ -581,21 +679,123 @@ namespace hCraft {
 							
 							need += 5;
 							if (have < need)
-								goto done;
-							tmp = _read_short (data + need - 2); // metadata length
+								return need;
+							tmp = (short)_read_short (data + need - 2); // metadata length
 							
 							if (tmp == -1)
 								break; // done
-							else if (tmp == 0)
+							else if (tmp <= 0)
 								return -1; // shouldn't happen
 							
 							need += tmp;
 							break;
+						
+						default: break;
 					}
 			}
 		
-	done:
-		return need - have;
+		return need;
+	}
+	
+	/* 
+	 * Checks the specified byte array and determines how many more bytes should
+	 * be read in-order to complete reading the packet. Note that this function
+	 * might be called numerous times, since packets often contain variable-
+	 * length data (such as strings, slot data, etc...). Aside from checking the
+	 * remaining amount of bytes left, the function can also be used to check
+	 * whether the first byte of the array (the packet's opcode) is associated
+	 * with any valid packet (it returns -1 to indicate that it is not).
+	 */
+	int
+	packet::remaining (const unsigned char *data, unsigned int have)
+	{
+		int len = packet::frame_length (data, have);
+		if (len == -1)
+			return -1;
+		return (len > (int)have) ? (len - (int)have) : 0;
+	}
+	
+	
+	
+//----
+	
+	/* 
+	 * Received packets are stored in buffers taken from per-size free lists,
+	 * since they are allocated by the network workers and released by the
+	 * thread pool at a high rate. Each buffer is preceded by a small header
+	 * that records the size class it belongs to.
+	 */
+	
+	namespace {
+		
+		static const int _recv_classes = 7;
+		static const unsigned int _recv_class_size[_recv_classes] =
+			{ 32, 128, 512, 2048, 8192, 32768, 131072 };
+		static const unsigned int _recv_max_free = 256; // per size class
+		static const unsigned int _recv_header = 16;    // keeps data aligned
+		
+		struct recv_free_list
+		{
+			std::mutex lock;
+			std::vector<unsigned char *> bufs;
+		};
+		
+		static recv_free_list _recv_free[_recv_classes];
+	}
+	
+	/* 
+	 * Returns a buffer that can hold at least @size bytes, to store a received
+	 * packet in. Must be released with release_received ().
+	 */
+	unsigned char*
+	packet::alloc_received (unsigned int size)
+	{
+		int cls = 0;
+		while (cls < _recv_classes && _recv_class_size[cls] < size)
+			++ cls;
+		
+		unsigned char *buf = nullptr;
+		if (cls < _recv_classes)
+			{
+				recv_free_list& fl = _recv_free[cls];
+				std::lock_guard<std::mutex> guard {fl.lock};
+				if (!fl.bufs.empty ())
+					{
+						buf = fl.bufs.back ();
+						fl.bufs.pop_back ();
+					}
+			}
+		
+		if (!buf)
+			{
+				buf = new unsigned char [_recv_header +
+					((cls < _recv_classes) ? _recv_class_size[cls] : size)];
+				buf[0] = (unsigned char)cls;
+			}
+		
+		return buf + _recv_header;
+	}
+	
+	void
+	packet::release_received (unsigned char *data)
+	{
+		if (!data)
+			return;
+		
+		unsigned char *buf = data - _recv_header;
+		int cls = buf[0];
+		if (cls < _recv_classes)
+			{
+				recv_free_list& fl = _recv_free[cls];
+				std::lock_guard<std::mutex> guard {fl.lock};
+				if (fl.bufs.size () < _recv_max_free)
+					{
+						fl.bufs.push_back (buf);
+						return;
+					}
+			}
+		
+		delete[] buf;
 	}
 	
 	
@@ -1228,18 +1428,26 @@ namespace hCraft {
 		return pack;
 	}
 	
-	packet*
-	packet::make_chunk (int x, int z, chunk *ch)
+	unsigned char*
+	packet::make_chunk_data (chunk *ch, unsigned int& out_size,
+		unsigned short& primary_bitmap, unsigned short& add_bitmap,
+		unsigned short sections)
 	{
 		int data_size = 0, n = 0, i;
-		unsigned short primary_bitmap = 0, add_bitmap = 0;
+		primary_bitmap = 0;
+		add_bitmap = 0;
+		
+		// a partial update must carry the sub-chunks it was asked for, even if
+		// they are empty (their light might have changed).
+		bool ground_up = (sections == 0xFFFF);
 		
 		// create bitmaps and calculate the size of the uncompressed data array.
-		data_size += 256; // biome array
+		if (ground_up)
+			data_size += 256; // biome array
 		for (i = 0; i < 16; ++i)
 			{
 				subchunk *sub = ch->get_sub (i);
-				if (sub && !sub->all_air ())
+				if (sub && (sections & (1 << i)) && (!ground_up || !sub->all_air ()))
 					{
 						primary_bitmap |= (1 << i);
 						data_size += 10240;
@@ -1260,76 +1468,67 @@ namespace hCraft {
 				{
 					// we take into account that the ID array might contain custom IDs -
 					// ID values that the vanilla client does NOT recognize. So we replace
-					// them with the their suitable equivalents.
-					
-					subchunk *sub = ch->get_sub (i);
-					unsigned char *ids = sub->ids;
-					unsigned int *customs = sub->custom;
-					for (int i = 0; i < 128; ++i)
-						{
-							if (customs[i] == 0)
-								{
-									std::memcpy (data + n, ids + (i << 5), 32);
-									n += 32;
-								}
-							else
-								{
-									int e = (i << 5) + 32; int id;
-									for (int j = (i << 5); j < e; ++j)
-										{
-											// extract full id
-											id = sub->ids[j];
-											if (sub->add)
-												{
-													if (j & 1)
-														id |= (sub->add[j >> 1] >> 4) << 8;
-													else
-														id |= (sub->add[j >> 1] & 0xF) << 8;
-												}
-											
-											if (block_info::is_vanilla_id (id))
-												data[n++] = id & 0xFF;
-											else
-												{
-													physics_block *ph = physics_block::from_id (id);
-													if (ph)
-														data[n++] = ph->vanilla_id () & 0xFF;
-													else
-														data[n++] = 0;
-												}
-										}
-								}
-						}
+					// them with the their suitable equivalents. This is done once per
+					// palette entry rather than once per block.
+					ch->get_sub (i)->export_ids (data + n,
+						[] (unsigned short id) -> unsigned short
+							{
+								if (block_info::is_vanilla_id (id))
+									return id;
+								
+								physics_block *ph = physics_block::from_id (id);
+								return ph ? ph->vanilla_id () : 0;
+							});
+					n += 4096;
 				}
 		
 		for (i = 0; i < 16; ++i)
 			if (primary_bitmap & (1 << i))
-				{ std::memcpy (data + n, ch->get_sub (i)->meta, 2048);
+				{ ch->get_sub (i)->export_meta (data + n);
 					n += 2048; }
 		
 		for (i = 0; i < 16; ++i)
 			if (primary_bitmap & (1 << i))
-				{ std::memcpy (data + n, ch->get_sub (i)->blight, 2048);
+				{ ch->get_sub (i)->blight.export_to (data + n);
 					n += 2048; }
 		
 		for (i = 0; i < 16; ++i)
 			if (primary_bitmap & (1 << i))
-				{ std::memcpy (data + n, ch->get_sub (i)->slight, 2048);
+				{ ch->get_sub (i)->slight.export_to (data + n);
 					n += 2048; }
 		
 		for (i = 0; i < 16; ++i)
 			if (add_bitmap & (1 << i))
-				{ std::memcpy (data + n, ch->get_sub (i)->add, 2048);
+				{ ch->get_sub (i)->export_add (data + n);
 					n += 2048; }
 		
-		std::memcpy (data + n, ch->get_biome_array (), 256);
-		n += 256;
+		if (ground_up)
+			{
+				std::memcpy (data + n, ch->get_biome_array (), 256);
+				n += 256;
+			}
+		
+		out_size = data_size;
+		return data;
+	}
+	
+	packet*
+	packet::make_chunk (int x, int z, chunk *ch, int level,
+		unsigned short sections)
+	{
+		unsigned int data_size;
+		unsigned short primary_bitmap, add_bitmap;
+		unsigned char *data = make_chunk_data (ch, data_size, primary_bitmap,
+			add_bitmap, sections);
+		
+		if (level < 0)
+			level = compression::get_level (CT_NETWORK);
 		
 		// compress.
-		unsigned long compressed_size = compressBound (data_size);
+		unsigned long compressed_size = compression::bound (data_size);
 		unsigned char *compressed = new unsigned char[compressed_size];
-		if (compress2 (compressed, &compressed_size, data, data_size,
-			Z_BEST_COMPRESSION) != Z_OK)
+		if (!compression::compress (compressed, compressed_size, data, data_size,
+			level))
 			{
 				delete[] compressed;
 				delete[] data;
@@ -1344,7 +1543,7 @@ namespace hCraft {
 		pack->put_byte (0x33);
 		pack->put_int (x);
 		pack->put_int (z);
-		pack->put_bool (true); // ground-up continuous
+		pack->put_bool (sections == 0xFFFF); // ground-up continuous
 		pack->put_short (primary_bitmap);
 		pack->put_short (add_bitmap);
 		pack->put_int (compressed_size);
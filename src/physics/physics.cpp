@@ -23,7 +23,9 @@
 #include "entities/entity.hpp"
 #include "player.hpp"
 #include <functional>
+#include <algorithm>
 #include <cstring>
+#include <cstdint>
 
 #include <iostream> // DEBUG
 
@@ -31,8 +33,8 @@
 namespace hCraft {
 	
 	physics_update::physics_update (world *w, int x, int y, int z, int extra, int tick,
-		std::chrono::steady_clock::time_point nt, physics_block_callback cb)
-		: params (), nt (nt)
+		unsigned long long due, physics_block_callback cb)
+		: params (), due (due)
 	{
 		this->type = PU_BLOCK;
 		
@@ -46,8 +48,8 @@ namespace hCraft {
 	}
 	
 	physics_update::physics_update (world *w, entity *e, bool persistent,
-		int tick, std::chrono::steady_clock::time_point nt)
-		: params (), nt (nt)
+		int tick, unsigned long long due)
+		: params (), due (due)
 	{
 		this->type = PU_ENTITY;
 		
@@ -73,12 +75,231 @@ namespace hCraft {
 	
 	
 	
+	ph_mem_region::ph_mem_region ()
+	{
+		std::memset (this->subs, 0, sizeof this->subs);
+		std::memset (this->counts, 0, sizeof this->counts);
+		this->total = 0;
+	}
+	
+	ph_mem_region::~ph_mem_region ()
+	{
+		for (int i = 0; i < (SIZE * SIZE); ++i)
+			for (int j = 0; j < 16; ++j)
+				delete this->subs[i][j];
+	}
+	
+	
+	static inline int
+	_region_chunk (int x, int z)
+	{
+		return (((z >> 4) & (ph_mem_region::SIZE - 1)) << ph_mem_region::SHIFT)
+			| ((x >> 4) & (ph_mem_region::SIZE - 1));
+	}
+	
+	static inline unsigned int
+	_subchunk_index (int x, int y, int z)
+		{ return ((y & 0xF) << 8) | ((z & 0xF) << 4) | (x & 0xF); }
+	
+	
+	bool
+	ph_mem_region::has (int x, int y, int z) const
+	{
+		const ph_mem_subchunk *sub = this->subs[_region_chunk (x, z)][y >> 4];
+		return sub && (sub->blocks[_subchunk_index (x, y, z)] > 0);
+	}
+	
+	/* 
+	 * Adds/removes a membership of the specified block. Both return true
+	 * if the block's chunk went from having none to having some, or the
+	 * other way around.
+	 */
+	bool
+	ph_mem_region::add (int x, int y, int z)
+	{
+		int ci = _region_chunk (x, z);
+		ph_mem_subchunk *& sub = this->subs[ci][y >> 4];
+		if (sub == nullptr)
+			sub = new ph_mem_subchunk ();
+		
+		unsigned short& n = sub->blocks[_subchunk_index (x, y, z)];
+		if (n == 0xFFFF)
+			return false;
+		
+		++ n;
+		++ this->total;
+		return (this->counts[ci] ++ == 0);
+	}
+	
+	bool
+	ph_mem_region::remove (int x, int y, int z)
+	{
+		int ci = _region_chunk (x, z);
+		ph_mem_subchunk *sub = this->subs[ci][y >> 4];
+		if (sub == nullptr)
+			return false;
+		
+		unsigned short& n = sub->blocks[_subchunk_index (x, y, z)];
+		if (n == 0)
+			return false;
+		
+		-- n;
+		-- this->total;
+		return (-- this->counts[ci] == 0);
+	}
+	
+	
+	
+	physics_shard::physics_shard ()
+		: last_region (nullptr), last_key {nullptr, 0, 0}, wheel_size (0),
+			retired (false)
+		{ }
+	
+	physics_shard::~physics_shard ()
+	{
+		for (auto& p : this->regions)
+			delete p.second;
+	}
+	
+	
+	
+	physics_wheel::physics_wheel ()
+	{
+		this->now = 0;
+		this->count = 0;
+	}
+	
+	
+	
+	void
+	physics_wheel::place (const physics_update& u)
+	{
+		if (u.due <= this->now)
+			{
+				this->ready.push_back (u);
+				return;
+			}
+		
+		// updates due further ahead than the wheel spans are parked in the last
+		// slot it covers, and placed again when that slot is cascaded.
+		const unsigned long long span = 1ULL << (slot_bits * levels);
+		unsigned long long at = u.due;
+		if (at - this->now >= span)
+			at = this->now + span - 1;
+		
+		unsigned long long delta = at - this->now;
+		int level = 0;
+		while (delta >= (1ULL << (slot_bits * (level + 1))))
+			++ level;
+		this->wheel[level][(at >> (slot_bits * level)) & (slots - 1)].push_back (u);
+	}
+	
+	/* 
+	 * Inserts the specified update into the slot of the tick it is due at.
+	 * Updates that are already due are made ready right away.
+	 */
+	void
+	physics_wheel::insert (const physics_update& u)
+	{
+		this->place (u);
+		++ this->count;
+	}
+	
+	/* 
+	 * Turns the wheel forward to tick @{t}, making every update due at or
+	 * before it ready.
+	 */
+	void
+	physics_wheel::advance (unsigned long long t)
+	{
+		std::vector<physics_update> moved;
+		while (this->now < t)
+			{
+				if (this->count == this->ready.size ())
+					{
+						// nothing left in the slots, skip straight to the end.
+						this->now = t;
+						break;
+					}
+				
+				++ this->now;
+				
+				// cascade the slots of the upper levels whose span starts now.
+				for (int level = 1; level < levels; ++level)
+					{
+						if (this->now & ((1ULL << (slot_bits * level)) - 1))
+							break;
+						
+						std::vector<physics_update>& slot
+							= this->wheel[level][(this->now >> (slot_bits * level)) & (slots - 1)];
+						if (slot.empty ())
+							continue;
+						
+						moved.swap (slot);
+						for (physics_update& u : moved)
+							this->place (u);
+						moved.clear ();
+					}
+				
+				std::vector<physics_update>& slot = this->wheel[0][this->now & (slots - 1)];
+				if (slot.empty ())
+					continue;
+				if (this->ready.empty ())
+					this->ready.swap (slot);
+				else
+					{
+						this->ready.insert (this->ready.end (), slot.begin (), slot.end ());
+						slot.clear ();
+					}
+			}
+	}
+	
+	/* 
+	 * Moves up to @{max} ready updates into @{out}.
+	 * Returns the number of updates taken.
+	 */
+	size_t
+	physics_wheel::take (std::vector<physics_update>& out, size_t max)
+	{
+		size_t n = std::min (max, this->ready.size ());
+		if (n == 0)
+			return 0;
+		
+		out.insert (out.end (), this->ready.end () - n, this->ready.end ());
+		this->ready.resize (this->ready.size () - n);
+		this->count -= n;
+		return n;
+	}
+	
+	/* 
+	 * Moves every update in the wheel, due or not, into @{out}.
+	 */
+	void
+	physics_wheel::drain (std::vector<physics_update>& out)
+	{
+		for (int level = 0; level < levels; ++level)
+			for (int i = 0; i < slots; ++i)
+				{
+					std::vector<physics_update>& slot = this->wheel[level][i];
+					out.insert (out.end (), slot.begin (), slot.end ());
+					slot.clear ();
+				}
+		
+		out.insert (out.end (), this->ready.begin (), this->ready.end ());
+		this->ready.clear ();
+		this->count = 0;
+	}
+	
+	
+	
+	thread_local physics_worker *physics_worker::current = nullptr;
+	
 	/* 
 	 * Constructs and starts the worker thread.
 	 */
-	physics_worker::physics_worker (physics_manager &man)
-		: paused (false), ticks (0), man (man),
-			rnd (utils::ns_since_epoch ()), _running (true),
+	physics_worker::physics_worker (physics_manager &man, unsigned int id)
+		: paused (false), ticks (0), man (man), id (id), layout (0),
+			rnd (utils::ns_since_epoch ()), lateness (0), _running (true),
 		
 			// and finally, the thread:
 			th (std::bind (std::mem_fn (&hCraft::physics_worker::main_loop), this))
@@ -95,9 +316,13 @@ namespace hCraft {
 	}
 	
 	
+	physics_manager::physics_manager ()
+		: shard_count (1), layout (1),
+			epoch (std::chrono::steady_clock::now ())
+		{ }
+	
 	physics_manager::~physics_manager ()
 	{
-		this->updates.clear ();
 		this->workers.clear ();
 	}
 	
@@ -116,10 +341,15 @@ namespace hCraft {
 		return true;
 	}
 	
+	/* 
+	 * Returns false if the update should be dropped. @{again} is set to true
+	 * if a copy of the update should be scheduled again.
+	 */
 	static bool
-	handle_params (physics_update& u, physics_manager &man, std::minstd_rand& rnd)
+	handle_params (physics_update& u, std::minstd_rand& rnd, bool& again)
 	{
 		bool expire = true;
+		again = false;
 		
 		for (int i = 0; i < 8; ++i)
 			{
@@ -148,188 +378,438 @@ namespace hCraft {
 					}
 			}
 		
-		if (!expire)
+		again = !expire;
+		return true;
+	}
+	
+	
+
+	/* 
+	 * Processes a single due update during tick @{now}.
+	 */
+	void
+	physics_worker::process (physics_update& u, unsigned long long now)
+	{
+		// parameters
+		bool again;
+		if (!handle_params (u, this->rnd, again))
+			return;
+		if (again)
 			{
 				physics_update nu = u;
-				nu.nt = std::chrono::steady_clock::now () + std::chrono::milliseconds (50 * nu.tick);
-				man.updates.push (nu);
+				this->man.schedule (nu, nu.tick, false);
 			}
 		
-		return true;
+		if (u.type == PU_BLOCK)
+			{
+				auto blk = u.data.blk;
+				
+				// does this block have a custom callback attached?
+				if (blk.cb)
+					{
+						blk.cb (*u.w, blk.x, blk.y, blk.z, blk.extra, this->rnd);
+					}
+				else
+					{
+						// nope, use the one associated with its ID
+						physics_block *pb = (u.w)->get_physics_at (blk.x, blk.y, blk.z);
+						if (pb)
+							pb->tick (*u.w, blk.x, blk.y, blk.z, blk.extra, nullptr, this->rnd);
+					}
+			}
+		else if (u.type == PU_ENTITY)
+			{
+				auto ent = u.data.ent;
+				
+				if (ent.e->get_type () == ET_PLAYER)
+					{
+						player *pl = dynamic_cast<player *> (ent.e);
+						if (pl->get_world () != u.w)
+							return;
+					}
+				
+				if (!ent.e->tick (*u.w) && ent.persistent)
+					{
+						// requeue
+						physics_update nu = u;
+						this->man.schedule (nu, nu.tick, false);
+					}
+			}
+	}
+	
+	/* 
+	 * Places the updates in the worker's inbox onto its wheel, and moves the
+	 * ones due by tick @{now} onto its ready list.
+	 */
+	void
+	physics_worker::collect (unsigned long long now)
+	{
+		physics_shard& shard = this->man.shards[this->id];
+		
+		{
+			std::lock_guard<std::mutex> guard {shard.inbox_lock};
+			this->mail.swap (shard.inbox);
+		}
+		
+		// messages sent before the thread count changed may have been meant
+		// for a shard that no longer owns them.
+		unsigned int count = this->man.shard_count;
+		for (physics_message& m : this->mail)
+			{
+				if (physics_manager::owner_of (m.u, count) != this->id)
+					this->man.dispatch (m.u, m.once);
+				else
+					this->man.place (shard, m.u, m.once);
+			}
+		this->mail.clear ();
+		
+		shard.wheel.advance (now);
+		shard.wheel.take (this->due, shard.wheel.ready_count ());
+		shard.wheel_size = shard.wheel.size ();
+		if (this->due.empty ())
+			return;
+		
+		// due blocks stop counting as scheduled, so that they can be queued
+		// again while they are being processed.
+		for (physics_update& u : this->due)
+			if (u.type == PU_BLOCK)
+				this->man.remove_block (shard, u.w, u.data.blk.x, u.data.blk.y, u.data.blk.z);
+		
+		{
+			std::lock_guard<std::mutex> guard {shard.ready_lock};
+			shard.ready.insert (shard.ready.end (), this->due.begin (), this->due.end ());
+		}
+		this->due.clear ();
 	}
 	
+	/* 
+	 * Hands the updates of regions that the shard no longer owns (after the
+	 * number of workers has changed) over to their new owners.
+	 */
+	void
+	physics_worker::rehome ()
+	{
+		physics_shard& shard = this->man.shards[this->id];
+		this->layout = this->man.layout;
+		if (shard.wheel.size () == 0)
+			return;
+		
+		// simply start over, the updates that stay are placed right back.
+		shard.wheel.drain (this->due);
+		for (auto& p : shard.regions)
+			delete p.second;
+		shard.regions.clear ();
+		shard.last_region = nullptr;
+		
+		for (physics_update& u : this->due)
+			this->man.dispatch (u, false);
+		this->due.clear ();
+		shard.wheel_size = shard.wheel.size ();
+	}
 	
-
 	/* 
 	 * Where everything happens.
 	 */
 	void
 	physics_worker::main_loop ()
 	{
-		physics_update u {};
-		const static int updates_per_tick = 8000;
-		int i, fcount;
+		// updates are taken off the ready list in batches this large, so that
+		// idle workers get a chance to steal the rest.
+		const static size_t batch_size = 256;
+		
+		physics_worker::current = this;
+		physics_shard& shard = this->man.shards[this->id];
 		
-		std::minstd_rand rnd ((utils::ns_since_epoch ()));
+		std::vector<physics_update> batch;
+		batch.reserve (batch_size);
 		
+		unsigned long long last = this->man.current_tick ();
 		while (this->_running)
 			{
-				std::this_thread::sleep_for (std::chrono::milliseconds (50));
-				++ this->ticks;
-				if (paused)
-					continue;
+				unsigned long long now = this->man.current_tick ();
+				if (now != last)
+					{
+						this->ticks += now - last;
+						last = now;
+					}
 				
-				fcount = 0; // failure counter
-				for (i = 0; i < updates_per_tick; ++i)
+				if (this->paused)
 					{
-						if (!this->_running || paused || this->man.updates.empty ())
-							break;
-						if (!this->man.updates.try_pop (u))
-							{
-								++ fcount;
-								if (fcount % 15 == 0)
-									std::this_thread::sleep_for (std::chrono::milliseconds (2));
-								if (fcount == 60)
-									break;
-								continue;
-							}
-						
-						if (u.nt > std::chrono::steady_clock::now ())
-							{
-								this->man.updates.push (u);
-								continue;
-							}
+						std::this_thread::sleep_until (this->man.tick_time (now + 1));
+						continue;
+					}
+				
+				if (this->layout != this->man.layout)
+					this->rehome ();
+				this->collect (now);
+				
+				{
+					std::lock_guard<std::mutex> guard {shard.ready_lock};
+					size_t n = std::min (batch_size, shard.ready.size ());
+					batch.insert (batch.end (), shard.ready.end () - n, shard.ready.end ());
+					shard.ready.resize (shard.ready.size () - n);
+				}
+				
+				if (batch.empty () && this->man.steal (this->id, batch, batch_size) == 0)
+					{
+						this->lateness = 0;
 						
-						// parameters
-						if (!handle_params (u, this->man, this->rnd))
-							continue;
+						// nothing is due anywhere. other workers might still be about to
+						// collect a tick's worth of updates though, so check back shortly
+						// if there is anyone to steal from.
+						auto wake = this->man.tick_time (now + 1);
+						if (this->man.shard_count > 1)
+							wake = std::min (wake, std::chrono::steady_clock::now ()
+								+ std::chrono::milliseconds (2));
+						std::this_thread::sleep_until (wake);
+						continue;
+					}
+				
+				unsigned long long late = 0;
+				for (physics_update& u : batch)
+					{
+						if (u.due < now && now - u.due > late)
+							late = now - u.due;
+						this->process (u, now);
 						
-						if (u.type == PU_BLOCK)
-							{
-								auto blk = u.data.blk;
-								this->man.remove_block (u.w, blk.x, blk.y, blk.z);
-								
-								// does this block have a custom callback attached?
-								if (blk.cb)
-									{
-										blk.cb (*u.w, blk.x, blk.y, blk.z, blk.extra, rnd);
-									}
-								else
-									{
-										// nope, use the one associated with its ID
-										physics_block *pb = (u.w)->get_physics_at (blk.x, blk.y, blk.z);
-										if (pb)
-											pb->tick (*u.w, blk.x, blk.y, blk.z, blk.extra, nullptr, rnd);
-									}
-							}
-						else if (u.type == PU_ENTITY)
-							{
-								auto ent = u.data.ent;
-								
-								if (ent.e->get_type () == ET_PLAYER)
-									{
-										player *pl = dynamic_cast<player *> (ent.e);
-										if (pl->get_world () != u.w)
-											continue;
-									}
-								
-								if (!ent.e->tick (*u.w) && ent.persistent)
-									{
-										// requeue
-										physics_update nu = u;
-										nu.nt = std::chrono::steady_clock::now () + std::chrono::milliseconds (50 * nu.tick);
-										man.updates.push (nu);
-									}
-							}
+						// any update it scheduled has been counted by now.
+						this->man.count_update (u, -1);
 					}
+				this->lateness = (unsigned int)late;
+				batch.clear ();
 			}
 	}
 	
 	
 	
+//-----------
+	
+	/* 
+	 * Returns the index of the shard owning the specified update, out of
+	 * the first @{count} shards.
+	 */
+	unsigned int
+	physics_manager::owner_of (const physics_update& u, unsigned int count)
+	{
+		if (count <= 1)
+			return 0;
+		
+		unsigned int h;
+		if (u.type == PU_BLOCK)
+			{
+				int rx = u.data.blk.x >> (4 + ph_mem_region::SHIFT);
+				int rz = u.data.blk.z >> (4 + ph_mem_region::SHIFT);
+				h = ((unsigned int)rx * 73856093U) ^ ((unsigned int)rz * 19349663U);
+			}
+		else
+			h = (unsigned int)((std::uintptr_t)u.data.ent.e >> 4);
+		
+		return (h ^ (h >> 16)) % count;
+	}
+	
+	
+	
+	/* 
+	 * Block membership in regions owned by @{shard}. Must be called by the
+	 * shard's owner.
+	 */
+	
+	ph_mem_region*
+	physics_manager::get_region (physics_shard& shard, world *w, int x, int z,
+		bool create)
+	{
+		ph_key key {w, x >> (4 + ph_mem_region::SHIFT), z >> (4 + ph_mem_region::SHIFT)};
+		if (shard.last_region && (shard.last_key == key))
+			return shard.last_region;
+		
+		ph_mem_region *reg;
+		auto itr = shard.regions.find (key);
+		if (itr != shard.regions.end ())
+			reg = itr->second;
+		else if (!create)
+			return nullptr;
+		else
+			reg = shard.regions[key] = new ph_mem_region ();
+		
+		shard.last_key = key;
+		shard.last_region = reg;
+		return reg;
+	}
+	
 	bool
-	physics_manager::block_exists_nolock (world *w, int x, int y, int z)
+	physics_manager::block_exists (physics_shard& shard, world *w, int x, int y, int z)
 	{
 		if (y < 0 || y > 255) return false;
 		
-		auto w_itr = this->block_mem.find (w);
-		if (w_itr == this->block_mem.end ())
-			return false;
-		std::unordered_map<chunk_pos, ph_mem_chunk, chunk_pos_hash>&
-			mem_chunks = w_itr->second;
+		ph_mem_region *reg = this->get_region (shard, w, x, z, false);
+		return reg && reg->has (x, y, z);
+	}
+	
+	void
+	physics_manager::add_block (physics_shard& shard, world *w, int x, int y, int z)
+	{
+		if (y < 0 || y > 255) return;
 		
-		auto ch_itr = mem_chunks.find ({x >> 4, z >> 4});
-		if (ch_itr == mem_chunks.end ())
-			return false;
-		ph_mem_chunk& ch = ch_itr->second;
-		ph_mem_subchunk* sub = ch.subs[y >> 4];
-		if (sub == nullptr)
-			return false;
-		return (sub->blocks[((y & 0xF) << 8) | ((z & 0xF) << 4) | (x & 0xF)] > 0);
+		ph_mem_region *reg = this->get_region (shard, w, x, z, true);
+		reg->add (x, y, z);
 	}
 	
 	void
-	physics_manager::add_block_nolock (world *w, int x, int y, int z)
+	physics_manager::remove_block (physics_shard& shard, world *w, int x, int y, int z)
 	{
 		if (y < 0 || y > 255) return;
 		
-		std::unordered_map<chunk_pos, ph_mem_chunk, chunk_pos_hash>&
-			mem_chunks = this->block_mem[w];
-		ph_mem_chunk& ch = mem_chunks[{x >> 4, z >> 4}];
-		ph_mem_subchunk* sub = ch.subs[y >> 4];
-		if (sub == nullptr)
-			sub = ch.subs[y >> 4] = new ph_mem_subchunk ();
+		ph_mem_region *reg = this->get_region (shard, w, x, z, false);
+		if (!reg)
+			return;
 		
-		unsigned int index = ((y & 0xF) << 8) | ((z & 0xF) << 4) | (x & 0xF);
-		if (sub->blocks[index] < 0xFFFF)
-			++ sub->blocks[index];
-		else
-			std::cout << "!!!" << std::endl;
+		reg->remove (x, y, z);
+		if (reg->total == 0)
+			{
+				shard.regions.erase ({w, x >> (4 + ph_mem_region::SHIFT),
+					z >> (4 + ph_mem_region::SHIFT)});
+				if (shard.last_region == reg)
+					shard.last_region = nullptr;
+				delete reg;
+			}
+	}
+	
+	/* 
+	 * Checks whether there are any queued block updates in the specified
+	 * chunk of world @{w}.
+	 */
+	bool
+	physics_manager::has_blocks_in_chunk (world *w, int cx, int cz)
+	{
+		ph_key key {w, cx, cz};
+		auto& set = this->chunk_counts[ph_key_hash () (key) % chunk_count_sets];
+		
+		std::lock_guard<std::mutex> guard {set.lock};
+		return set.counts.find (key) != set.counts.end ();
 	}
 	
+	/* 
+	 * Adds @{delta} to the number of updates counted in the chunk of the
+	 * specified update, if it's a block update.
+	 */
+	void
+	physics_manager::count_update (const physics_update& u, int delta)
+	{
+		if (u.type != PU_BLOCK)
+			return;
+		
+		ph_key key {u.w, u.data.blk.x >> 4, u.data.blk.z >> 4};
+		auto& set = this->chunk_counts[ph_key_hash () (key) % chunk_count_sets];
 		
+		std::lock_guard<std::mutex> guard {set.lock};
+		int& count = set.counts[key];
+		count += delta;
+		if (count <= 0)
+			set.counts.erase (key);
+	}
+	
+	
+	
+	/* 
+	 * Puts the specified update on @{shard}'s wheel and records its block.
+	 * Must be called by the shard's owner. Returns false if @{once} is set
+	 * and the block already has an update scheduled.
+	 */
 	bool
-	physics_manager::block_exists (world *w, int x, int y, int z)
+	physics_manager::place (physics_shard& shard, const physics_update& u, bool once)
 	{
-		std::lock_guard<std::mutex> guard {this->lock};
-		return this->block_exists_nolock (w, x, y, z);
+		if (u.type == PU_BLOCK)
+			{
+				auto& blk = u.data.blk;
+				if (once && this->block_exists (shard, u.w, blk.x, blk.y, blk.z))
+					{
+						this->count_update (u, -1);
+						return false;
+					}
+				this->add_block (shard, u.w, blk.x, blk.y, blk.z);
+			}
+		
+		shard.wheel.insert (u);
+		return true;
 	}
 	
+	/* 
+	 * Schedules the specified update on the shard owning it: directly, if
+	 * called by the owner, otherwise through the shard's inbox.
+	 */
 	void
-	physics_manager::add_block (world *w, int x, int y, int z)
+	physics_manager::dispatch (const physics_update& u, bool once)
 	{
-		std::lock_guard<std::mutex> guard {this->lock};
-		this->add_block_nolock (w, x, y, z);
+		for (;;)
+			{
+				unsigned int index = owner_of (u, this->shard_count);
+				
+				physics_worker *self = physics_worker::current;
+				if (self && (&self->man == this) && (self->id == index))
+					{
+						this->place (this->shards[index], u, once);
+						return;
+					}
+				
+				physics_shard& shard = this->shards[index];
+				std::lock_guard<std::mutex> guard {shard.inbox_lock};
+				if (shard.retired)
+					continue; // its worker has just been removed, look again
+				
+				shard.inbox.push_back ({u, once});
+				return;
+			}
 	}
 	
+	/* 
+	 * Schedules the specified update @{tick_delay} ticks from now.
+	 */
 	void
-	physics_manager::remove_block (world *w, int x, int y, int z)
+	physics_manager::schedule (physics_update& u, int tick_delay, bool once)
 	{
-		if (y < 0 || y > 255) return;
-		std::lock_guard<std::mutex> guard {this->lock};
-		
-		auto w_itr = this->block_mem.find (w);
-		if (w_itr == this->block_mem.end ())
-			return;
-		std::unordered_map<chunk_pos, ph_mem_chunk, chunk_pos_hash>&
-			mem_chunks = w_itr->second;
-		
-		auto ch_itr = mem_chunks.find ({x >> 4, z >> 4});
-		if (ch_itr == mem_chunks.end ())
-			return;
-		ph_mem_chunk& ch = ch_itr->second;
-		ph_mem_subchunk* sub = ch.subs[y >> 4];
-		if (sub == nullptr)
-			return;
+		u.tick = tick_delay;
+		u.due = this->current_tick () + tick_delay;
+		this->count_update (u, 1);
+		this->dispatch (u, once);
+	}
+	
+	/* 
+	 * Moves up to @{max} due updates from the shards of other workers into
+	 * @{out}, taking at most half of what is due on any single shard.
+	 */
+	size_t
+	physics_manager::steal (unsigned int thief, std::vector<physics_update>& out,
+		size_t max)
+	{
+		size_t taken = 0;
+		unsigned int count = this->shard_count;
+		for (unsigned int i = 1; i < count && taken < max; ++i)
+			{
+				physics_shard& shard = this->shards[(thief + i) % count];
+				std::lock_guard<std::mutex> guard {shard.ready_lock};
+				
+				size_t n = std::min ((shard.ready.size () + 1) / 2, max - taken);
+				out.insert (out.end (), shard.ready.end () - n, shard.ready.end ());
+				shard.ready.resize (shard.ready.size () - n);
+				taken += n;
+			}
 		
-		unsigned int index = ((y & 0xF) << 8) | ((z & 0xF) << 4) | (x & 0xF);
-		if (sub->blocks[index] > 0)
-			-- sub->blocks[index];
+		return taken;
 	}
 	
 	
 	
-//-----------
+	/* 
+	 * Returns the number of the current physics tick.
+	 */
+	unsigned long long
+	physics_manager::current_tick ()
+	{
+		return (std::chrono::steady_clock::now () - this->epoch)
+			/ std::chrono::milliseconds (tick_ms);
+	}
+	
+	
 	
 	/* 
 	 * Changes the number of worker threads to utilize.
@@ -337,26 +817,115 @@ namespace hCraft {
 	void
 	physics_manager::set_thread_count (unsigned int count)
 	{
-		if (count > 20) count = 20;
-		std::lock_guard<std::mutex> guard {this->lock};
-		
-		if (count == this->workers.size ())
-			return; // nothing to do
-		
-		if (count > this->workers.size ())
+		if (count > max_threads) count = max_threads;
+		
+		std::vector<std::shared_ptr<physics_worker>> removed;
+		unsigned int old_shards, new_shards;
+		{
+			std::lock_guard<std::mutex> guard {this->lock};
+			
+			if (count == this->workers.size ())
+				return; // nothing to do
+			
+			old_shards = this->shard_count;
+			new_shards = (count == 0) ? 1 : count;
+			
+			if (count > this->workers.size ())
+				{
+					for (unsigned int i = old_shards; i < new_shards; ++i)
+						{
+							std::lock_guard<std::mutex> inbox_guard {this->shards[i].inbox_lock};
+							this->shards[i].retired = false;
+						}
+					this->shard_count = new_shards;
+					++ this->layout;
+					
+					while (this->workers.size () < count)
+						this->workers.emplace_back (
+							new physics_worker (*this, this->workers.size ()));
+					return;
+				}
+			
+			removed.assign (this->workers.begin () + count, this->workers.end ());
+			this->workers.resize (count);
+			this->shard_count = new_shards;
+			++ this->layout;
+		}
+		
+		// the removed workers are stopped outside of the lock, since they might
+		// still need it to finish their current batch.
+		removed.clear ();
+		
+		// hand whatever was left on their shards over to the workers left.
+		std::vector<physics_message> mail;
+		std::vector<physics_update> orphans;
+		for (unsigned int i = new_shards; i < old_shards; ++i)
 			{
-				while (this->workers.size () < count)
-					this->workers.emplace_back (new physics_worker (*this));
-				return;
+				physics_shard& shard = this->shards[i];
+				{
+					std::lock_guard<std::mutex> guard {shard.inbox_lock};
+					shard.retired = true;
+					mail.swap (shard.inbox);
+				}
+				{
+					std::lock_guard<std::mutex> guard {shard.ready_lock};
+					orphans.swap (shard.ready);
+				}
+				
+				shard.wheel.drain (orphans);
+				shard.wheel_size = 0;
+				for (auto& p : shard.regions)
+					delete p.second;
+				shard.regions.clear ();
+				shard.last_region = nullptr;
+				
+				for (physics_message& m : mail)
+					this->dispatch (m.u, m.once);
+				for (physics_update& u : orphans)
+					this->dispatch (u, false);
+				mail.clear ();
+				orphans.clear ();
 			}
-		
-		if (count == 0)
+	}
+	
+	
+	
+	/* 
+	 * Returns the total number of scheduled updates, due or not.
+	 */
+	size_t
+	physics_manager::get_backlog ()
+	{
+		size_t total = 0;
+		for (physics_shard& shard : this->shards)
 			{
-				this->workers.clear ();
-				return;
+				total += shard.wheel_size.load ();
+				{
+					std::lock_guard<std::mutex> guard {shard.ready_lock};
+					total += shard.ready.size ();
+				}
+				{
+					std::lock_guard<std::mutex> guard {shard.inbox_lock};
+					total += shard.inbox.size ();
+				}
 			}
 		
-		this->workers.resize (count);
+		return total;
+	}
+	
+	/* 
+	 * Returns how many ticks behind schedule the workers are running (the
+	 * largest lateness of the updates they processed most recently).
+	 */
+	unsigned int
+	physics_manager::get_lateness ()
+	{
+		std::lock_guard<std::mutex> guard {this->lock};
+		
+		unsigned int late = 0;
+		for (auto& w : this->workers)
+			late = std::max (late, w->lateness.load ());
+		return late;
 	}
 	
 	
@@ -369,15 +938,9 @@ namespace hCraft {
 		int extra, int tick_delay, physics_params *params,
 		physics_block_callback cb)
 	{
-		if (tick_delay == 0) tick_delay = 1;
-		-- tick_delay;
+		if (tick_delay <= 0) tick_delay = 1;
 		
-		std::lock_guard<std::mutex> guard {this->lock};
-		this->add_block_nolock (w, x, y, z);
-		
-		physics_update u (w, x, y, z, extra, tick_delay,
-			std::chrono::steady_clock::now () + std::chrono::milliseconds (50 * tick_delay),
-			cb);
+		physics_update u (w, x, y, z, extra, tick_delay, 0, cb);
 		if (params)
 			for (int i = 0; i < 8; ++i)
 				{
@@ -386,7 +949,7 @@ namespace hCraft {
 						break;
 				}
 		
-		this->updates.push (u);
+		this->schedule (u, tick_delay, false);
 	}
 	
 	/* 
@@ -398,17 +961,9 @@ namespace hCraft {
 		int extra, int tick_delay, physics_params *params,
 		physics_block_callback cb)
 	{
-		std::lock_guard<std::mutex> guard {this->lock};
-		if (this->block_exists_nolock (w, x, y, z))
-			return;
-		
-		if (tick_delay == 0) tick_delay = 1;
-		-- tick_delay;
+		if (tick_delay <= 0) tick_delay = 1;
 		
-		this->add_block_nolock (w, x, y, z);
-		physics_update u (w, x, y, z, extra, tick_delay,
-			std::chrono::steady_clock::now () + std::chrono::milliseconds (50 * tick_delay),
-			cb);
+		physics_update u (w, x, y, z, extra, tick_delay, 0, cb);
 		if (params)
 			for (int i = 0; i < 8; ++i)
 				{
@@ -417,7 +972,8 @@ namespace hCraft {
 						break;
 				}
 		
-		this->updates.push (u);
+		// the check is made by the block's owner, when the update is placed.
+		this->schedule (u, tick_delay, true);
 	}
 	
 	
@@ -428,13 +984,9 @@ namespace hCraft {
 	physics_manager::queue_physics (world *w, entity *e, bool persistent,
 		int tick_delay, physics_params *params)
 	{
-		if (tick_delay == 0) tick_delay = 1;
-		-- tick_delay;
-		
-		std::lock_guard<std::mutex> guard {this->lock};
+		if (tick_delay <= 0) tick_delay = 1;
 		
-		physics_update u (w, e, persistent, tick_delay,
-			std::chrono::steady_clock::now () + std::chrono::milliseconds (50 * tick_delay));
+		physics_update u (w, e, persistent, tick_delay, 0);
 		if (params)
 			for (int i = 0; i < 8; ++i)
 				{
@@ -443,7 +995,7 @@ namespace hCraft {
 						break;
 				}
 		
-		this->updates.push (u);
+		this->schedule (u, tick_delay, false);
 	}
 }
 
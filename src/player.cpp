@@ -55,7 +55,8 @@ namespace hCraft {
 	player::player (server &srv, struct event_base *evbase, evutil_socket_t sock,
 		const char *ip)
 		: living_entity (srv.next_entity_id ()),
-			srv (srv), log (srv.get_logger ()), sock (sock)
+			srv (srv), log (srv.get_logger ()), sock (sock),
+			pkt_strand (srv.get_thread_pool ())
 	{
 		std::strcpy (this->ip, ip);
 		
@@ -81,8 +82,7 @@ namespace hCraft {
 		this->reading = false;
 		this->writing = false;
 		this->handlers_scheduled = 0;
-		this->total_read = 0;
-		this->read_rem = 1;
+		this->in_decrypted = 0;
 		this->dbid = -1;
 		
 		this->eating = false;
@@ -91,6 +91,7 @@ namespace hCraft {
 		this->hunger_saturation = 20.0;
 		this->exhaustion = 0.0;
 		this->total_walked = this->total_run = this->total_walked_old = this->total_run_old = 0.0;
+		this->move_dx = this->move_dz = 0.0;
 		
 		this->last_tick = std::chrono::steady_clock::now ();
 		this->last_heart_regen = this->last_tick;
@@ -105,17 +106,35 @@ namespace hCraft {
 		this->sb_block.set (BT_GLASS);
 		this->need_new_chunks = false;
 		this->streaming_chunks = false;
+		this->light_refreshes = 0;
+		this->light_refresh_time = std::chrono::steady_clock::now ();
 		
 		this->curr_sel = nullptr;
 		this->last_ping = std::chrono::system_clock::now ();
 		this->keep_alives_received = 0;
 		
+		this->outbuf = evbuffer_new ();
+		this->corked = 0;
+		this->flush_pending = false;
+		this->kick_pending = false;
+		this->kick_flushed = false;
+		
 		this->evbase = evbase;
+		this->flush_ev = nullptr;
 		this->bufev  = bufferevent_socket_new (evbase, sock,
-			BEV_OPT_CLOSE_ON_FREE);
+			BEV_OPT_CLOSE_ON_FREE | BEV_OPT_THREADSAFE);
 		if (!this->bufev)
 			{ this->fail = true; this->get_server ().schedule_destruction (this); return; }
 		
+		this->flush_ev = event_new (evbase, -1, 0, &hCraft::player::handle_flush, this);
+		if (!this->flush_ev)
+			{
+				bufferevent_free (this->bufev);
+				this->fail = true;
+				this->get_server ().schedule_destruction (this);
+				return;
+			}
+		
 		this->encryptor = nullptr;
 		this->decryptor = nullptr;
 		
@@ -154,12 +173,8 @@ namespace hCraft {
 		
 		{
 			std::lock_guard<std::mutex> guard {this->out_lock};
-			while (!this->out_queue.empty ())
-				{
-					packet *top = this->out_queue.front ();
-					delete top;
-					this->out_queue.pop ();
-				}
+			evbuffer_free (this->outbuf);
+			this->outbuf = nullptr;
 		}
 	}
 	
@@ -171,47 +186,22 @@ namespace hCraft {
 	 */
 	
 	
-	struct handle_context
-	{
-		player *pl;
-		unsigned char **packets;
-		int count;
-	};
-	
 	/* 
-	 * Executed in a thread pool task, spawned by handle ().
+	 * Executed in the player's packet strand, spawned by handle_read ().
 	 */
 	void
-	handle_func (void *ptr)
+	handle_func (player *pl, unsigned char *data)
 	{
-		handle_context *ctx = static_cast<handle_context *> (ptr);
-		player *pl = ctx->pl;
-		unsigned char **packets = ctx->packets;
-		int count = ctx->count;
-		delete ctx; // no longer needed
+		std::unique_ptr<unsigned char, void (*)(unsigned char *)> buf (data,
+			packet::release_received);
 		
-		// this will destroy all pointers in case of failure
-		std::vector<std::unique_ptr<unsigned char []> > vec;
-		for (int i = 0; i < count; ++i)
-			vec.emplace_back (packets [i]);
-		delete[] packets;
-		
-		if (pl->srv.is_shutting_down ())
-			return;
-		
-		for (std::unique_ptr<unsigned char []>& data : vec)
+		if (!pl->srv.is_shutting_down () && !pl->bad ())
 			{
 				try
 					{
-						int err = pl->handle (data.get ());
-						-- pl->handlers_scheduled;
-						if (pl->is_disconnecting ())
-							return;
-						else if (err != 0)
-							{
-								pl->disconnect ();
-								return;
-							}
+						int err = pl->handle (data);
+						if (err != 0 && !pl->is_disconnecting ())
+							pl->disconnect ();
 					}
 				catch (const std::exception& ex)
 					{
@@ -219,6 +209,43 @@ namespace hCraft {
 						pl->disconnect (false, false);
 					}
 			}
+		
+		-- pl->handlers_scheduled;
+	}
+	
+	/* 
+	 * Decrypts newly arrived data in place, inside the bufferevent's input
+	 * buffer. Data is only ever decrypted once, the amount of bytes at the
+	 * front of the buffer that already are is kept in @in_decrypted.
+	 */
+	void
+	player::decrypt_input (struct evbuffer *buf)
+	{
+		size_t len = evbuffer_get_length (buf);
+		if (len <= this->in_decrypted)
+			return;
+		
+		struct evbuffer_ptr pos;
+		evbuffer_ptr_set (buf, &pos, this->in_decrypted, EVBUFFER_PTR_SET);
+		
+		struct evbuffer_iovec vecs[8];
+		size_t left = len - this->in_decrypted;
+		while (left > 0)
+			{
+				int n = evbuffer_peek (buf, left, &pos, vecs, 8);
+				if (n > 8) n = 8;
+				
+				for (int i = 0; i < n && left > 0; ++i)
+					{
+						size_t ext = (vecs[i].iov_len < left) ? vecs[i].iov_len : left;
+						this->decryptor->ProcessData ((unsigned char *)vecs[i].iov_base,
+							(const unsigned char *)vecs[i].iov_base, ext);
+						evbuffer_ptr_set (buf, &pos, ext, EVBUFFER_PTR_ADD);
+						left -= ext;
+					}
+			}
+		
+		this->in_decrypted = len;
 	}
 	
 	void
@@ -230,110 +257,64 @@ namespace hCraft {
 		
 		struct evbuffer *buf = bufferevent_get_input (bufev);
 		size_t buf_size;
-		int n;
-		int tl = 0;
 		
 		while ((buf_size = evbuffer_get_length (buf)) > 0)
 			{
-				n = evbuffer_remove (buf, pl->rdbuf + pl->total_read, pl->read_rem);
-				if (n <= 0)
-					{ pl->reading = false; pl->disconnect (); return; }
+				// encryption might have been turned on by a packet handled since the
+				// last iteration, so this is checked every time around.
+				bool enc = pl->encrypted;
+				if (enc && pl->in_decrypted < buf_size)
+					pl->decrypt_input (buf);
+				
+				// frame the packet in place, looking at the first contiguous extent
+				// of the buffer, and only linearizing more of it if the packet's
+				// length can not be determined otherwise.
+				struct evbuffer_iovec vec;
+				if (evbuffer_peek (buf, -1, nullptr, &vec, 1) < 1)
+					break;
+				const unsigned char *data = (const unsigned char *)vec.iov_base;
+				size_t have = vec.iov_len;
 				
-				tl = pl->total_read;
-				pl->total_read += n;
-				
-				//// DEBUG
-				//if (pl->total_read == 1)
-				//	{
-				//		pl->log (LT_DEBUG) << "Packet [" << (int)pl->rdbuf[0] << "]" << std::endl;
-				//	}
-				
-				if (pl->encrypted)
+				// a small check...
+				if (!pl->handshake && data[0] != 0x02 && data[0] != 0xFE && data[0] != 0xFA)
 					{
-						// decrypt data.
-						std::string src ((char *)(pl->rdbuf + tl), pl->total_read - tl);
-						std::string tar;
-						
-						try
-							{
-								CryptoPP::StringSource (src, true,
-									new CryptoPP::StreamTransformationFilter (*pl->decryptor,
-										new CryptoPP::StringSink (tar)));
-							}
-						catch (CryptoPP::Exception& ex)
-							{
-								pl->log (LT_ERROR) << "Packet decryption failed (Player \"" << pl->get_username () << "\")" << std::endl;
-								pl->disconnect ();
-								return;
-							}
-						
-						std::memcpy (pl->rdbuf + tl, tar.data (), tar.size ());
-						pl->total_read = tar.size () + tl; // might not be necessary...
+						pl->log (LT_WARNING) << "Expected handshake from @" << pl->get_ip () << " (got " << (int)data[0] << ")" << std::endl;
+						pl->reading = false; 
+						pl->disconnect ();
+						return;
 					}
 				
-				// a small check...
-				if (!pl->handshake && (pl->total_read == 1))
+				int len = packet::frame_length (data, have);
+				while (len > (int)have && len <= (int)buf_size)
 					{
-						if (pl->rdbuf[0] != 0x02 && pl->rdbuf[0] != 0xFE)
-							{
-								if (pl->rdbuf[0] == 0xFA)
-									{
-										// plugin messages...
-										// TODO
-										
-									}
-								else
-									{
-										pl->log (LT_WARNING) << "Expected handshake from @" << pl->get_ip () << " (got " << (int)pl->rdbuf[0] << ")" << std::endl;
-										pl->reading = false; 
-										pl->disconnect ();
-										return;
-									}
-							}
+						data = evbuffer_pullup (buf, len);
+						have = len;
+						len = packet::frame_length (data, have);
 					}
 				
-				pl->read_rem = packet::remaining (pl->rdbuf, pl->total_read);
-				if (pl->read_rem == -1)
+				if (len == -1)
 					{
 						pl->log (LT_WARNING) << "Received an invalid packet from @"
 							<< pl->get_ip () << " (opcode: " << std::hex << std::setfill ('0')
-							<< std::setw (2) << (pl->rdbuf[0] & 0xFF) << ")" << std::setfill (' ')
+							<< std::setw (2) << (data[0] & 0xFF) << ")" << std::setfill (' ')
 							<< std::endl;
 						pl->reading = false; 
 						pl->disconnect ();
 						return;
 					}
-				else if (pl->read_rem == 0)
-					{
-						/* finished reading packet */
-						unsigned char *data = new unsigned char [pl->total_read];
-						std::memcpy (data, pl->rdbuf, pl->total_read);
-						pl->exec_queue.push_back (data);
-						if (pl->test_packet_chain ())
-							{
-								// copy queue into an array, so we could use it in a pooled thread.
-								int packet_count = pl->exec_queue.size ();
-								unsigned char **packets = new unsigned char* [packet_count];
-								for (int i = 0; !pl->exec_queue.empty (); ++i)
-									{
-										packets[i] = pl->exec_queue.front ();
-										pl->exec_queue.pop_front ();
-									}
-								
-								// wrap everything up
-								handle_context *ctx = new handle_context;
-								ctx->pl = pl;
-								ctx->packets = packets;
-								ctx->count = packet_count;
-								
-								++ pl->handlers_scheduled;
-								pl->get_server ().get_thread_pool ().enqueue (
-									handle_func, ctx);
-							}
-						
-						pl->total_read = 0;
-						pl->read_rem = 1;
-					}
+				else if (len > (int)buf_size)
+					break; // wait for the rest of the packet to arrive
+				
+				/* got a whole packet */
+				unsigned char *pack = packet::alloc_received (len);
+				evbuffer_remove (buf, pack, len);
+				if (enc)
+					pl->in_decrypted -= len;
+				
+				++ pl->handlers_scheduled;
+				pl->pkt_strand.post (
+					[pl] (void *ptr) { handle_func (pl, static_cast<unsigned char *> (ptr)); },
+					pack);
 			}
 		
 		pl->reading = false; 
@@ -346,42 +327,46 @@ namespace hCraft {
 		if (pl->bad ()) return;
 		pl->writing = true;
 		
-		int opcode;
+		// everything has been written out, including the kick packet?
+		// (libevent holds the bufferevent's lock here, so out_lock must not be
+		// taken: other threads take the two in the opposite order.)
+		if (pl->kick_flushed)
+			{
+				if (pl->kick_msg[0] == '\0')
+					pl->log () << pl->get_username () << " has been kicked." << std::endl;
+				else
+					pl->log () << pl->get_username () << " has been kicked: " << pl->kick_msg << std::endl;	
+				
+				pl->writing = false;
+				pl->disconnect (true);
+				return;
+			}
 		
+		pl->writing = false;
+	}
+	
+	/* 
+	 * Called in the worker thread that owns the player's bufferevent when
+	 * there are queued packets to write out.
+	 */
+	void
+	player::handle_flush (evutil_socket_t fd, short events, void *ctx)
+	{
+		player *pl = static_cast<player *> (ctx);
+		if (pl->bad ()) return;
+		pl->writing = true;
+		
+		// moves the queued data without copying it, libevent then writes all of
+		// it out using as few system calls as possible.
 		std::lock_guard<std::mutex> guard {pl->out_lock};
-		if (!pl->out_queue.empty ())
+		pl->flush_pending = false;
+		if (evbuffer_get_length (pl->outbuf) > 0)
 			{
-				// dispose of the packet that we just completed sending.
-				packet *pack = pl->out_queue.front ();
-				pl->out_queue.pop ();
-				opcode = pack->data[0];
-				delete pack;
+				bufferevent_write_buffer (pl->bufev, pl->outbuf);
 				
-				if (pl->kicked && (opcode == 0xFF))
-					{
-						if (pl->kick_msg[0] == '\0')
-							pl->log () << pl->get_username () << " has been kicked." << std::endl;
-						else
-							pl->log () << pl->get_username () << " has been kicked: " << pl->kick_msg << std::endl;	
-						
-						while (!pl->out_queue.empty ())
-							{
-								pack = pl->out_queue.front ();
-								delete pack;
-								pl->out_queue.pop ();
-							}
-						
-						pl->writing = false;
-						pl->disconnect (true);
-						return;
-					}
-				
-				// if the queue has more packets, send the next one.
-				if (!pl->out_queue.empty ())
-					{
-						packet *pack = pl->out_queue.front ();
-						bufferevent_write (bufev, pack->data, pack->size);
-					}
+				// nothing gets queued after the kick packet.
+				if (pl->kick_pending)
+					pl->kick_flushed = true;
 			}
 		
 		pl->writing = false;
@@ -417,6 +402,9 @@ namespace hCraft {
 		
 		this->save_data ();
 		
+		// make sure the generator doesn't try to deliver any more chunks.
+		this->get_server ().cgen.cancel (this);
+		
 		/*
 		// wait for the I/O to stop.
 		if (wait_for_callbacks_to_finish)
@@ -447,7 +435,10 @@ namespace hCraft {
 							this->chcurr.x, this->chcurr.z);
 						if (curr_chunk)
 							curr_chunk->remove_entity (this);
-						this->known_chunks.clear ();
+						{
+							std::lock_guard<std::mutex> kc_guard {this->known_chunks_lock};
+							this->known_chunks.clear ();
+						}
 				
 						// despawn from other players.
 						std::lock_guard<std::mutex> guard {this->visible_player_lock};
@@ -458,6 +449,17 @@ namespace hCraft {
 					}
 			}
 		
+		// stop send () from waking the worker up, then get rid of the event
+		// (event_free () waits for the callback if it's currently running).
+		struct event *flush_ev;
+		{
+			std::lock_guard<std::mutex> guard {this->out_lock};
+			flush_ev = this->flush_ev;
+			this->flush_ev = nullptr;
+		}
+		if (flush_ev)
+			event_free (flush_ev);
+		
 		{	
 			std::lock_guard<std::mutex> guard ((this->get_server ().get_player_lock ()));
 			bufferevent_free (this->bufev);
@@ -510,6 +512,53 @@ namespace hCraft {
 	
 	
 	
+	// packets smaller than this are copied into the output buffer rather than
+	// referenced by it, since a reference costs more than a small copy.
+	static const unsigned int _min_referenced_packet = 1024;
+	
+	static void
+	_release_packet (const void *data, size_t len, void *ctx)
+	{
+		delete static_cast<packet *> (ctx);
+	}
+	
+	static void
+	_release_shared_packet (const void *data, size_t len, void *ctx)
+	{
+		delete static_cast<std::shared_ptr<packet> *> (ctx);
+	}
+	
+	// appends the specified packet to the output buffer and takes ownership of it.
+	static void
+	_queue_packet (struct evbuffer *outbuf, packet *pack)
+	{
+		if (pack->size < _min_referenced_packet)
+			{
+				evbuffer_add (outbuf, pack->data, pack->size);
+				delete pack;
+			}
+		else
+			evbuffer_add_reference (outbuf, pack->data, pack->size,
+				_release_packet, pack);
+	}
+	
+	/* 
+	 * Wakes up the player's worker to write out queued packets, unless the
+	 * player is corked. The output lock must be held.
+	 */
+	void
+	player::schedule_flush ()
+	{
+		if (this->corked > 0 || this->flush_pending || !this->flush_ev)
+			return;
+		
+		// send () is usually called from threads other than the worker that owns
+		// the bufferevent, so we wake the worker up and let it do the writing.
+		// Packets sent until it gets to it are written out along with this one.
+		this->flush_pending = true;
+		event_active (this->flush_ev, EV_WRITE, 0);
+	}
+	
 	/* 
 	 * Inserts the specified packet into the player's queue of outgoing packets.
 	 */
@@ -520,40 +569,97 @@ namespace hCraft {
 			{ delete pack; return; }
 		
 		std::lock_guard<std::mutex> guard {this->out_lock};
+		if (!this->outbuf || this->kick_pending)
+			{ delete pack; return; }
+		
+		if (this->kicked && (pack->data[0] == 0xFF))
+			this->kick_pending = true;
+		
+		// packets are encrypted in place, the stream cipher keeps the size.
+		if (this->encrypted)
+			this->encryptor->ProcessData (pack->data, pack->data, pack->size);
+		
+		_queue_packet (this->outbuf, pack);
+		this->schedule_flush ();
+	}
+	
+	/* 
+	 * Same as send (packet *), but for packets that are shared between
+	 * several players (e.g. cached chunks). The packet must not be modified
+	 * afterwards.
+	 */
+	void
+	player::send (std::shared_ptr<packet> pack)
+	{
+		if (this->bad ())
+			return;
+		
+		std::lock_guard<std::mutex> guard {this->out_lock};
+		if (!this->outbuf || this->kick_pending)
+			return;
 		
-		// encrypt contents
 		if (this->encrypted)
 			{
-				std::string src ((const char *)pack->data, (int)pack->size);
-				std::string tar;
+				// the shared contents must stay intact, so encrypted connections
+				// encrypt straight into a copy of their own.
+				packet *enc = new packet (pack->size);
+				this->encryptor->ProcessData (enc->data, pack->data, pack->size);
+				enc->size = pack->size;
 				
-				try
-					{
-						CryptoPP::StringSource (src, true,
-							new CryptoPP::StreamTransformationFilter (*this->encryptor,
-								new CryptoPP::StringSink (tar)));
-					}
-				catch (CryptoPP::Exception& ex)
-					{
-						log (LT_ERROR) << "Packet encryption failed (Player \"" << this->get_username () << "\")" << std::endl;
-						this->disconnect ();
-						return;
-					}
-		
-				if (pack->cap < tar.size ())
-					pack->resize (tar.size ());
-				pack->clear ();
-				pack->put_bytes ((const unsigned char *)tar.data (), tar.size ());
+				_queue_packet (this->outbuf, enc);
+				this->schedule_flush ();
+				return;
 			}
 		
-		this->out_queue.push (pack);
-		if (this->out_queue.size () == 1)
+		evbuffer_add_reference (this->outbuf, pack->data, pack->size,
+			_release_shared_packet, new std::shared_ptr<packet> (pack));
+		this->schedule_flush ();
+	}
+	
+	/* 
+	 * While the player is corked, sent packets are only queued, and are
+	 * written out together once uncork () is called. Calls may be nested.
+	 */
+	
+	void
+	player::cork ()
+	{
+		std::lock_guard<std::mutex> guard {this->out_lock};
+		++ this->corked;
+	}
+	
+	void
+	player::uncork ()
+	{
+		std::lock_guard<std::mutex> guard {this->out_lock};
+		if (this->corked > 0 && (-- this->corked) == 0)
 			{
-				// initiate write
-				bufferevent_write (this->bufev, pack->data, pack->size);
+				if (this->outbuf && evbuffer_get_length (this->outbuf) > 0)
+					this->schedule_flush ();
 			}
 	}
 	
+	/* 
+	 * Returns the amount of bytes queued for sending, but not yet written
+	 * out to the socket.
+	 */
+	int
+	player::get_send_queue_size ()
+	{
+		if (this->bad ())
+			return 0;
+		
+		int size;
+		{
+			std::lock_guard<std::mutex> guard {this->out_lock};
+			size = this->outbuf ? evbuffer_get_length (this->outbuf) : 0;
+		}
+		
+		// the bufferevent's output is locked by libevent, and must not be
+		// looked at while holding out_lock (see handle_write ()).
+		return size + evbuffer_get_length (bufferevent_get_output (this->bufev));
+	}
+	
 	
 	
 	/* 
@@ -652,6 +758,7 @@ namespace hCraft {
 						if (!this->can_see_chunk (kc.cx, kc.cz))
 							{
 								unload_list.push_back (std::make_pair (kc, true));
+								std::lock_guard<std::mutex> kc_guard {this->known_chunks_lock};
 								itr = this->known_chunks.erase (itr);
 							}
 						else
@@ -662,6 +769,19 @@ namespace hCraft {
 							}
 					}
 				
+				// withdraw requests for chunks that we no longer need
+				for (auto itr = this->pending_chunks.begin (); itr != this->pending_chunks.end (); )
+					{
+						known_chunk kc = *itr;
+						if (kc.w != w || !this->can_see_chunk (kc.cx, kc.cz))
+							{
+								this->srv.cgen.cancel (this, kc.w, kc.cx, kc.cz);
+								itr = this->pending_chunks.erase (itr);
+							}
+						else
+							++ itr;
+					}
+				
 				// get a sorted list of chunk coordinates.
 				std::vector<chunk_pos> coords;
 				{
@@ -695,7 +815,10 @@ namespace hCraft {
 								if (kc.cx == cx && kc.cz == cz)
 									{
 										if (kc.w != w)
-											this->known_chunks.erase (itr);
+											{
+												std::lock_guard<std::mutex> kc_guard {this->known_chunks_lock};
+												this->known_chunks.erase (itr);
+											}
 										else
 											found = true;
 										break;
@@ -705,32 +828,16 @@ namespace hCraft {
 						if (!found)
 							{
 								bool p_found = false;
-								for (auto itr = this->pending_chunks.begin (); itr != this->pending_chunks.end (); ++itr)
-									{
-										known_chunk c = *itr;
-										if (c.cx == cx && c.cz == cz)
-											{
-												if (c.w == w) 
-													p_found = true;
-												else
-													this->pending_chunks.erase (itr);
-												break;
-											}
-									}
+								for (known_chunk c : this->pending_chunks)
+									if (c.cx == cx && c.cz == cz)
+										{ p_found = true; break; }
 								
+								// requests for chunks that are already pending are merged by
+								// the generator, re-requesting them only updates their priority
+								// according to our new position.
+								this->srv.cgen.request (w, cx, cz, this);
 								if (!p_found)
-									{
-										// fetch all chunks around it first!
-										// to ensure that the world generator doesn't produce any
-										// glitched structures (such as trees cut in half)
-										for (int xx = (cx - 1); xx <= (cx + 1); ++xx)
-											for (int zz = (cz - 1); zz <= (cz + 1); ++zz)
-												if (!(xx == cx && zz == cz))
-													this->srv.cgen.request (w, xx, zz, this, GFL_NODELIVER);
-										
-										this->srv.cgen.request (w, cx, cz, this);
-										this->pending_chunks.push_back ({w, cx, cz});
-									}
+									this->pending_chunks.push_back ({w, cx, cz});
 							}
 					}
 				
@@ -750,7 +857,7 @@ namespace hCraft {
 					
 						// remove from pending chunk list
 						for (auto itr = this->pending_chunks.begin (); itr != this->pending_chunks.end (); ++itr)
-							if (itr->cx == resp.cx && itr->cz == resp.cz)
+							if (itr->w == resp.w && itr->cx == resp.cx && itr->cz == resp.cz)
 								{ this->pending_chunks.erase (itr); break; }
 						
 						if (!resp.ch || resp.flags == GFL_ABORTED)
@@ -763,8 +870,15 @@ namespace hCraft {
 						if (!this->can_see_chunk (resp.cx, resp.cz))
 							continue;
 						
-						this->send (packet::make_chunk (resp.cx, resp.cz, resp.ch));
-						this->known_chunks.push_back ({w, resp.cx, resp.cz});
+						std::shared_ptr<packet> cpack = this->srv.chunk_cache.get (
+							w, resp.cx, resp.cz, resp.ch);
+						if (!cpack)
+							continue;
+						this->send (cpack);
+						{
+							std::lock_guard<std::mutex> kc_guard {this->known_chunks_lock};
+							this->known_chunks.push_back ({w, resp.cx, resp.cz});
+						}
 						
 						// is this our new home chunk? (When switching between worlds)
 						if (this->joining_world && (my_cpos.x == resp.cx && my_cpos.z == resp.cz))
@@ -844,6 +958,42 @@ namespace hCraft {
 			(utils::iabs (me_pos.z - z) <= player::chunk_radius ()));
 	}
 	
+	/* 
+	 * Checks whether the player has been sent the specified chunk and has
+	 * not unloaded it since. Safe to call from other threads.
+	 */
+	bool
+	player::knows_chunk (world *w, int x, int z)
+	{
+		std::lock_guard<std::mutex> guard {this->known_chunks_lock};
+		for (const known_chunk& kc : this->known_chunks)
+			if (kc.w == w && kc.cx == x && kc.cz == z)
+				return true;
+		return false;
+	}
+	
+	/* 
+	 * Called by the player's world before it sends the player a chunk whose
+	 * light has changed. Returns false if the player has already been sent
+	 * as many light refreshes as it is allowed to in the current second,
+	 * in which case the refresh should be retried later.
+	 */
+	bool
+	player::take_light_refresh ()
+	{
+		auto now = std::chrono::steady_clock::now ();
+		if ((now - this->light_refresh_time) >= std::chrono::seconds (1))
+			{
+				this->light_refresh_time = now;
+				this->light_refreshes = 0;
+			}
+		
+		if (this->light_refreshes >= player::light_refresh_rate ())
+			return false;
+		++ this->light_refreshes;
+		return true;
+	}
+	
 	/* 
 	 * Used by the chunk_generator class to inform the player that a chunk
 	 * has been generated.
@@ -889,6 +1039,41 @@ namespace hCraft {
 			}
 	}
 	
+	/* 
+	 * Has the world's I/O thread read in the chunks just past the edge of
+	 * the player's view, in the direction the player is moving in.
+	 */
+	void
+	player::prefetch_ahead (chunk_pos cpos)
+	{
+		const static double min_speed = 0.05; // in blocks per position update
+		
+		world *w = this->get_world ();
+		if (!w)
+			return;
+		
+		double ax = std::abs (this->move_dx), az = std::abs (this->move_dz);
+		int dx = (ax < min_speed) ? 0 : ((this->move_dx > 0.0) ? 1 : -1);
+		int dz = (az < min_speed) ? 0 : ((this->move_dz > 0.0) ? 1 : -1);
+		
+		// only bother with the minor axis when moving diagonally.
+		if (ax > (az * 2.0))
+			dz = 0;
+		else if (az > (ax * 2.0))
+			dx = 0;
+		
+		int r = player::chunk_radius ();
+		for (int d = r + 1; d <= r + 2; ++d)
+			{
+				if (dx != 0)
+					for (int i = -r; i <= r; ++i)
+						w->io.prefetch (cpos.x + dx * d, cpos.z + i);
+				if (dz != 0)
+					for (int i = -r; i <= r; ++i)
+						w->io.prefetch (cpos.x + i, cpos.z + dz * d);
+			}
+	}
+	
 	/* 
 	 * Moves the player to the specified position.
 	 */
@@ -964,6 +1149,17 @@ namespace hCraft {
 				this->total_run_old = this->total_run;
 			}
 	//----
+		/* 
+		 * Read-ahead.
+		 */
+		if ((std::abs (x_delta) < 8.0) && (std::abs (z_delta) < 8.0)) // not teleporting
+			{
+				this->move_dx += (x_delta - this->move_dx) * 0.2;
+				this->move_dz += (z_delta - this->move_dz) * 0.2;
+			}
+		if ((curr_cpos.x != prev_cpos.x) || (curr_cpos.z != prev_cpos.z))
+			this->prefetch_ahead (curr_cpos);
+	//----
 		
 		
 		if (x_delta == 0.0 && y_delta == 0.0 && z_delta == 0.0)
@@ -3273,69 +3469,5 @@ namespace hCraft {
 		packet_reader reader {data};
 		return handlers[reader.read_byte ()] (this, reader);
 	}
-
-
-
-//----
-	
-	static bool
-	test_packet_66 (packet_reader reader)
-	{
-		reader.read_byte (); // wid
-		short slot = reader.read_short ();
-		char mbtn  = reader.read_byte ();
-		reader.read_short (); // action number
-		char mode = reader.read_byte ();
-		
-		if (mode == 5)
-			{
-				if (slot == -999 && ((mbtn == 2) || (mbtn == 6)))
-					return true;
-				
-				return false;
-			}			
-		
-		return true;
-	}
-	
-	/* 
-	 * Examines the queue that holds packets pending to be handled by
-	 * appropriate callback methods in-order to conclude whether it is safe
-	 * to handle the packets. 
-	 */
-	bool
-	player::test_packet_chain ()
-	{
-		// if the last packet is different compared to the existing ones,
-		// then consider it as the end of chain.
-		if (this->exec_queue.size () > 1)
-			{
-				int last_op = -1;
-				for (auto itr = this->exec_queue.rbegin (); itr != this->exec_queue.rend (); ++itr)
-					{
-						if (last_op == -1)
-							last_op = (*itr)[0];
-						else
-							{
-								if (last_op != (*itr)[0])
-									return true;
-							}
-					}
-			} 
-		
-		// we only test the last packet
-		unsigned char *data = this->exec_queue.back ();
-		packet_reader reader {data};
-		
-		switch (reader.read_byte ())
-			{
-				// window click
-				case 0x66: return test_packet_66 (reader);
-				case 0x6B: return false;
-				
-				default:
-					return true;
-			}
-	}
 }
 
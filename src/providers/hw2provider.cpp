@@ -0,0 +1,989 @@
+/* 
+ * hCraft - A custom Minecraft server.
+ * Copyright (C) 2012	Jacob Zhitomirsky
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "providers/hw2provider.hpp"
+#include "world.hpp"
+#include "chunk.hpp"
+#include <stdexcept>
+#include <algorithm>
+#include <cstring>
+#include <cctype>
+#include <cstdio>
+#include <zlib.h>
+#include <sys/stat.h>
+
+
+namespace hCraft {
+	
+	/* 
+	 * HWv2 file layout, in 512-byte sectors:
+	 * 
+	 * Sector 0 holds the header:
+	 *   0    magic ("HWv2")
+	 *   4    format revision
+	 *   8    width, depth
+	 *   16   spawn position (x, y, z as doubles, then r and l as floats)
+	 *   48   chunk count
+	 *   52   generator seed
+	 *   56   index offset (in sectors)
+	 *   60   index size (in entries, always a power of two)
+	 *   64   generator name (short length, followed by the characters)
+	 *   508  CRC-32 of the 508 bytes that precede it
+	 * 
+	 * The index is an open-addressed hash table (linear probing) of 20-byte
+	 * entries: x, z, offset (in sectors, zero for unused slots), size (in
+	 * bytes) and a CRC-32 of the chunk's data. Everything else is chunk data,
+	 * each chunk occupying a contiguous run of sectors.
+	 */
+	
+	static const unsigned int HW2_MAGIC    = 0x32765748;
+	static const unsigned int HW2_REVISION = 1;
+	
+	static const unsigned int SECTOR_SIZE  = 512;
+	static const unsigned int ENTRY_SIZE   = 20;
+	static const unsigned int MIN_INDEX    = 1024;
+	
+	
+	
+	static inline unsigned int
+	sectors_for (unsigned long long len)
+		{ return (len + SECTOR_SIZE - 1) / SECTOR_SIZE; }
+	
+	static unsigned int
+	hash_chunk (int x, int z)
+	{
+		unsigned int h = ((unsigned int)x * 0x9E3779B1U)
+			^ ((unsigned int)z * 0x85EBCA77U);
+		h ^= h >> 16;
+		h *= 0x7FEB352DU;
+		h ^= h >> 15;
+		return h;
+	}
+	
+	
+	
+//----
+	
+	static void
+	_put_int (unsigned char *ptr, unsigned int val)
+	{
+		ptr[0] = val & 0xFF;
+		ptr[1] = (val >> 8) & 0xFF;
+		ptr[2] = (val >> 16) & 0xFF;
+		ptr[3] = (val >> 24) & 0xFF;
+	}
+	
+	static void
+	_put_long (unsigned char *ptr, unsigned long long val)
+	{
+		_put_int (ptr, val & 0xFFFFFFFFU);
+		_put_int (ptr + 4, val >> 32);
+	}
+	
+	static unsigned int
+	_get_int (const unsigned char *ptr)
+	{
+		return ((unsigned int)ptr[0])
+				 | ((unsigned int)ptr[1] << 8)
+				 | ((unsigned int)ptr[2] << 16)
+				 | ((unsigned int)ptr[3] << 24);
+	}
+	
+	static unsigned long long
+	_get_long (const unsigned char *ptr)
+	{
+		return (unsigned long long)_get_int (ptr)
+				 | ((unsigned long long)_get_int (ptr + 4) << 32);
+	}
+	
+	
+	
+	static void
+	encode_header (unsigned char *hdr, const world_information& inf,
+		unsigned int index_offset, unsigned int index_size)
+	{
+		std::memset (hdr, 0, SECTOR_SIZE);
+		
+		_put_int (hdr, HW2_MAGIC);
+		_put_int (hdr + 4, HW2_REVISION);
+		_put_int (hdr + 8, inf.width);
+		_put_int (hdr + 12, inf.depth);
+		
+		double d;
+		float f;
+		d = inf.spawn_pos.x; _put_long (hdr + 16, *((unsigned long long *)&d));
+		d = inf.spawn_pos.y; _put_long (hdr + 24, *((unsigned long long *)&d));
+		d = inf.spawn_pos.z; _put_long (hdr + 32, *((unsigned long long *)&d));
+		f = inf.spawn_pos.r; _put_int (hdr + 40, *((unsigned int *)&f));
+		f = inf.spawn_pos.l; _put_int (hdr + 44, *((unsigned int *)&f));
+		
+		_put_int (hdr + 48, inf.chunk_count);
+		_put_int (hdr + 52, inf.seed);
+		_put_int (hdr + 56, index_offset);
+		_put_int (hdr + 60, index_size);
+		
+		unsigned int len = inf.generator.size ();
+		if (len > 256)
+			len = 256;
+		hdr[64] = len & 0xFF;
+		hdr[65] = (len >> 8) & 0xFF;
+		std::memcpy (hdr + 66, inf.generator.data (), len);
+		
+		_put_int (hdr + 508, crc32 (0, hdr, 508));
+	}
+	
+	static void
+	encode_entry (unsigned char *ptr, const hw2_entry& ent)
+	{
+		_put_int (ptr, ent.x);
+		_put_int (ptr + 4, ent.z);
+		_put_int (ptr + 8, ent.offset);
+		_put_int (ptr + 12, ent.size);
+		_put_int (ptr + 16, ent.crc);
+	}
+	
+	static void
+	decode_entry (const unsigned char *ptr, hw2_entry& ent)
+	{
+		ent.x = _get_int (ptr);
+		ent.z = _get_int (ptr + 4);
+		ent.offset = _get_int (ptr + 8);
+		ent.size = _get_int (ptr + 12);
+		ent.crc = _get_int (ptr + 16);
+	}
+	
+	/* 
+	 * Places @{ent} into the first free slot of its probe sequence.
+	 */
+	static void
+	insert_entry (std::vector<hw2_entry>& index, const hw2_entry& ent)
+	{
+		unsigned int mask = index.size () - 1;
+		unsigned int i = hash_chunk (ent.x, ent.z) & mask;
+		while (index[i].offset != 0)
+			i = (i + 1) & mask;
+		index[i] = ent;
+	}
+	
+	static void
+	write_index (std::ostream& strm, unsigned int offset,
+		const std::vector<hw2_entry>& index)
+	{
+		std::vector<unsigned char> data (sectors_for (index.size () * ENTRY_SIZE)
+			* SECTOR_SIZE, 0);
+		for (unsigned int i = 0; i < index.size (); ++i)
+			encode_entry (data.data () + (i * ENTRY_SIZE), index[i]);
+		
+		strm.seekp ((unsigned long long)offset * SECTOR_SIZE);
+		strm.write ((const char *)data.data (), data.size ());
+	}
+	
+	static void
+	write_padded (std::ostream& strm, const unsigned char *data, unsigned int len)
+	{
+		static const char zeroes[SECTOR_SIZE] = { 0 };
+		
+		strm.write ((const char *)data, len);
+		unsigned int pad = (sectors_for (len) * SECTOR_SIZE) - len;
+		if (pad > 0)
+			strm.write (zeroes, pad);
+	}
+	
+	
+	
+//----
+	
+	hw2_space_map::hw2_space_map ()
+	{
+		this->clear ();
+	}
+	
+	void
+	hw2_space_map::clear ()
+	{
+		this->bits.clear ();
+		this->sectors = 0;
+		this->hint = 0;
+		this->used = 0;
+	}
+	
+	
+	
+	/* 
+	 * Extends the map to span at least @{sectors} sectors, the new ones
+	 * being free.
+	 */
+	void
+	hw2_space_map::extend (unsigned int sectors)
+	{
+		if (sectors <= this->sectors)
+			return;
+		
+		this->bits.resize ((sectors + 63) / 64, 0);
+		this->sectors = sectors;
+	}
+	
+	/* 
+	 * Marks @{count} sectors starting at @{off} as used\free.
+	 */
+	void
+	hw2_space_map::mark (unsigned int off, unsigned int count)
+	{
+		this->extend (off + count);
+		for (unsigned int i = off; i < off + count; ++i)
+			{
+				unsigned long long& word = this->bits[i >> 6];
+				unsigned long long bit = 1ULL << (i & 63);
+				if (!(word & bit))
+					{
+						word |= bit;
+						++ this->used;
+					}
+			}
+	}
+	
+	void
+	hw2_space_map::release (unsigned int off, unsigned int count)
+	{
+		unsigned int end = std::min (off + count, this->sectors);
+		for (unsigned int i = off; i < end; ++i)
+			{
+				unsigned long long& word = this->bits[i >> 6];
+				unsigned long long bit = 1ULL << (i & 63);
+				if (word & bit)
+					{
+						word &= ~bit;
+						-- this->used;
+					}
+			}
+		
+		if (off < this->hint)
+			this->hint = off;
+	}
+	
+	/* 
+	 * Finds the first run of @{count} free sectors, extending the file if
+	 * there is none, marks it as used and returns its offset.
+	 */
+	unsigned int
+	hw2_space_map::allocate (unsigned int count)
+	{
+		const unsigned int none = 0xFFFFFFFFU;
+		unsigned int first_free = none, start = this->sectors, run = 0;
+		
+		for (unsigned int i = this->hint; i < this->sectors; ++i)
+			{
+				unsigned long long word = this->bits[i >> 6];
+				if (((i & 63) == 0) && (word == ~0ULL) && ((i + 64) <= this->sectors))
+					{
+						// skip whole words of used sectors at a time
+						run = 0;
+						i += 63;
+						continue;
+					}
+				
+				if (word & (1ULL << (i & 63)))
+					{
+						run = 0;
+						continue;
+					}
+				
+				if (first_free == none)
+					first_free = i;
+				if (run++ == 0)
+					start = i;
+				if (run == count)
+					break;
+			}
+		
+		// if no hole was large enough, the run either extends past the end of
+		// the file, or starts right at it.
+		if (run == 0)
+			start = this->sectors;
+		this->mark (start, count);
+		
+		this->hint = ((first_free == none) || (first_free == start))
+			? (start + count) : first_free;
+		return start;
+	}
+	
+	
+	
+//----
+	
+	/* 
+	 * Adds required prefixes, suffixes, etc... to the specified world name so
+	 * that the importer's claims_name () function returns true when passed to
+	 * it.
+	 */
+	std::string
+	hw2_provider_naming::make_name (const char *world_name)
+	{
+		std::string out;
+		out.reserve (std::strlen (world_name) + 5);
+		
+		int c;
+		while ((c = (int)(*world_name++)))
+			{
+				if (c == ' ')
+					out.push_back ('_');
+				else
+					out.push_back (std::tolower (c));
+			}
+		
+		out.append (".hw2"); // extension
+		
+		return out;
+	}
+	
+	/* 
+	 * Checks whether the specified path name meets the format required by this
+	 * exporter (could be a name prefix, suffix, extension, etc...).
+	 */
+	bool
+	hw2_provider_naming::claims_name (const char *path)
+	{
+		int len = std::strlen (path);
+		return ((len > 5) && (std::strcmp (path + len - 4, ".hw2") == 0));
+	}
+	
+	
+	
+//----
+	
+	/* 
+	 * Constructs a new world provider for the HWv2 format.
+	 */
+	hw2_provider::hw2_provider (const char *path, const char *world_name)
+		: out_path (path), inf ()
+	{
+		if (this->out_path[this->out_path.size () - 1] != '/')
+			this->out_path.push_back ('/');
+		this->out_path.append (hw2_provider_naming ().make_name (world_name));
+		
+		this->map = nullptr;
+		this->index_offset = 0;
+		this->read_file ();
+	}
+	
+	/* 
+	 * Class destructor.
+	 */
+	hw2_provider::~hw2_provider ()
+	{
+		this->close ();
+		delete this->map;
+	}
+	
+	
+	
+	/* 
+	 * Maps the world file and reads in its header and index, rebuilding the
+	 * space map from the latter.
+	 */
+	void
+	hw2_provider::read_file ()
+	{
+		delete this->map;
+		this->map = new hw_mapping (this->out_path);
+		this->index.clear ();
+		this->space.clear ();
+		this->index_offset = 0;
+		
+		struct stat st;
+		if (stat (this->out_path.c_str (), &st) != 0)
+			return; // doesn't exist yet
+		
+		const unsigned char *hdr = this->map->get (0, SECTOR_SIZE);
+		if (!hdr || _get_int (hdr) != HW2_MAGIC)
+			throw std::runtime_error ("not an HWv2 world file");
+		if (crc32 (0, hdr, 508) != _get_int (hdr + 508))
+			throw std::runtime_error ("corrupt HWv2 world header");
+		if (_get_int (hdr + 4) > HW2_REVISION)
+			throw std::runtime_error ("unsupported HWv2 revision");
+		
+		this->inf.width = _get_int (hdr + 8);
+		this->inf.depth = _get_int (hdr + 12);
+		
+		unsigned long long num;
+		unsigned int fnum;
+		num = _get_long (hdr + 16); this->inf.spawn_pos.x = *((double *)&num);
+		num = _get_long (hdr + 24); this->inf.spawn_pos.y = *((double *)&num);
+		num = _get_long (hdr + 32); this->inf.spawn_pos.z = *((double *)&num);
+		fnum = _get_int (hdr + 40); this->inf.spawn_pos.r = *((float *)&fnum);
+		fnum = _get_int (hdr + 44); this->inf.spawn_pos.l = *((float *)&fnum);
+		this->inf.spawn_pos.on_ground = true;
+		
+		this->inf.chunk_count = _get_int (hdr + 48);
+		this->inf.seed = _get_int (hdr + 52);
+		
+		unsigned int index_offset = _get_int (hdr + 56);
+		unsigned int index_size = _get_int (hdr + 60);
+		unsigned int gen_len = hdr[64] | (hdr[65] << 8);
+		if (gen_len > 256 || index_offset == 0 || index_size < MIN_INDEX
+			|| (index_size & (index_size - 1)))
+			throw std::runtime_error ("corrupt HWv2 world header");
+		this->inf.generator.assign ((const char *)hdr + 66, gen_len);
+		
+		// the whole index is read in at once.
+		const unsigned char *tbl = this->map->get (
+			(unsigned long long)index_offset * SECTOR_SIZE, index_size * ENTRY_SIZE);
+		if (!tbl)
+			throw std::runtime_error ("corrupt HWv2 world index");
+		
+		this->index_offset = index_offset;
+		this->index.resize (index_size);
+		this->space.mark (0, 1);
+		this->space.mark (index_offset, sectors_for (index_size * ENTRY_SIZE));
+		for (unsigned int i = 0; i < index_size; ++i)
+			{
+				hw2_entry& ent = this->index[i];
+				decode_entry (tbl + (i * ENTRY_SIZE), ent);
+				if (ent.offset != 0)
+					this->space.mark (ent.offset, sectors_for (ent.size));
+			}
+		
+		// free space at the end of the file can be reused as well.
+		this->space.extend (sectors_for (st.st_size));
+	}
+	
+	/* 
+	 * Like open (), but fails instead of creating the world file if it does
+	 * not exist.
+	 */
+	bool
+	hw2_provider::open_file ()
+	{
+		if (this->strm.is_open ())
+			return true;
+		
+		this->strm.open (this->out_path, std::ios_base::binary | std::ios_base::in
+			| std::ios_base::out);
+		return this->strm.is_open ();
+	}
+	
+	
+	
+	/* 
+	 * Opens the underlying file stream for reading\writing.
+	 * By using open () and close (), multiple chunks can be read\written
+	 * without reopening the world file everytime.
+	 */
+	void
+	hw2_provider::open (world &wr)
+	{
+		if (this->strm.is_open ())
+			return;
+		
+		if (!this->open_file ())
+			{
+				this->save_empty (wr);
+				this->open_file ();
+			}
+	}
+	
+	/* 
+	 * Closes the underlying file stream.
+	 */
+	void
+	hw2_provider::close ()
+	{
+		if (this->strm.is_open ())
+			{
+				this->strm.flush ();
+				this->strm.close ();
+			}
+	}
+	
+	
+	
+	/* 
+	 * Opens the file located at path @{path} and performs a check to see if it
+	 * is of the same format created by this exporter.
+	 */
+	bool
+	hw2_provider::claims (const char *path)
+	{
+		std::ifstream strm (path, std::ios_base::binary);
+		if (!strm)
+			return false;
+		
+		unsigned char magic[4];
+		if (!strm.read ((char *)magic, 4))
+			return false;
+		return (_get_int (magic) == HW2_MAGIC);
+	}
+	
+	
+	
+//----
+	
+	void
+	hw2_provider::write_header ()
+	{
+		unsigned char hdr[SECTOR_SIZE];
+		encode_header (hdr, this->inf, this->index_offset, this->index.size ());
+		
+		this->strm.seekp (0);
+		this->strm.write ((const char *)hdr, SECTOR_SIZE);
+	}
+	
+	void
+	hw2_provider::write_entry (unsigned int slot)
+	{
+		unsigned char data[ENTRY_SIZE];
+		encode_entry (data, this->index[slot]);
+		
+		this->strm.seekp (((unsigned long long)this->index_offset * SECTOR_SIZE)
+			+ (slot * ENTRY_SIZE));
+		this->strm.write ((const char *)data, ENTRY_SIZE);
+	}
+	
+	/* 
+	 * Doubles the size of the index. The new table is written out in full
+	 * before the header is pointed at it.
+	 */
+	void
+	hw2_provider::grow_index ()
+	{
+		std::vector<hw2_entry> next (this->index.size () * 2, hw2_entry ());
+		for (const hw2_entry& ent : this->index)
+			if (ent.offset != 0)
+				insert_entry (next, ent);
+		
+		unsigned int prev_offset = this->index_offset;
+		unsigned int prev_sectors = sectors_for (this->index.size () * ENTRY_SIZE);
+		
+		unsigned int offset = this->space.allocate (
+			sectors_for (next.size () * ENTRY_SIZE));
+		write_index (this->strm, offset, next);
+		
+		this->index.swap (next);
+		this->index_offset = offset;
+		this->write_header ();
+		
+		this->space.release (prev_offset, prev_sectors);
+	}
+	
+	/* 
+	 * Returns the slot holding the chunk at the specified coordinates, or the
+	 * free slot it should be placed in.
+	 */
+	unsigned int
+	hw2_provider::find_slot (int x, int z)
+	{
+		unsigned int mask = this->index.size () - 1;
+		unsigned int i = hash_chunk (x, z) & mask;
+		for (;;)
+			{
+				hw2_entry& ent = this->index[i];
+				if (ent.offset == 0 || (ent.x == x && ent.z == z))
+					return i;
+				i = (i + 1) & mask;
+			}
+	}
+	
+	/* 
+	 * Returns a pointer to the mapped, compressed data of the chunk at the
+	 * specified coordinates, after verifying its checksum. Null is returned
+	 * if the chunk is not present within the world file.
+	 */
+	const unsigned char*
+	hw2_provider::chunk_data (int x, int z, unsigned int& len)
+	{
+		if (this->index.empty ())
+			return nullptr;
+		
+		// reads go through the mapping, which only sees what has been flushed.
+		if (this->strm.is_open ())
+			this->strm.flush ();
+		
+		const hw2_entry& ent = this->index[this->find_slot (x, z)];
+		if (ent.offset == 0)
+			return nullptr;
+		
+		const unsigned char *data = this->map->get (
+			(unsigned long long)ent.offset * SECTOR_SIZE, ent.size);
+		if (!data)
+			throw std::runtime_error ("chunk lies outside of the world file");
+		if (crc32 (0, data, ent.size) != ent.crc)
+			throw std::runtime_error ("chunk checksum mismatch");
+		
+		len = ent.size;
+		return data;
+	}
+	
+	
+	
+//----
+	
+	/* 
+	 * Saves only the specified chunk.
+	 */
+	void
+	hw2_provider::save (world& wr, chunk *ch, int x, int z)
+	{
+		std::vector<unsigned char> data;
+		hw_encode_chunk (ch, data);
+		this->save_encoded (wr, data, x, z);
+	}
+	
+	/* 
+	 * Serializes and compresses the specified chunk into @{out}, in the form
+	 * expected by save_encoded (). Safe to call from several threads at once.
+	 */
+	void
+	hw2_provider::encode_chunk (chunk *ch, std::vector<unsigned char>& out)
+	{
+		hw_encode_chunk (ch, out);
+	}
+	
+	/* 
+	 * Writes out chunk data previously produced by encode_chunk ().
+	 */
+	void
+	hw2_provider::save_encoded (world& wr, const std::vector<unsigned char>& data,
+		int x, int z)
+	{
+		bool close_when_done = false;
+		if (!this->strm.is_open ())
+			{
+				this->open (wr);
+				if (!this->strm)
+					return;
+				close_when_done = true;
+			}
+		
+		this->save_raw (data.data (), data.size (), x, z);
+		
+		if (close_when_done)
+			this->close ();
+	}
+	
+	/* 
+	 * Writes out compressed chunk data, in the form produced by
+	 * hw_encode_chunk (). The world file must already exist.
+	 */
+	void
+	hw2_provider::save_raw (const unsigned char *data, unsigned int len,
+		int x, int z)
+	{
+		if (this->index.empty ())
+			throw std::runtime_error ("world file does not exist");
+		
+		bool close_when_done = false;
+		if (!this->strm.is_open ())
+			{
+				if (!this->open_file ())
+					throw std::runtime_error ("failed to open world file");
+				close_when_done = true;
+			}
+		
+		unsigned int slot = this->find_slot (x, z);
+		if (this->index[slot].offset == 0
+			&& (((unsigned int)this->inf.chunk_count + 1) * 4) > (this->index.size () * 3))
+			{
+				this->grow_index ();
+				slot = this->find_slot (x, z);
+			}
+		
+		// the chunk is always written to a fresh run of sectors, and the old one
+		// is only released once the index points away from it.
+		hw2_entry prev = this->index[slot];
+		unsigned int offset = this->space.allocate (sectors_for (len));
+		this->strm.seekp ((unsigned long long)offset * SECTOR_SIZE);
+		write_padded (this->strm, data, len);
+		
+		hw2_entry& ent = this->index[slot];
+		ent.x = x;
+		ent.z = z;
+		ent.offset = offset;
+		ent.size = len;
+		ent.crc = crc32 (0, data, len);
+		this->write_entry (slot);
+		
+		if (prev.offset == 0)
+			{
+				++ this->inf.chunk_count;
+				this->write_header ();
+			}
+		else
+			this->space.release (prev.offset, sectors_for (prev.size));
+		
+		if (close_when_done)
+			this->close ();
+	}
+	
+	
+	
+	/* 
+	 * Saves the specified world without writing out any chunks.
+	 */
+	void
+	hw2_provider::save_empty (world &wr)
+	{
+		world_information info;
+		info.width = wr.get_width ();
+		info.depth = wr.get_depth ();
+		info.spawn_pos = wr.get_spawn ();
+		info.chunk_count = 0;
+		if (wr.get_generator ())
+			{
+				info.generator = wr.get_generator ()->name ();
+				info.seed = wr.get_generator ()->seed ();
+			}
+		else
+			info.seed = 0;
+		
+		this->save_empty (info);
+	}
+	
+	/* 
+	 * Creates an empty world file that holds the specified information, if
+	 * one does not already exist.
+	 */
+	void
+	hw2_provider::save_empty (const world_information& info)
+	{
+		{
+			// check if the file exists
+			std::ifstream strm (this->out_path);
+			if (strm.is_open ())
+				{
+					strm.close ();
+					return;
+				}
+		}
+		
+		std::ofstream strm (this->out_path, std::ios_base::binary | std::ios_base::out
+			| std::ios_base::trunc);
+		if (!strm)
+			throw std::runtime_error ("failed to open world file");
+		
+		world_information empty = info;
+		empty.chunk_count = 0;
+		
+		// header, followed by an empty index.
+		unsigned char hdr[SECTOR_SIZE];
+		encode_header (hdr, empty, 1, MIN_INDEX);
+		strm.write ((const char *)hdr, SECTOR_SIZE);
+		write_index (strm, 1, std::vector<hw2_entry> (MIN_INDEX, hw2_entry ()));
+		
+		strm.close ();
+		if (!strm)
+			throw std::runtime_error ("failed to write world file");
+		
+		this->read_file ();
+	}
+	
+	/* 
+	 * Updates world information for a given world. The chunk count is kept
+	 * by the provider itself.
+	 */
+	void
+	hw2_provider::save_info (world &w, const world_information &info)
+	{
+		unsigned int chunk_count = this->inf.chunk_count;
+		this->inf = info;
+		this->inf.chunk_count = chunk_count;
+		
+		if (this->index.empty ())
+			return;
+		
+		bool close_when_done = false;
+		if (!this->strm.is_open ())
+			{
+				if (!this->open_file ())
+					return;
+				close_when_done = true;
+			}
+		
+		this->write_header ();
+		this->strm.flush ();
+		
+		if (close_when_done)
+			this->close ();
+	}
+	
+	
+	
+//----
+	
+	/* 
+	 * Attempts to load the chunk located at the specified coordinates into
+	 * @{ch}. Returns true on success, and false if the chunk is not present
+	 * within the world file.
+	 */
+	bool
+	hw2_provider::load (world &wr, chunk *ch, int x, int z)
+	{
+		unsigned int len;
+		const unsigned char *data = this->chunk_data (x, z, len);
+		if (!data)
+			return false;
+		
+		hw_decode_chunk (ch, data, len);
+		return true;
+	}
+	
+	/* 
+	 * Reads the chunk located at the specified coordinates into @{out},
+	 * still compressed. Returns false if the chunk is not present within the
+	 * world file.
+	 */
+	bool
+	hw2_provider::load_raw (int x, int z, std::vector<unsigned char>& out)
+	{
+		unsigned int len;
+		const unsigned char *data = this->chunk_data (x, z, len);
+		if (!data)
+			return false;
+		
+		out.assign (data, data + len);
+		return true;
+	}
+	
+	/* 
+	 * Returns the position within the world file at which the data of the
+	 * specified chunk begins, or -1 if the chunk is not present.
+	 */
+	long long
+	hw2_provider::locate (int x, int z)
+	{
+		if (this->index.empty ())
+			return -1;
+		
+		const hw2_entry& ent = this->index[this->find_slot (x, z)];
+		if (ent.offset == 0)
+			return -1;
+		return (long long)ent.offset * SECTOR_SIZE;
+	}
+	
+	/* 
+	 * Fills @{out} with the coordinates of every chunk stored in the world
+	 * file.
+	 */
+	void
+	hw2_provider::list_chunks (std::vector<std::pair<int, int>>& out)
+	{
+		for (const hw2_entry& ent : this->index)
+			if (ent.offset != 0)
+				out.emplace_back (ent.x, ent.z);
+	}
+	
+	
+	
+	/* 
+	 * Returns the size of the world file, and how many bytes of it are not
+	 * used by anything.
+	 */
+	unsigned long long
+	hw2_provider::file_size () const
+	{
+		return (unsigned long long)this->space.size () * SECTOR_SIZE;
+	}
+	
+	unsigned long long
+	hw2_provider::free_space () const
+	{
+		return (unsigned long long)(this->space.size () - this->space.in_use ())
+			* SECTOR_SIZE;
+	}
+	
+	
+	
+	/* 
+	 * Rewrites the world file with no free space in it, with chunks laid
+	 * out region by region. The world must not be in use by a server.
+	 */
+	void
+	hw2_provider::compact ()
+	{
+		if (this->index.empty ())
+			return;
+		this->close ();
+		
+		std::vector<hw2_entry> ents;
+		for (const hw2_entry& ent : this->index)
+			if (ent.offset != 0)
+				ents.push_back (ent);
+		
+		// neighbouring chunks end up next to each other.
+		std::sort (ents.begin (), ents.end (),
+			[] (const hw2_entry& a, const hw2_entry& b)
+				{
+					if ((a.x >> 5) != (b.x >> 5)) return (a.x >> 5) < (b.x >> 5);
+					if ((a.z >> 5) != (b.z >> 5)) return (a.z >> 5) < (b.z >> 5);
+					if (a.z != b.z) return a.z < b.z;
+					return a.x < b.x;
+				});
+		
+		unsigned int index_size = MIN_INDEX;
+		while ((ents.size () * 4) > (index_size * 3))
+			index_size *= 2;
+		std::vector<hw2_entry> next (index_size, hw2_entry ());
+		
+		std::string tmp_path = this->out_path + ".tmp";
+		std::ofstream strm (tmp_path, std::ios_base::binary | std::ios_base::out
+			| std::ios_base::trunc);
+		if (!strm)
+			throw std::runtime_error ("failed to create temporary world file");
+		
+		unsigned int offset = 1 + sectors_for (index_size * ENTRY_SIZE);
+		strm.seekp ((unsigned long long)offset * SECTOR_SIZE);
+		for (hw2_entry ent : ents)
+			{
+				const unsigned char *data = this->map->get (
+					(unsigned long long)ent.offset * SECTOR_SIZE, ent.size);
+				if (!data || crc32 (0, data, ent.size) != ent.crc)
+					{
+						strm.close ();
+						std::remove (tmp_path.c_str ());
+						throw std::runtime_error ("chunk checksum mismatch");
+					}
+				
+				write_padded (strm, data, ent.size);
+				ent.offset = offset;
+				offset += sectors_for (ent.size);
+				insert_entry (next, ent);
+			}
+		
+		world_information info = this->inf;
+		info.chunk_count = ents.size ();
+		unsigned char hdr[SECTOR_SIZE];
+		encode_header (hdr, info, 1, index_size);
+		write_index (strm, 1, next);
+		strm.seekp (0);
+		strm.write ((const char *)hdr, SECTOR_SIZE);
+		
+		strm.close ();
+		if (!strm)
+			{
+				std::remove (tmp_path.c_str ());
+				throw std::runtime_error ("failed to write temporary world file");
+			}
+		
+		if (std::rename (tmp_path.c_str (), this->out_path.c_str ()) != 0)
+			{
+				std::remove (tmp_path.c_str ());
+				throw std::runtime_error ("failed to replace world file");
+			}
+		
+		this->read_file ();
+	}
+}
@@ -19,13 +19,18 @@
 #include "providers/hwprovider.hpp"
 #include "world.hpp"
 #include "chunk.hpp"
+#include "compression.hpp"
 #include <iostream>
 #include <fstream>
 #include <stdexcept>
 #include <cstring>
 #include <cctype>
 #include <zlib.h>
-#include <stdexcept>
+#include <memory>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 
 namespace hCraft {
@@ -255,8 +260,276 @@ namespace hCraft {
 	
 	
 //----
+	
+	hw_mapping::hw_mapping (const std::string& path)
+		: path (path)
+	{
+		this->fd = -1;
+		this->data = nullptr;
+		this->size = 0;
+	}
+	
+	hw_mapping::~hw_mapping ()
+	{
+		this->close ();
+	}
+	
+	
+	/* 
+	 * Unmaps the file.
+	 */
+	void
+	hw_mapping::close ()
+	{
+		if (this->data)
+			{
+				munmap (this->data, this->size);
+				this->data = nullptr;
+				this->size = 0;
+			}
+		
+		if (this->fd != -1)
+			{
+				::close (this->fd);
+				this->fd = -1;
+			}
+	}
+	
+	/* 
+	 * (Re)maps the whole file.
+	 */
+	bool
+	hw_mapping::remap ()
+	{
+		if (this->fd == -1)
+			{
+				this->fd = ::open (this->path.c_str (), O_RDONLY);
+				if (this->fd == -1)
+					return false;
+			}
+		
+		struct stat st;
+		if (fstat (this->fd, &st) != 0)
+			return false;
+		if ((unsigned long long)st.st_size <= this->size)
+			return true; // hasn't grown
+		
+		if (this->data)
+			munmap (this->data, this->size);
+		this->data = nullptr;
+		this->size = 0;
+		
+		void *ptr = mmap (nullptr, st.st_size, PROT_READ, MAP_SHARED, this->fd, 0);
+		if (ptr == MAP_FAILED)
+			return false;
 		
-	static void read_file (world_information&, hw_superblock **, binary_reader); // forward def
+		this->data = (unsigned char *)ptr;
+		this->size = st.st_size;
+		return true;
+	}
+	
+	/* 
+	 * Returns a pointer to @{len} bytes of the file starting at offset @{off},
+	 * or null if the file is not that large. The pointer remains valid until
+	 * the next call to get ().
+	 */
+	const unsigned char*
+	hw_mapping::get (unsigned long long off, unsigned int len)
+	{
+		if ((off + len) > this->size)
+			{
+				if (!this->remap () || ((off + len) > this->size))
+					return nullptr;
+			}
+		
+		return this->data + off;
+	}
+	
+	
+	
+//----
+	
+	static int
+	_write_short (unsigned char *ptr, unsigned short val)
+	{
+		ptr[0] = val & 0xFF;
+		ptr[1] = (val >> 8) & 0xFF;
+		return 2;
+	}
+	
+	/*
+	// Unused
+	static int
+	_write_int (unsigned char *ptr, unsigned int val)
+	{
+		ptr[0] = val & 0xFF;
+		ptr[1] = (val >> 8) & 0xFF;
+		ptr[2] = (val >> 16) & 0xFF;
+		ptr[3] = (val >> 24) & 0xFF;
+		return 4;
+	}
+	*/
+	
+	
+	static unsigned short
+	_read_short (const unsigned char *ptr)
+	{
+		return ((unsigned short)ptr[0])
+				 | ((unsigned short)ptr[1] << 8);
+	}
+	
+	static unsigned int
+	_read_int (const unsigned char *ptr)
+	{
+		return ((unsigned int)ptr[0])
+				 | ((unsigned int)ptr[1] << 8)
+				 | ((unsigned int)ptr[2] << 16)
+				 | ((unsigned int)ptr[3] << 24);
+	}
+	
+	
+	
+
+	
+//----
+	
+	static bool
+	read_header (world_information& inf, hw_mapping& map)
+	{
+		const unsigned char *ptr = map.get (0, 512);
+		if (!ptr)
+			return false;
+		
+		// dimensions
+		inf.width = _read_int (ptr + 4);
+		inf.depth = _read_int (ptr + 8);
+		
+		// spawn pos
+		unsigned long long num;
+		num = (unsigned long long)_read_int (ptr + 12) | ((unsigned long long)_read_int (ptr + 16) << 32);
+		inf.spawn_pos.x = *((double *)&num);
+		num = (unsigned long long)_read_int (ptr + 20) | ((unsigned long long)_read_int (ptr + 24) << 32);
+		inf.spawn_pos.y = *((double *)&num);
+		num = (unsigned long long)_read_int (ptr + 28) | ((unsigned long long)_read_int (ptr + 32) << 32);
+		inf.spawn_pos.z = *((double *)&num);
+		unsigned int fnum;
+		fnum = _read_int (ptr + 36);
+		inf.spawn_pos.r = *((float *)&fnum);
+		fnum = _read_int (ptr + 40);
+		inf.spawn_pos.l = *((float *)&fnum);
+		inf.spawn_pos.on_ground = true;
+		
+		inf.chunk_count = _read_int (ptr + 44);
+		
+		// generator
+		int generator_len = _read_short (ptr + 48);
+		if (generator_len > (512 - 54))
+			return false;
+		inf.generator.assign ((const char *)ptr + 50, generator_len);
+		
+		inf.seed = _read_int (ptr + 50 + generator_len);
+		return true;
+	}
+	
+	/* 
+	 * Only the super-block table is read up front. Everything beneath it is
+	 * read in as it is needed.
+	 */
+	static void
+	read_superblock_table (hw_superblock **sblocks, hw_mapping& map)
+	{
+		const unsigned char *tbl = map.get (512, 4096 * 12);
+		if (!tbl)
+			return;
+		
+		for (int i = 0; i < 4096; ++i, tbl += 12)
+			{
+				unsigned int offset = _read_int (tbl + 8);
+				if (offset == 0xFFFFFFFFU)
+					continue;
+				
+				hw_superblock *sblock = new hw_superblock (_read_int (tbl), _read_int (tbl + 4));
+				sblock->offset = offset;
+				sblocks[i] = sblock;
+			}
+	}
+	
+	static void
+	load_superblock (hw_superblock *sblock, hw_mapping& map)
+	{
+		sblock->loaded = true;
+		const unsigned char *tbl = map.get ((unsigned long long)sblock->offset * 512, 64 * 12);
+		if (!tbl)
+			return;
+		
+		for (int i = 0; i < 64; ++i, tbl += 12)
+			{
+				unsigned int offset = _read_int (tbl + 8);
+				if (offset == 0xFFFFFFFFU)
+					continue;
+				
+				hw_block *block = new hw_block (_read_int (tbl), _read_int (tbl + 4));
+				block->offset = offset;
+				sblock->blocks[i] = block;
+			}
+	}
+	
+	static void
+	load_block (hw_block *block, hw_mapping& map)
+	{
+		block->loaded = true;
+		const unsigned char *tbl = map.get ((unsigned long long)block->offset * 512, 1024 * 12);
+		if (!tbl)
+			return;
+		
+		for (int i = 0; i < 1024; ++i, tbl += 12)
+			{
+				unsigned int offset = _read_int (tbl + 8);
+				if (offset == 0xFFFFFFFFU)
+					continue;
+				
+				hw_region *region = new hw_region (_read_int (tbl), _read_int (tbl + 4));
+				region->offset = offset;
+				block->regions[i] = region;
+			}
+	}
+	
+	static void
+	load_region (hw_region *region, hw_mapping& map)
+	{
+		region->loaded = true;
+		const unsigned char *tbl = map.get ((unsigned long long)region->offset * 512, 1024 * 12);
+		if (!tbl)
+			return;
+		
+		for (int i = 0; i < 1024; ++i, tbl += 12)
+			{
+				unsigned int offset = _read_int (tbl + 8);
+				if (offset == 0xFFFFFFFFU)
+					continue;
+				
+				hw_chunk *ch = new hw_chunk (_read_int (tbl), _read_int (tbl + 4));
+				ch->offset = offset;
+				region->chunks[i] = ch;
+			}
+	}
+	
+	static void
+	load_chunk_table (hw_chunk *ch, hw_mapping& map)
+	{
+		ch->loaded = true;
+		const unsigned char *tbl = map.get ((unsigned long long)ch->offset * 512, 4 + (256 * 4));
+		if (!tbl)
+			return;
+		
+		ch->size = _read_int (tbl);
+		for (int i = 0; i < 256; ++i)
+			ch->sector_table[i] = _read_int (tbl + 4 + (i * 4));
+	}
+	
+	
+	
+//----
 	
 	/* 
 	 * Constructs a new world provider for the HWv1 format.
@@ -271,17 +544,11 @@ namespace hCraft {
 		for (int i = 0; i < 4096; ++i)
 			this->sblocks[i] = nullptr;
 		
-		// read tables if the world file already exists
-		{
-			std::fstream strm (this->out_path, std::ios_base::in
-				| std::ios_base::binary);
-			if (strm.is_open ())
-				{
-					binary_reader reader {strm};
-					read_file (this->inf, this->sblocks, reader);
-					strm.close ();
-				}
-		}
+		// the file stays mapped for as long as the provider lives, and tables
+		// are only read in once they're needed.
+		this->map = new hw_mapping (this->out_path);
+		if (read_header (this->inf, *this->map))
+			read_superblock_table (this->sblocks, *this->map);
 	}
 	
 	/* 
@@ -292,6 +559,7 @@ namespace hCraft {
 		for (int i = 0; i < 4096; ++i)
 			delete this->sblocks[i];
 		this->close ();
+		delete this->map;
 	}
 	
 	
@@ -423,6 +691,7 @@ namespace hCraft {
 			{
 				sblocks[hash_m] = new hw_superblock (x, z);
 				sblock = sblocks[hash_m];
+				sblock->loaded = true;
 		
 				// create the superblock
 				writer.seek (0, std::ios_base::end);
@@ -446,12 +715,14 @@ namespace hCraft {
 	}
 	
 	static hw_block*
-	find_or_create_block (int x, int z, hw_superblock **sblocks,
+	find_or_create_block (int x, int z, hw_superblock **sblocks, hw_mapping& map,
 		binary_writer writer, bool create = true)
 	{
 		hw_superblock *sblock = find_or_create_superblock (
 			fast_floor (x / 8.0), fast_floor (z / 8.0), sblocks,writer, create);
 		if (!sblock) return nullptr;
+		if (!sblock->loaded)
+			load_superblock (sblock, map);
 		
 		unsigned int hash = hash_coords (x, z);
 		unsigned int hash_m = hash & 0x3F;
@@ -481,6 +752,7 @@ namespace hCraft {
 			{
 				sblock->blocks[hash_m] = new hw_block (x, z);
 				block = sblock->blocks[hash_m];
+				block->loaded = true;
 		
 				// create the block
 				writer.seek (0, std::ios_base::end);
@@ -504,12 +776,14 @@ namespace hCraft {
 	}
 	
 	static hw_region*
-	find_or_create_region (int x, int z, hw_superblock **sblocks,
+	find_or_create_region (int x, int z, hw_superblock **sblocks, hw_mapping& map,
 		binary_writer writer, bool create = true)
 	{
 		hw_block *block = find_or_create_block (
-			fast_floor (x / 32.0), fast_floor (z / 32.0), sblocks, writer, create);
+			fast_floor (x / 32.0), fast_floor (z / 32.0), sblocks, map, writer, create);
 		if (!block) return nullptr;
+		if (!block->loaded)
+			load_block (block, map);
 		
 		unsigned int hash = hash_coords (x, z);
 		unsigned int hash_m = hash & 0x3FF;
@@ -539,6 +813,7 @@ namespace hCraft {
 			{
 				block->regions[hash_m] = new hw_region (x, z);
 				region = block->regions[hash_m];
+				region->loaded = true;
 		
 				// create the region
 				writer.seek (0, std::ios_base::end);
@@ -562,13 +837,15 @@ namespace hCraft {
 	}
 	
 	static hw_chunk*
-	find_or_create_chunk (int x, int z, hw_superblock **sblocks,
+	find_or_create_chunk (int x, int z, hw_superblock **sblocks, hw_mapping& map,
 		binary_writer writer, bool create = true, bool* got_created = nullptr)
 	{
 		if (got_created) *got_created = false;
 		hw_region *region = find_or_create_region (
-			fast_floor (x / 32.0), fast_floor (z / 32.0), sblocks, writer, create);
+			fast_floor (x / 32.0), fast_floor (z / 32.0), sblocks, map, writer, create);
 		if (!region) return nullptr;
+		if (!region->loaded)
+			load_region (region, map);
 		
 		unsigned int hash = hash_coords (x, z);
 		unsigned int hash_m = hash & 0x3FF;
@@ -577,7 +854,11 @@ namespace hCraft {
 		if (ch != nullptr)
 			{
 				if (ch->x == x && ch->z == z)
-					return ch;
+					{
+						if (!ch->loaded)
+							load_chunk_table (ch, map);
+						return ch;
+					}
 				
 				// linear probe
 				int i;
@@ -592,13 +873,19 @@ namespace hCraft {
 					return nullptr;
 				hash_m = (hash_m + i) & 0x3FF;
 			}
-		if (ch) return ch;
+		if (ch)
+			{
+				if (!ch->loaded)
+					load_chunk_table (ch, map);
+				return ch;
+			}
 		
 		if (create)
 			{
 				if (got_created) *got_created = true;
 				region->chunks[hash_m] = new hw_chunk (x, z);
 				ch = region->chunks[hash_m];
+				ch->loaded = true;
 		
 				// create the chunk
 				writer.seek (0, std::ios_base::end);
@@ -622,51 +909,6 @@ namespace hCraft {
 	
 	
 	
-//----
-	
-	static int
-	_write_short (unsigned char *ptr, unsigned short val)
-	{
-		ptr[0] = val & 0xFF;
-		ptr[1] = (val >> 8) & 0xFF;
-		return 2;
-	}
-	
-	/*
-	// Unused
-	static int
-	_write_int (unsigned char *ptr, unsigned int val)
-	{
-		ptr[0] = val & 0xFF;
-		ptr[1] = (val >> 8) & 0xFF;
-		ptr[2] = (val >> 16) & 0xFF;
-		ptr[3] = (val >> 24) & 0xFF;
-		return 4;
-	}
-	*/
-	
-	
-	static unsigned short
-	_read_short (const unsigned char *ptr)
-	{
-		return ((unsigned short)ptr[0])
-				 | ((unsigned short)ptr[1] << 8);
-	}
-	
-	/*
-	// Unused
-	static unsigned int
-	_read_int (const unsigned char *ptr)
-	{
-		return ((unsigned int)ptr[0])
-				 | ((unsigned int)ptr[1] << 8)
-				 | ((unsigned int)ptr[2] << 16)
-				 | ((unsigned int)ptr[3] << 24);
-	}
-	*/
-	
-	
-	
 //----
 	
 	static unsigned char*
@@ -709,27 +951,27 @@ namespace hCraft {
 		
 		for (i = 0; i < 16; ++i)
 			if (primary_bitmap & (1 << i))
-				{ std::memcpy (data + n, ch->get_sub (i)->ids, 4096); n += 4096; }
+				{ ch->get_sub (i)->export_ids (data + n); n += 4096; }
 		
 		for (i = 0; i < 16; ++i)
 			if (primary_bitmap & (1 << i))
-				{ std::memcpy (data + n, ch->get_sub (i)->meta, 2048); n += 2048; }
+				{ ch->get_sub (i)->export_meta (data + n); n += 2048; }
 		
 		for (i = 0; i < 16; ++i)
 			if (primary_bitmap & (1 << i))
-				{ std::memcpy (data + n, ch->get_sub (i)->blight, 2048); n += 2048; }
+				{ ch->get_sub (i)->blight.export_to (data + n); n += 2048; }
 		
 		for (i = 0; i < 16; ++i)
 			if (primary_bitmap & (1 << i))
-				{ std::memcpy (data + n, ch->get_sub (i)->slight, 2048); n += 2048; }
+				{ ch->get_sub (i)->slight.export_to (data + n); n += 2048; }
 		
 		for (i = 0; i < 16; ++i)
 			if (add_bitmap & (1 << i))
-				{ std::memcpy (data + n, ch->get_sub (i)->add, 2048); n += 2048; }
+				{ ch->get_sub (i)->export_add (data + n); n += 2048; }
 		
 		for (i = 0; i < 16; ++i)
 			if (primary_bitmap & (1 << i))
-				{ std::memcpy (data + n, ch->get_sub (i)->extra, 4096); n += 4096; }
+				{ ch->get_sub (i)->export_extra (data + n); n += 4096; }
 		
 		std::memcpy (data + n, ch->get_biome_array (), 256);
 		n += 256;
@@ -741,7 +983,7 @@ namespace hCraft {
 	
 	
 	static void
-	write_to_sector (hw_chunk *hch, unsigned int index, unsigned char *data,
+	write_to_sector (hw_chunk *hch, unsigned int index, const unsigned char *data,
 		unsigned int len, binary_writer writer)
 	{
 		unsigned int sectors_used = hch->size / 4096;
@@ -778,7 +1020,7 @@ namespace hCraft {
 	}
 	
 	static void
-	write_in_sectors (hw_chunk *hch, unsigned char *data, unsigned int data_size,
+	write_in_sectors (hw_chunk *hch, const unsigned char *data, unsigned int data_size,
 		binary_writer writer)
 	{
 		unsigned int sectors_needed = data_size / 4096;
@@ -809,29 +1051,36 @@ namespace hCraft {
 			}
 	}
 	
-	static void
-	save_chunk (chunk *ch, int x, int z, hw_superblock **sblocks,
-		world_information& inf, binary_writer writer)
+	/* 
+	 * Serializes and compresses the specified chunk into @{out}. Both .hw
+	 * formats store chunks in this form.
+	 */
+	void
+	hw_encode_chunk (chunk *ch, std::vector<unsigned char>& out)
 	{
-		unsigned char *compressed;
-		unsigned long compressed_size;
-		
 		unsigned int data_size = 0;
 		unsigned char *data = make_chunk_data (ch, &data_size);
 		
-		compressed_size = compressBound (data_size);
-		compressed = new unsigned char[compressed_size];
-		if (compress2 (compressed, &compressed_size, data, data_size,
-			Z_BEST_COMPRESSION) != Z_OK)
+		unsigned long compressed_size = compression::bound (data_size);
+		out.resize (compressed_size);
+		if (!compression::compress (out.data (), compressed_size, data, data_size,
+			compression::get_level (CT_DISK)))
 			{
 				delete[] data;
-				delete[] compressed;
+				out.clear ();
 				throw std::runtime_error ("failed to compress chunk");
 			}
 		delete[] data;
-		
+		out.resize (compressed_size);
+	}
+	
+	static void
+	save_chunk_data (const unsigned char *compressed, unsigned int compressed_size,
+		int x, int z, hw_superblock **sblocks, hw_mapping& map,
+		world_information& inf, binary_writer writer)
+	{
 		bool created = false;
-		hw_chunk *hch = find_or_create_chunk (x, z, sblocks, writer, true, &created);
+		hw_chunk *hch = find_or_create_chunk (x, z, sblocks, map, writer, true, &created);
 		if (hch)
 			write_in_sectors (hch, compressed, compressed_size, writer);
 		
@@ -841,8 +1090,6 @@ namespace hCraft {
 				writer.seek (44);
 				writer.write_int (++ (inf.chunk_count));
 			}
-		
-		delete[] compressed;
 	}
 	
 	
@@ -852,19 +1099,48 @@ namespace hCraft {
 	 */
 	void
 	hw_provider::save (world& wr, chunk *ch, int x, int z)
+	{
+		std::vector<unsigned char> data;
+		hw_encode_chunk (ch, data);
+		this->save_encoded (wr, data, x, z);
+	}
+	
+	/* 
+	 * Serializes and compresses the specified chunk into @{out}, in the form
+	 * expected by save_encoded (). Safe to call from several threads at once.
+	 */
+	void
+	hw_provider::encode_chunk (chunk *ch, std::vector<unsigned char>& out)
+	{
+		hw_encode_chunk (ch, out);
+	}
+	
+	/* 
+	 * Writes out chunk data previously produced by encode_chunk ().
+	 */
+	void
+	hw_provider::save_encoded (world& wr, const std::vector<unsigned char>& data,
+		int x, int z)
 	{
 		bool close_when_done = false;
 		if (!this->strm.is_open ())
 			{
 				this->open (wr);
 				if (!this->strm)
-					return;
+					throw std::runtime_error ("failed to open world file");
 				close_when_done = true;
 			}
 		
 		binary_writer writer {this->strm};
-		save_chunk (ch, x, z, this->sblocks, this->inf, writer);
+		save_chunk_data (data.data (), data.size (), x, z, this->sblocks,
+			*this->map, this->inf, writer);
 		//rewrite_header (wr, strm);
+		if (!this->strm)
+			{
+				if (close_when_done)
+					this->close ();
+				throw std::runtime_error ("failed to write chunk");
+			}
 		
 		if (close_when_done)
 			{
@@ -987,283 +1263,225 @@ namespace hCraft {
 //----
 	
 	static void
-	read_tables (hw_superblock **sblocks, binary_reader reader)
+	fill_chunk (chunk *ch, const unsigned char *data)
 	{
-		reader.seek (512);
+		unsigned int n = 0, i;
+		unsigned short primary_bitmap, add_bitmap;
 		
-		int sb_x, sb_z;
-		unsigned int sb_offset;
-		for (int i = 0; i < 4096; ++i)
+		ch->generated = data[n++];
+		primary_bitmap = _read_short (data + 1);
+		add_bitmap = _read_short (data + 3);
+		n += 4;
+		
+		// the arrays are grouped by type, each holding an entry for every
+		// sub-chunk present.
+		unsigned int present = 0, adds = 0;
+		for (i = 0; i < 16; ++i)
 			{
-				sb_x = reader.read_int ();
-				sb_z = reader.read_int ();
-				sb_offset = reader.read_int ();
-				if (sb_offset == 0xFFFFFFFFU)
-					{
-						sblocks[i] = nullptr;
-						continue;
-					}
-				
-				hw_superblock *sblock = new hw_superblock (sb_x, sb_z);
-				sblocks[i] = sblock;
-				sblock->offset = sb_offset;
-				
-				int saved_pos = reader.tell ();
-				int b_x, b_z;
-				unsigned int b_offset;
-				reader.seek (sblock->offset * 512);
-				for (int i = 0; i < 64; ++i)
-					{
-						b_x = reader.read_int ();
-						b_z = reader.read_int ();
-						b_offset = reader.read_int ();
-						if (b_offset == 0xFFFFFFFFU)
-							{
-								sblock->blocks[i] = nullptr;
-								continue;
-							}
-						
-						hw_block *block = new hw_block (b_x, b_z);
-						sblock->blocks[i] = block;
-						block->offset = b_offset;
-						
-						int saved_pos = reader.tell ();
-						int r_x, r_z;
-						unsigned int r_offset;
-						reader.seek (block->offset * 512);
-						for (int i = 0; i < 1024; ++i)
-							{
-								r_x = reader.read_int ();
-								r_z = reader.read_int ();
-								r_offset = reader.read_int ();
-								if (r_offset == 0xFFFFFFFFU)
-									{
-										block->regions[i] = nullptr;
-										continue;
-									}
-								
-								hw_region *region = new hw_region (r_x, r_z);
-								block->regions[i] = region;
-								region->offset = r_offset;
-								
-								int saved_pos = reader.tell ();
-								int c_x, c_z;
-								unsigned int c_offset;
-								reader.seek (region->offset * 512);
-								for (int i = 0; i < 1024; ++i)
-									{
-										c_x = reader.read_int ();
-										c_z = reader.read_int ();
-										c_offset = reader.read_int ();
-										if (c_offset == 0xFFFFFFFFU)
-											{
-												region->chunks[i] = nullptr;
-												continue;
-											}
-										
-										hw_chunk *ch = new hw_chunk (c_x, c_z);
-										region->chunks[i] = ch;
-										ch->offset = c_offset;
-										
-										int saved_pos = reader.tell ();
-										reader.seek (c_offset * 512);
-										
-										ch->size = reader.read_int ();
-										for (int i = 0; i < 256; ++i)
-											ch->sector_table[i] = reader.read_int ();
-										
-										reader.seek (saved_pos);
-									}
-								reader.seek (saved_pos);
-							}
-						reader.seek (saved_pos);
-					}
-				reader.seek (saved_pos);
+				if (primary_bitmap & (1 << i))
+					++ present;
+				if (add_bitmap & (1 << i))
+					++ adds;
 			}
-	}
-	
-	static void
-	read_header (world_information& inf, binary_reader reader)
-	{
-		reader.seek (4);
 		
-		// dimensions
-		inf.width = reader.read_int ();
-		inf.depth = reader.read_int ();
+		const unsigned char *ids = data + n;
+		const unsigned char *meta = ids + present * 4096;
+		const unsigned char *blight = meta + present * 2048;
+		const unsigned char *slight = blight + present * 2048;
+		const unsigned char *add = slight + present * 2048;
+		const unsigned char *extra = add + adds * 2048;
 		
-		// spawn pos
-		inf.spawn_pos.x = reader.read_double ();
-		inf.spawn_pos.y = reader.read_double ();
-		inf.spawn_pos.z = reader.read_double ();
-		inf.spawn_pos.r = reader.read_float ();
-		inf.spawn_pos.l = reader.read_float ();
-		inf.spawn_pos.on_ground = true;
-		
-		inf.chunk_count = reader.read_int ();
-		
-		// generator
-		int generator_len = reader.read_short ();
-		inf.generator.clear ();
-		inf.generator.reserve (generator_len + 1);
-		for (int i = 0; i < generator_len; ++i)
-			{
-				inf.generator.push_back (reader.read_byte ());
-			}
+		unsigned int k = 0, a = 0;
+		for (i = 0; i < 16; ++i)
+			if (primary_bitmap & (1 << i))
+				{
+					const unsigned char *sub_add = nullptr;
+					if (add_bitmap & (1 << i))
+						sub_add = add + (a++) * 2048;
+					
+					ch->create_sub (i)->import (ids + k * 4096, sub_add,
+						meta + k * 2048, blight + k * 2048, slight + k * 2048,
+						extra + k * 4096);
+					++ k;
+				}
+		n += present * 14336 + adds * 2048;
 		
-		inf.seed = reader.read_int ();
+		// biomes
+		std::memcpy (ch->get_biome_array (), data + n, 256);
+		n += 256;
 	}
 	
-	static void
-	read_file (world_information& inf, hw_superblock **sblocks, binary_reader reader)
+	/* 
+	 * Inflates @{len} bytes of chunk data produced by hw_encode_chunk () into
+	 * @{ch}.
+	 */
+	void
+	hw_decode_chunk (chunk *ch, const unsigned char *data, unsigned int len)
 	{
-		read_header (inf, reader);
-		read_tables (sblocks, reader);
+		std::unique_ptr<unsigned char[]> out {new unsigned char[524288]};
+		
+		z_stream zs;
+		std::memset (&zs, 0, sizeof zs);
+		if (inflateInit (&zs) != Z_OK)
+			throw std::runtime_error ("failed to decompress chunk");
+		zs.next_in = (Bytef *)data;
+		zs.avail_in = len;
+		zs.next_out = out.get ();
+		zs.avail_out = 524288;
+		int ret = inflate (&zs, Z_FINISH);
+		inflateEnd (&zs);
+		if (ret != Z_STREAM_END)
+			throw std::runtime_error ("failed to decompress chunk");
+		
+		fill_chunk (ch, out.get ());
 	}
 	
 	
 	
-	static unsigned char*
-	combine_sectors (hw_chunk *hch, binary_reader reader, unsigned int *out_size)
+	/* 
+	 * Attempts to load the chunk located at the specified coordinates into
+	 * @{ch}. Returns true on success, and false if the chunk is not present
+	 * within the world file.
+	 */
+	bool
+	hw_provider::load (world &wr, chunk *ch, int x, int z)
 	{
-		unsigned int compressed_size = hch->size;
-		*out_size = compressed_size;
-		
-		unsigned char *compressed = new unsigned char[compressed_size];
-		unsigned int n = 0;
+		// reads go through the mapping, which only sees what has been flushed.
+		if (this->strm.is_open ())
+			this->strm.flush ();
 		
-		int sector_index = 0;
-		while (compressed_size > 0)
+		binary_writer writer; // not actually used
+		hw_chunk *hch = find_or_create_chunk (x, z, this->sblocks, *this->map,
+			writer, false);
+		if (!hch || hch->size <= 0) return false;
+		
+		std::unique_ptr<unsigned char[]> data {new unsigned char[524288]};
+		
+		// inflate the chunk's sectors straight out of the mapping.
+		z_stream zs;
+		std::memset (&zs, 0, sizeof zs);
+		if (inflateInit (&zs) != Z_OK)
+			throw std::runtime_error ("failed to decompress chunk");
+		zs.next_out = data.get ();
+		zs.avail_out = 524288;
+		
+		unsigned int rem = hch->size;
+		int ret = Z_OK;
+		for (int i = 0; (rem > 0) && (i < 256) && (ret == Z_OK); ++i)
 			{
-				int need = (compressed_size >= 4096) ? 4096 : compressed_size;
-				reader.seek (hch->sector_table[sector_index] * 512);
-				reader.read_bytes (compressed + n, need);
+				unsigned int need = (rem >= 4096) ? 4096 : rem;
+				const unsigned char *sector = this->map->get (
+					(unsigned long long)hch->sector_table[i] * 512, need);
+				if (!sector)
+					break;
 				
-				n += need;
-				compressed_size -= need;
+				zs.next_in = (Bytef *)sector;
+				zs.avail_in = need;
+				ret = inflate (&zs, Z_NO_FLUSH);
+				rem -= need;
 			}
+		inflateEnd (&zs);
+		if (ret != Z_STREAM_END)
+			throw std::runtime_error ("failed to decompress chunk");
 		
-		return compressed;
+		fill_chunk (ch, data.get ());
+		return true;
 	}
 	
-	static void
-	fill_chunk (chunk *ch, const unsigned char *data)
+	
+	
+	/* 
+	 * Reads the chunk located at the specified coordinates into @{out},
+	 * still compressed, in the form produced by hw_encode_chunk ().
+	 * Returns false if the chunk is not present within the world file.
+	 */
+	bool
+	hw_provider::load_raw (int x, int z, std::vector<unsigned char>& out)
 	{
-		unsigned int n = 0, i;
-		unsigned short primary_bitmap, add_bitmap;
-		
-		ch->generated = data[n++];
-		primary_bitmap = _read_short (data + 1);
-		add_bitmap = _read_short (data + 3);
-		n += 4;
-		
-		// create sub-chunks
-		for (i = 0; i < 16; ++i)
-			if (primary_bitmap & (1 << i))
-				{
-					subchunk *sub = ch->create_sub (i, false);
-					sub->air_count = 4096;
-					sub->add_count = 0;
-					sub->add = nullptr;
-				}
+		if (this->strm.is_open ())
+			this->strm.flush ();
 		
-		for (i = 0; i < 16; ++i)
-			if (primary_bitmap & (1 << i))
-				{ std::memcpy (ch->get_sub (i)->ids, data + n, 4096); n += 4096; }
-		for (i = 0; i < 16; ++i)
-			if (primary_bitmap & (1 << i))
-				{ std::memcpy (ch->get_sub (i)->meta, data + n, 2048); n += 2048; }
-		for (i = 0; i < 16; ++i)
-			if (primary_bitmap & (1 << i))
-				{ std::memcpy (ch->get_sub (i)->blight, data + n, 2048); n += 2048; }
-		for (i = 0; i < 16; ++i)
-			if (primary_bitmap & (1 << i))
-				{ std::memcpy (ch->get_sub (i)->slight, data + n, 2048); n += 2048; }
-		for (i = 0; i < 16; ++i)
-			{
-				subchunk *sub = ch->get_sub (i);
-				if (add_bitmap & (1 << i))
-					{
-						sub->add = new unsigned char[2048];
-						std::memcpy (ch->get_sub (i)->add, data + n, 2048); n += 2048;
-					}
-			}
-		for (i = 0; i < 16; ++i)
-			if (primary_bitmap & (1 << i))
-				{ std::memcpy (ch->get_sub (i)->extra, data + n, 4096); n += 4096; }
+		binary_writer writer; // not actually used
+		hw_chunk *hch = find_or_create_chunk (x, z, this->sblocks, *this->map,
+			writer, false);
+		if (!hch || hch->size <= 0) return false;
 		
-		// custom blocks
-		for (i = 0; i < 16; ++i)
+		out.resize (hch->size);
+		unsigned int rem = hch->size, n = 0;
+		for (int i = 0; (rem > 0) && (i < 256); ++i)
 			{
-				subchunk *sub = ch->get_sub (i);
-				if (!sub) continue;
+				unsigned int need = (rem >= 4096) ? 4096 : rem;
+				const unsigned char *sector = this->map->get (
+					(unsigned long long)hch->sector_table[i] * 512, need);
+				if (!sector)
+					return false;
 				
-				for (int i = 0; i < 128; ++i)
-					sub->custom[i] = 0;
-				
-				for (int i = 0; i < 4096; ++i)
-					if (!block_info::is_vanilla_id (sub->ids[i]))
-						sub->custom[i >> 5] |=  (1 << (i & 0x1F));
+				std::memcpy (out.data () + n, sector, need);
+				n += need;
+				rem -= need;
 			}
 		
-		// biomes
-		std::memcpy (ch->get_biome_array (), data + n, 256);
-		n += 256;
-		
-		// calculate add\air count
-		for (i = 0; i < 16; ++i)
-			{
-				subchunk *sub = ch->get_sub (i);
-				if (sub)
-					{
-						for (int j = 0; j < 4096; ++j)
-							{
-								if (sub->ids[j] != 0)
-									-- sub->air_count;
-								if (sub->add && sub->add[j >> 1] != 0)
-									{
-										if (sub->add[j >> 1] >> 4)
-											++ sub->add_count;
-										if (sub->add[j >> 1] & 0xF)
-											++ sub->add_count;
-									}
-							}
-					}
-			}
+		return (rem == 0);
 	}
 	
 	/* 
-	 * Attempts to load the chunk located at the specified coordinates into
-	 * @{ch}. Returns true on success, and false if the chunk is not present
-	 * within the world file.
+	 * Returns the position within the world file at which the data of the
+	 * specified chunk begins, or -1 if the chunk is not present.
 	 */
-	bool
-	hw_provider::load (world &wr, chunk *ch, int x, int z)
+	long long
+	hw_provider::locate (int x, int z)
 	{
-		if (!this->strm.is_open ())
-			return false;
-		
 		binary_writer writer; // not actually used
-		hw_chunk *hch = find_or_create_chunk (x, z, this->sblocks, writer, false);
-		if (!hch) return false;
-		
-		binary_reader reader {this->strm};
+		hw_chunk *hch = find_or_create_chunk (x, z, this->sblocks, *this->map,
+			writer, false);
+		if (!hch || hch->size <= 0) return -1;
 		
-		unsigned int compressed_size = 0;
-		unsigned char *compressed = combine_sectors (hch, reader, &compressed_size);
+		return (long long)hch->sector_table[0] * 512;
+	}
+	
+	/* 
+	 * Fills @{out} with the coordinates of every chunk stored in the world
+	 * file. This reads in all of the file's tables.
+	 */
+	void
+	hw_provider::list_chunks (std::vector<std::pair<int, int>>& out)
+	{
+		if (this->strm.is_open ())
+			this->strm.flush ();
 		
-		unsigned long data_size = 524288;
-		unsigned char *data = new unsigned char[data_size];
-		if (uncompress (data, &data_size, compressed, compressed_size) != Z_OK)
+		for (int i = 0; i < 4096; ++i)
 			{
-				delete[] compressed;
-				delete[] data;
-				throw std::runtime_error ("failed to decompress chunk");
+				hw_superblock *sblock = this->sblocks[i];
+				if (!sblock) continue;
+				if (!sblock->loaded)
+					load_superblock (sblock, *this->map);
+				
+				for (int j = 0; j < 64; ++j)
+					{
+						hw_block *block = sblock->blocks[j];
+						if (!block) continue;
+						if (!block->loaded)
+							load_block (block, *this->map);
+						
+						for (int k = 0; k < 1024; ++k)
+							{
+								hw_region *region = block->regions[k];
+								if (!region) continue;
+								if (!region->loaded)
+									load_region (region, *this->map);
+								
+								for (int m = 0; m < 1024; ++m)
+									{
+										hw_chunk *ch = region->chunks[m];
+										if (!ch) continue;
+										if (!ch->loaded)
+											load_chunk_table (ch, *this->map);
+										
+										if (ch->size > 0)
+											out.emplace_back (ch->x, ch->z);
+									}
+							}
+					}
 			}
-		delete[] compressed;
-		
-		fill_chunk (ch, data);
-		delete[] data;
-		return true;
 	}
 }
-
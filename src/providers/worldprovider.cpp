@@ -24,6 +24,7 @@
 #include <sys/stat.h>
 
 #include "providers/hwprovider.hpp"
+#include "providers/hw2provider.hpp"
 
 
 namespace hCraft {
@@ -32,6 +33,10 @@ namespace hCraft {
 	create_hw_provider (const char *path, const char *world_name)
 		{ return new hw_provider (path, world_name); }
 	
+	static world_provider*
+	create_hw2_provider (const char *path, const char *world_name)
+		{ return new hw2_provider (path, world_name); }
+	
 	/* 
 	 * Returns a new instance of the world provider named @{name}.
 	 * @{path} specifies the directory to which the world should be exported to\
@@ -43,6 +48,7 @@ namespace hCraft {
 	{
 		static std::unordered_map<std::string, world_provider* (*) (const char *, const char *)> creators {
 			{ "hw", create_hw_provider },
+			{ "hw2", create_hw2_provider },
 		};
 		
 		auto itr = creators.find (name);
@@ -64,6 +70,9 @@ namespace hCraft {
 		
 		if (!populated)
 			{
+				// a converted world keeps its old .hw file around, so the newer
+				// format has to be checked first.
+				provs.emplace_back (new hw2_provider_naming ());
 				provs.emplace_back (new hw_provider_naming ());
 				populated = true;
 			}
@@ -18,6 +18,7 @@
 
 #include "server.hpp"
 #include "utils.hpp"
+#include "compression.hpp"
 #include "physics/blocks/physics_block.hpp"
 #include <memory>
 #include <fstream>
@@ -25,6 +26,7 @@
 #include <libconfig.h++>
 #include <arpa/inet.h>
 #include <sys/stat.h>
+#include <sys/socket.h>
 #include <algorithm>
 #include <event2/thread.h>
 
@@ -52,14 +54,17 @@ namespace hCraft {
 	
 	
 	// constructor.
-	server::worker::worker (struct event_base *base, std::thread&& th)
-		: evbase (base), event_count (0), th (std::move (th))
+	server::worker::worker (server *srv, struct event_base *base,
+		std::thread&& th)
+		: srv (srv), evbase (base), keepalive (nullptr), listener (nullptr),
+			conn_count (0), th (std::move (th))
 		{ }
 	
 	// move constructor.
 	server::worker::worker (worker&& w)
-		: evbase (w.evbase), 
-			event_count (w.event_count.load ()),
+		: srv (w.srv), evbase (w.evbase), keepalive (w.keepalive),
+			listener (w.listener),
+			conn_count (w.conn_count.load ()),
 			th (std::move (w.th))
 		{ }
 	
@@ -75,7 +80,8 @@ namespace hCraft {
 		: log (log), 
 			spool (sql_pool_size, "data/database.sqlite"),
 			perms (),
-			groups (perms)
+			groups (perms),
+			autosave (*this)
 	{
 		// add <init, destory> pairs
 		
@@ -159,28 +165,50 @@ namespace hCraft {
 					w = &t;
 			}
 		
+		// blocks until the loop is broken by destroy_workers ().
 		while (!event_base_got_break (w->evbase))
-			{
-				event_base_loop (w->evbase, EVLOOP_NONBLOCK);
-				std::this_thread::sleep_for (std::chrono::milliseconds (1));
-			}
+			event_base_dispatch (w->evbase);
 	}
 	
 	/* 
-	 * Returns the worker that has the least amount of events associated with
-	 * it.
+	 * Picks the worker that should handle a new connection. The worker that
+	 * accepted the connection is preferred, unless it handles noticeably more
+	 * connections than the least busy worker.
 	 */
 	server::worker&
-	server::get_min_worker ()
+	server::pick_worker (worker& local)
 	{
-		auto min_itr = this->workers.begin ();
-		for (auto itr = (min_itr + 1); itr != this->workers.end (); ++itr)
+		int count = this->workers.size ();
+		
+		// start looking from a different worker every time, so that ties are
+		// broken in a round-robin fashion.
+		int start = this->next_worker++ % count;
+		worker *best = &this->workers[start];
+		for (int i = 1; i < count; ++i)
 			{
-				if (itr->event_count.load () < min_itr->event_count.load ())
-					min_itr = itr;
+				worker *w = &this->workers[(start + i) % count];
+				if (w->conn_count.load () < best->conn_count.load ())
+					best = w;
 			}
 		
-		return *min_itr;
+		if (local.conn_count.load () <= best->conn_count.load () + 1)
+			return local;
+		return *best;
+	}
+	
+	/* 
+	 * Informs the worker that owns the given event base that one of its
+	 * connections has been closed.
+	 */
+	void
+	server::release_worker (struct event_base *evbase)
+	{
+		for (worker& w : this->workers)
+			if (w.evbase == evbase)
+				{
+					-- w.conn_count;
+					break;
+				}
 	}
 	
 	/* 
@@ -191,7 +219,8 @@ namespace hCraft {
 	server::handle_accept (struct evconnlistener *listener, evutil_socket_t sock,
 		struct sockaddr *addr, int len, void *ptr)
 	{
-		server &srv = *static_cast<server *> (ptr);
+		worker &local = *static_cast<worker *> (ptr);
+		server &srv = *local.srv;
 		if (srv.is_shutting_down ())
 			{
 				evutil_closesocket (sock);
@@ -208,7 +237,8 @@ namespace hCraft {
 				return;
 			}
 		
-		worker &w = srv.get_min_worker ();
+		worker &w = srv.pick_worker (local);
+		++ w.conn_count;
 		
 		std::lock_guard<std::mutex> guard {srv.player_lock};
 		player *pl = new player (srv, w.evbase, sock, ip);
@@ -348,8 +378,10 @@ namespace hCraft {
 				world *other = itr->second;
 				if (other == w)
 					{
+						this->autosave.release (other);
 						other->stop ();
 						this->worlds.erase (itr);
+						this->chunk_cache.purge (other);
 						delete other;
 						break;
 					}
@@ -380,6 +412,18 @@ namespace hCraft {
 		return nullptr;
 	}
 	
+	/* 
+	 * Calls the given function on every loaded world, with the world lock
+	 * held.
+	 */
+	void
+	server::all_worlds (std::function<void (world *)> f)
+	{
+		std::lock_guard<std::mutex> guard {this->world_lock};
+		for (auto itr = this->worlds.begin (); itr != this->worlds.end (); ++itr)
+			f (itr->second);
+	}
+	
 	
 	
 	/* 
@@ -434,7 +478,8 @@ namespace hCraft {
 		this->get_players ().remove (pl);
 		this->connecting.erase (pl);
 		
-		this->to_destroy.insert (pl);
+		if (this->to_destroy.insert (pl).second)
+			this->release_worker (pl->get_event_base ());
 	}
 	
 	
@@ -511,6 +556,54 @@ namespace hCraft {
 	}
 	
 	
+	/* 
+	 * Lowers the compression level of chunk packets while chunks can't be
+	 * generated or sent fast enough, and raises it back once things calm
+	 * down.
+	 */
+	void
+	server::adjust_compression (scheduler_task& task)
+	{
+		server &srv = *(static_cast<server *> (task.get_context ()));
+		if (!srv.is_running () || srv.is_shutting_down ())
+			return;
+		
+		// average backlog of each generator worker
+		int gen_backlog = 0;
+		if (srv.cgen.worker_count () > 0)
+			gen_backlog = srv.cgen.pending_count () / srv.cgen.worker_count ();
+		
+		// average amount of bytes waiting to be sent to a player
+		int queued = 0, count = 0;
+		srv.get_players ().all (
+			[&queued, &count] (player *pl)
+				{
+					queued += pl->get_send_queue_size ();
+					++ count;
+				});
+		if (count > 0)
+			queued /= count;
+		
+		int max_level = srv.get_config ().net_comp_level;
+		int level = compression::get_level (CT_NETWORK);
+		if (gen_backlog > 8 || queued > (256 * 1024))
+			{
+				// compression is the most expensive part of sending a chunk,
+				// back off quickly.
+				if (level > 1)
+					level = utils::max (1, level - 2);
+			}
+		else if (gen_backlog <= 1 && queued <= (32 * 1024))
+			{
+				if (level < max_level)
+					++ level;
+			}
+		
+		if (level != compression::get_level (CT_NETWORK))
+			compression::set_level (CT_NETWORK, level);
+	}
+	
+	
 	
 /*******************************************************************************
 		
@@ -537,6 +630,14 @@ namespace hCraft {
 		
 		std::strcpy (out.ip, "0.0.0.0");
 		out.port = 25565;
+		
+		out.gen_threads = 0;
+		out.chunk_cache_mb = 32;
+		out.world_mem_mb = 256;
+		out.autosave_interval = 300;
+		out.net_comp_level = 6;
+		out.disk_comp_level = 9;
+		out.adaptive_comp = true;
 	}
 	
 	static void
@@ -573,6 +674,27 @@ namespace hCraft {
 				= in.port;
 		}
 		
+		/* 'performance' group */
+		{
+			libconfig::Setting& grp_perf = grp_server.add ("performance",
+				libconfig::Setting::TypeGroup);
+			
+			grp_perf.add ("generator-threads", libconfig::Setting::TypeInt)
+				= in.gen_threads;
+			grp_perf.add ("chunk-cache-size", libconfig::Setting::TypeInt)
+				= in.chunk_cache_mb;
+			grp_perf.add ("world-memory-budget", libconfig::Setting::TypeInt)
+				= in.world_mem_mb;
+			grp_perf.add ("autosave-interval", libconfig::Setting::TypeInt)
+				= in.autosave_interval;
+			grp_perf.add ("network-compression-level", libconfig::Setting::TypeInt)
+				= in.net_comp_level;
+			grp_perf.add ("disk-compression-level", libconfig::Setting::TypeInt)
+				= in.disk_comp_level;
+			grp_perf.add ("adaptive-compression", libconfig::Setting::TypeBoolean)
+				= in.adaptive_comp;
+		}
+		
 		try
 			{
 				cfg.writeFile ("data/config.cfg");
@@ -700,6 +822,101 @@ namespace hCraft {
 			}
 	}
 	
+	static void
+	_cfg_read_performance_grp (logger& log, libconfig::Setting& grp_perf, server_config& out)
+	{
+		int num;
+		bool error = false;
+		
+		// generator threads
+		if (grp_perf.lookupValue ("generator-threads", num))
+			{
+				if (num >= 0 && num <= 64)
+					out.gen_threads = num;
+				else
+					{
+						if (!error)
+							log (LT_ERROR) << "Config: at group \"server.performance\":" << std::endl;
+						log (LT_INFO) << " - \"generator-threads\" must be in the range of 0-64." << std::endl;
+						error = true;
+					}
+			}
+		
+		// chunk packet cache size (in megabytes)
+		if (grp_perf.lookupValue ("chunk-cache-size", num))
+			{
+				if (num >= 0 && num <= 4096)
+					out.chunk_cache_mb = num;
+				else
+					{
+						if (!error)
+							log (LT_ERROR) << "Config: at group \"server.performance\":" << std::endl;
+						log (LT_INFO) << " - \"chunk-cache-size\" must be in the range of 0-4096." << std::endl;
+						error = true;
+					}
+			}
+		
+		// resident chunk memory budget per world (in megabytes)
+		if (grp_perf.lookupValue ("world-memory-budget", num))
+			{
+				if (num >= 0 && num <= 65536)
+					out.world_mem_mb = num;
+				else
+					{
+						if (!error)
+							log (LT_ERROR) << "Config: at group \"server.performance\":" << std::endl;
+						log (LT_INFO) << " - \"world-memory-budget\" must be in the range of 0-65536." << std::endl;
+						error = true;
+					}
+			}
+		
+		// seconds between autosaves
+		if (grp_perf.lookupValue ("autosave-interval", num))
+			{
+				if (num >= 0 && num <= 86400)
+					out.autosave_interval = num;
+				else
+					{
+						if (!error)
+							log (LT_ERROR) << "Config: at group \"server.performance\":" << std::endl;
+						log (LT_INFO) << " - \"autosave-interval\" must be in the range of 0-86400." << std::endl;
+						error = true;
+					}
+			}
+		
+		// compression levels
+		if (grp_perf.lookupValue ("network-compression-level", num))
+			{
+				if (num >= 0 && num <= compression::max_level ())
+					out.net_comp_level = num;
+				else
+					{
+						if (!error)
+							log (LT_ERROR) << "Config: at group \"server.performance\":" << std::endl;
+						log (LT_INFO) << " - \"network-compression-level\" must be in the range of 0-"
+							<< compression::max_level () << "." << std::endl;
+						error = true;
+					}
+			}
+		if (grp_perf.lookupValue ("disk-compression-level", num))
+			{
+				if (num >= 0 && num <= compression::max_level ())
+					out.disk_comp_level = num;
+				else
+					{
+						if (!error)
+							log (LT_ERROR) << "Config: at group \"server.performance\":" << std::endl;
+						log (LT_INFO) << " - \"disk-compression-level\" must be in the range of 0-"
+							<< compression::max_level () << "." << std::endl;
+						error = true;
+					}
+			}
+		
+		bool bl;
+		if (grp_perf.lookupValue ("adaptive-compression", bl))
+			out.adaptive_comp = bl;
+	}
+	
 	static void
 	_cfg_read_server_grp (logger& log, libconfig::Setting& grp_server, server_config& out)
 	{
@@ -722,6 +939,16 @@ namespace hCraft {
 			{
 				log (LT_WARNING) << "Config: Group \"server.network\" not found, using defaults" << std::endl;
 			}
+		
+		try
+			{
+				libconfig::Setting& grp_perf = grp_server["performance"];
+				_cfg_read_performance_grp (log, grp_perf, out);
+			}
+		catch (const std::exception& ex)
+			{
+				log (LT_WARNING) << "Config: Group \"server.performance\" not found, using defaults" << std::endl;
+			}
 	}
 	
 	static void
@@ -894,6 +1121,13 @@ namespace hCraft {
 		this->get_scheduler ().new_task (hCraft::server::handle_muted, this)
 			.run_forever (1000);
 		
+		compression::set_level (CT_NETWORK, this->get_config ().net_comp_level);
+		compression::set_level (CT_DISK, this->get_config ().disk_comp_level);
+		log () << "Using " << compression::backend_name () << " for compression." << std::endl;
+		if (this->get_config ().adaptive_comp)
+			this->get_scheduler ().new_task (hCraft::server::adjust_compression, this)
+				.run_forever (1000);
+		
 		// create pooled threads
 		this->tpool.start (6);
 	}
@@ -1517,7 +1751,7 @@ namespace hCraft {
 				log () << " - Main world does not exist, creating..." << std::endl;
 				main_world = new world (*this, this->get_config ().main_world, this->log, 
 					world_generator::create ("overhang"),
-					world_provider::create ("hw", "data/worlds", this->get_config ().main_world));
+					world_provider::create ("hw2", "data/worlds", this->get_config ().main_world));
 				main_world->set_size (192, 192);
 				main_world->prepare_spawn (15, true);
 				main_world->save_all ();
@@ -1567,8 +1801,18 @@ namespace hCraft {
 						continue;
 					}
 				
-				world_provider *prov = world_provider::create (prov_name.c_str (),
-					"data/worlds", wname.c_str ());
+				world_provider *prov;
+				try
+					{
+						prov = world_provider::create (prov_name.c_str (),
+							"data/worlds", wname.c_str ());
+					}
+				catch (const std::exception& ex)
+					{
+						log (LT_ERROR) << " - Failed to load world \"" << wname
+							<< "\": " << ex.what () << std::endl;
+						continue;
+					}
 				if (!prov)
 					{
 						log (LT_ERROR) << " - Failed to load world \"" << wname
@@ -1604,8 +1848,14 @@ namespace hCraft {
 		// start physics
 		this->global_physics.set_thread_count (1);
 		
+		this->chunk_cache.set_capacity (
+			(unsigned long long)this->get_config ().chunk_cache_mb << 20);
+		
 		// start the generator
-		this->cgen.start ();
+		this->cgen.start (this->get_config ().gen_threads);
+		log () << "Started " << this->cgen.worker_count () << " chunk generator worker(s)." << std::endl;
+		
+		this->autosave.start (this->get_config ().autosave_interval);
 	}
 	
 	void
@@ -1615,6 +1865,7 @@ namespace hCraft {
 		
 		// generator
 		this->cgen.stop ();
+		this->autosave.stop ();
 		
 		// clear worlds
 		{
@@ -1642,6 +1893,10 @@ namespace hCraft {
 	 * the work will be parallelized between all cores.
 	 */
 	
+	static void
+	_keepalive_cb (evutil_socket_t fd, short events, void *ctx)
+		{ }
+	
 	void
 	server::init_workers ()
 	{
@@ -1653,11 +1908,28 @@ namespace hCraft {
 		
 		this->workers_stop = false;
 		this->workers_ready = false;
+		this->next_worker = 0;
 		for (int i = 0; i < this->worker_count; ++i)
 			{
 				struct event_base *base = event_base_new ();
-				if (!base)
+				
+				// event_base_dispatch () returns as soon as there are no events left
+				// to wait for, which would happen to any worker without connections.
+				// A persistent timer keeps the loop going.
+				struct event *keepalive = nullptr;
+				if (base)
+					{
+						keepalive = event_new (base, -1, EV_PERSIST, _keepalive_cb, nullptr);
+						struct timeval tv { 3600, 0 };
+						if (keepalive && event_add (keepalive, &tv) != 0)
+							{ event_free (keepalive); keepalive = nullptr; }
+					}
+				
+				if (!base || !keepalive)
 					{
+						if (base)
+							event_base_free (base);
+						
 						this->workers_stop = true;
 						for (auto itr = this->workers.begin (); itr != this->workers.end (); ++itr)
 							{
@@ -1665,14 +1937,17 @@ namespace hCraft {
 								if (w.th.joinable ())
 									w.th.join ();
 								
+								event_free (w.keepalive);
 								event_base_free (w.evbase);
 							}
+						this->workers.clear ();
 						
 						throw server_error ("failed to create workers");
 					}
 				
 				std::thread th (std::bind (std::mem_fn (&hCraft::server::work), this));
-				this->workers.push_back (worker (base, std::move (th)));
+				this->workers.push_back (worker (this, base, std::move (th)));
+				this->workers.back ().keepalive = keepalive;
 			}
 		
 		this->workers_ready = true;
@@ -1703,29 +1978,90 @@ namespace hCraft {
 	 * port number specified by the user in the configuration file for incoming
 	 * connections.
 	 */
+	
+	/* 
+	 * Creates a non-blocking socket bound to the specified address, with
+	 * SO_REUSEPORT set, so that every worker can have a listening socket of
+	 * its own. Returns -1 on failure.
+	 */
+	static evutil_socket_t
+	_open_shared_listener (const struct sockaddr_in& addr)
+	{
+#ifdef SO_REUSEPORT
+		evutil_socket_t fd = socket (AF_INET, SOCK_STREAM, 0);
+		if (fd < 0)
+			return -1;
+		
+		int one = 1;
+		if (evutil_make_listen_socket_reuseable (fd) != 0
+			|| setsockopt (fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof one) != 0
+			|| evutil_make_socket_nonblocking (fd) != 0
+			|| bind (fd, (const struct sockaddr *)&addr, sizeof addr) != 0)
+			{
+				evutil_closesocket (fd);
+				return -1;
+			}
+		
+		return fd;
+#else
+		return -1;
+#endif
+	}
+	
 	void
 	server::init_listener ()
 	{
 		struct sockaddr_in addr;
+		std::memset (&addr, 0, sizeof addr);
 		addr.sin_family = AF_INET;
 		addr.sin_port   = htons (this->cfg.port);
 		inet_pton (AF_INET, this->cfg.ip, &addr.sin_addr);
 		
-		worker &w = this->get_min_worker ();
-		this->listener = evconnlistener_new_bind (w.evbase,
-			&hCraft::server::handle_accept, this, LEV_OPT_CLOSE_ON_FREE
-			| LEV_OPT_REUSEABLE, -1, (struct sockaddr *)&addr, sizeof addr);
-		if (!this->listener)
-			throw server_error ("failed to create listening socket (port taken?)");
+		// try to give every worker a listener of its own, and let the kernel
+		// spread incoming connections between them.
+		int listeners = 0;
+		for (worker& w : this->workers)
+			{
+				evutil_socket_t fd = _open_shared_listener (addr);
+				if (fd < 0)
+					break;
+				
+				w.listener = evconnlistener_new (w.evbase,
+					&hCraft::server::handle_accept, &w, LEV_OPT_CLOSE_ON_FREE, -1, fd);
+				if (!w.listener)
+					{
+						evutil_closesocket (fd);
+						break;
+					}
+				
+				++ listeners;
+			}
+		
+		if (listeners == 0)
+			{
+				// fall back to a single listener.
+				worker &w = this->workers[0];
+				w.listener = evconnlistener_new_bind (w.evbase,
+					&hCraft::server::handle_accept, &w, LEV_OPT_CLOSE_ON_FREE
+					| LEV_OPT_REUSEABLE, -1, (struct sockaddr *)&addr, sizeof addr);
+				if (!w.listener)
+					throw server_error ("failed to create listening socket (port taken?)");
+				listeners = 1;
+			}
 		
-		++ w.event_count;
-		log () << "Started listening on port " << this->cfg.port << "." << std::endl;
+		log () << "Started listening on port " << this->cfg.port << " ("
+			<< listeners << " listener(s))." << std::endl;
 	}
 	
 	void
 	server::destroy_listener ()
 	{
-		evconnlistener_free (this->listener);
+		for (worker& w : this->workers)
+			if (w.listener)
+				{
+					evconnlistener_free (w.listener);
+					w.listener = nullptr;
+				}
 	}
 	
 	
@@ -1785,6 +2121,7 @@ namespace hCraft {
 		for (auto itr = this->workers.begin (); itr != this->workers.end (); ++itr)
 			{
 				worker &w = *itr;
+				event_free (w.keepalive);
 				event_base_free (w.evbase);
 			}
 		this->workers.clear ();
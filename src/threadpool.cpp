@@ -16,16 +16,26 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
-#include "threadpool.hpp"
 
-#include <iostream> // DEBUG
+#include "threadpool.hpp"
+#include <algorithm>
 
 
 namespace hCraft {
 	
+	thread_local thread_pool::worker_thread *thread_pool::this_worker = nullptr;
+	
 	thread_pool::thread_pool ()
 	{
 		this->terminating = false;
+		this->next_worker = 0;
+		this->pending = 0;
+		this->sleepers = 0;
+		
+		this->tasks_run = 0;
+		this->steals = 0;
+		this->lock_acquisitions = 0;
+		this->lock_contentions = 0;
 	}
 	
 	
@@ -37,11 +47,18 @@ namespace hCraft {
 	void
 	thread_pool::start (int thread_count)
 	{
+		// all queues must exist before any of the threads start stealing.
 		for (int i = 0; i < thread_count; ++i)
 			{
-				this->workers.emplace_back (worker_thread (this, std::thread (
-					std::bind (std::mem_fn (&hCraft::thread_pool::main_loop), this))));
+				worker_thread *w = new worker_thread ();
+				w->pool = this;
+				w->index = i;
+				this->workers.emplace_back (w);
 			}
+		
+		for (auto& w : this->workers)
+			w->th = std::thread (
+				std::bind (std::mem_fn (&hCraft::thread_pool::main_loop), this, w.get ()));
 	}
 	
 	/* 
@@ -51,14 +68,15 @@ namespace hCraft {
 	thread_pool::stop ()
 	{
 		this->terminating = true;
-		this->cv.notify_all ();
+		{
+			std::lock_guard<std::mutex> guard {this->idle_lock};
+			this->cv.notify_all ();
+		}
 		
-		while (!this->workers.empty ())
-			{
-				worker_thread& w = this->workers.back ();
-				w.th.join ();
-				this->workers.pop_back ();
-			}
+		for (auto& w : this->workers)
+			if (w->th.joinable ())
+				w->th.join ();
+		this->workers.clear ();
 	}
 	
 	
@@ -67,39 +85,88 @@ namespace hCraft {
 	 * The function ran by worker threads.
 	 */
 	void
-	thread_pool::main_loop ()
+	thread_pool::main_loop (worker_thread *w)
 	{
-		for (;;)
+		this_worker = w;
+		
+		task t;
+		while (this->get_task (w, t))
 			{
-				task t = this->get_task ();
-				if (this->terminating)
-					break;
-				
 				t.callback (t.context);
+				++ this->tasks_run;
 			}
+		
+		this_worker = nullptr;
+	}
+	
+	/* 
+	 * Locks the specified queue lock, keeping track of contention.
+	 */
+	void
+	thread_pool::acquire (std::mutex& lock)
+	{
+		this->lock_acquisitions.fetch_add (1, std::memory_order_relaxed);
+		if (!lock.try_lock ())
+			{
+				this->lock_contentions.fetch_add (1, std::memory_order_relaxed);
+				lock.lock ();
+			}
+	}
+	
+	/* 
+	 * Removes the task at the front of the specified thread's queue.
+	 */
+	bool
+	thread_pool::try_pop (worker_thread *w, task& t)
+	{
+		this->acquire (w->lock);
+		std::lock_guard<std::mutex> guard {w->lock, std::adopt_lock};
+		if (w->tasks.empty ())
+			return false;
+		
+		t = std::move (w->tasks.front ());
+		w->tasks.pop_front ();
+		-- this->pending;
+		return true;
 	}
 	
 	/* 
 	 * Returns the next available task. If none are currently available, the
-	 * function blocks until one is.
+	 * function blocks until one is. Returns false if the pool is stopping.
 	 */
-	thread_pool::task
-	thread_pool::get_task ()
+	bool
+	thread_pool::get_task (worker_thread *w, task& t)
 	{
-		bool& terminating = this->terminating;
-		if (terminating)
-			return task ();
-		
-		decltype (this->tasks)& task_ref = this->tasks;
-		
-		std::unique_lock<std::mutex> guard {this->task_lock};
-		this->cv.wait (guard, [&task_ref, &terminating] { return !task_ref.empty () || terminating; });
-		if (terminating)
-			return task ();
-			
-		task task = this->tasks.front ();
-		this->tasks.pop ();
-		return task;
+		int count = this->workers.size ();
+		
+		for (;;)
+			{
+				if (this->terminating)
+					return false;
+				
+				if (this->try_pop (w, t))
+					return true;
+				
+				// steal
+				for (int i = 1; i < count; ++i)
+					{
+						worker_thread *other = this->workers[(w->index + i) % count].get ();
+						if (this->try_pop (other, t))
+							{
+								++ this->steals;
+								return true;
+							}
+					}
+				
+				// nothing to do, sleep until a task is scheduled. the sleeper count
+				// is raised before the pending count is checked, and enqueue () does
+				// the opposite, so at least one of the two sides sees the other.
+				std::unique_lock<std::mutex> guard {this->idle_lock};
+				++ this->sleepers;
+				this->cv.wait (guard, [this] {
+					return (this->pending.load () > 0) || this->terminating; });
+				-- this->sleepers;
+			}
 	}
 	
 	
@@ -110,9 +177,180 @@ namespace hCraft {
 	void
 	thread_pool::enqueue (std::function<void (void *)>&& cb, void *context)
 	{
-		std::unique_lock<std::mutex> guard {this->task_lock};
-		this->tasks.emplace (std::move (cb), context);
-		this->cv.notify_one ();
+		if (this->workers.empty ())
+			return;
+		
+		worker_thread *w = this_worker;
+		if (!w || w->pool != this)
+			w = this->workers[this->next_worker++ % this->workers.size ()].get ();
+		
+		{
+			this->acquire (w->lock);
+			std::lock_guard<std::mutex> guard {w->lock, std::adopt_lock};
+			w->tasks.emplace_back (std::move (cb), context);
+		}
+		
+		++ this->pending;
+		if (this->sleepers.load () > 0)
+			{
+				std::lock_guard<std::mutex> guard {this->idle_lock};
+				this->cv.notify_one ();
+			}
+	}
+	
+	/* 
+	 * Calls @{f} (i) for every i in [0, @{count}), on the calling thread and
+	 * on up to @{count} - 1 pooled threads, and returns once all calls
+	 * have completed. The calling thread keeps claiming work too, and only
+	 * waits for calls already in progress on other threads, never for the
+	 * helper tasks themselves to get to run. So this is safe to call while
+	 * holding locks that the pool's threads might be blocked on; helpers
+	 * that start late find nothing left to do and return.
+	 */
+	void
+	thread_pool::run_parallel (size_t count,
+		const std::function<void (size_t)>& f)
+	{
+		struct shared_state
+		{
+			const std::function<void (size_t)> *f; // only valid while work is left
+			size_t count;
+			std::atomic<size_t> next;
+			std::atomic<size_t> done;
+			std::mutex done_lock;
+			std::condition_variable done_cv;
+		};
+		
+		auto st = std::make_shared<shared_state> ();
+		st->f = &f;
+		st->count = count;
+		st->next = 0;
+		st->done = 0;
+		
+		auto work = [] (shared_state& st)
+			{
+				size_t i;
+				while ((i = st.next.fetch_add (1)) < st.count)
+					{
+						(*st.f) (i);
+						if (st.done.fetch_add (1) + 1 == st.count)
+							{
+								std::lock_guard<std::mutex> guard {st.done_lock};
+								st.done_cv.notify_one ();
+							}
+					}
+			};
+		
+		int helpers = std::min ((int)count - 1, this->thread_count ());
+		for (int i = 0; i < helpers; ++i)
+			this->enqueue (
+				[st, work] (void *)
+					{
+						work (*st);
+					});
+		
+		work (*st);
+		
+		std::unique_lock<std::mutex> guard {st->done_lock};
+		st->done_cv.wait (guard, [&st] { return st->done.load () == st->count; });
+	}
+
+	/* 
+	 * Returns counters describing the pool's activity since it was created.
+	 */
+	thread_pool::stats
+	thread_pool::get_stats () const
+	{
+		stats st;
+		st.tasks_run = this->tasks_run.load ();
+		st.steals = this->steals.load ();
+		st.lock_acquisitions = this->lock_acquisitions.load ();
+		st.lock_contentions = this->lock_contentions.load ();
+		return st;
+	}
+	
+	
+	
+//----
+	
+	// the amount of tasks a strand runs before giving its thread back.
+	static const int _strand_batch = 16;
+	
+	strand::strand (thread_pool& pool)
+		: pool (pool)
+	{
+		this->scheduled = false;
+	}
+	
+	
+	
+	/* 
+	 * Schedules the specified task to be ran after all previously posted
+	 * tasks have finished.
+	 */
+	void
+	strand::post (std::function<void (void *)>&& cb, void *context)
+	{
+		{
+			std::lock_guard<std::mutex> guard {this->lock};
+			this->tasks.emplace_back (std::move (cb), context);
+			if (this->scheduled)
+				return;
+			this->scheduled = true;
+		}
+		
+		this->pool.enqueue (strand::run, this);
+	}
+	
+	/* 
+	 * Checks whether there are no tasks pending or running.
+	 */
+	bool
+	strand::idle ()
+	{
+		std::lock_guard<std::mutex> guard {this->lock};
+		return !this->scheduled;
+	}
+	
+	
+	
+	void
+	strand::run (void *ptr)
+	{
+		strand *s = static_cast<strand *> (ptr);
+		
+		for (int i = 0; i < _strand_batch; ++i)
+			{
+				thread_pool::task t;
+				{
+					std::lock_guard<std::mutex> guard {s->lock};
+					if (s->tasks.empty ())
+						{
+							// the strand must not be touched after this point, its owner
+							// is free to destroy it once it's idle.
+							s->scheduled = false;
+							return;
+						}
+					
+					t = std::move (s->tasks.front ());
+					s->tasks.pop_front ();
+				}
+				
+				t.callback (t.context);
+			}
+		
+		// more work might be waiting, continue in a new pool task to let other
+		// strands run in the meantime.
+		{
+			std::lock_guard<std::mutex> guard {s->lock};
+			if (s->tasks.empty ())
+				{
+					s->scheduled = false;
+					return;
+				}
+		}
+		
+		s->pool.enqueue (strand::run, s);
 	}
 }
 
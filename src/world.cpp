@@ -22,6 +22,7 @@
 #include "player.hpp"
 #include "packet.hpp"
 #include "logger.hpp"
+#include "utils.hpp"
 #include <stdexcept>
 #include <cassert>
 #include <cstring>
@@ -43,16 +44,55 @@ namespace hCraft {
 		{ *x = key & 0xFFFFFFFFU; *z = key >> 32; }
 	
 	
+	static std::atomic<unsigned long long> next_world_uid {1};
+	
+	namespace {
+		
+		// the last chunk looked up by the calling thread (see get_chunk ()).
+		struct chunk_lookup_cache
+		{
+			unsigned long long uid; // of the world
+			unsigned int epoch;     // of the world's chunk map
+			int x, z;
+			chunk *ch;
+		};
+		
+		thread_local chunk_lookup_cache last_lookup = {0, 0, 0, 0, nullptr};
+		
+		
+		// the outcome of a single block update (see world::apply_updates ()).
+		struct update_result
+		{
+			bool changed;
+			unsigned short old_id;
+			unsigned char old_meta;
+			
+			// neighbouring physics blocks to notify: a range within the neighbour
+			// list of the task that applied the update.
+			unsigned int task;
+			unsigned int nb_first, nb_count;
+		};
+		
+		struct update_neighbour
+		{
+			int x, y, z;
+			physics_block *ph;
+		};
+	}
+	
+	
 	
 	/* 
 	 * Constructs a new empty world.
 	 */
 	world::world (server &srv, const char *name, logger &log, world_generator *gen,
 		world_provider *provider)
-		: srv (srv), log (log), lm (log, this), estage (this)
+		: srv (srv), log (log), lm (log, this), estage (this),
+		  io (*this, this->prov_lock)
 	{
 		assert (world::is_valid_name (name));
 		std::strcpy (this->name, name);
+		this->uid = next_world_uid.fetch_add (1);
 		
 		this->gen = gen;
 		this->width = 0;
@@ -60,15 +100,21 @@ namespace hCraft {
 		
 		this->prov = provider;
 		this->edge_chunk = nullptr;
-		this->last_chunk = {0, 0, nullptr};
 		
 		this->players = new playerlist ();
 		this->th_running = false;
 		this->auto_lighting = true;
 		this->ticks = 0;
+		this->updates_applied = 0;
+		this->update_rate = 0;
 		
 		this->ph_state = PHY_ON;
 		//this->physics.set_thread_count (0);
+		
+		this->res_clock = 0;
+		this->mem_budget = (unsigned long long)srv.get_config ().world_mem_mb << 20;
+		this->mem_used = 0;
+		this->saves_running = 0;
 	}
 	
 	/* 
@@ -88,13 +134,13 @@ namespace hCraft {
 		
 		{
 			std::lock_guard<std::mutex> guard {this->chunk_lock};
-			for (auto itr = this->chunks.begin (); itr != this->chunks.end (); ++itr)
-				{
-					chunk *ch = itr->second;
-					delete ch;
-				}
+			this->chunks.for_each (
+				[] (int x, int z, chunk *ch) { delete ch; });
 			this->chunks.clear ();
 		}
+		
+		for (auto& r : this->retired)
+			delete r.second;
 	}
 	
 	
@@ -130,6 +176,8 @@ namespace hCraft {
 		if (this->th_running)
 			return;
 		
+		this->io.start ();
+		
 		this->th_running = true;
 		this->th.reset (new std::thread (
 			std::bind (std::mem_fn (&hCraft::world::worker), this)));
@@ -150,6 +198,9 @@ namespace hCraft {
 		if (this->th->joinable ())
 			this->th->join ();
 		this->th.reset ();
+		
+		// after the world's thread, which queues chunks to be written out.
+		this->io.stop ();
 	}
 	
 	
@@ -162,17 +213,39 @@ namespace hCraft {
 	{
 		const static int block_update_cap = 10000; // per tick
 		const static int light_update_cap = 10000; // per tick
+		const static std::chrono::milliseconds light_refresh_interval {250};
 		
 		int update_count;
 		dense_edit_stage pl_tr;
 		
+		auto start_time = std::chrono::steady_clock::now ();
+		auto last_light_refresh = start_time;
+		unsigned int last_eviction = 0;
+		unsigned int rate_clock = 0;
+		unsigned long long rate_applied = this->get_updates_applied ();
+		
 		this->ticks = 0;
 		while (this->th_running)
 			{
 				++ this->ticks;
+				unsigned int now = std::chrono::duration_cast<std::chrono::seconds> (
+					std::chrono::steady_clock::now () - start_time).count ();
+				this->res_clock.store (now, std::memory_order_relaxed);
+				
+				if (now != rate_clock)
+					{
+						unsigned long long applied = this->get_updates_applied ();
+						this->update_rate.store ((applied - rate_applied) / (now - rate_clock),
+							std::memory_order_relaxed);
+						rate_clock = now;
+						rate_applied = applied;
+					}
+				
 				{
 					std::lock_guard<std::mutex> guard {this->update_lock};
 					
+					this->release_held_updates ();
+					
 					/* 
 					 * Block updates.
 					 */
@@ -184,24 +257,14 @@ namespace hCraft {
 							this->get_players ().populate (pl_vc);
 							std::cout << "[" << pl_vc.size () << "p]" << std::endl;
 							
+							std::vector<block_update> batch;
 							update_count = 0;
 							while (!this->updates.empty () && (update_count++ < block_update_cap))
 								{
 									block_update &u = this->updates.front ();
 									
-									block_data old_bd = this->get_block (u.x, u.y, u.z);
-									if (old_bd.id == u.id && old_bd.meta == u.meta)
-										{
-											// nothing modified
-											this->updates.pop_front ();
-											continue;
-										}
-									
-									block_info *old_inf = block_info::from_id (old_bd.id);
-									block_info *new_inf = block_info::from_id (u.id);
-							
-									physics_block *ph = physics_block::from_id (u.id);
-									
+									// updates outside the world are dropped before anything can
+									// bring their chunk into memory.
 									if (((this->width > 0) && ((u.x >= this->width) || (u.x < 0))) ||
 										((this->depth > 0) && ((u.z >= this->depth) || (u.z < 0))) ||
 										((u.y < 0) || (u.y > 255)))
@@ -210,75 +273,28 @@ namespace hCraft {
 											continue;
 										}
 									
-									if ((this->get_id (u.x, u.y, u.z) == u.id) &&
-											(this->get_meta (u.x, u.y, u.z) == u.meta))
+									// don't wait on chunks that aren't in memory, get back to
+									// the update once its chunk has been read in or generated.
+									if (this->hold_update (u))
 										{
 											this->updates.pop_front ();
 											continue;
 										}
 									
-									unsigned short old_id = this->get_id (u.x, u.y, u.z);
-									unsigned char old_meta = this->get_meta (u.x, u.y, u.z);
-									this->set_block (u.x, u.y, u.z, u.id, u.meta);
-							
-									chunk *ch = this->get_chunk_at (u.x, u.z);
-									if (new_inf->opaque != old_inf->opaque)
-										ch->recalc_heightmap (u.x & 0xF, u.z & 0xF);
-									
-									// update players
-									pl_tr.set (u.x, u.y, u.z, ph ? ph->vanilla_id () : u.id, u.meta);
-									
-									if (ch)
-										{
-											if (auto_lighting)
-												{
-													this->lm.enqueue_nolock (u.x, u.y, u.z);
-												}
-											
-											// physics
-											if (u.physics && ph)
-												{
-													if (old_id != u.id || old_meta != u.meta)
-														{
-															physics_block *old_ph = physics_block::from_id (old_id);
-															if (old_ph)
-																old_ph->on_modified (*this, u.x, u.y, u.z);
-														}
-													
-													this->queue_physics (u.x, u.y, u.z, u.extra, u.ptr,
-														ph->tick_rate ());
-												}
-											
-											// check neighbouring blocks
-											{
-												physics_block *nph;
-											
-												int xx, yy, zz;
-												for (xx = (u.x - 1); xx <= (u.x + 1); ++xx)
-													for (yy = (u.y - 1); yy <= (u.y + 1); ++yy)
-														for (zz = (u.z - 1); zz <= (u.z + 1); ++zz)
-															{
-																if (xx == u.x && yy == u.y && zz == u.z)
-																	continue;
-																if ((yy < 0) || (yy > 255))
-																	continue;
-															
-																nph = this->get_physics_at (xx, yy, zz);
-																if (nph && nph->affected_by_neighbours ())
-																	{
-																		nph->on_neighbour_modified (*this, xx, yy, zz,
-																			u.x, u.y, u.z);
-																	}
-															}
-											}
-										}
-									
+									batch.push_back (u);
 									this->updates.pop_front ();
 								}
 							
-							// send updates to players
+							this->apply_updates (batch, pl_tr);
+							
+							// send updates to players, all of this tick's changes are
+							// written out together.
+							for (player *pl : pl_vc)
+								pl->cork ();
 							pl_tr.preview (pl_vc);
 							pl_tr.clear ();
+							for (player *pl : pl_vc)
+								pl->uncork ();
 						}
 					
 				} // release of update lock
@@ -288,12 +304,424 @@ namespace hCraft {
 				 */
 				this->lm.update (light_update_cap);
 				
+				auto light_now = std::chrono::steady_clock::now ();
+				if ((light_now - last_light_refresh) >= light_refresh_interval)
+					{
+						last_light_refresh = light_now;
+						this->send_light_refreshes ();
+					}
+				
+				/* 
+				 * Chunk residency.
+				 */
+				if ((now - last_eviction) >= 5)
+					{
+						last_eviction = now;
+						this->evict_chunks ();
+						this->free_retired ();
+					}
+				
 				std::this_thread::sleep_for (std::chrono::milliseconds (5));
 			}
 	}
 	
 	
 	
+	/* 
+	 * Adds the specified change to a list of pending refreshes, merging it
+	 * with an earlier change to the same column.
+	 */
+	static void
+	_add_light_change (std::vector<light_change>& vec, const light_change& c)
+	{
+		for (light_change& o : vec)
+			if (o.cx == c.cx && o.cz == c.cz)
+				{
+					o.sections |= c.sections;
+					return;
+				}
+		vec.push_back (c);
+	}
+	
+	/* 
+	 * Resends the sub-chunks whose light has changed to the players that have
+	 * been sent their column. Every chunk column is encoded once, and the
+	 * packet is shared between all of those players. Refreshes that do not
+	 * fit within a player's rate limit are kept for the next call, for that
+	 * player only.
+	 */
+	void
+	world::send_light_refreshes ()
+	{
+		this->lm.take_changes (this->light_changes);
+		if (this->light_changes.empty () && this->light_deferred.empty ())
+			return;
+		
+		// merge changes to the same column.
+		std::vector<light_change>& changes = this->light_changes;
+		std::sort (changes.begin (), changes.end (),
+			[] (const light_change& a, const light_change& b)
+				{ return (a.cx < b.cx) || ((a.cx == b.cx) && (a.cz < b.cz)); });
+		size_t merged = 0;
+		for (size_t i = 0; i < changes.size (); ++i)
+			{
+				if (merged > 0 && changes[merged - 1].cx == changes[i].cx
+					&& changes[merged - 1].cz == changes[i].cz)
+					changes[merged - 1].sections |= changes[i].sections;
+				else
+					changes[merged++] = changes[i];
+			}
+		changes.resize (merged);
+		
+		std::vector<player *> pl_vc;
+		this->get_players ().populate (pl_vc);
+		for (player *pl : pl_vc)
+			pl->cork ();
+		
+		// light stored in a sub-chunk creates it, so ones that do not exist
+		// have nothing new to send.
+		auto present_sections = [] (chunk *ch, unsigned short sections)
+			{
+				unsigned short present = 0;
+				for (int i = 0; i < 16; ++i)
+					if ((sections & (1 << i)) && ch->get_sub (i))
+						present |= 1 << i;
+				return present;
+			};
+		
+		// refreshes deferred by earlier calls go out first, and only to the
+		// players that missed them. Entries of players that have since left
+		// the world are dropped.
+		std::unordered_map<player *, std::vector<light_change>> deferred;
+		for (player *pl : pl_vc)
+			{
+				auto itr = this->light_deferred.find (pl);
+				if (itr == this->light_deferred.end ())
+					continue;
+				if (pl->get_world () != this)
+					continue;
+				
+				for (const light_change& c : itr->second)
+					{
+						if (!pl->knows_chunk (this, c.cx, c.cz))
+							continue;
+						chunk *ch = this->get_chunk (c.cx, c.cz);
+						if (!ch)
+							continue;
+						unsigned short sections = present_sections (ch, c.sections);
+						if (sections == 0)
+							continue;
+						if (!pl->take_light_refresh ())
+							{
+								_add_light_change (deferred[pl], { c.cx, c.cz, sections });
+								continue;
+							}
+						
+						packet *pack = packet::make_chunk (c.cx, c.cz, ch, -1, sections);
+						if (pack)
+							pl->send (pack);
+					}
+			}
+		
+		for (const light_change& c : changes)
+			{
+				chunk *ch = this->get_chunk (c.cx, c.cz);
+				if (!ch)
+					continue;
+				
+				unsigned short sections = present_sections (ch, c.sections);
+				if (sections == 0)
+					continue;
+				
+				std::shared_ptr<packet> pack;
+				for (player *pl : pl_vc)
+					{
+						// partial chunk packets are only valid for columns the
+						// player has already been sent in full.
+						if (pl->get_world () != this || !pl->knows_chunk (this, c.cx, c.cz))
+							continue;
+						if (!pl->take_light_refresh ())
+							{
+								_add_light_change (deferred[pl], { c.cx, c.cz, sections });
+								continue;
+							}
+						
+						if (!pack)
+							{
+								pack.reset (packet::make_chunk (c.cx, c.cz, ch, -1, sections));
+								if (!pack)
+									break;
+							}
+						pl->send (pack);
+					}
+			}
+		
+		for (player *pl : pl_vc)
+			pl->uncork ();
+		changes.clear ();
+		this->light_deferred.swap (deferred);
+	}
+	
+	
+	
+	/* 
+	 * Applies a tick's worth of block updates in two phases: blocks are set
+	 * (in parallel, for large batches), and players, lighting and physics
+	 * are then notified on the world's thread in the order the updates were
+	 * queued. Changed blocks are staged in @{pl_tr} to be sent to players.
+	 */
+	void
+	world::apply_updates (std::vector<block_update>& batch,
+		dense_edit_stage& pl_tr)
+	{
+		const static size_t parallel_threshold = 2048; // updates per batch
+		const static size_t task_size = 1024; // updates per task
+		
+		size_t count = batch.size ();
+		if (count == 0)
+			return;
+		
+		std::vector<update_result> results (count);
+		
+		/* 
+		 * Split the batch into tasks. Updates are ordered by chunk (and the
+		 * chunks by region) without reordering updates to the same chunk, and
+		 * tasks are only cut between chunks, so every chunk is modified by a
+		 * single task, in queue order.
+		 */
+		std::vector<unsigned int> order (count);
+		for (size_t i = 0; i < count; ++i)
+			order[i] = i;
+		std::stable_sort (order.begin (), order.end (),
+			[&batch] (unsigned int a, unsigned int b) -> bool
+				{
+					int acx = batch[a].x >> 4, acz = batch[a].z >> 4;
+					int bcx = batch[b].x >> 4, bcz = batch[b].z >> 4;
+					int arz = acz >> chunk_map::REGION_SHIFT, brz = bcz >> chunk_map::REGION_SHIFT;
+					if (arz != brz) return arz < brz;
+					int arx = acx >> chunk_map::REGION_SHIFT, brx = bcx >> chunk_map::REGION_SHIFT;
+					if (arx != brx) return arx < brx;
+					if (acz != bcz) return acz < bcz;
+					return acx < bcx;
+				});
+		
+		std::vector<std::pair<size_t, size_t>> tasks;
+		size_t task_start = 0;
+		for (size_t i = 1; i < count; ++i)
+			{
+				const block_update& prev = batch[order[i - 1]], & u = batch[order[i]];
+				if ((i - task_start) >= task_size &&
+					(((u.x >> 4) != (prev.x >> 4)) || ((u.z >> 4) != (prev.z >> 4))))
+					{
+						tasks.emplace_back (task_start, i);
+						task_start = i;
+					}
+			}
+		tasks.emplace_back (task_start, count);
+		
+		std::vector<std::vector<update_neighbour>> neighbours (tasks.size ());
+		
+		// phase 1: set blocks.
+		auto apply = [this, &batch, &results, &order, &tasks] (size_t t)
+			{
+				for (size_t i = tasks[t].first; i < tasks[t].second; ++i)
+					{
+						block_update& u = batch[order[i]];
+						update_result& r = results[order[i]];
+						r.changed = false;
+						
+						// held back by hold_update () unless resident.
+						chunk *ch = this->get_chunk (u.x >> 4, u.z >> 4);
+						if (!ch)
+							continue;
+						
+						int bx = u.x & 0xF, bz = u.z & 0xF;
+						block_data old_bd = ch->get_block (bx, u.y, bz);
+						if (old_bd.id == u.id && old_bd.meta == u.meta)
+							continue; // nothing modified
+						
+						r.changed = true;
+						r.old_id = old_bd.id;
+						r.old_meta = old_bd.meta;
+						ch->set_block (bx, u.y, bz, u.id, u.meta);
+						
+						block_info *old_inf = block_info::from_id (old_bd.id);
+						block_info *new_inf = block_info::from_id (u.id);
+						if (new_inf->opaque != old_inf->opaque)
+							ch->recalc_heightmap (bx, bz);
+					}
+			};
+		
+		// phase 2: once every block is in place, look for neighbouring blocks
+		// that have to be told about the change.
+		auto scan = [this, &batch, &results, &order, &tasks, &neighbours] (size_t t)
+			{
+				std::vector<update_neighbour>& nbs = neighbours[t];
+				for (size_t i = tasks[t].first; i < tasks[t].second; ++i)
+					{
+						block_update& u = batch[order[i]];
+						update_result& r = results[order[i]];
+						if (!r.changed)
+							continue;
+						
+						r.task = t;
+						r.nb_first = nbs.size ();
+						for (int xx = (u.x - 1); xx <= (u.x + 1); ++xx)
+							for (int yy = (u.y - 1); yy <= (u.y + 1); ++yy)
+								for (int zz = (u.z - 1); zz <= (u.z + 1); ++zz)
+									{
+										if (xx == u.x && yy == u.y && zz == u.z)
+											continue;
+										if ((yy < 0) || (yy > 255))
+											continue;
+										
+										physics_block *nph = this->get_physics_at (xx, yy, zz);
+										if (nph && nph->affected_by_neighbours ())
+											nbs.push_back ({xx, yy, zz, nph});
+									}
+						r.nb_count = nbs.size () - r.nb_first;
+					}
+			};
+		
+		if (count < parallel_threshold || tasks.size () == 1)
+			{
+				for (size_t t = 0; t < tasks.size (); ++t)
+					apply (t);
+				for (size_t t = 0; t < tasks.size (); ++t)
+					scan (t);
+			}
+		else
+			{
+				thread_pool& pool = this->srv.get_thread_pool ();
+				pool.run_parallel (tasks.size (), apply);
+				pool.run_parallel (tasks.size (), scan);
+			}
+		
+		// phase 3: notify, in queue order.
+		unsigned long long applied = 0;
+		for (size_t i = 0; i < count; ++i)
+			{
+				block_update& u = batch[i];
+				update_result& r = results[i];
+				if (!r.changed)
+					continue;
+				++ applied;
+				
+				physics_block *ph = physics_block::from_id (u.id);
+				
+				// update players
+				pl_tr.set (u.x, u.y, u.z, ph ? ph->vanilla_id () : u.id, u.meta);
+				
+				if (this->auto_lighting)
+					this->lm.enqueue_nolock (u.x, u.y, u.z);
+				
+				// physics
+				if (u.physics && ph)
+					{
+						physics_block *old_ph = physics_block::from_id (r.old_id);
+						if (old_ph)
+							old_ph->on_modified (*this, u.x, u.y, u.z);
+						
+						this->queue_physics (u.x, u.y, u.z, u.extra, u.ptr,
+							ph->tick_rate ());
+					}
+				
+				// neighbouring blocks
+				std::vector<update_neighbour>& nbs = neighbours[r.task];
+				for (unsigned int j = r.nb_first; j < (r.nb_first + r.nb_count); ++j)
+					nbs[j].ph->on_neighbour_modified (*this, nbs[j].x, nbs[j].y,
+						nbs[j].z, u.x, u.y, u.z);
+			}
+		
+		this->updates_applied.fetch_add (applied, std::memory_order_relaxed);
+	}
+	
+	
+	
+	/* 
+	 * Holds back the specified block update if its chunk isn't in memory
+	 * yet, and has the chunk read in or generated in the background.
+	 * Returns true if the update was held back.
+	 */
+	bool
+	world::hold_update (const block_update& u)
+	{
+		int cx = u.x >> 4, cz = u.z >> 4;
+		unsigned long long key = chunk_key (cx, cz);
+		
+		// keep the order of updates to the same chunk.
+		auto itr = this->held_updates.find (key);
+		if (itr != this->held_updates.end ())
+			{
+				itr->second.push_back (u);
+				return true;
+			}
+		
+		chunk *ch = this->get_chunk (cx, cz);
+		if (ch && ch->generated)
+			return false;
+		
+		this->held_updates[key].push_back (u);
+		this->io.load (cx, cz,
+			[this, key, cx, cz] (chunk *ch)
+				{
+					if (ch && ch->generated)
+						{
+							this->chunk_ready (key, false);
+							return;
+						}
+					
+					// not on disk either
+					if (!this->srv.cgen.request (this, cx, cz,
+						[this, key] (chunk *) { this->chunk_ready (key, false); }))
+						this->chunk_ready (key, true);
+				});
+		return true;
+	}
+	
+	void
+	world::chunk_ready (unsigned long long key, bool load_here)
+	{
+		std::lock_guard<std::mutex> guard {this->ready_lock};
+		this->ready_chunks.emplace_back (key, load_here);
+	}
+	
+	/* 
+	 * Requeues the updates held back for chunks that have become ready.
+	 */
+	void
+	world::release_held_updates ()
+	{
+		std::vector<std::pair<unsigned long long, bool>> ready;
+		{
+			std::lock_guard<std::mutex> guard {this->ready_lock};
+			if (this->ready_chunks.empty ())
+				return;
+			ready.swap (this->ready_chunks);
+		}
+		
+		for (auto& r : ready)
+			{
+				auto itr = this->held_updates.find (r.first);
+				if (itr == this->held_updates.end ())
+					continue;
+				
+				// the chunk generator isn't running.
+				if (r.second)
+					{
+						int cx, cz;
+						chunk_coords (r.first, &cx, &cz);
+						this->load_chunk (cx, cz);
+					}
+				
+				this->updates.insert (this->updates.begin (),
+					itr->second.begin (), itr->second.end ());
+				this->held_updates.erase (itr);
+			}
+	}
+	
+	
+	
 	void
 	world::set_width (int width)
 	{
@@ -350,6 +778,7 @@ namespace hCraft {
 		if (this->prov == nullptr)
 			return;
 		
+		std::lock_guard<std::mutex> prov_guard {this->prov_lock};
 		std::lock_guard<std::mutex> guard {this->chunk_lock};
 		
 		if (this->chunks.empty ())
@@ -365,17 +794,18 @@ namespace hCraft {
 		this->get_information (inf);
 		this->prov->save_info (*this, inf);
 		
-		for (auto itr = this->chunks.begin (); itr != this->chunks.end (); ++itr)
-			{
-				chunk *ch = itr->second;
-				if (ch->modified)
-					{
-						int x, z;
-						chunk_coords (itr->first, &x, &z);
-						this->prov->save (*this, ch, x, z);
-						ch->modified = false;
-					}
-			}
+		world_provider *prov = this->prov;
+		this->chunks.for_each (
+			[this, prov] (int x, int z, chunk *ch)
+				{
+					if (ch->dirty ())
+						{
+							unsigned long long ver = ch->get_version ();
+							prov->save (*this, ch, x, z);
+							ch->modified = false;
+							ch->mark_saved (ver);
+						}
+				});
 		this->prov->close ();
 	}
 	
@@ -389,6 +819,7 @@ namespace hCraft {
 			return;
 		
 		// we're not modifying any chunks, but we'll still take ahold of this lock...
+		std::lock_guard<std::mutex> prov_guard {this->prov_lock};
 		std::lock_guard<std::mutex> guard {this->chunk_lock};
 		
 		this->prov->open (*this);
@@ -400,6 +831,166 @@ namespace hCraft {
 		this->prov->close ();
 	}
 	
+	namespace {
+		
+		struct save_job
+		{
+			unsigned long long key;
+			chunk *snap;
+			unsigned long long ver; // the version @{snap} was taken at
+			std::vector<unsigned char> data;
+			bool written;
+		};
+		
+		// keeps world::saves_running raised for as long as it exists, even if
+		// the save fails halfway through.
+		struct save_counter
+		{
+			std::atomic<int>& count;
+			
+			save_counter (std::atomic<int>& count)
+				: count (count)
+				{ ++ this->count; }
+			
+			~save_counter ()
+				{ -- this->count; }
+		};
+	}
+	
+	/* 
+	 * Saves chunks that have been modified since they were last saved, in
+	 * batches: each batch is copied while the chunk lock is held, compressed
+	 * on the given thread pool, and then written out with only the provider
+	 * lock held.
+	 * 
+	 * @{progress} is called with the number of chunks saved so far and the
+	 * total number of chunks to save after every batch. Returns the number of
+	 * chunks saved and adds the amount of bytes written to @{bytes}.
+	 */
+	int
+	world::save_dirty (thread_pool& pool, unsigned long long& bytes,
+		std::function<void (int, int)> progress)
+	{
+		const static size_t batch_size = 32;
+		
+		if (this->prov == nullptr)
+			return 0;
+		
+		save_counter running {this->saves_running};
+		std::vector<unsigned long long> keys;
+		{
+			std::lock_guard<std::mutex> guard {this->chunk_lock};
+			this->chunks.for_each (
+				[&keys] (int x, int z, chunk *ch)
+					{
+						if (ch->dirty ())
+							keys.push_back (chunk_key (x, z));
+					});
+		}
+		
+		int total = keys.size (), saved = 0;
+		if (progress)
+			progress (0, total);
+		if (keys.empty ())
+			return 0;
+		
+		for (size_t i = 0; i < keys.size (); i += batch_size)
+			{
+				std::vector<save_job> jobs;
+				
+				// chunks evicted in the meantime have been saved on their way out.
+				{
+					std::lock_guard<std::mutex> guard {this->chunk_lock};
+					for (size_t j = i; (j < keys.size ()) && (j < (i + batch_size)); ++j)
+						{
+							int x, z;
+							chunk_coords (keys[j], &x, &z);
+							chunk *ch = this->chunks.find (x, z);
+							if (!ch)
+								continue;
+							
+							jobs.emplace_back ();
+							jobs.back ().key = keys[j];
+							jobs.back ().snap = ch->snapshot (jobs.back ().ver);
+							jobs.back ().written = false;
+						}
+				}
+				
+				// compress
+				{
+					std::mutex done_lock;
+					std::condition_variable done_cv;
+					int remaining = jobs.size ();
+					
+					world_provider *prov = this->prov;
+					for (save_job& job : jobs)
+						pool.enqueue (
+							[prov, &job, &done_lock, &done_cv, &remaining] (void *)
+								{
+									try
+										{
+											prov->encode_chunk (job.snap, job.data);
+										}
+									catch (const std::exception&)
+										{
+											job.data.clear ();
+										}
+									delete job.snap;
+									job.snap = nullptr;
+									
+									std::lock_guard<std::mutex> guard {done_lock};
+									if (-- remaining == 0)
+										done_cv.notify_one ();
+								});
+					
+					std::unique_lock<std::mutex> guard {done_lock};
+					done_cv.wait (guard, [&remaining] { return remaining == 0; });
+				}
+				
+				// write
+				{
+					std::lock_guard<std::mutex> prov_guard {this->prov_lock};
+					this->prov->open (*this);
+					for (save_job& job : jobs)
+						{
+							if (job.data.empty ())
+								continue;
+							
+							int x, z;
+							chunk_coords (job.key, &x, &z);
+							this->prov->save_encoded (*this, job.data, x, z);
+							job.written = true;
+							bytes += job.data.size ();
+						}
+					this->prov->close ();
+				}
+				
+				// only chunks that have actually been written out count as saved,
+				// the rest have to be saved next time.
+				{
+					std::lock_guard<std::mutex> guard {this->chunk_lock};
+					for (save_job& job : jobs)
+						if (job.written)
+							{
+								int x, z;
+								chunk_coords (job.key, &x, &z);
+								chunk *ch = this->chunks.find (x, z);
+								if (ch)
+									{
+										ch->modified = false;
+										ch->mark_saved (job.ver);
+									}
+							}
+				}
+				
+				saved += jobs.size ();
+				if (progress)
+					progress (saved, total);
+			}
+		
+		return saved;
+	}
+	
 	
 	
 	/* 
@@ -412,8 +1003,9 @@ namespace hCraft {
 		int r_half = diameter >> 1;
 		int cx, cz;
 		
-		for (cx = (cpos.x - r_half); cx <= (cpos.x + r_half); ++cx)
-			for (cz = (cpos.z - r_half); cz <= (cpos.z + r_half); ++cz)
+		// rows along x, the order in which chunks are laid out in regions.
+		for (cz = (cpos.z - r_half); cz <= (cpos.z + r_half); ++cz)
+			for (cx = (cpos.x - r_half); cx <= (cpos.x + r_half); ++cx)
 				{
 					this->load_chunk (cx, cz);
 				}
@@ -460,18 +1052,43 @@ namespace hCraft {
 	void
 	world::put_chunk (int x, int z, chunk *ch)
 	{
-		unsigned long long key = chunk_key (x, z);
+		std::lock_guard<std::mutex> guard {this->chunk_lock};
+		chunk *prev = this->chunks.find (x, z);
+		if (prev == ch)
+			return;
 		
+		this->link_chunk_nolock (x, z, ch);
+		if (prev)
+			this->retire_chunk (prev);
+	}
+	
+	/* 
+	 * Inserts a chunk that has been read in by the I/O thread into the world,
+	 * unless one is already present. Returns the chunk that ends up in the
+	 * world, or null if the chunk can't be inserted yet because a chunk close
+	 * to it is being generated.
+	 */
+	chunk*
+	world::adopt_chunk (int x, int z, chunk *ch)
+	{
 		std::lock_guard<std::mutex> guard {this->chunk_lock};
-		auto itr = this->chunks.find (key);
-		if (itr != this->chunks.end ())
-			{
-				chunk *prev = itr->second;
-				if (prev == ch) return;
-				delete prev;
-				this->chunks.erase (itr);
-			}
+		chunk *prev = this->get_chunk_nolock (x, z);
+		if (prev)
+			return prev;
+		
+		// generating a chunk modifies its neighbours through their links.
+		std::lock_guard<std::mutex> gen_guard {this->gen_lock};
+		for (const chunk_pos& p : this->gen_active)
+			if ((utils::iabs (p.x - x) <= 2) && (utils::iabs (p.z - z) <= 2))
+				return nullptr;
 		
+		this->link_chunk_nolock (x, z, ch);
+		return ch;
+	}
+	
+	void
+	world::link_chunk_nolock (int x, int z, chunk *ch)
+	{
 		// set links
 		{
 			// north (-z)
@@ -516,7 +1133,53 @@ namespace hCraft {
 				ch->east = nullptr;
 		}
 		
-		this->chunks[key] = ch;
+		ch->mark_access (this->res_clock.load (std::memory_order_relaxed));
+		this->chunks.insert (x, z, ch);
+	}
+	
+	/* 
+	 * Frees the specified chunk, which must have already been removed from
+	 * the world, once any lookup that might have found it just before that
+	 * is done with it.
+	 */
+	void
+	world::retire_chunk (chunk *ch)
+	{
+		std::lock_guard<std::mutex> guard {this->retire_lock};
+		this->retired.emplace_back (
+			this->res_clock.load (std::memory_order_relaxed), ch);
+	}
+	
+	/* 
+	 * Frees retired chunks that no lookup can be using anymore.
+	 */
+	void
+	world::free_retired ()
+	{
+		const static unsigned int retire_grace = 5; // seconds
+		
+		unsigned int now = this->res_clock.load (std::memory_order_relaxed);
+		std::vector<chunk *> expired;
+		{
+			std::lock_guard<std::mutex> guard {this->retire_lock};
+			for (auto itr = this->retired.begin (); itr != this->retired.end (); )
+				{
+					if ((itr->first + retire_grace) <= now)
+						{
+							expired.push_back (itr->second);
+							itr = this->retired.erase (itr);
+						}
+					else
+						++ itr;
+				}
+		}
+		
+		for (chunk *ch : expired)
+			delete ch;
+		
+		// old chunk map tables, on the same schedule.
+		std::lock_guard<std::mutex> guard {this->chunk_lock};
+		this->chunks.reclaim ();
 	}
 	
 	
@@ -526,15 +1189,13 @@ namespace hCraft {
 		if (!this->chunk_in_bounds (x, z))
 			return this->edge_chunk;
 		
-		auto itr = this->chunks.find ((unsigned long long)chunk_key (x, z));
-		if (itr != this->chunks.end ())
-			return itr->second;
-		
-		return nullptr;
+		return this->chunks.find (x, z);
 	}
 	
 	/* 
 	 * Searches the chunk world for a chunk located at the specified coordinates.
+	 * Takes no locks. The last chunk looked up by each thread is remembered
+	 * until a chunk is removed from the world.
 	 */
 	chunk*
 	world::get_chunk (int x, int z)
@@ -542,14 +1203,33 @@ namespace hCraft {
 		if (!this->chunk_in_bounds (x, z))
 			return this->edge_chunk;
 		
-		unsigned long long key = chunk_key (x, z);
+		chunk *ch;
+		chunk_lookup_cache& lc = last_lookup;
+		unsigned int epoch = this->chunks.get_epoch ();
+		if ((lc.uid == this->uid) && (lc.epoch == epoch) && (lc.x == x) && (lc.z == z))
+			ch = lc.ch;
+		else
+			{
+				ch = this->chunks.find (x, z);
+				if (!ch)
+					return nullptr;
+				lc = {this->uid, epoch, x, z, ch};
+			}
 		
+		// lets evict_chunks () tell whether anyone got hold of the chunk since
+		// it was picked.
+		ch->mark_access (this->res_clock.load (std::memory_order_relaxed));
+		return ch;
+	}
+	
+	/* 
+	 * Returns the number of chunks currently held in memory.
+	 */
+	int
+	world::get_resident_chunks ()
+	{
 		std::lock_guard<std::mutex> guard {this->chunk_lock};
-		auto itr = this->chunks.find (key);
-		if (itr != this->chunks.end ())
-			return itr->second;
-		
-		return nullptr;
+		return (int)this->chunks.size ();
 	}
 	
 	/* 
@@ -578,24 +1258,28 @@ namespace hCraft {
 	{
 		chunk *ch = this->get_chunk (x, z);
 		if (ch && ch->generated) return ch;
+		
+		this->reserve_generation (x, z);
+		
+		// another thread might have gotten here first.
+		ch = this->get_chunk (x, z);
+		if (ch && ch->generated)
+			{
+				this->release_generation (x, z);
+				return ch;
+			}
 		else if (!ch)
 			{
-				ch = new chunk ();
-		
 				// try to load from disk
-				this->prov->open (*this);
-				if (this->prov->load (*this, ch, x, z))
+				ch = this->io.fetch (x, z).get ();
+				if (ch)
 					{
-						if (ch->generated)
-							{
-								ch->recalc_heightmap ();
-								this->prov->close ();
-								this->put_chunk (x, z, ch);
-								return ch;
-							}
+						this->put_chunk (x, z, ch);
+						this->release_generation (x, z);
+						return ch;
 					}
 				
-				this->prov->close ();
+				ch = new chunk ();
 				this->put_chunk (x, z, ch);
 			}
 		
@@ -603,10 +1287,251 @@ namespace hCraft {
 		ch->generated = true;
 		ch->recalc_heightmap ();
 		this->lm.relight_chunk (ch);
+		this->lm.queue_borders (x, z);
+		ch->compact ();
+		
+		this->release_generation (x, z);
+		return ch;
+	}
+	
+	
+	/* 
+	 * Returns the chunk at the given coordinates, reading it in from disk if
+	 * it isn't in memory, or inserting an empty, ungenerated chunk if it isn't
+	 * on disk either. Used to write into the chunks around one that is being
+	 * generated, by the thread generating it.
+	 */
+	chunk*
+	world::load_neighbour (int x, int z)
+	{
+		chunk *ch = this->get_chunk (x, z);
+		if (ch)
+			return ch;
+		
+		// a chunk that has been evicted has to be read back in: an empty chunk
+		// put in its place would later be generated over and saved on top of
+		// the one on disk. (Nothing else can insert the chunk in the meantime,
+		// as the reservation held by the caller covers it.)
+		ch = this->io.fetch (x, z).get ();
+		if (!ch)
+			ch = new chunk ();
+		this->put_chunk (x, z, ch);
 		return ch;
 	}
 	
 	
+	/* 
+	 * Generating a chunk may modify the chunks around it as well (trees that
+	 * cross chunk borders, etc...), and so no two chunks that are less than
+	 * three chunks apart may be generated at the same time. These block
+	 * until the chunk at the given coordinates can be safely generated, and
+	 * mark it as done.
+	 */
+	
+	void
+	world::reserve_generation (int cx, int cz)
+	{
+		std::unique_lock<std::mutex> guard {this->gen_lock};
+		std::vector<chunk_pos>& active = this->gen_active;
+		this->gen_cv.wait (guard,
+			[&active, cx, cz] () -> bool
+				{
+					for (const chunk_pos& p : active)
+						if ((utils::iabs (p.x - cx) <= 2) && (utils::iabs (p.z - cz) <= 2))
+							return false;
+					return true;
+				});
+		
+		active.emplace_back (cx, cz);
+	}
+	
+	void
+	world::release_generation (int cx, int cz)
+	{
+		{
+			std::lock_guard<std::mutex> guard {this->gen_lock};
+			for (auto itr = this->gen_active.begin (); itr != this->gen_active.end (); ++itr)
+				if (itr->x == cx && itr->z == cz)
+					{
+						this->gen_active.erase (itr);
+						break;
+					}
+		}
+		
+		this->gen_cv.notify_all ();
+	}
+	
+	
+	
+	namespace {
+		
+		struct evict_candidate
+		{
+			unsigned long long key;
+			chunk *ch;
+			unsigned int stamp;
+			unsigned long long size;
+		};
+	}
+	
+	/* 
+	 * Writes out and frees the least recently used chunks that are neither
+	 * visible to players nor pinned by entities, physics, edit stages or
+	 * nearby generation, until the world fits its memory budget again.
+	 * 
+	 * Chunks are only ever evicted here, on the world's own thread. Any chunk
+	 * that gets looked up after being picked is left alone (get_chunk ()
+	 * stamps chunks as it finds them). Modified chunks are handed over to the
+	 * I/O thread to be written out, and all evicted chunks are retired rather
+	 * than freed right away.
+	 */
+	void
+	world::evict_chunks ()
+	{
+		const static unsigned int idle_grace = 30; // seconds
+		const static size_t max_evictions = 512;   // per pass
+		
+		unsigned int now = this->res_clock.load (std::memory_order_relaxed);
+		unsigned long long budget = this->mem_budget.load (std::memory_order_relaxed);
+		
+		std::vector<evict_candidate> cands;
+		unsigned long long used = 0;
+		{
+			std::lock_guard<std::mutex> guard {this->chunk_lock};
+			this->chunks.for_each (
+				[&cands, &used, now] (int x, int z, chunk *ch)
+					{
+						unsigned long long size = ch->resident_size ();
+						used += size;
+						
+						unsigned int stamp = ch->get_last_access ();
+						if ((stamp + idle_grace) <= now)
+							cands.push_back ({chunk_key (x, z), ch, stamp, size});
+					});
+		}
+		
+		this->mem_used.store (used, std::memory_order_relaxed);
+		if (budget == 0 || used <= budget || cands.empty ())
+			return;
+		
+		// go a bit below the budget, so that we don't end up back here on the
+		// very next pass.
+		unsigned long long target = budget - (budget >> 3);
+		
+		std::sort (cands.begin (), cands.end (),
+			[] (const evict_candidate& a, const evict_candidate& b) -> bool
+				{ return a.stamp < b.stamp; });
+		
+		std::vector<player *> pl_vc;
+		this->get_players ().populate (pl_vc);
+		std::vector<chunk_pos> watchers;
+		for (player *pl : pl_vc)
+			watchers.push_back (chunk_pos (pl->pos));
+		
+		std::vector<evict_candidate> victims;
+		unsigned long long freed = 0;
+		for (const evict_candidate& c : cands)
+			{
+				if ((used - freed) <= target || victims.size () >= max_evictions)
+					break;
+				
+				int cx, cz;
+				chunk_coords (c.key, &cx, &cz);
+				if (this->chunk_pinned (cx, cz, c.ch, watchers))
+					continue;
+				
+				victims.push_back (c);
+				freed += c.size;
+			}
+		if (victims.empty ())
+			return;
+		
+		std::lock_guard<std::mutex> guard {this->chunk_lock};
+		
+		// an autosave in progress might still write out a copy of a chunk taken
+		// before the chunk was last modified, over the one evicted here.
+		if (this->saves_running.load () > 0)
+			return;
+		
+		std::lock_guard<std::mutex> gen_guard {this->gen_lock};
+		for (const evict_candidate& v : victims)
+			{
+				int cx, cz;
+				chunk_coords (v.key, &cx, &cz);
+				
+				chunk *ch = v.ch;
+				if (this->chunks.find (cx, cz) != ch)
+					continue;
+				if (ch->get_last_access () != v.stamp)
+					continue; // someone got to it in the meantime
+				
+				// generating a chunk modifies its neighbours through their links.
+				bool generating = false;
+				for (const chunk_pos& p : this->gen_active)
+					if ((utils::iabs (p.x - cx) <= 2) && (utils::iabs (p.z - cz) <= 2))
+						{ generating = true; break; }
+				if (generating)
+					continue;
+				
+				if (ch->dirty () && !this->prov)
+					continue; // nowhere to write it to
+				
+				// lookups don't take the chunk lock, so have a last look after the
+				// chunk can no longer be found.
+				this->chunks.erase (cx, cz);
+				if (ch->get_last_access () != v.stamp)
+					{
+						this->chunks.insert (cx, cz, ch);
+						continue;
+					}
+				
+				// unlink
+				if (ch->north && ch->north->south == ch) ch->north->south = nullptr;
+				if (ch->south && ch->south->north == ch) ch->south->north = nullptr;
+				if (ch->west && ch->west->east == ch) ch->west->east = nullptr;
+				if (ch->east && ch->east->west == ch) ch->east->west = nullptr;
+				used -= v.size;
+				
+				// queued while the chunk lock is still held, so that anyone who finds
+				// the chunk missing from now on reads it back after it's written.
+				if (ch->dirty ())
+					this->io.save (cx, cz, ch);
+				else
+					this->retire_chunk (ch);
+			}
+		
+		this->mem_used.store (used, std::memory_order_relaxed);
+	}
+	
+	bool
+	world::chunk_pinned (int cx, int cz, chunk *ch,
+		const std::vector<chunk_pos>& watchers)
+	{
+		// visible to a player, with some room for the trees and such that
+		// generating the chunks at the edge of their view spills over.
+		const static int keep_radius = player::chunk_radius () + 3;
+		for (const chunk_pos& p : watchers)
+			if ((utils::iabs (p.x - cx) <= keep_radius) &&
+				(utils::iabs (p.z - cz) <= keep_radius))
+				return true;
+		
+		if (ch->has_entities ())
+			return true;
+		
+		if (this->physics.has_blocks_in_chunk (this, cx, cz) ||
+			this->srv.global_physics.has_blocks_in_chunk (this, cx, cz))
+			return true;
+		
+		{
+			std::lock_guard<std::mutex> guard {this->estage_lock};
+			if (this->estage.has_changes_in (cx, cz))
+				return true;
+		}
+		
+		return false;
+	}
+	
+	
 	/* 
 	 * Checks whether a block exists at the given coordinates.
 	 */
@@ -755,35 +1680,7 @@ namespace hCraft {
 	void
 	world::set_id (int x, int y, int z, unsigned short id)
 	{
-		chunk *ch = nullptr;
-		if (this->last_chunk.ch)
-			{
-				int dx = this->last_chunk.x - (x >> 4);
-				int dz = this->last_chunk.z - (z >> 4);
-				if (dx == 0)
-					{
-						switch (dz)
-							{
-								case  0: ch = this->last_chunk.ch; break;
-								case  1: ch = ch->south; break;
-								case -1: ch = ch->north; break;
-							}
-					}
-				else if (dz == 0)
-					{
-						switch (dx)
-							{
-								case  0: ch = this->last_chunk.ch; break;
-								case  1: ch = ch->east; break;
-								case -1: ch = ch->west; break;
-							}
-					}
-				
-				if (!ch)
-					ch = this->load_chunk (x >> 4, z >> 4);
-			}
-		else
-			ch = this->load_chunk (x >> 4, z >> 4);
+		chunk *ch = this->load_chunk (x >> 4, z >> 4);
 		ch->set_id (x & 0xF, y, z & 0xF, id);
 	}
 	
@@ -928,6 +1825,16 @@ namespace hCraft {
 		this->estage.set (x, y, z, id, meta);
 	}
 	
+	/* 
+	 * Relights the specified chunks as a whole, in parallel on the server's
+	 * thread pool. The lighting manager's lock must be held by the caller.
+	 */
+	void
+	world::relight_chunks_nolock (const std::vector<chunk_pos>& chunks)
+	{
+		this->lm.relight_chunks_nolock (this->srv.get_thread_pool (), chunks);
+	}
+	
 	void
 	world::queue_physics (int x, int y, int z, int extra, void *ptr,
 		int tick_delay, physics_params *params, physics_block_callback cb)
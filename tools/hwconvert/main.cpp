@@ -0,0 +1,207 @@
+/* 
+ * hCraft - A custom Minecraft server.
+ * Copyright (C) 2012	Jacob Zhitomirsky
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/* 
+ * HWv1 to HWv2 world converter.
+ * 
+ * Copies every chunk of an HWv1 world (.hw) into a new HWv2 world (.hw2)
+ * without decompressing it, checks that each one reads back intact, and then
+ * compacts the result. The HWv1 file is kept around as <name>.hw.old.
+ * 
+ * With -c, an existing HWv2 world is compacted instead: its free space is
+ * dropped and its chunks are laid out region by region.
+ * 
+ * The world must not be loaded by a running server.
+ */
+
+#include "providers/hwprovider.hpp"
+#include "providers/hw2provider.hpp"
+#include <iostream>
+#include <string>
+#include <vector>
+#include <utility>
+#include <stdexcept>
+#include <cstdio>
+#include <unistd.h>
+#include <sys/stat.h>
+
+using namespace hCraft;
+
+
+namespace {
+	
+	void
+	_usage (const char *prog)
+	{
+		std::cerr << "usage: " << prog << " [-c] <world directory> <world name>\n"
+			"  -c   compact an HWv2 world instead of converting an HWv1 one\n";
+	}
+	
+	bool
+	_exists (const std::string& path)
+	{
+		struct stat st;
+		return (stat (path.c_str (), &st) == 0);
+	}
+	
+	std::string
+	_path (const char *dir, const std::string& file)
+	{
+		std::string out (dir);
+		if (out.empty () || out[out.size () - 1] != '/')
+			out.push_back ('/');
+		out.append (file);
+		return out;
+	}
+	
+	
+	
+	int
+	_compact (const char *dir, const char *name)
+	{
+		std::string path = _path (dir, hw2_provider_naming ().make_name (name));
+		if (!_exists (path))
+			{
+				std::cerr << "error: " << path << " does not exist" << std::endl;
+				return 1;
+			}
+		
+		hw2_provider prov (dir, name);
+		unsigned long long before = prov.file_size ();
+		unsigned long long wasted = prov.free_space ();
+		prov.compact ();
+		
+		std::cout << path << ": " << prov.info ().chunk_count << " chunks, "
+			<< (before / 1024) << " KB -> " << (prov.file_size () / 1024) << " KB ("
+			<< (wasted / 1024) << " KB were free)" << std::endl;
+		return 0;
+	}
+	
+	int
+	_convert (const char *dir, const char *name)
+	{
+		std::string src_path = _path (dir, hw_provider_naming ().make_name (name));
+		std::string dest_path = _path (dir, hw2_provider_naming ().make_name (name));
+		if (!_exists (src_path))
+			{
+				std::cerr << "error: " << src_path << " does not exist" << std::endl;
+				return 1;
+			}
+		if (_exists (dest_path))
+			{
+				std::cerr << "error: " << dest_path << " already exists" << std::endl;
+				return 1;
+			}
+		
+		hw_provider src (dir, name);
+		if (!src.claims (src_path.c_str ()))
+			{
+				std::cerr << "error: " << src_path << " is not an HWv1 world" << std::endl;
+				return 1;
+			}
+		
+		std::vector<std::pair<int, int>> chunks;
+		src.list_chunks (chunks);
+		
+		hw2_provider dest (dir, name);
+		dest.save_empty (src.info ());
+		if (!dest.open_file ())
+			throw std::runtime_error ("failed to open " + dest_path);
+		
+		// chunk data is stored the same way in both formats, so it's copied as is.
+		std::vector<unsigned char> data, check;
+		int copied = 0;
+		for (auto& c : chunks)
+			{
+				if (!src.load_raw (c.first, c.second, data))
+					{
+						std::cerr << "warning: skipping unreadable chunk at ("
+							<< c.first << ", " << c.second << ")" << std::endl;
+						continue;
+					}
+				
+				dest.save_raw (data.data (), data.size (), c.first, c.second);
+				++ copied;
+			}
+		dest.close ();
+		
+		// make sure that everything reads back the same.
+		for (auto& c : chunks)
+			{
+				if (!src.load_raw (c.first, c.second, data))
+					continue;
+				if (!dest.load_raw (c.first, c.second, check) || check != data)
+					{
+						std::remove (dest_path.c_str ());
+						throw std::runtime_error ("verification failed for the chunk at ("
+							+ std::to_string (c.first) + ", " + std::to_string (c.second)
+							+ ")");
+					}
+			}
+		
+		dest.compact ();
+		
+		std::string old_path = src_path + ".old";
+		if (std::rename (src_path.c_str (), old_path.c_str ()) != 0)
+			std::cerr << "warning: failed to rename " << src_path << std::endl;
+		
+		struct stat st;
+		unsigned long long src_size = (stat (old_path.c_str (), &st) == 0) ? st.st_size : 0;
+		std::cout << src_path << " -> " << dest_path << ": " << copied << " chunks, "
+			<< (src_size / 1024) << " KB -> " << (dest.file_size () / 1024) << " KB"
+			<< std::endl;
+		return 0;
+	}
+}
+
+
+int
+main (int argc, char *argv[])
+{
+	bool compact = false;
+	
+	int opt;
+	while ((opt = getopt (argc, argv, "c")) != -1)
+		{
+			switch (opt)
+				{
+					case 'c': compact = true; break;
+					default:
+						_usage (argv[0]);
+						return 1;
+				}
+		}
+	if ((argc - optind) != 2)
+		{
+			_usage (argv[0]);
+			return 1;
+		}
+	
+	try
+		{
+			if (compact)
+				return _compact (argv[optind], argv[optind + 1]);
+			return _convert (argv[optind], argv[optind + 1]);
+		}
+	catch (const std::exception& ex)
+		{
+			std::cerr << "error: " << ex.what () << std::endl;
+			return 1;
+		}
+}
@@ -0,0 +1,744 @@
+/* 
+ * hCraft - A custom Minecraft server.
+ * Copyright (C) 2012	Jacob Zhitomirsky
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "bot.hpp"
+#include "frames.hpp"
+#include "packet.hpp"
+#include <event2/buffer.h>
+#include <cmath>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+
+
+namespace hCraft {
+	namespace swarm {
+		
+		static inline unsigned long long
+		_chunk_key (int cx, int cz)
+		{
+			return ((unsigned long long)(unsigned int)cx << 32) | (unsigned int)cz;
+		}
+		
+		static inline unsigned long long
+		_block_key (int x, int y, int z)
+		{
+			return ((unsigned long long)((unsigned int)x & 0x3FFFFFF) << 34)
+				| ((unsigned long long)((unsigned int)z & 0x3FFFFFF) << 8)
+				| (unsigned long long)(y & 0xFF);
+		}
+		
+		static inline double
+		_ms_since (swarm_clock::time_point then)
+		{
+			return std::chrono::duration<double, std::milli> (
+				swarm_clock::now () - then).count ();
+		}
+		
+		
+		
+		swarm_stats::swarm_stats ()
+		{
+			this->bytes_in = this->bytes_out = 0;
+			this->packets_in = this->packets_out = 0;
+			this->chunks = this->chats = 0;
+			this->logged_in = this->failed = this->kicked = 0;
+		}
+		
+		void
+		swarm_stats::merge (const swarm_stats& other)
+		{
+			this->chunk_latency.insert (this->chunk_latency.end (),
+				other.chunk_latency.begin (), other.chunk_latency.end ());
+			this->block_latency.insert (this->block_latency.end (),
+				other.block_latency.begin (), other.block_latency.end ());
+			
+			this->bytes_in += other.bytes_in;
+			this->bytes_out += other.bytes_out;
+			this->packets_in += other.packets_in;
+			this->packets_out += other.packets_out;
+			this->chunks += other.chunks;
+			this->chats += other.chats;
+			this->logged_in += other.logged_in;
+			this->failed += other.failed;
+			this->kicked += other.kicked;
+		}
+		
+		
+		
+	//----
+		
+		change_tracker::change_tracker ()
+		{
+			this->lost = 0;
+		}
+		
+		
+		
+		/* 
+		 * Records that a change to the specified block has been requested.
+		 */
+		void
+		change_tracker::expect (int x, int y, int z)
+		{
+			std::lock_guard<std::mutex> guard {this->lock};
+			this->pending[_block_key (x, y, z)] = swarm_clock::now ();
+		}
+		
+		/* 
+		 * Checks whether a change to the specified block was expected, and if
+		 * so, stores the time it took in @ms.
+		 */
+		bool
+		change_tracker::seen (int x, int y, int z, double& ms)
+		{
+			std::lock_guard<std::mutex> guard {this->lock};
+			auto itr = this->pending.find (_block_key (x, y, z));
+			if (itr == this->pending.end ())
+				return false;
+			
+			ms = _ms_since (itr->second);
+			this->pending.erase (itr);
+			return true;
+		}
+		
+		/* 
+		 * Forgets about changes that have not been seen for too long, and
+		 * returns the total amount of such changes.
+		 */
+		int
+		change_tracker::expire (std::chrono::milliseconds max_age)
+		{
+			std::lock_guard<std::mutex> guard {this->lock};
+			auto now = swarm_clock::now ();
+			for (auto itr = this->pending.begin (); itr != this->pending.end ();)
+				{
+					if ((now - itr->second) > max_age)
+						{
+							itr = this->pending.erase (itr);
+							++ this->lost;
+						}
+					else
+						++ itr;
+				}
+			
+			return this->lost;
+		}
+		
+		
+		
+	//----
+		
+		bot::bot (bot_group& grp, int id, const std::string& name)
+			: grp (grp), name (name), rnd (id + 1)
+		{
+			this->id = id;
+			this->bev = nullptr;
+			this->state = BS_IDLE;
+			
+			this->spawned = false;
+			this->x = this->y = this->z = 0.0;
+			this->yaw = 0.0f;
+			this->spawn_x = this->spawn_z = 0.0;
+			this->target_x = this->target_z = 0.0;
+			this->ccx = this->ccz = 0;
+			
+			this->placed = false;
+			this->px = this->py = this->pz = 0;
+			this->chat_counter = 0;
+		}
+		
+		bot::~bot ()
+		{
+			if (this->bev)
+				bufferevent_free (this->bev);
+		}
+		
+		
+		
+		/* 
+		 * Starts connecting to the server.
+		 */
+		void
+		bot::connect ()
+		{
+			this->bev = bufferevent_socket_new (this->grp.evbase, -1,
+				BEV_OPT_CLOSE_ON_FREE);
+			if (!this->bev)
+				{ this->fail (BS_DEAD); return; }
+			
+			bufferevent_setcb (this->bev, &bot::handle_read, nullptr,
+				&bot::handle_event, this);
+			bufferevent_enable (this->bev, EV_READ | EV_WRITE);
+			
+			this->state = BS_CONNECTING;
+			if (bufferevent_socket_connect_hostname (this->bev, nullptr, AF_INET,
+				this->grp.cfg.host.c_str (), this->grp.cfg.port) != 0)
+				this->fail (BS_DEAD);
+		}
+		
+		void
+		bot::fail (bot_state new_state)
+		{
+			if (this->state == BS_PLAYING)
+				-- this->grp.playing;
+			if (this->state != BS_DEAD && this->state != BS_PLAYING)
+				++ this->grp.stats.failed;
+			
+			this->state = new_state;
+			if (this->bev)
+				{
+					bufferevent_free (this->bev);
+					this->bev = nullptr;
+				}
+		}
+		
+		/* 
+		 * Closes the connection, if open.
+		 */
+		void
+		bot::disconnect ()
+		{
+			if (this->state == BS_PLAYING)
+				-- this->grp.playing;
+			if (this->state != BS_IDLE)
+				this->state = BS_DEAD;
+			
+			if (this->bev)
+				{
+					bufferevent_free (this->bev);
+					this->bev = nullptr;
+				}
+		}
+		
+		void
+		bot::send (packet *pack)
+		{
+			if (this->bev)
+				{
+					bufferevent_write (this->bev, pack->data, pack->size);
+					this->grp.stats.bytes_out += pack->size;
+					++ this->grp.stats.packets_out;
+				}
+			delete pack;
+		}
+		
+		
+		
+		void
+		bot::handle_event (struct bufferevent *bev, short events, void *ctx)
+		{
+			bot *b = static_cast<bot *> (ctx);
+			
+			if (events & BEV_EVENT_CONNECTED)
+				{
+					// handshake
+					std::string host = b->grp.cfg.host;
+					packet *pack = new packet (12 + (b->name.size () + host.size ()) * 2);
+					pack->put_byte (0x02);
+					pack->put_byte (packet::protocol_version);
+					pack->put_string (b->name.c_str ());
+					pack->put_string (host.c_str ());
+					pack->put_int (b->grp.cfg.port);
+					
+					b->state = BS_LOGGING_IN;
+					b->send (pack);
+				}
+			else if (events & (BEV_EVENT_ERROR | BEV_EVENT_EOF))
+				b->fail (BS_DEAD);
+		}
+		
+		void
+		bot::handle_read (struct bufferevent *bev, void *ctx)
+		{
+			bot *b = static_cast<bot *> (ctx);
+			struct evbuffer *buf = bufferevent_get_input (bev);
+			
+			size_t buf_size;
+			while (b->bev && (buf_size = evbuffer_get_length (buf)) > 0)
+				{
+					struct evbuffer_iovec vec;
+					if (evbuffer_peek (buf, -1, nullptr, &vec, 1) < 1)
+						break;
+					const unsigned char *data = (const unsigned char *)vec.iov_base;
+					size_t have = vec.iov_len;
+					
+					int len = s2c_frame_length (data, have);
+					while (len > (int)have && len <= (int)buf_size)
+						{
+							data = evbuffer_pullup (buf, len);
+							have = len;
+							len = s2c_frame_length (data, have);
+						}
+					
+					if (len == -1)
+						{
+							std::cerr << b->name << ": unknown packet (opcode: 0x"
+								<< std::hex << (int)data[0] << std::dec << ")" << std::endl;
+							b->fail (BS_DEAD);
+							return;
+						}
+					else if (len > (int)buf_size)
+						break;
+					
+					if (len > (int)have)
+						data = evbuffer_pullup (buf, len);
+					
+					b->grp.stats.bytes_in += len;
+					++ b->grp.stats.packets_in;
+					b->handle (data, len);
+					if (b->bev)
+						evbuffer_drain (buf, len);
+				}
+		}
+		
+		
+		
+		/* 
+		 * Handles a single packet sent by the server.
+		 */
+		void
+		bot::handle (const unsigned char *data, unsigned int len)
+		{
+			packet_reader reader {data};
+			int op = reader.read_byte ();
+			
+			switch (op)
+				{
+					// keep alive
+					case 0x00:
+						{
+							int id = reader.read_int ();
+							packet *pack = new packet (5);
+							pack->put_byte (0x00);
+							pack->put_int (id);
+							this->send (pack);
+						}
+						break;
+					
+					// login
+					case 0x01:
+						{
+							this->state = BS_PLAYING;
+							++ this->grp.playing;
+							++ this->grp.stats.logged_in;
+							
+							// hold the stone block given to new players
+							packet *pack = new packet (3);
+							pack->put_byte (0x10);
+							pack->put_short (1);
+							this->send (pack);
+							
+							auto now = swarm_clock::now ();
+							this->next_chat = now + std::chrono::seconds (
+								1 + this->rnd () % this->grp.cfg.chat_interval);
+							this->next_build = now + std::chrono::seconds (
+								1 + this->rnd () % this->grp.cfg.build_interval);
+						}
+						break;
+					
+					// chat
+					case 0x03:
+						++ this->grp.stats.chats;
+						break;
+					
+					// player position and look
+					case 0x0D:
+						{
+							this->x = reader.read_double ();
+							reader.read_double (); // stance
+							this->y = reader.read_double ();
+							this->z = reader.read_double ();
+							this->yaw = reader.read_float ();
+							float pitch = reader.read_float ();
+							
+							// confirm
+							packet *pack = new packet (42);
+							pack->put_byte (0x0D);
+							pack->put_double (this->x);
+							pack->put_double (this->y);
+							pack->put_double (this->y + 1.62);
+							pack->put_double (this->z);
+							pack->put_float (this->yaw);
+							pack->put_float (pitch);
+							pack->put_bool (true);
+							this->send (pack);
+							
+							if (!this->spawned)
+								{
+									this->spawned = true;
+									this->spawn_x = this->target_x = this->x;
+									this->spawn_z = this->target_z = this->z;
+								}
+							
+							this->enter_chunk ((int)std::floor (this->x) >> 4,
+								(int)std::floor (this->z) >> 4);
+						}
+						break;
+					
+					// chunk data
+					case 0x33:
+						{
+							int cx = reader.read_int ();
+							int cz = reader.read_int ();
+							bool ground_up = reader.read_byte ();
+							unsigned short primary = reader.read_short ();
+							this->chunk_arrived (cx, cz, ground_up && (primary == 0));
+						}
+						break;
+					
+					// multi block change
+					case 0x34:
+						{
+							int cx = reader.read_int ();
+							int cz = reader.read_int ();
+							int count = reader.read_short ();
+							reader.read_int (); // data size
+							for (int i = 0; i < count; ++i)
+								{
+									int xz = reader.read_byte ();
+									int by = reader.read_byte ();
+									reader.read_short (); // id and meta
+									
+									double ms;
+									if (this->grp.changes.seen ((cx << 4) | (xz >> 4), by,
+										(cz << 4) | (xz & 0xF), ms))
+										this->grp.stats.block_latency.push_back (ms);
+								}
+						}
+						break;
+					
+					// block change
+					case 0x35:
+						{
+							int bx = reader.read_int ();
+							int by = reader.read_byte ();
+							int bz = reader.read_int ();
+							
+							double ms;
+							if (this->grp.changes.seen (bx, by, bz, ms))
+								this->grp.stats.block_latency.push_back (ms);
+						}
+						break;
+					
+					// map chunk bulk
+					case 0x38:
+						{
+							int count = reader.read_short ();
+							int data_len = reader.read_int ();
+							reader.seek (8 + data_len);
+							for (int i = 0; i < count; ++i)
+								{
+									int cx = reader.read_int ();
+									int cz = reader.read_int ();
+									reader.read_short (); // primary bitmap
+									reader.read_short (); // add bitmap
+									this->chunk_arrived (cx, cz, false);
+								}
+						}
+						break;
+					
+					// kick
+					case 0xFF:
+						{
+							char reason[256];
+							reader.read_string (reason, 80);
+							std::cerr << this->name << ": kicked: " << reason << std::endl;
+							++ this->grp.stats.kicked;
+							this->fail (BS_DEAD);
+						}
+						break;
+				}
+		}
+		
+		
+		
+		void
+		bot::chunk_arrived (int cx, int cz, bool unload)
+		{
+			unsigned long long key = _chunk_key (cx, cz);
+			if (unload)
+				{
+					this->loaded.erase (key);
+					return;
+				}
+			
+			++ this->grp.stats.chunks;
+			this->loaded.insert (key);
+			
+			auto itr = this->wanted.find (key);
+			if (itr != this->wanted.end ())
+				{
+					this->grp.stats.chunk_latency.push_back (_ms_since (itr->second));
+					this->wanted.erase (itr);
+				}
+		}
+		
+		/* 
+		 * Called when the bot moves into a new chunk, to start waiting for the
+		 * chunks that come into view.
+		 */
+		void
+		bot::enter_chunk (int cx, int cz)
+		{
+			if (cx == this->ccx && cz == this->ccz && !this->wanted.empty ())
+				return;
+			this->ccx = cx;
+			this->ccz = cz;
+			
+			int r = this->grp.cfg.view_radius;
+			auto now = swarm_clock::now ();
+			for (int i = -r; i <= r; ++i)
+				for (int j = -r; j <= r; ++j)
+					{
+						unsigned long long key = _chunk_key (cx + i, cz + j);
+						if (this->loaded.find (key) == this->loaded.end ()
+							&& this->wanted.find (key) == this->wanted.end ())
+							this->wanted[key] = now;
+					}
+			
+			// chunks that went out of view before arriving are not expected anymore.
+			for (auto itr = this->wanted.begin (); itr != this->wanted.end ();)
+				{
+					int wcx = (int)(itr->first >> 32);
+					int wcz = (int)(itr->first & 0xFFFFFFFF);
+					if (std::abs (wcx - cx) > r || std::abs (wcz - cz) > r)
+						itr = this->wanted.erase (itr);
+					else
+						++ itr;
+				}
+		}
+		
+		
+		
+		/* 
+		 * Called by the bot's group twenty times a second.
+		 */
+		void
+		bot::tick ()
+		{
+			if (this->state != BS_PLAYING || !this->spawned)
+				return;
+			
+			this->walk ();
+			
+			auto now = swarm_clock::now ();
+			if (now >= this->next_build)
+				{
+					this->build ();
+					this->next_build = now + std::chrono::milliseconds (
+						(this->grp.cfg.build_interval * 1000) / (this->placed ? 5 : 1));
+				}
+			if (now >= this->next_chat)
+				{
+					this->chat ();
+					this->next_chat = now + std::chrono::seconds (this->grp.cfg.chat_interval);
+				}
+		}
+		
+		void
+		bot::walk ()
+		{
+			static const double speed = 4.3 / 20.0; // blocks per tick
+			
+			double dx = this->target_x - this->x;
+			double dz = this->target_z - this->z;
+			double dist = std::sqrt (dx * dx + dz * dz);
+			if (dist < speed)
+				{
+					// pick a new destination
+					int w = this->grp.cfg.wander;
+					this->target_x = this->spawn_x + (int)(this->rnd () % (2 * w + 1)) - w;
+					this->target_z = this->spawn_z + (int)(this->rnd () % (2 * w + 1)) - w;
+					return;
+				}
+			
+			this->x += dx / dist * speed;
+			this->z += dz / dist * speed;
+			
+			packet *pack = new packet (34);
+			pack->put_byte (0x0B);
+			pack->put_double (this->x);
+			pack->put_double (this->y);
+			pack->put_double (this->y + 1.62);
+			pack->put_double (this->z);
+			pack->put_bool (true);
+			this->send (pack);
+			
+			this->enter_chunk ((int)std::floor (this->x) >> 4,
+				(int)std::floor (this->z) >> 4);
+		}
+		
+		/* 
+		 * Places a block next to the bot, or breaks the one placed last time.
+		 */
+		void
+		bot::build ()
+		{
+			if (this->placed)
+				{
+					this->grp.changes.expect (this->px, this->py, this->pz);
+					for (int status = 0; status <= 2; status += 2)
+						{
+							packet *pack = new packet (12);
+							pack->put_byte (0x0E);
+							pack->put_byte (status);
+							pack->put_int (this->px);
+							pack->put_byte (this->py);
+							pack->put_int (this->pz);
+							pack->put_byte (1);
+							this->send (pack);
+						}
+					
+					this->placed = false;
+					return;
+				}
+			
+			this->px = (int)std::floor (this->x) + 2;
+			this->py = (int)std::floor (this->y);
+			this->pz = (int)std::floor (this->z);
+			if (this->py < 1 || this->py > 255)
+				return;
+			
+			// click on top of the block below
+			this->grp.changes.expect (this->px, this->py, this->pz);
+			packet *pack = new packet (16);
+			pack->put_byte (0x0F);
+			pack->put_int (this->px);
+			pack->put_byte (this->py - 1);
+			pack->put_int (this->pz);
+			pack->put_byte (1);
+			pack->put_short (-1); // held item, the server knows
+			pack->put_byte (8);
+			pack->put_byte (16);
+			pack->put_byte (8);
+			this->send (pack);
+			
+			this->placed = true;
+		}
+		
+		void
+		bot::chat ()
+		{
+			std::ostringstream ss;
+			ss << "hello from " << this->name << " #" << (++ this->chat_counter);
+			std::string msg = ss.str ();
+			
+			packet *pack = new packet (3 + msg.size () * 2);
+			pack->put_byte (0x03);
+			pack->put_string (msg.c_str ());
+			this->send (pack);
+		}
+		
+		
+		
+	//----
+		
+		bot_group::bot_group (const swarm_config& cfg, change_tracker& changes,
+			int first_id, int count)
+			: cfg (cfg), changes (changes)
+		{
+			this->evbase = event_base_new ();
+			this->tick_ev = event_new (this->evbase, -1, EV_PERSIST,
+				&bot_group::handle_tick, this);
+			this->stopping = false;
+			this->playing = 0;
+			this->next_connect = 0;
+			this->connect_credit = 0.0;
+			
+			for (int i = 0; i < count; ++i)
+				{
+					std::ostringstream ss;
+					ss << cfg.name_prefix << (first_id + i);
+					this->bots.emplace_back (new bot (*this, first_id + i, ss.str ()));
+				}
+		}
+		
+		bot_group::~bot_group ()
+		{
+			this->stop ();
+			this->bots.clear ();
+			event_free (this->tick_ev);
+			event_base_free (this->evbase);
+		}
+		
+		
+		
+		/* 
+		 * Starts the group's thread, which connects the bots at the configured
+		 * rate and runs them.
+		 */
+		void
+		bot_group::start ()
+		{
+			struct timeval tv;
+			tv.tv_sec = 0;
+			tv.tv_usec = 50000;
+			event_add (this->tick_ev, &tv);
+			
+			this->th = std::thread ([this] {
+				event_base_dispatch (this->evbase);
+			});
+		}
+		
+		/* 
+		 * Disconnects all bots and waits for the thread to finish.
+		 */
+		void
+		bot_group::stop ()
+		{
+			if (!this->th.joinable ())
+				return;
+			
+			this->stopping = true;
+			this->th.join ();
+			
+			for (auto& b : this->bots)
+				b->disconnect ();
+		}
+		
+		
+		
+		void
+		bot_group::handle_tick (evutil_socket_t fd, short events, void *ctx)
+		{
+			bot_group *grp = static_cast<bot_group *> (ctx);
+			if (grp->stopping)
+				{
+					event_base_loopbreak (grp->evbase);
+					return;
+				}
+			
+			// connect new bots, spreading the group's share of the connection rate
+			// over ticks.
+			grp->connect_credit += (double)grp->cfg.connect_rate / grp->cfg.threads / 20.0;
+			while (grp->connect_credit >= 1.0 && grp->next_connect < grp->bots.size ())
+				{
+					grp->bots[grp->next_connect ++]->connect ();
+					grp->connect_credit -= 1.0;
+				}
+			if (grp->next_connect >= grp->bots.size ())
+				grp->connect_credit = 0.0;
+			
+			for (auto& b : grp->bots)
+				b->tick ();
+		}
+	}
+}
+
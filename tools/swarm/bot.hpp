@@ -0,0 +1,262 @@
+/* 
+ * hCraft - A custom Minecraft server.
+ * Copyright (C) 2012	Jacob Zhitomirsky
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef _hCraft__SWARM__BOT_H_
+#define _hCraft__SWARM__BOT_H_
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <random>
+#include <unordered_map>
+#include <unordered_set>
+#include <event2/event.h>
+#include <event2/bufferevent.h>
+
+
+namespace hCraft {
+	
+	struct packet;
+	
+	namespace swarm {
+		
+		typedef std::chrono::steady_clock swarm_clock;
+		
+		
+		struct swarm_config
+		{
+			std::string host;
+			int port;
+			int bots;
+			int duration;        // seconds
+			int threads;
+			int connect_rate;    // new connections per second
+			int view_radius;     // in chunks, must match the server's
+			int wander;          // how far bots walk away from their spawn
+			int chat_interval;   // seconds
+			int build_interval;  // seconds
+			std::string name_prefix;
+			int server_pid;
+		};
+		
+		
+		/* 
+		 * Latency samples and counters collected by a group of bots.
+		 */
+		struct swarm_stats
+		{
+			std::vector<double> chunk_latency; // milliseconds
+			std::vector<double> block_latency; // milliseconds
+			
+			unsigned long long bytes_in, bytes_out;
+			unsigned long long packets_in, packets_out;
+			unsigned long long chunks;
+			unsigned long long chats;
+			
+			int logged_in;
+			int failed;
+			int kicked;
+			
+		public:
+			swarm_stats ();
+			
+			void merge (const swarm_stats& other);
+		};
+		
+		
+		/* 
+		 * Keeps track of block changes made by bots until they are seen by any
+		 * bot, to measure how long changes take to reach players.
+		 */
+		class change_tracker
+		{
+			std::mutex lock;
+			std::unordered_map<unsigned long long, swarm_clock::time_point> pending;
+			int lost;
+			
+		public:
+			change_tracker ();
+			
+			/* 
+			 * Records that a change to the specified block has been requested.
+			 */
+			void expect (int x, int y, int z);
+			
+			/* 
+			 * Checks whether a change to the specified block was expected, and if
+			 * so, stores the time it took in @ms.
+			 */
+			bool seen (int x, int y, int z, double& ms);
+			
+			/* 
+			 * Forgets about changes that have not been seen for too long, and
+			 * returns the total amount of such changes.
+			 */
+			int expire (std::chrono::milliseconds max_age);
+		};
+		
+		
+		
+		enum bot_state
+		{
+			BS_IDLE,
+			BS_CONNECTING,
+			BS_LOGGING_IN,
+			BS_PLAYING,
+			BS_DEAD,
+		};
+		
+		class bot_group;
+		
+		/* 
+		 * A headless client that connects to the server in offline mode, and
+		 * then walks around, builds, and chats.
+		 */
+		class bot
+		{
+			bot_group& grp;
+			int id;
+			std::string name;
+			struct bufferevent *bev;
+			bot_state state;
+			std::minstd_rand rnd;
+			
+			bool spawned;
+			double x, y, z;
+			float yaw;
+			double spawn_x, spawn_z;
+			double target_x, target_z;
+			int ccx, ccz; // current chunk
+			
+			// chunks within view distance that have not arrived yet, and when
+			// they came into view.
+			std::unordered_map<unsigned long long, swarm_clock::time_point> wanted;
+			std::unordered_set<unsigned long long> loaded;
+			
+			swarm_clock::time_point next_chat;
+			swarm_clock::time_point next_build;
+			bool placed;
+			int px, py, pz; // last placed block
+			int chat_counter;
+			
+		private:
+			static void handle_read (struct bufferevent *bev, void *ctx);
+			static void handle_event (struct bufferevent *bev, short events, void *ctx);
+			
+			/* 
+			 * Handles a single packet sent by the server.
+			 */
+			void handle (const unsigned char *data, unsigned int len);
+			
+			void chunk_arrived (int cx, int cz, bool unload);
+			void enter_chunk (int cx, int cz);
+			
+			void send (packet *pack);
+			void fail (bot_state new_state);
+			
+			void walk ();
+			void build ();
+			void chat ();
+			
+		public:
+			bot (bot_group& grp, int id, const std::string& name);
+			bot (const bot&) = delete;
+			~bot ();
+			
+			inline bot_state get_state () { return this->state; }
+			
+			
+			
+			/* 
+			 * Starts connecting to the server.
+			 */
+			void connect ();
+			
+			/* 
+			 * Closes the connection, if open.
+			 */
+			void disconnect ();
+			
+			/* 
+			 * Called by the bot's group twenty times a second.
+			 */
+			void tick ();
+		};
+		
+		
+		
+		/* 
+		 * A set of bots that share a thread and an event base.
+		 */
+		class bot_group
+		{
+			friend class bot;
+			
+			const swarm_config& cfg;
+			change_tracker& changes;
+			struct event_base *evbase;
+			struct event *tick_ev;
+			std::thread th;
+			std::atomic_bool stopping;
+			
+			std::vector<std::unique_ptr<bot> > bots;
+			size_t next_connect;
+			double connect_credit;
+			swarm_stats stats;
+			
+		public:
+			std::atomic_int playing;
+			
+		private:
+			static void handle_tick (evutil_socket_t fd, short events, void *ctx);
+			
+		public:
+			bot_group (const swarm_config& cfg, change_tracker& changes,
+				int first_id, int count);
+			bot_group (const bot_group&) = delete;
+			~bot_group ();
+			
+			
+			
+			/* 
+			 * Starts the group's thread, which connects the bots at the configured
+			 * rate and runs them.
+			 */
+			void start ();
+			
+			/* 
+			 * Disconnects all bots and waits for the thread to finish.
+			 */
+			void stop ();
+			
+			/* 
+			 * Returns the collected statistics. Must only be called once the group
+			 * has been stopped.
+			 */
+			inline const swarm_stats& get_stats () { return this->stats; }
+		};
+	}
+}
+
+#endif
+
@@ -0,0 +1,353 @@
+/* 
+ * hCraft - A custom Minecraft server.
+ * Copyright (C) 2012	Jacob Zhitomirsky
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "frames.hpp"
+
+
+namespace hCraft {
+	namespace swarm {
+		
+		/* 
+		 * Layout of packets sent by the server, indexed by opcode. Uses the same
+		 * letters as the server's table of client packets, with the addition of:
+		 * 
+		 * A = array (prefixed with 32-bit integer describing length)
+		 * m = entity metadata
+		 * 
+		 * Packets whose layout can't be described this way are marked with '*'.
+		 */
+		static const char* _s2c_table[] =
+			{
+				"i"          , "izbbbbb"    , ""           , "z"          , // 0x03
+				"ll"         , "isq"        , "iii"        , ""           , // 0x07
+				"fsf"        , "ibbsz"      , ""           , ""           , // 0x0B
+				""           , "ddddff?"    , ""           , ""           , // 0x0F
+				
+				"s"          , "ibibi"      , "ib"         , ""           , // 0x13
+				"iziiibbsm"  , ""           , "ii"         , "*"          , // 0x17
+				"ibiiibbbsssm", "iziiii"    , "iiiis"      , ""           , // 0x1B
+				"isss"       , "*"          , "i"          , "ibbb"       , // 0x1F
+				
+				"ibb"        , "ibbbbb"     , "iiiibb"     , "ib"         , // 0x23
+				""           , ""           , "ib"         , "ii?"        , // 0x27
+				"im"         , "ibbs"       , "ib"         , "fss"        , // 0x2B
+				"*"          , ""           , ""           , ""           , // 0x2F
+				
+				""           , ""           , ""           , "ii?ssA"     , // 0x33
+				"iisA"       , "ibisb"      , "isibbs"     , "iiiib"      , // 0x37
+				"*"          , ""           , ""           , ""           , // 0x3B
+				"*"          , "iibii?"     , "ziiifb"     , "zfffffffi"  , // 0x3F
+				
+				""           , ""           , ""           , ""           , // 0x43
+				""           , ""           , "bb"         , "ibiii"      , // 0x47
+				""           , ""           , ""           , ""           , // 0x4B
+				""           , ""           , ""           , ""           , // 0x4F
+				
+				""           , ""           , ""           , ""           , // 0x53
+				""           , ""           , ""           , ""           , // 0x57
+				""           , ""           , ""           , ""           , // 0x5B
+				""           , ""           , ""           , ""           , // 0x5F
+				
+				""           , ""           , ""           , ""           , // 0x63
+				"*"          , "b"          , ""           , "bsq"        , // 0x67
+				"*"          , "bss"        , "bs?"        , "sq"         , // 0x6B
+				""           , ""           , ""           , ""           , // 0x6F
+			};
+		
+		static const int _s2c_table_size = sizeof _s2c_table / sizeof _s2c_table[0];
+		
+		
+		
+		namespace {
+			
+			/* 
+			 * Walks over the fields of a packet, keeping track of how many bytes
+			 * the packet needs. Once a field can't be read because not enough data
+			 * is available, the scanner stops and @need holds a lower bound.
+			 */
+			class frame_scanner
+			{
+				const unsigned char *data;
+				unsigned int have;
+				
+			public:
+				unsigned int need;
+				bool more; // more data is needed
+				bool bad;  // invalid packet
+				
+			public:
+				frame_scanner (const unsigned char *data, unsigned int have)
+				{
+					this->data = data;
+					this->have = have;
+					this->need = 1; // opcode
+					this->more = false;
+					this->bad = false;
+				}
+				
+				inline bool
+				ok ()
+					{ return !this->more && !this->bad; }
+				
+				void
+				skip (unsigned int n)
+				{
+					if (this->ok ())
+						this->need += n;
+				}
+				
+				int
+				read_byte ()
+				{
+					if (!this->ok ())
+						return 0;
+					if (this->need + 1 > this->have)
+						{ this->need += 1; this->more = true; return 0; }
+					return (signed char)this->data[this->need ++];
+				}
+				
+				int
+				read_short ()
+				{
+					if (!this->ok ())
+						return 0;
+					if (this->need + 2 > this->have)
+						{ this->need += 2; this->more = true; return 0; }
+					short val = (short)((this->data[this->need] << 8) | this->data[this->need + 1]);
+					this->need += 2;
+					return val;
+				}
+				
+				int
+				read_int ()
+				{
+					if (!this->ok ())
+						return 0;
+					if (this->need + 4 > this->have)
+						{ this->need += 4; this->more = true; return 0; }
+					const unsigned char *p = this->data + this->need;
+					this->need += 4;
+					return (int)(((unsigned int)p[0] << 24) | ((unsigned int)p[1] << 16)
+						| ((unsigned int)p[2] << 8) | (unsigned int)p[3]);
+				}
+				
+				void
+				length (int len, int unit = 1)
+				{
+					if (len < 0)
+						this->bad = true;
+					else
+						this->skip (len * unit);
+				}
+				
+				void
+				string ()
+					{ this->length (this->read_short (), 2); }
+				
+				void
+				slot ()
+				{
+					if (this->read_short () == -1)
+						return;
+					this->skip (3); // count, damage
+					int len = this->read_short ();
+					if (len > 0)
+						this->skip (len);
+				}
+				
+				void
+				metadata ()
+				{
+					while (this->ok ())
+						{
+							int x = this->read_byte () & 0xFF;
+							if (!this->ok () || x == 0x7F)
+								return;
+							
+							switch (x >> 5)
+								{
+									case 0: this->skip (1); break;
+									case 1: this->skip (2); break;
+									case 2: case 3: this->skip (4); break;
+									case 4: this->string (); break;
+									case 5: this->slot (); break;
+									case 6: this->skip (12); break;
+									default: this->bad = true; break;
+								}
+						}
+				}
+				
+				/* 
+				 * Scans fields according to a layout string.
+				 */
+				void
+				layout (const char *str)
+				{
+					for (; *str && this->ok (); ++str)
+						switch (*str)
+							{
+								case 'b': case '?': this->skip (1); break;
+								case 's': this->skip (2); break;
+								case 'f': case 'i': this->skip (4); break;
+								case 'd': case 'l': this->skip (8); break;
+								
+								case 'z': this->string (); break;
+								case 'a': this->length (this->read_short ()); break;
+								case 'A': this->length (this->read_int ()); break;
+								case 'q': this->slot (); break;
+								case 'm': this->metadata (); break;
+							}
+				}
+			};
+		}
+		
+		
+		
+		/* 
+		 * Packets that have fields whose presence or count depends on other
+		 * fields.
+		 */
+		static void
+		_scan_special (frame_scanner& sc, int op)
+		{
+			switch (op)
+				{
+					// spawn object
+					case 0x17:
+						sc.layout ("ibiiibb");
+						if (sc.read_int () != 0)
+							sc.skip (6);
+						break;
+					
+					// destroy entity
+					case 0x1D:
+						sc.length (sc.read_byte () & 0xFF, 4);
+						break;
+					
+					// entity properties
+					case 0x2C:
+						{
+							sc.skip (4);
+							int count = sc.read_int ();
+							if (count < 0)
+								{ sc.bad = true; break; }
+							for (int i = 0; i < count && sc.ok (); ++i)
+								{
+									sc.layout ("zd");
+									sc.length (sc.read_short (), 25);
+								}
+						}
+						break;
+					
+					// map chunk bulk
+					case 0x38:
+						{
+							int count = sc.read_short ();
+							int len = sc.read_int ();
+							sc.skip (1);
+							sc.length (len);
+							sc.length (count, 12);
+						}
+						break;
+					
+					// explosion
+					case 0x3C:
+						sc.layout ("dddf");
+						sc.length (sc.read_int (), 3);
+						sc.layout ("fff");
+						break;
+					
+					// open window
+					case 0x64:
+						{
+							sc.skip (1);
+							int type = sc.read_byte ();
+							sc.layout ("zb?");
+							if (type == 11)
+								sc.skip (4);
+						}
+						break;
+					
+					// set window items
+					case 0x68:
+						{
+							sc.skip (1);
+							int count = sc.read_short ();
+							for (int i = 0; i < count && sc.ok (); ++i)
+								sc.slot ();
+						}
+						break;
+					
+					default:
+						sc.bad = true;
+						break;
+				}
+		}
+		
+		/* 
+		 * Determines the total length of the server-to-client packet at the start
+		 * of the specified byte array. If the first @have bytes are not enough to
+		 * tell, a lower bound greater than @have is returned instead. Returns -1
+		 * if the packet is invalid or unknown.
+		 */
+		int
+		s2c_frame_length (const unsigned char *data, unsigned int have)
+		{
+			if (have == 0)
+				return 1;
+			
+			int op = data[0];
+			frame_scanner sc {data, have};
+			
+			const char *str = nullptr;
+			if (op < _s2c_table_size)
+				str = _s2c_table[op];
+			else
+				switch (op)
+					{
+						case 0x82: str = "isizzzz"; break;
+						case 0x83: str = "ssa"; break;
+						case 0x84: str = "isiba"; break;
+						case 0x85: str = "biii"; break;
+						case 0xC8: str = "ii"; break;
+						case 0xC9: str = "z?s"; break;
+						case 0xCA: str = "bff"; break;
+						case 0xCB: str = "z"; break;
+						case 0xCE: str = "zzb"; break;
+						case 0xFA: str = "za"; break;
+						case 0xFC: str = "aa"; break;
+						case 0xFD: str = "zaa"; break;
+						case 0xFF: str = "z"; break;
+						default: return -1;
+					}
+			
+			if (!str[0])
+				return -1;
+			else if (str[0] == '*')
+				_scan_special (sc, op);
+			else
+				sc.layout (str);
+			
+			if (sc.bad)
+				return -1;
+			return sc.need;
+		}
+	}
+}
+
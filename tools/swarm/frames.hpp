@@ -0,0 +1,38 @@
+/* 
+ * hCraft - A custom Minecraft server.
+ * Copyright (C) 2012	Jacob Zhitomirsky
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef _hCraft__SWARM__FRAMES_H_
+#define _hCraft__SWARM__FRAMES_H_
+
+
+namespace hCraft {
+	namespace swarm {
+		
+		/* 
+		 * Determines the total length of the server-to-client packet at the start
+		 * of the specified byte array. If the first @have bytes are not enough to
+		 * tell, a lower bound greater than @have is returned instead. Returns -1
+		 * if the packet is invalid or unknown.
+		 */
+		int s2c_frame_length (const unsigned char *data, unsigned int have);
+	}
+}
+
+#endif
+
@@ -0,0 +1,279 @@
+/* 
+ * hCraft - A custom Minecraft server.
+ * Copyright (C) 2012	Jacob Zhitomirsky
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/* 
+ * Bot swarm load generator.
+ * 
+ * Connects a number of offline-mode bots to a running server over the
+ * network. The bots log in, walk around, place and break blocks, and chat.
+ * Once the run is over, the tool reports how long chunks took to arrive after
+ * coming into view, how long block changes took to be seen, the amount of
+ * traffic per player and, if the server's PID is given, its CPU usage and
+ * memory footprint.
+ * 
+ * The server must be running in offline mode, and its view distance must
+ * match the one given to the tool (-v).
+ */
+
+#include "bot.hpp"
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <cstdlib>
+#include <unistd.h>
+#include <getopt.h>
+
+using namespace hCraft::swarm;
+
+
+namespace {
+	
+	void
+	_usage (const char *prog)
+	{
+		std::cerr << "usage: " << prog << " [options]\n"
+			"  -h <host>      server address (default: 127.0.0.1)\n"
+			"  -p <port>      server port (default: 25565)\n"
+			"  -n <bots>      number of bots (default: 50)\n"
+			"  -d <seconds>   duration of the run (default: 60)\n"
+			"  -t <threads>   client threads (default: 2)\n"
+			"  -r <rate>      connections per second (default: 20)\n"
+			"  -v <radius>    server view distance in chunks (default: 5)\n"
+			"  -w <blocks>    how far bots wander from their spawn (default: 64)\n"
+			"  -c <seconds>   chat interval (default: 15)\n"
+			"  -b <seconds>   block placement interval (default: 5)\n"
+			"  -N <prefix>    bot name prefix (default: bot)\n"
+			"  -P <pid>       server process to sample CPU and memory usage of\n";
+	}
+	
+	
+	
+	/* 
+	 * CPU time and memory usage of a process, read from /proc.
+	 */
+	struct proc_sample
+	{
+		bool valid;
+		double cpu_secs;
+		long rss_kb;
+	};
+	
+	proc_sample
+	_sample_process (int pid)
+	{
+		proc_sample smp {false, 0.0, 0};
+		if (pid <= 0)
+			return smp;
+		
+		{
+			std::ostringstream path;
+			path << "/proc/" << pid << "/stat";
+			std::ifstream strm (path.str ());
+			std::string line;
+			if (!std::getline (strm, line))
+				return smp;
+			
+			// skip past the executable name, which might contain spaces.
+			size_t pos = line.rfind (')');
+			if (pos == std::string::npos)
+				return smp;
+			std::istringstream fields (line.substr (pos + 2));
+			std::string field;
+			unsigned long long utime = 0, stime = 0;
+			for (int i = 3; i <= 15 && (fields >> field); ++i)
+				{
+					if (i == 14) utime = std::strtoull (field.c_str (), nullptr, 10);
+					else if (i == 15) stime = std::strtoull (field.c_str (), nullptr, 10);
+				}
+			smp.cpu_secs = (double)(utime + stime) / sysconf (_SC_CLK_TCK);
+		}
+		
+		{
+			std::ostringstream path;
+			path << "/proc/" << pid << "/status";
+			std::ifstream strm (path.str ());
+			std::string line;
+			while (std::getline (strm, line))
+				if (line.compare (0, 6, "VmRSS:") == 0)
+					smp.rss_kb = std::atol (line.c_str () + 6);
+		}
+		
+		smp.valid = true;
+		return smp;
+	}
+	
+	
+	
+	void
+	_print_percentiles (const char *what, std::vector<double>& samples)
+	{
+		std::cout << "  " << std::left << std::setw (18) << what << std::right;
+		if (samples.empty ())
+			{
+				std::cout << "no samples" << std::endl;
+				return;
+			}
+		
+		std::sort (samples.begin (), samples.end ());
+		auto pct = [&samples] (double p) {
+			size_t i = (size_t)(p * (samples.size () - 1));
+			return samples[i]; };
+		
+		std::cout << std::fixed << std::setprecision (1)
+			<< "p50 " << std::setw (8) << pct (0.50) << "ms"
+			<< "  p90 " << std::setw (8) << pct (0.90) << "ms"
+			<< "  p99 " << std::setw (8) << pct (0.99) << "ms"
+			<< "  max " << std::setw (8) << samples.back () << "ms"
+			<< "  (" << samples.size () << " samples)" << std::endl;
+	}
+}
+
+
+int
+main (int argc, char *argv[])
+{
+	swarm_config cfg;
+	cfg.host = "127.0.0.1";
+	cfg.port = 25565;
+	cfg.bots = 50;
+	cfg.duration = 60;
+	cfg.threads = 2;
+	cfg.connect_rate = 20;
+	cfg.view_radius = 5;
+	cfg.wander = 64;
+	cfg.chat_interval = 15;
+	cfg.build_interval = 5;
+	cfg.name_prefix = "bot";
+	cfg.server_pid = 0;
+	
+	int c;
+	while ((c = getopt (argc, argv, "h:p:n:d:t:r:v:w:c:b:N:P:")) != -1)
+		switch (c)
+			{
+				case 'h': cfg.host = optarg; break;
+				case 'p': cfg.port = std::atoi (optarg); break;
+				case 'n': cfg.bots = std::atoi (optarg); break;
+				case 'd': cfg.duration = std::atoi (optarg); break;
+				case 't': cfg.threads = std::atoi (optarg); break;
+				case 'r': cfg.connect_rate = std::atoi (optarg); break;
+				case 'v': cfg.view_radius = std::atoi (optarg); break;
+				case 'w': cfg.wander = std::atoi (optarg); break;
+				case 'c': cfg.chat_interval = std::atoi (optarg); break;
+				case 'b': cfg.build_interval = std::atoi (optarg); break;
+				case 'N': cfg.name_prefix = optarg; break;
+				case 'P': cfg.server_pid = std::atoi (optarg); break;
+				default: _usage (argv[0]); return 1;
+			}
+	
+	if (cfg.bots <= 0 || cfg.duration <= 0 || cfg.threads <= 0 || cfg.connect_rate <= 0
+		|| cfg.view_radius < 0 || cfg.wander <= 0 || cfg.chat_interval <= 0
+		|| cfg.build_interval <= 0 || cfg.name_prefix.size () > 10)
+		{
+			_usage (argv[0]);
+			return 1;
+		}
+	if (cfg.threads > cfg.bots)
+		cfg.threads = cfg.bots;
+	
+	std::cout << "Connecting " << cfg.bots << " bots to " << cfg.host << ":"
+		<< cfg.port << " for " << cfg.duration << " seconds" << std::endl;
+	
+	change_tracker changes;
+	std::vector<std::unique_ptr<bot_group> > groups;
+	int per_group = cfg.bots / cfg.threads;
+	for (int i = 0, first = 0; i < cfg.threads; ++i)
+		{
+			int count = per_group + ((i < (cfg.bots % cfg.threads)) ? 1 : 0);
+			groups.emplace_back (new bot_group (cfg, changes, first, count));
+			first += count;
+		}
+	
+	proc_sample start_smp = _sample_process (cfg.server_pid);
+	long peak_rss = start_smp.rss_kb;
+	auto start = swarm_clock::now ();
+	
+	for (auto& grp : groups)
+		grp->start ();
+	
+	for (int sec = 1; sec <= cfg.duration; ++sec)
+		{
+			std::this_thread::sleep_until (start + std::chrono::seconds (sec));
+			
+			proc_sample smp = _sample_process (cfg.server_pid);
+			if (smp.valid && smp.rss_kb > peak_rss)
+				peak_rss = smp.rss_kb;
+			
+			if (sec % 10 == 0 || sec == cfg.duration)
+				{
+					int playing = 0;
+					for (auto& grp : groups)
+						playing += grp->playing.load ();
+					std::cout << "[" << std::setw (4) << sec << "s] " << playing
+						<< " bots playing" << std::endl;
+				}
+		}
+	
+	proc_sample end_smp = _sample_process (cfg.server_pid);
+	double elapsed = std::chrono::duration<double> (swarm_clock::now () - start).count ();
+	
+	swarm_stats stats;
+	for (auto& grp : groups)
+		{
+			grp->stop ();
+			stats.merge (grp->get_stats ());
+		}
+	int lost = changes.expire (std::chrono::milliseconds (0));
+	
+	/* 
+	 * Report
+	 */
+	std::cout << std::endl << "Results:" << std::endl;
+	std::cout << "  bots logged in    " << stats.logged_in << "/" << cfg.bots
+		<< " (" << stats.failed << " failed, " << stats.kicked << " kicked)" << std::endl;
+	_print_percentiles ("chunk delivery", stats.chunk_latency);
+	_print_percentiles ("block change", stats.block_latency);
+	std::cout << "  changes not seen  " << lost << std::endl;
+	std::cout << "  chunks received   " << stats.chunks << std::endl;
+	std::cout << "  chat lines seen   " << stats.chats << std::endl;
+	
+	int players = (stats.logged_in > 0) ? stats.logged_in : 1;
+	std::cout << std::fixed << std::setprecision (1)
+		<< "  traffic in        " << (stats.bytes_in / 1024.0 / players) << " KB/player ("
+		<< (stats.bytes_in / 1024.0 / players / elapsed) << " KB/s), "
+		<< (stats.packets_in / players) << " packets/player" << std::endl
+		<< "  traffic out       " << (stats.bytes_out / 1024.0 / players) << " KB/player ("
+		<< (stats.bytes_out / 1024.0 / players / elapsed) << " KB/s), "
+		<< (stats.packets_out / players) << " packets/player" << std::endl;
+	
+	if (start_smp.valid && end_smp.valid)
+		{
+			std::cout << "  server cpu        "
+				<< (100.0 * (end_smp.cpu_secs - start_smp.cpu_secs) / elapsed) << "%" << std::endl
+				<< "  server rss        " << (end_smp.rss_kb / 1024.0) << " MB (peak "
+				<< (peak_rss / 1024.0) << " MB, "
+				<< ((end_smp.rss_kb - start_smp.rss_kb) / 1024.0 / players) << " MB/player)" << std::endl;
+		}
+	else if (cfg.server_pid > 0)
+		std::cout << "  could not sample server process " << cfg.server_pid << std::endl;
+	
+	return 0;
+}
+